@@ -0,0 +1,203 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "bench.h"
+
+
+uint64_t bench_now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+/*}}}*/
+
+
+void bench_generate_image(const char *fname, uint64_t fsize)/*{{{*/
+{
+	char *buf = calloc(1, fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	FILE *fd = fopen(fname, "w");
+	if(!fd) { perror(fname); exit(EXIT_FAILURE); }
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void bench_stats_init(struct bench_stats *st, const char *op)/*{{{*/
+{
+	memset(st, 0, sizeof(*st));
+	st->op = op;
+}
+/*}}}*/
+
+
+void bench_stats_add(struct bench_stats *st, uint64_t ns)/*{{{*/
+{
+	if(st->n == st->cap) {
+		st->cap = st->cap ? 2 * st->cap : 1024;
+		st->ns = realloc(st->ns, st->cap * sizeof(uint64_t));
+		if(!st->ns) { perror(NULL); exit(EXIT_FAILURE); }
+	}
+	st->ns[st->n++] = ns;
+	st->total += ns;
+}
+/*}}}*/
+
+
+void bench_stats_free(struct bench_stats *st)/*{{{*/
+{
+	free(st->ns);
+	st->ns = NULL;
+	st->n = st->cap = 0;
+}
+/*}}}*/
+
+
+static int cmp_u64(const void *a, const void *b)/*{{{*/
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+/*}}}*/
+
+
+uint64_t bench_percentile(struct bench_stats *st, double p)/*{{{*/
+{
+	if(st->n == 0) return 0;
+	qsort(st->ns, st->n, sizeof(uint64_t), cmp_u64);
+	uint64_t i = (uint64_t)(p / 100.0 * (st->n - 1) + 0.5);
+	return st->ns[i];
+}
+/*}}}*/
+
+
+void bench_print_header(FILE *out)/*{{{*/
+{
+	fprintf(out, "bench,op,fsize,blksz,features,opts,ops,errors,"
+			"ops_per_sec,p50_ns,p99_ns\n");
+}
+/*}}}*/
+
+
+void bench_print(FILE *out, const struct bench_config *cfg,/*{{{*/
+                 struct bench_stats *st)
+{
+	double secs = st->total / 1e9;
+	fprintf(out, "%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%.1f,%" PRIu64 ",%" PRIu64 "\n",
+			cfg->bench, st->op, cfg->fsize, cfg->blksz, cfg->features,
+			cfg->opts, st->n, st->errors, secs > 0 ? st->n / secs : 0.0,
+			bench_percentile(st, 50), bench_percentile(st, 99));
+}
+/*}}}*/
+
+
+void bench_print_histogram_header(FILE *out)/*{{{*/
+{
+	fprintf(out, "bench,op,fsize,blksz,features,opts,le_ns,count\n");
+}
+/*}}}*/
+
+
+void bench_print_histogram(FILE *out, const struct bench_config *cfg,/*{{{*/
+                           const struct bench_stats *st)
+{
+	uint64_t buckets[64] = {0};
+	uint64_t i;
+	int k;
+	for(i = 0; i < st->n; i++) {
+		for(k = 0; k < 63 && (1ULL << k) < st->ns[i]; k++);
+		buckets[k]++;
+	}
+	for(k = 0; k < 64; k++) {
+		if(!buckets[k]) continue;
+		fprintf(out, "%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+				",%" PRIu64 ",%" PRIu64 "\n", cfg->bench, st->op,
+				cfg->fsize, cfg->blksz, cfg->features, cfg->opts,
+				(uint64_t)1 << k, buckets[k]);
+	}
+}
+/*}}}*/
+
+
+/* walks the on-disk free list directly, so =sb must have no outstanding
+ * changes to it (the superblock itself is read from memory) */
+int bench_fragmentation(struct superblock *sb, struct bench_frag *frag)/*{{{*/
+{
+	struct freepage *page = malloc(sb->blksz);
+	uint64_t *blks = malloc((sb->freeblks + 1) * sizeof(uint64_t));
+	uint64_t blk = sb->freelist, n = 0, i, run;
+	if(!page || !blks) { perror(NULL); exit(EXIT_FAILURE); }
+
+	while(n < sb->freeblks && blk != 0) {
+		if(pread(sb->fd, page, sb->blksz, blk * sb->blksz) != (ssize_t)sb->blksz) {
+			free(page);
+			free(blks);
+			return -1;
+		}
+		blks[n++] = blk;
+		blk = page->next;
+	}
+	qsort(blks, n, sizeof(uint64_t), cmp_u64);
+
+	memset(frag, 0, sizeof(*frag));
+	frag->free_blocks = n;
+	for(i = 0, run = 0; i < n; i++) {
+		if(i == 0 || blks[i] != blks[i-1] + 1) {
+			frag->extents++;
+			run = 0;
+		}
+		if(++run > frag->largest) frag->largest = run;
+	}
+	free(page);
+	free(blks);
+	return 0;
+}
+/*}}}*/
+
+
+void bench_print_frag_header(FILE *out)/*{{{*/
+{
+	fprintf(out, "bench,fsize,blksz,features,opts,free_blocks,free_extents,"
+			"largest_extent,mean_extent\n");
+}
+/*}}}*/
+
+
+void bench_print_frag(FILE *out, const struct bench_config *cfg,/*{{{*/
+                      const struct bench_frag *frag)
+{
+	fprintf(out, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%.1f\n", cfg->bench, cfg->fsize,
+			cfg->blksz, cfg->features, cfg->opts, frag->free_blocks,
+			frag->extents, frag->largest, frag->extents ?
+			(double)frag->free_blocks / frag->extents : 0.0);
+}
+/*}}}*/
+
+
+uint64_t bench_parse_size(const char *s)/*{{{*/
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+	switch(*end) {
+	case 'g': case 'G': v <<= 10; /* fall through */
+	case 'm': case 'M': v <<= 10; /* fall through */
+	case 'k': case 'K': v <<= 10; end++; break;
+	}
+	if(end == s || *end != '\0') {
+		fprintf(stderr, "invalid size: %s\n", s);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+/*}}}*/
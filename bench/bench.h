@@ -0,0 +1,70 @@
+#ifndef __BENCH_HEADER__
+#define __BENCH_HEADER__
+
+#include <inttypes.h>
+#include <stdio.h>
+
+/* Helpers shared by the benchmark drivers in bench/.  Results are printed
+ * as CSV, one row per operation and configuration, so they can be compared
+ * across runs with standard tools. */
+
+/* latency samples of one operation, in nanoseconds */
+struct bench_stats {
+	const char *op;
+	uint64_t *ns;
+	uint64_t n;
+	uint64_t cap;
+	uint64_t total; /* sum of =ns */
+	uint64_t errors; /* failed calls, not sampled */
+};
+
+/* configuration a row of results was measured with */
+struct bench_config {
+	const char *bench;
+	uint64_t fsize;
+	uint64_t blksz;
+	uint64_t features;
+	uint64_t opts;
+};
+
+/* monotonic clock, in nanoseconds */
+uint64_t bench_now(void);
+
+/* create (or truncate) =fname as a zero-filled image of =fsize bytes */
+void bench_generate_image(const char *fname, uint64_t fsize);
+
+void bench_stats_init(struct bench_stats *st, const char *op);
+void bench_stats_add(struct bench_stats *st, uint64_t ns);
+void bench_stats_free(struct bench_stats *st);
+
+/* =p-th percentile (0 to 100) of the samples in =st; sorts them */
+uint64_t bench_percentile(struct bench_stats *st, double p);
+
+void bench_print_header(FILE *out);
+void bench_print(FILE *out, const struct bench_config *cfg,
+                 struct bench_stats *st);
+
+/* latency histogram of =st with power-of-two buckets: one row per
+ * non-empty bucket, =le_ns being the bucket's upper bound */
+void bench_print_histogram_header(FILE *out);
+void bench_print_histogram(FILE *out, const struct bench_config *cfg,
+                           const struct bench_stats *st);
+
+/* free space layout of an image, from walking its free list */
+struct bench_frag {
+	uint64_t free_blocks;
+	uint64_t extents; /* runs of consecutive free blocks */
+	uint64_t largest; /* blocks in the longest run */
+};
+
+struct superblock;
+
+int bench_fragmentation(struct superblock *sb, struct bench_frag *frag);
+void bench_print_frag_header(FILE *out);
+void bench_print_frag(FILE *out, const struct bench_config *cfg,
+                      const struct bench_frag *frag);
+
+/* parse a size with an optional k, m or g suffix; exits on error */
+uint64_t bench_parse_size(const char *s);
+
+#endif
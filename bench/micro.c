@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+#include "bench.h"
+
+/* Microbenchmark for each public operation of fs.h.
+ *
+ * usage: micro [-s fsize]... [-b blksz]... [-n ops] [-f filesize]
+ *              [-F features] [-o opts] [-i image]
+ *
+ * Every (fsize, blksz) pair is measured on a freshly formatted image, as
+ * the tests do with their fsizes/blkszs matrix.  =features and =opts are
+ * passed to fs_format_features and fs_set_options.  Results go to stdout
+ * as CSV (see bench_print_header). */
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define MAXCONF 16
+
+static char *image = "img";
+
+#define TIMED(st, call) {\
+	uint64_t t0_ = bench_now();\
+	int ok_ = (call);\
+	uint64_t t1_ = bench_now();\
+	if(ok_) bench_stats_add((st), t1_ - t0_); else (st)->errors++;\
+}
+
+
+void run(const struct bench_config *cfg, uint64_t nops, uint64_t filesz)/*{{{*/
+{
+	struct bench_stats st[8];
+	char name[64];
+	uint64_t i;
+
+	bench_generate_image(image, cfg->fsize);
+	struct superblock *sb = fs_format_features(image, cfg->blksz, cfg->features);
+	if(!sb) {
+		fprintf(stderr, "fs_format_features fsize %" PRIu64 " blksz %" PRIu64
+				": %s\n", cfg->fsize, cfg->blksz, strerror(errno));
+		return;
+	}
+	if(fs_set_options(sb, cfg->opts)) { perror("fs_set_options"); exit(EXIT_FAILURE); }
+
+	char *data = malloc(filesz + 1);
+	uint64_t *blks = malloc(nops * sizeof(uint64_t));
+	if(!data || !blks) { perror(NULL); exit(EXIT_FAILURE); }
+	for(i = 0; i < filesz; i++) data[i] = 'a' + (i % 26);
+
+	bench_stats_init(&st[0], "fs_write_file");
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/f%" PRIu64, i);
+		TIMED(&st[0], fs_write_file(sb, name, data, filesz) == 0);
+	}
+	if(fs_sync(sb)) perror("fs_sync");
+
+	bench_stats_init(&st[1], "fs_read_file");
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/f%" PRIu64, i);
+		TIMED(&st[1], fs_read_file(sb, name, data, filesz) >= 0);
+	}
+
+	bench_stats_init(&st[2], "fs_list_dir");
+	for(i = 0; i < nops; i++) {
+		char *list;
+		TIMED(&st[2], (list = fs_list_dir(sb, "/")) != NULL);
+		free(list);
+	}
+
+	bench_stats_init(&st[3], "fs_unlink");
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/f%" PRIu64, i);
+		TIMED(&st[3], fs_unlink(sb, name) == 0);
+	}
+
+	bench_stats_init(&st[4], "fs_mkdir");
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/d%" PRIu64, i);
+		TIMED(&st[4], fs_mkdir(sb, name) == 0);
+	}
+
+	bench_stats_init(&st[5], "fs_rmdir");
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/d%" PRIu64, i);
+		TIMED(&st[5], fs_rmdir(sb, name) == 0);
+	}
+
+	bench_stats_init(&st[6], "fs_get_block");
+	for(i = 0; i < nops; i++) {
+		uint64_t blk;
+		TIMED(&st[6], (blk = fs_get_block(sb)) != 0 && blk != (uint64_t)-1);
+		blks[i] = (blk == (uint64_t)-1) ? 0 : blk;
+	}
+
+	bench_stats_init(&st[7], "fs_put_block");
+	for(i = 0; i < nops; i++) {
+		if(blks[i] == 0) continue;
+		TIMED(&st[7], fs_put_block(sb, blks[i]) == 0);
+	}
+
+	if(fs_close(sb)) perror("fs_close");
+
+	for(i = 0; i < NELEMS(st); i++) {
+		bench_print(stdout, cfg, &st[i]);
+		bench_stats_free(&st[i]);
+	}
+	fflush(stdout);
+	free(data);
+	free(blks);
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[MAXCONF] = {1 << 20, 1 << 22};
+	uint64_t blkszs[MAXCONF] = {128, 256, 512, 1024};
+	int nfsizes = 0, nblkszs = 0;
+	uint64_t nops = 256, filesz = 1000;
+	struct bench_config cfg = {"micro", 0, 0, 0, 0};
+	int c, i, j;
+
+	while((c = getopt(argc, argv, "s:b:n:f:F:o:i:")) != -1) {
+		switch(c) {
+		case 's':
+			if(nfsizes < MAXCONF) fsizes[nfsizes++] = bench_parse_size(optarg);
+			break;
+		case 'b':
+			if(nblkszs < MAXCONF) blkszs[nblkszs++] = bench_parse_size(optarg);
+			break;
+		case 'n': nops = bench_parse_size(optarg); break;
+		case 'f': filesz = bench_parse_size(optarg); break;
+		case 'F': cfg.features = bench_parse_size(optarg); break;
+		case 'o': cfg.opts = bench_parse_size(optarg); break;
+		case 'i': image = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-s fsize]... [-b blksz]... [-n ops] "
+					"[-f filesize] [-F features] [-o opts] [-i image]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(nfsizes == 0) nfsizes = 2;
+	if(nblkszs == 0) nblkszs = 4;
+
+	bench_print_header(stdout);
+	for(i = 0; i < nblkszs; i++) {
+	for(j = 0; j < nfsizes; j++) {
+		cfg.fsize = fsizes[j];
+		cfg.blksz = blkszs[i];
+		run(&cfg, nops, filesz);
+	}
+	}
+	unlink(image);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fs.h"
+
+/* Summarize a block trace written by fs_trace.
+ *
+ * usage: tracestat [-n hot] trace
+ *
+ * Prints three CSV tables separated by blank lines: per-call I/O with
+ * read and write amplification (bytes moved to or from the image per byte
+ * of file data the call returned or stored), the =hot most accessed
+ * blocks, and a log2 histogram of seek distances, the distance in blocks
+ * between the end of an access and the start of the next one. */
+
+static const char *apinames[] = {"fs_write_file", "fs_read_file",
+		"fs_read_view", "fs_unlink", "fs_mkdir", "fs_rmdir", "fs_list_dir",
+		"fs_get_block", "fs_put_block", "fs_sync", "fs_stat", "fs_opendir",
+		"fs_rename", "fs_clone", "fs_snapshot", "fs_seek", "other"};
+
+typedef char apinames_complete[(sizeof(apinames)/sizeof(apinames[0]) == FS_API_COUNT + 1) ? 1 : -1];
+
+struct api_io {
+	uint64_t calls, reads, writes, bytes_read, bytes_written, data;
+};
+
+struct blk_io {
+	uint64_t blk, reads, writes;
+};
+
+
+int cmp_hot(const void *a, const void *b)/*{{{*/
+{
+	const struct blk_io *x = a, *y = b;
+	uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+	if(nx != ny) return nx < ny ? 1 : -1;
+	return (x->blk > y->blk) - (x->blk < y->blk);
+}
+/*}}}*/
+
+
+double ratio(uint64_t a, uint64_t b)/*{{{*/
+{
+	return b ? (double)a / b : 0.0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	struct fs_trace_header header;
+	struct fs_trace_rec rec;
+	struct api_io apis[FS_API_COUNT + 1];
+	struct blk_io *blks = NULL;
+	uint64_t nblks = 0, seeks[65] = {0}, nseeks = 0, seeksum = 0;
+	uint64_t prev_end = 0, i;
+	int have_prev = 0, hot = 10, k, argi = 1;
+
+	if(argc > 2 && !strcmp(argv[1], "-n")) {
+		hot = atoi(argv[2]);
+		argi = 3;
+	}
+	if(argi != argc - 1) {
+		fprintf(stderr, "usage: %s [-n hot] trace\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *fp = fopen(argv[argi], "rb");
+	if(!fp) { perror(argv[argi]); exit(EXIT_FAILURE); }
+	if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != FS_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a block trace\n", argv[argi]);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(apis, 0, sizeof(apis));
+	while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+		struct api_io *io = &apis[rec.api <= FS_API_COUNT ? rec.api : FS_API_COUNT];
+
+		if(rec.op == FS_TRACE_CALL) {
+			io->calls++;
+			io->data += rec.size;
+			continue;
+		}
+
+		if(rec.blk >= nblks) {
+			uint64_t n = nblks ? nblks : 1024;
+			while(n <= rec.blk) n *= 2;
+			blks = realloc(blks, n * sizeof(struct blk_io));
+			if(!blks) { perror(NULL); exit(EXIT_FAILURE); }
+			memset(blks + nblks, 0, (n - nblks) * sizeof(struct blk_io));
+			nblks = n;
+		}
+
+		if(rec.op == FS_TRACE_READ) {
+			io->reads++;
+			io->bytes_read += rec.size;
+			blks[rec.blk].reads++;
+		} else {
+			io->writes++;
+			io->bytes_written += rec.size;
+			blks[rec.blk].writes++;
+		}
+
+		if(have_prev) {
+			uint64_t d = rec.blk > prev_end ? rec.blk - prev_end : prev_end - rec.blk;
+			for(k = 0; k < 64 && d >= ((uint64_t)1 << k); k++);
+			seeks[k]++;
+			seeksum += d;
+			nseeks++;
+		}
+		prev_end = rec.blk + (rec.size + header.blksz - 1) / header.blksz;
+		have_prev = 1;
+	}
+	fclose(fp);
+
+	printf("api,calls,reads,writes,bytes_read,bytes_written,data_bytes,"
+			"reads_per_call,writes_per_call,read_amp,write_amp\n");
+	for(k = 0; k <= FS_API_COUNT; k++) {
+		struct api_io *io = &apis[k];
+		if(!io->calls && !io->reads && !io->writes) continue;
+		printf("%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+				",%" PRIu64 ",%.2f,%.2f,%.2f,%.2f\n", apinames[k], io->calls,
+				io->reads, io->writes, io->bytes_read, io->bytes_written,
+				io->data, ratio(io->reads, io->calls),
+				ratio(io->writes, io->calls),
+				ratio(io->bytes_read, io->data),
+				ratio(io->bytes_written, io->data));
+	}
+
+	for(i = 0; i < nblks; i++) blks[i].blk = i;
+	qsort(blks, nblks, sizeof(struct blk_io), cmp_hot);
+	printf("\nblock,reads,writes\n");
+	for(i = 0; i < nblks && i < hot && blks[i].reads + blks[i].writes; i++)
+		printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", blks[i].blk,
+				blks[i].reads, blks[i].writes);
+
+	/* bucket k holds distances in [2^(k-1), 2^k); bucket 0 is sequential */
+	printf("\nseek_lt,count\n");
+	for(k = 0; k < 65; k++)
+		if(seeks[k]) printf("%" PRIu64 ",%" PRIu64 "\n",
+				k < 64 ? (uint64_t)1 << k : UINT64_MAX, seeks[k]);
+	fprintf(stderr, "%" PRIu64 " accesses, mean seek %.1f blocks\n",
+			nseeks + have_prev, ratio(seeksum, nseeks));
+
+	free(blks);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
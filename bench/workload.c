@@ -0,0 +1,391 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+#include "bench.h"
+
+/* Workload benchmark: runs a filebench-style personality against fs.h, or
+ * replays a recorded trace.
+ *
+ * usage: workload [-w fileserver|varmail|webserver] [-t trace] [-r record]
+ *                 [-n ops] [-s fsize] [-b blksz] [-F features] [-o opts]
+ *                 [-S seed] [-i image] [-T blktrace]
+ *
+ * Personalities:
+ *   fileserver  files of 1-16KB in a two-level tree; whole-file writes,
+ *               reads, appends, deletes and directory listings.
+ *   varmail     many 1-4KB files in one directory; each new message or
+ *               append is followed by fs_sync, as mail servers fsync.
+ *   webserver   a four-level tree of 1-8KB files read ten times for every
+ *               append to a shared log file.
+ *
+ * A trace is a text file with one operation per line:
+ *
+ *   write <path> <size> | read <path> | unlink <path> | mkdir <path> |
+ *   rmdir <path> | list <path> | sync | setup | start
+ *
+ * Operations between "setup" and "start" populate the image and are not
+ * measured.  -r records the operations a personality performs, setup
+ * included, so the run can be replayed later with -t.  Appends are
+ * recorded as the read and write they are made of.
+ *
+ * -T traces every block access of the run with fs_trace; see tracestat.
+ *
+ * At the end of a run, three CSV tables go to stdout separated by blank
+ * lines: per-operation throughput and percentiles (op "all" aggregates
+ * every operation), latency histograms, and free space fragmentation. */
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define PATHMAX 256
+
+enum { OP_WRITE, OP_READ, OP_UNLINK, OP_MKDIR, OP_RMDIR, OP_LIST, OP_SYNC, OP_ALL };
+
+static const char *opnames[] = {"write", "read", "unlink", "mkdir", "rmdir", "list", "sync"};
+static const char *statnames[] = {"fs_write_file", "fs_read_file", "fs_unlink",
+		"fs_mkdir", "fs_rmdir", "fs_list_dir", "fs_sync", "all"};
+
+struct ctx {
+	struct superblock *sb;
+	struct bench_stats st[OP_ALL + 1];
+	int timed;
+	FILE *record;
+	char *buf;
+	uint64_t bufsz;
+	uint64_t rng;
+	/* files currently in the image */
+	char (*files)[PATHMAX];
+	uint64_t *sizes;
+	uint64_t nfiles;
+	uint64_t maxfiles;
+	/* directories created during setup */
+	char (*dirs)[PATHMAX];
+	uint64_t ndirs;
+	uint64_t maxdirs;
+};
+
+static char *image = "img";
+
+
+uint64_t rnd(struct ctx *c, uint64_t n)/*{{{*/
+{
+	/* xorshift64, so runs are reproducible across platforms */
+	c->rng ^= c->rng << 13;
+	c->rng ^= c->rng >> 7;
+	c->rng ^= c->rng << 17;
+	return n ? c->rng % n : 0;
+}
+/*}}}*/
+
+
+void grow_buf(struct ctx *c, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	if(size <= c->bufsz) return;
+	c->buf = realloc(c->buf, size);
+	if(!c->buf) { perror(NULL); exit(EXIT_FAILURE); }
+	for(i = c->bufsz; i < size; i++) c->buf[i] = 'a' + (i % 26);
+	c->bufsz = size;
+}
+/*}}}*/
+
+
+/* run one operation, timing it once setup is over.  returns the call's
+ * result (bytes read for OP_READ). */
+int64_t do_op(struct ctx *c, int op, const char *path, uint64_t size)/*{{{*/
+{
+	int64_t ret = 0;
+	char *list;
+
+	if(c->record) {
+		if(op == OP_SYNC) fprintf(c->record, "sync\n");
+		else if(op == OP_WRITE) fprintf(c->record, "write %s %" PRIu64 "\n", path, size);
+		else fprintf(c->record, "%s %s\n", opnames[op], path);
+	}
+
+	if(op == OP_WRITE || op == OP_READ) grow_buf(c, size ? size : 1);
+
+	uint64_t t0 = bench_now();
+	switch(op) {
+	case OP_WRITE: ret = fs_write_file(c->sb, path, c->buf, size); break;
+	case OP_READ: ret = fs_read_file(c->sb, path, c->buf, c->bufsz); break;
+	case OP_UNLINK: ret = fs_unlink(c->sb, path); break;
+	case OP_MKDIR: ret = fs_mkdir(c->sb, path); break;
+	case OP_RMDIR: ret = fs_rmdir(c->sb, path); break;
+	case OP_LIST:
+		list = fs_list_dir(c->sb, path);
+		ret = list ? 0 : -1;
+		free(list);
+		break;
+	case OP_SYNC: ret = fs_sync(c->sb); break;
+	}
+	uint64_t t1 = bench_now();
+
+	if(c->timed) {
+		if(ret < 0) {
+			c->st[op].errors++;
+			c->st[OP_ALL].errors++;
+		} else {
+			bench_stats_add(&c->st[op], t1 - t0);
+			bench_stats_add(&c->st[OP_ALL], t1 - t0);
+		}
+	}
+	return ret;
+}
+/*}}}*/
+
+
+void setup_mark(struct ctx *c, int timed)/*{{{*/
+{
+	c->timed = timed;
+	if(c->record) fprintf(c->record, timed ? "start\n" : "setup\n");
+}
+/*}}}*/
+
+
+/* file set bookkeeping for the personalities */
+
+void add_dir(struct ctx *c, const char *path)/*{{{*/
+{
+	if(c->ndirs == c->maxdirs) {
+		c->maxdirs = c->maxdirs ? 2 * c->maxdirs : 64;
+		c->dirs = realloc(c->dirs, c->maxdirs * PATHMAX);
+		if(!c->dirs) { perror(NULL); exit(EXIT_FAILURE); }
+	}
+	if(do_op(c, OP_MKDIR, path, 0) == 0)
+		strcpy(c->dirs[c->ndirs++], path);
+}
+/*}}}*/
+
+
+/* create a file of =size bytes under a random directory */
+void create_file(struct ctx *c, uint64_t size)/*{{{*/
+{
+	static uint64_t seq;
+	if(c->nfiles == c->maxfiles) {
+		c->maxfiles = c->maxfiles ? 2 * c->maxfiles : 256;
+		c->files = realloc(c->files, c->maxfiles * PATHMAX);
+		c->sizes = realloc(c->sizes, c->maxfiles * sizeof(uint64_t));
+		if(!c->files || !c->sizes) { perror(NULL); exit(EXIT_FAILURE); }
+	}
+	const char *dir = c->ndirs ? c->dirs[rnd(c, c->ndirs)] : "";
+	char *path = c->files[c->nfiles];
+	snprintf(path, PATHMAX, "%s/f%" PRIu64, dir, seq++);
+	if(do_op(c, OP_WRITE, path, size) == 0) c->sizes[c->nfiles++] = size;
+}
+/*}}}*/
+
+
+void delete_file(struct ctx *c, uint64_t i)/*{{{*/
+{
+	do_op(c, OP_UNLINK, c->files[i], 0);
+	c->nfiles--;
+	if(i != c->nfiles) {
+		memcpy(c->files[i], c->files[c->nfiles], PATHMAX);
+		c->sizes[i] = c->sizes[c->nfiles];
+	}
+}
+/*}}}*/
+
+
+/* rewrite file =i with =extra more bytes, as fs.h has no append */
+void append_file(struct ctx *c, uint64_t i, uint64_t extra)/*{{{*/
+{
+	do_op(c, OP_READ, c->files[i], 0);
+	if(do_op(c, OP_WRITE, c->files[i], c->sizes[i] + extra) == 0)
+		c->sizes[i] += extra;
+	else if(errno == ENOSPC)
+		delete_file(c, i);
+}
+/*}}}*/
+
+
+void make_tree(struct ctx *c, const char *base, int width, int depth)/*{{{*/
+{
+	char path[PATHMAX];
+	int i;
+	if(depth == 0) return;
+	for(i = 0; i < width; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", base, i);
+		add_dir(c, path);
+		make_tree(c, path, width, depth - 1);
+	}
+}
+/*}}}*/
+
+
+void fileserver(struct ctx *c, uint64_t nops)/*{{{*/
+{
+	uint64_t i;
+	setup_mark(c, 0);
+	make_tree(c, "", 8, 2);
+	for(i = 0; i < 200; i++) create_file(c, 1024 + rnd(c, 15 * 1024));
+	setup_mark(c, 1);
+
+	for(i = 0; i < nops; i++) {
+		uint64_t r = rnd(c, 100);
+		if(c->nfiles == 0 || r < 20) create_file(c, 1024 + rnd(c, 15 * 1024));
+		else if(r < 50) do_op(c, OP_READ, c->files[rnd(c, c->nfiles)], 0);
+		else if(r < 70) append_file(c, rnd(c, c->nfiles), 1 + rnd(c, 4096));
+		else if(r < 90) delete_file(c, rnd(c, c->nfiles));
+		else do_op(c, OP_LIST, c->dirs[rnd(c, c->ndirs)], 0);
+	}
+}
+/*}}}*/
+
+
+void varmail(struct ctx *c, uint64_t nops)/*{{{*/
+{
+	uint64_t i;
+	setup_mark(c, 0);
+	add_dir(c, "/mail");
+	for(i = 0; i < 500; i++) create_file(c, 1024 + rnd(c, 3 * 1024));
+	do_op(c, OP_SYNC, NULL, 0);
+	setup_mark(c, 1);
+
+	for(i = 0; i < nops; i++) {
+		uint64_t r = rnd(c, 4);
+		if(c->nfiles == 0 || r == 0) {
+			create_file(c, 1024 + rnd(c, 3 * 1024));
+			do_op(c, OP_SYNC, NULL, 0);
+		} else if(r == 1) {
+			delete_file(c, rnd(c, c->nfiles));
+		} else if(r == 2) {
+			append_file(c, rnd(c, c->nfiles), 1 + rnd(c, 1024));
+			do_op(c, OP_SYNC, NULL, 0);
+		} else {
+			do_op(c, OP_READ, c->files[rnd(c, c->nfiles)], 0);
+		}
+	}
+}
+/*}}}*/
+
+
+void webserver(struct ctx *c, uint64_t nops)/*{{{*/
+{
+	uint64_t i, log;
+	setup_mark(c, 0);
+	make_tree(c, "", 3, 4);
+	for(i = 0; i < 300; i++) create_file(c, 1024 + rnd(c, 7 * 1024));
+	log = c->nfiles;
+	create_file(c, 0);
+	setup_mark(c, 1);
+
+	for(i = 0; i < nops; i++) {
+		if(i % 11 == 10 && log < c->nfiles) {
+			/* the log wraps around instead of filling the image */
+			if(c->sizes[log] > 64 * 1024) c->sizes[log] = 0;
+			append_file(c, log, 256);
+		} else if(log > 0) {
+			do_op(c, OP_READ, c->files[rnd(c, log)], 0);
+		}
+	}
+}
+/*}}}*/
+
+
+void replay(struct ctx *c, const char *fname)/*{{{*/
+{
+	FILE *fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	char line[2 * PATHMAX], opname[16], path[PATHMAX];
+	uint64_t size, lineno = 0;
+	int op;
+
+	if(!fp) { perror(fname); exit(EXIT_FAILURE); }
+	c->timed = 1;
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		path[0] = '\0';
+		size = 0;
+		if(line[0] == '#' || sscanf(line, "%15s %255s %" SCNu64, opname, path, &size) < 1)
+			continue;
+		if(!strcmp(opname, "setup")) { c->timed = 0; continue; }
+		if(!strcmp(opname, "start")) { c->timed = 1; continue; }
+		for(op = 0; op < OP_ALL && strcmp(opname, opnames[op]); op++);
+		if(op == OP_ALL || (op != OP_SYNC && path[0] == '\0')) {
+			fprintf(stderr, "%s:%" PRIu64 ": invalid operation\n", fname, lineno);
+			exit(EXIT_FAILURE);
+		}
+		do_op(c, op, path, size);
+	}
+	if(fp != stdin) fclose(fp);
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	struct bench_config cfg = {"fileserver", 4 << 20, 512, 0, 0};
+	const char *trace = NULL, *record = NULL, *blktrace = NULL;
+	uint64_t nops = 5000, seed = 1;
+	struct ctx c;
+	struct bench_frag frag;
+	int ch, i;
+
+	while((ch = getopt(argc, argv, "w:t:r:n:s:b:F:o:S:i:T:")) != -1) {
+		switch(ch) {
+		case 'w': cfg.bench = optarg; break;
+		case 't': trace = optarg; break;
+		case 'r': record = optarg; break;
+		case 'n': nops = bench_parse_size(optarg); break;
+		case 's': cfg.fsize = bench_parse_size(optarg); break;
+		case 'b': cfg.blksz = bench_parse_size(optarg); break;
+		case 'F': cfg.features = bench_parse_size(optarg); break;
+		case 'o': cfg.opts = bench_parse_size(optarg); break;
+		case 'S': seed = bench_parse_size(optarg); break;
+		case 'i': image = optarg; break;
+		case 'T': blktrace = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-w fileserver|varmail|webserver] "
+					"[-t trace] [-r record] [-n ops] [-s fsize] [-b blksz] "
+					"[-F features] [-o opts] [-S seed] [-i image] [-T blktrace]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(trace) cfg.bench = "replay";
+
+	memset(&c, 0, sizeof(c));
+	c.rng = seed ? seed : 1;
+	for(i = 0; i <= OP_ALL; i++) bench_stats_init(&c.st[i], statnames[i]);
+	if(record && !(c.record = fopen(record, "w"))) { perror(record); exit(EXIT_FAILURE); }
+
+	bench_generate_image(image, cfg.fsize);
+	c.sb = fs_format_features(image, cfg.blksz, cfg.features);
+	if(!c.sb) { perror("fs_format_features"); exit(EXIT_FAILURE); }
+	if(fs_set_options(c.sb, cfg.opts)) { perror("fs_set_options"); exit(EXIT_FAILURE); }
+	if(blktrace && fs_trace(c.sb, blktrace)) { perror(blktrace); exit(EXIT_FAILURE); }
+
+	if(trace) replay(&c, trace);
+	else if(!strcmp(cfg.bench, "fileserver")) fileserver(&c, nops);
+	else if(!strcmp(cfg.bench, "varmail")) varmail(&c, nops);
+	else if(!strcmp(cfg.bench, "webserver")) webserver(&c, nops);
+	else { fprintf(stderr, "unknown workload: %s\n", cfg.bench); exit(EXIT_FAILURE); }
+
+	if(fs_sync(c.sb)) perror("fs_sync");
+	if(bench_fragmentation(c.sb, &frag)) perror("bench_fragmentation");
+
+	bench_print_header(stdout);
+	for(i = 0; i <= OP_ALL; i++)
+		if(c.st[i].n || c.st[i].errors) bench_print(stdout, &cfg, &c.st[i]);
+	printf("\n");
+	bench_print_histogram_header(stdout);
+	for(i = 0; i <= OP_ALL; i++) bench_print_histogram(stdout, &cfg, &c.st[i]);
+	printf("\n");
+	bench_print_frag_header(stdout);
+	bench_print_frag(stdout, &cfg, &frag);
+
+	if(fs_close(c.sb)) perror("fs_close");
+	if(c.record) fclose(c.record);
+	for(i = 0; i <= OP_ALL; i++) bench_stats_free(&c.st[i]);
+	free(c.buf);
+	free(c.files);
+	free(c.sizes);
+	free(c.dirs);
+	unlink(image);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
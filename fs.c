@@ -1,13 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <sys/types.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h> 
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "fs.h"
 
@@ -19,11 +37,152 @@
 
 #define SUPERBLOCK_BLK 0
 #define ROOT_INODE_BLK 1
-#define ROOT_INFO_BLK 2
-#define FREE_LIST_BLK 3
+#define ITABLE_BLK 1
+
+/* with FS_FEATURE_ITABLE, one inode is reserved for every few blocks */
+#define ITABLE_BLOCKS_PER_INODE 4
 
 #define INVALID_BLOCK ((uint64_t) -1)
 
+/* upper bound on fs_fsck threads */
+#define FS_FSCK_MAX_THREADS 64
+
+/* trace records buffered before they are written out */
+#define FS_TRACE_RING 4096
+
+/* largest request fs_import issues, and its thread limit */
+#define FS_IMPORT_CHUNK (1 << 20)
+#define FS_IMPORT_MAX_THREADS 64
+
+/* decompression threads for one read, each taking at least a few chunks */
+#define FS_COMP_MAX_THREADS 8
+#define FS_COMP_THREAD_CHUNKS 4
+
+/* positions remembered by the compressor, as a power of two */
+#define FS_LZ_HASH_BITS 12
+
+/* fs_dd_hash constants */
+#define FS_DD_SEED 0x9e3779b97f4a7c15ULL
+#define FS_DD_PRIME 0xff51afd7ed558ccdULL
+
+/* with the index of an earlier block in fs_dd_plan */
+#define FS_DD_PREV ((uint64_t) 1 << 63)
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected */
+#define FS_CRC32C_POLY 0x82f63b78
+
+/* checksum table blocks cached, each in the slot picked by its number */
+#define FS_CSUM_CACHE 16
+
+/* blocks staged by FS_OPT_SORTFREE before they are merged */
+#define FS_FREE_STAGE 1024
+
+/* alignment of the buffers handed out by fs_blk_alloc */
+#define FS_SLAB_ALIGN 64
+
+/* result of fs_walk */
+struct fs_walk {
+  uint64_t blk; /* the entity named by the path, or INVALID_BLOCK */
+  uint64_t parent; /* directory that holds or would hold it, or INVALID_BLOCK */
+  const char *name; /* last component, within the path, not terminated */
+  size_t namelen;
+};
+
+/* in-memory copy of a file's contents whose data blocks have not been
+ * allocated yet (see FS_OPT_DELALLOC). */
+struct fs_dirty {
+  uint64_t blk; /* first inode of the file */
+  uint64_t reserved; /* free blocks promised to this entry */
+  uint64_t ireserved; /* free inodes promised to this entry */
+  uint64_t nnew; /* data blocks to allocate at flush time */
+  int unread; /* its inode could not be read at flush time */
+  size_t cnt;
+  char *data;
+  struct fs_dirty *next;
+};
+
+/* progress of an fs_defrag pass.  while a pass runs, the free list is kept
+ * in ascending order and mirrored in =free. */
+struct fs_defrag {
+  uint8_t *free; /* blocks on the free list */
+  uint64_t *dirs; /* directories still to visit */
+  uint64_t ndirs;
+  uint64_t capdirs;
+  uint64_t dir; /* directory being visited, zero between directories */
+  uint64_t pos; /* inode of =dir's chain holding its next entry */
+  uint64_t slot; /* slot of that entry in =pos */
+};
+
+/* one cached block of a table of uint32_t entries, one per block of the
+ * image: =blk is zero if none, =dirty tells whether it was changed since it
+ * was written */
+struct fs_tcache {
+  uint64_t blk;
+  uint32_t *buf;
+  int dirty;
+};
+
+/* private per-filesystem state.  =sb must be the first member: callers only
+ * ever see a pointer to it. */
+struct fs_state {
+  struct superblock sb;
+  uint64_t opts;
+  /* blocks and inodes reserved by entries in =dirty, not yet allocated */
+  uint64_t reserved;
+  uint64_t ireserved;
+  struct fs_dirty *dirty;
+  struct fs_dirty **dirty_tail;
+  /* last inode table block read (FS_FEATURE_ITABLE), zero if none */
+  uint64_t icache_blk;
+  char *icache;
+  /* read-only mapping of the whole image backing fs_read_view, or NULL */
+  char *map;
+  /* updated only with FS_OPT_STATS */
+  struct fs_stats stats;
+  /* public call in progress, FS_API_COUNT outside of them */
+  int api;
+  /* block trace ring (see fs_trace), NULL when not tracing */
+  struct fs_trace_rec *trace;
+  uint64_t ntrace;
+  int trace_fd;
+  /* fs_defrag pass in progress, or NULL */
+  struct fs_defrag *defrag;
+  /* read and write requests issued to the image */
+  uint64_t nio;
+  /* blocks freed with FS_OPT_SORTFREE, not yet on the free list */
+  uint64_t *staged;
+  uint64_t nstaged;
+  /* block buffers returned with fs_blk_free, chained through their first
+   * bytes */
+  void *slab;
+  /* last reference count table block used (FS_FEATURE_REFCOUNT) */
+  struct fs_tcache rcache;
+  /* FS_FEATURE_DEDUP: last hash table block used, and the whole table,
+   * loaded on first use, with each block chained to the next one of its
+   * bucket; buckets are selected by the low bits of the hash */
+  struct fs_tcache hcache;
+  uint32_t *dd_hash;
+  uint64_t *dd_next;
+  uint64_t *dd_head;
+  uint64_t dd_mask;
+  /* generation of each inode, bumped whenever it is allocated so that
+   * directory handles notice reuse; allocated on first use */
+  uint32_t *igen;
+  /* checksum table blocks used last (FS_FEATURE_CSUM), since inodes are
+   * spread over the image; written back at the end of each public call */
+  struct fs_tcache ccache[FS_CSUM_CACHE];
+};
+
+#define FS_STATE(sb) ((struct fs_state*) (sb))
+
+#define FS_STAT_ADD(sb, field, n) do { \
+  if (FS_STATE(sb)->opts & FS_OPT_STATS) \
+    FS_STATE(sb)->stats.field += (n); \
+} while (0)
+
+/* the superblock must fit in the smallest block */
+typedef char fs_superblock_fits[(sizeof(struct superblock) <= MIN_BLOCK_SIZE) ? 1 : -1];
+
 /****************************************************************************
  * auxiliar functions
  ***************************************************************************/
@@ -31,932 +190,7818 @@
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 #define CEIL(X, Y) (((X) / (Y)) + (((X) % (Y) > 0) ? 1 : 0))
 
-uint64_t fs_inode_max_links(struct superblock *sb) {
-  return (sb->blksz - sizeof(struct inode)) / (sizeof(uint64_t));
-}
+int fs_do_put_block(struct superblock *sb, uint64_t block);
+int fs_free_insert(struct superblock *sb, uint64_t blk);
+int fs_free_merge(struct superblock *sb);
+int fs_trace_flush(struct superblock *sb);
+struct inode * fs_map_inode(struct superblock *sb, char *map, uint64_t ino);
+int fs_kept(struct superblock *sb, const uint32_t *kept, const uint8_t *zero, uint64_t j);
+int fs_export_valid_ino(struct superblock *sb, uint64_t ino);
+int fs_blk_cmp(const void *a, const void *b);
+int fs_tcache_flush(struct superblock *sb, struct fs_tcache *tc);
+int fs_csum_set(struct superblock *sb, uint64_t blk, const void *data, size_t n);
+int fs_csum_check(struct superblock *sb, uint64_t blk, const void *data, size_t n);
 
-uint64_t fs_nodeinfo_max_name_size(struct superblock *sb) {
-  return (sb->blksz - sizeof(struct nodeinfo)) / (sizeof(char));
-}
+uint64_t fs_now(void) {
+  struct timespec ts;
 
-int fs_write_blk_sz(struct superblock *sb, uint64_t pos, void *data, size_t sz) {
-  if (lseek(sb->fd, pos * sb->blksz, SEEK_SET) == -1) 
-    return -1;
-  
-  if (write(sb->fd, data, sz) == -1) 
-    return -1;
-  
-  return 0;
-}
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-int fs_write_blk(struct superblock *sb, uint64_t pos, void *data) {
-  return fs_write_blk_sz(sb, pos, data, sb->blksz);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
 }
 
-int fs_read_blk_sz(struct superblock *sb, uint64_t pos, void *buf, size_t sz) {
-  if (lseek(sb->fd, pos * sb->blksz, SEEK_SET) == -1) 
-    return -1;
-  
-  if (read(sb->fd, buf, sz) == -1) 
+/* Write out the buffered trace records. */
+int fs_trace_flush(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+  size_t sz = state->ntrace * sizeof(struct fs_trace_rec);
+
+  state->ntrace = 0;
+
+  if (sz > 0 && write(state->trace_fd, state->trace, sz) != (ssize_t) sz) {
     return -1;
-  
+  }
+
   return 0;
 }
 
-int fs_read_blk(struct superblock *sb, uint64_t pos, void *buf) {
-  return fs_read_blk_sz(sb, pos, buf, sb->blksz);
-}
+/* Flush and close the block trace, if any. */
+int fs_trace_stop(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
 
-char * fs_get_basedir(const char *path) {
-  int n = (int)(strrchr(path, DIR_DELIM_CHR) - path);
+  if (state->trace == NULL) {
+    return 0;
+  }
 
-  char *basedir = (char*) malloc((n + 2) * sizeof(char));
-  *basedir = '\0';
+  int ret = fs_trace_flush(sb);
 
-  if (n == 0) {
-    strcat(basedir, "/");
-  } else {
-    strncat(basedir, path, n);
+  if (close(state->trace_fd) == -1) {
+    ret = -1;
   }
 
-  return basedir;
+  free(state->trace);
+  state->trace = NULL;
+
+  return ret;
 }
 
-char * fs_get_basename(const char *path) {
-  char *c = strrchr(path, DIR_DELIM_CHR);
+/* Append a record to the block trace, writing the ring out when full. */
+void fs_trace_add(struct superblock *sb, uint8_t op, uint64_t blk, uint64_t size) {
+  struct fs_state *state = FS_STATE(sb);
+  struct fs_trace_rec *rec = &state->trace[state->ntrace++];
 
-  char *basename = (char*) malloc(strlen(c) * sizeof(char));
-  strcpy(basename, c+1);
+  rec->ns = fs_now();
+  rec->blk = blk;
+  rec->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+  rec->op = op;
+  rec->api = state->api;
+  rec->pad = 0;
 
-  return basename;
+  if (state->ntrace == FS_TRACE_RING) {
+    fs_trace_flush(sb);
+  }
 }
 
-int fs_is_invalid_name(const char *name) {
-  return strlen(name) == 0 \
-    || strncmp(name, ROOT_DIR_NAME, strlen(ROOT_DIR_NAME)) != 0 \
-    || strchr(name, ' ') != NULL;
+/* Enter public call =api.  Returns the start time if the call is to be
+ * timed (see FS_OPT_STATS), zero otherwise. */
+uint64_t fs_call_begin(struct superblock *sb, int api) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    return 0;
+  }
+
+  FS_STATE(sb)->api = api;
+
+  return (FS_STATE(sb)->opts & FS_OPT_STATS) ? fs_now() : 0;
 }
 
-uint64_t fs_find_blk(struct superblock *sb, const char *name) {
-  if (strlen(name) == 1) {
-    return sb->root;
+/* Leave the current public call, which moved =bytes bytes of file data.
+ * Returns -1 with errno set if the checksums of the blocks it wrote could
+ * not be written, which fails the call; a call that already =failed keeps
+ * its own errno. */
+int fs_call_end(struct superblock *sb, uint64_t t0, int failed, uint64_t bytes) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    return 0;
   }
 
-  char *name_c = (char*) malloc((strlen(name) + 1) * sizeof(char));
-  strcpy(name_c, name);
+  struct fs_state *state = FS_STATE(sb);
+  int api = state->api;
+  int err = errno;
+  int ret = 0;
 
-  struct inode* inode = (struct inode*) malloc(sb->blksz);
-  struct nodeinfo* nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
+  // The checksums of the blocks the call wrote reach the image with it
+  for (int k=0; k<FS_CSUM_CACHE; k++) {
+    if (fs_tcache_flush(sb, &state->ccache[k]) == -1) {
+      ret = -1;
+    }
+  }
 
-  fs_read_blk(sb, ROOT_INODE_BLK, (void*) inode);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
+  if (failed) {
+    errno = err;
+  }
 
-  struct inode* child_inode = (struct inode*) malloc(sb->blksz);
-  struct nodeinfo* child_nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
+  failed = failed || ret == -1;
 
-  uint64_t blk_pos = ROOT_INODE_BLK;
+  if (state->trace != NULL) {
+    fs_trace_add(sb, FS_TRACE_CALL, 0, bytes);
+  }
 
-  char *token = strtok(name_c, DIR_DELIM_STR);
+  state->api = FS_API_COUNT;
 
-  while (token != NULL) {
-    int found = 0;
+  if (t0 == 0) {
+    return ret;
+  }
 
-    uint64_t max_links = fs_inode_max_links(sb);
+  struct fs_api_stats *st = &state->stats.api[api];
+  uint64_t ns = fs_now() - t0;
+  uint64_t us = ns / 1000;
+  int k = 0;
 
-    int i = -1;
-    int j = 0;
+  while (k < FS_STATS_BUCKETS - 1 && us >= ((uint64_t) 1 << k)) {
+    k++;
+  }
 
-    while (j < nodeinfo->size && ++i < max_links) {
-      if (inode->links[i] == INVALID_BLOCK) {
-        continue;
-      }
+  st->calls++;
+  st->errors += failed ? 1 : 0;
+  st->ns += ns;
+  st->hist[k]++;
 
-      fs_read_blk(sb, inode->links[i], (void*)child_inode);
-      fs_read_blk(sb, child_inode->meta, (void*)child_nodeinfo);
+  return ret;
+}
 
-      if (strcmp(child_nodeinfo->name, token) == 0) {
-        found = 1;
-        blk_pos = inode->links[i];        
-        break;
-      }
+int fs_has_itable(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_ITABLE) != 0;
+}
 
-      j++;
-    }
+/* Inodes are a full block, unless packed in an inode table. */
+uint64_t fs_inode_size(struct superblock *sb) {
+  return fs_has_itable(sb) ? FS_INODE_SIZE : sb->blksz;
+}
 
-    if (found != 1) {
-      errno = ENOENT;
-      blk_pos = INVALID_BLOCK;
-      break;
-    }
+uint64_t fs_inode_max_links(struct superblock *sb) {
+  return (fs_inode_size(sb) - sizeof(struct inode)) / (sizeof(uint64_t));
+}
 
-    token = strtok(NULL, DIR_DELIM_STR);
+int fs_has_refcount(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_REFCOUNT) != 0;
+}
 
-    if (token == NULL) {
-      break;
-    }
+int fs_has_compress(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_COMPRESS) != 0;
+}
 
-    if (child_inode->mode != IMDIR) {
-      errno = ENOTDIR;
-      blk_pos = INVALID_BLOCK;
-      break;
-    }
+int fs_has_dedup(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_DEDUP) != 0;
+}
 
-    memcpy(inode, child_inode, sb->blksz);
-    memcpy(nodeinfo, child_nodeinfo, sb->blksz);
-  }
+int fs_has_csum(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_CSUM) != 0;
+}
 
-  free(name_c);
-  free(inode);
-  free(nodeinfo);
-  free(child_inode);
-  free(child_nodeinfo);
+int fs_has_dcsum(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_DCSUM) != 0;
+}
 
-  return blk_pos;
+int fs_has_sparse(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_SPARSE) != 0;
 }
 
-int fs_link_blk(struct superblock *sb, uint64_t parent_blk, uint64_t link_blk) {
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  fs_read_blk(sb, parent_blk, (void*) inode);
+/* Blocks in the checksum table (FS_FEATURE_CSUM). */
+uint64_t fs_csum_blocks(struct superblock *sb) {
+  return CEIL(sb->blks * sizeof(uint32_t), sb->blksz);
+}
 
-  if (inode->mode != IMDIR) {
-    free(inode);
-    errno = ENOTDIR;
-    return -1;
+int fs_is_compact(struct superblock *sb) {
+  return (sb->features & FS_FEATURE_COMPACT) != 0;
+}
+
+/* Link slots in the first inode of an entity.  Compact images give half of
+ * what remains after the inode header to links and half to the embedded
+ * struct cnodeinfo; IMCHILD inodes always have fs_inode_max_links slots. */
+uint64_t fs_inode_first_links(struct superblock *sb) {
+  if (!fs_is_compact(sb)) {
+    return fs_inode_max_links(sb);
   }
-  
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
 
-  size_t max_links = fs_inode_max_links(sb);
+  return (fs_inode_size(sb) - sizeof(struct inode) - sizeof(struct cnodeinfo)) / 2 / sizeof(uint64_t);
+}
 
-  if (nodeinfo->size == max_links) {
-    free(inode);
-    free(nodeinfo);
-    errno = EMLINK;
-    return -1;
+struct cnodeinfo * fs_cnodeinfo(struct superblock *sb, struct inode *inode) {
+  return (struct cnodeinfo*) &inode->links[fs_inode_first_links(sb)];
+}
+
+uint64_t fs_nodeinfo_max_name_size(struct superblock *sb) {
+  if (fs_is_compact(sb)) {
+    return (fs_inode_size(sb) - sizeof(struct inode) - sizeof(struct cnodeinfo) \
+      - fs_inode_first_links(sb) * sizeof(uint64_t)) / (sizeof(char));
   }
 
-  for (int i=0; i<max_links; i++) {
-    if (inode->links[i] == INVALID_BLOCK) {
-      inode->links[i] = link_blk;
-      nodeinfo->size++;
-      break;
-    }
+  return (sb->blksz - sizeof(struct nodeinfo)) / (sizeof(char));
+}
+
+/* Inode units taken by a new entity: its inode, plus a nodeinfo block unless
+ * the image is compact. */
+uint64_t fs_meta_blocks(struct superblock *sb) {
+  return fs_is_compact(sb) ? 1 : 2;
+}
+
+/* Largest file that can be stored inline in the nodeinfo block of an entity
+ * whose name has =namelen characters. */
+uint64_t fs_inline_max_size(struct superblock *sb, size_t namelen) {
+  uint64_t max_name_size = fs_nodeinfo_max_name_size(sb);
+
+  return namelen + 1 < max_name_size ? max_name_size - (namelen + 1) : 0;
+}
+
+/* Inline data is stored right after the NUL terminating the name. */
+char * fs_inline_data(struct nodeinfo *nodeinfo) {
+  return nodeinfo->name + strlen(nodeinfo->name) + 1;
+}
+
+/* Number of data blocks used by the regular file described by =inode and
+ * =nodeinfo. */
+uint64_t fs_data_blocks(struct superblock *sb, struct inode *inode, struct nodeinfo *nodeinfo) {
+  return (inode->mode & IMINLINE) ? 0 : CEIL(nodeinfo->size, sb->blksz);
+}
+
+/* First block that may hold an inode, metadata or file data. */
+uint64_t fs_first_data_blk(struct superblock *sb) {
+  if (fs_has_csum(sb)) {
+    return sb->cstable + fs_csum_blocks(sb);
   }
 
-  fs_write_blk(sb, parent_blk, (void*) inode);
-  fs_write_blk(sb, inode->meta, (void*) nodeinfo);
+  if (fs_has_refcount(sb)) {
+    return sb->rctable + sb->rcblocks * (fs_has_dedup(sb) ? 2 : 1);
+  }
 
-  free(inode);
-  free(nodeinfo);
+  if (!fs_has_itable(sb)) {
+    return SUPERBLOCK_BLK + 1;
+  }
 
-  return 0;
+  return sb->itable + sb->inodes / (sb->blksz / FS_INODE_SIZE);
 }
 
-int fs_unlink_blk(struct superblock *sb, uint64_t parent_blk, uint64_t link_blk) {
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  fs_read_blk(sb, parent_blk, (void*) inode);
+int fs_write_at(struct superblock *sb, uint64_t off, void *data, size_t sz) {
+  FS_STATE(sb)->nio++;
+  FS_STAT_ADD(sb, writes, 1);
+  FS_STAT_ADD(sb, bytes_written, sz);
+  FS_STAT_ADD(sb, syscalls, 2);
 
-  if (inode->mode != IMDIR) {
-    free(inode);
-    errno = ENOTDIR;
+  if (FS_STATE(sb)->trace != NULL) {
+    fs_trace_add(sb, FS_TRACE_WRITE, off / sb->blksz, sz);
+  }
+
+  if (lseek(sb->fd, off, SEEK_SET) == -1) 
+    return -1;
+  
+  if (write(sb->fd, data, sz) == -1) 
     return -1;
+  
+  return 0;
+}
+
+int fs_read_at(struct superblock *sb, uint64_t off, void *buf, size_t sz) {
+  FS_STATE(sb)->nio++;
+  FS_STAT_ADD(sb, reads, 1);
+  FS_STAT_ADD(sb, bytes_read, sz);
+  FS_STAT_ADD(sb, syscalls, 2);
+
+  if (FS_STATE(sb)->trace != NULL) {
+    fs_trace_add(sb, FS_TRACE_READ, off / sb->blksz, sz);
   }
 
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
+  if (lseek(sb->fd, off, SEEK_SET) == -1) 
+    return -1;
+  
+  if (read(sb->fd, buf, sz) == -1) 
+    return -1;
+  
+  return 0;
+}
+
+int fs_write_blk_sz(struct superblock *sb, uint64_t pos, void *data, size_t sz) {
+  return fs_write_at(sb, pos * sb->blksz, data, sz);
+}
 
-  uint64_t max_links = fs_inode_max_links(sb);
+int fs_write_blk(struct superblock *sb, uint64_t pos, void *data) {
+  return fs_write_blk_sz(sb, pos, data, sb->blksz);
+}
 
-  int i = -1;
-  int j = 0;
+int fs_read_blk_sz(struct superblock *sb, uint64_t pos, void *buf, size_t sz) {
+  return fs_read_at(sb, pos * sb->blksz, buf, sz);
+}
 
-  while (j < nodeinfo->size && ++i < max_links) {
-    if (inode->links[i] == INVALID_BLOCK) {
-      continue;
-    }
+int fs_read_blk(struct superblock *sb, uint64_t pos, void *buf) {
+  return fs_read_blk_sz(sb, pos, buf, sb->blksz);
+}
 
-    if (inode->links[i] == link_blk) {
-      inode->links[i] = INVALID_BLOCK;
-      nodeinfo->size--;
-      break;
-    }
+int fs_write_sb(struct superblock *sb) {
+  return fs_write_blk_sz(sb, SUPERBLOCK_BLK, (void*) sb, sizeof(struct superblock));
+}
+
+/* Make inode table block =blk the cached one, reading it unless it already
+ * is.  With FS_FEATURE_CSUM the block is checked as it is read. */
+int fs_icache_load(struct superblock *sb, uint64_t blk) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (state->icache == NULL) {
+    state->icache = (char*) malloc(sb->blksz);
+  }
 
-    j++;
+  if (state->icache_blk == blk) {
+    FS_STAT_ADD(sb, icache_hits, 1);
+    return 0;
   }
 
-  fs_write_blk(sb, parent_blk, (void*) inode);
-  fs_write_blk(sb, inode->meta, (void*) nodeinfo);
+  FS_STAT_ADD(sb, icache_misses, 1);
 
-  free(inode);
-  free(nodeinfo);
+  if (fs_read_blk(sb, blk, (void*) state->icache) == -1
+      || (fs_has_csum(sb) && fs_csum_check(sb, blk, state->icache, sb->blksz) == -1)) {
+    state->icache_blk = 0;
+    return -1;
+  }
+
+  state->icache_blk = blk;
 
   return 0;
 }
 
-/****************************************************************************
- * external functions
- ***************************************************************************/
+/* Read inode number =ino.  Without an inode table the inode number is the
+ * inode's block.  With one, the whole table block is read and kept, so
+ * walking neighbouring inodes (e.g. listing a directory) costs one read per
+ * table block.  Fails with EIO if the block does not match its checksum. */
+int fs_read_inode(struct superblock *sb, uint64_t ino, struct inode *inode) {
+  if (!fs_has_itable(sb)) {
+    if (fs_read_blk(sb, ino, (void*) inode) == -1) {
+      return -1;
+    }
 
-struct superblock * fs_format(const char *fname, uint64_t blocksize) {
-  if (blocksize < MIN_BLOCK_SIZE) {
-    errno = EINVAL;
-    return NULL;
+    return fs_has_csum(sb) ? fs_csum_check(sb, ino, inode, sb->blksz) : 0;
   }
 
-  int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR);
+  uint64_t per_blk = sb->blksz / FS_INODE_SIZE;
 
-  off_t fsize = lseek(fd, 0, SEEK_END);
+  if (fs_icache_load(sb, sb->itable + ino / per_blk) == -1) {
+    return -1;
+  }
 
-  long nblocks = fsize / blocksize;
+  memcpy(inode, FS_STATE(sb)->icache + (ino % per_blk) * FS_INODE_SIZE, FS_INODE_SIZE);
 
-  if (nblocks < MIN_BLOCK_COUNT) {
-    errno = ENOSPC;
-    return NULL;
-  }
+  return 0;
+}
 
-  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-    close(fd);
-    errno = EBUSY;
-    return NULL;
+int fs_write_inode(struct superblock *sb, uint64_t ino, struct inode *inode) {
+  if (!fs_has_itable(sb)) {
+    if (fs_has_csum(sb) && fs_csum_set(sb, ino, inode, sb->blksz) == -1) {
+      return -1;
+    }
+
+    return fs_write_blk(sb, ino, (void*) inode);
   }
 
-  lseek(fd, 0, SEEK_SET);
+  struct fs_state *state = FS_STATE(sb);
 
-  // ----- Superblock -----
+  uint64_t per_blk = sb->blksz / FS_INODE_SIZE;
+  uint64_t blk = sb->itable + ino / per_blk;
 
-  struct superblock *sb = (struct superblock*) malloc(sizeof(struct superblock));
+  // The checksum covers the whole table block, so it has to be at hand
+  if (fs_has_csum(sb) && fs_icache_load(sb, blk) == -1) {
+    return -1;
+  }
 
-  if (sb == NULL) {
-    return NULL;
+  if (state->icache_blk == blk) {
+    memcpy(state->icache + (ino % per_blk) * FS_INODE_SIZE, inode, FS_INODE_SIZE);
   }
-  
-  sb->magic = SUPERBLOCK_MAGIC;
-  sb->blksz = blocksize;
-  sb->blks = nblocks;
-  sb->freeblks = nblocks - 3;
-  sb->root = ROOT_INODE_BLK;
-  sb->freelist = FREE_LIST_BLK;
-  sb->fd = fd;
 
-  if (fs_write_blk(sb, SUPERBLOCK_BLK, (void*) sb) == -1) 
-    return NULL;
+  if (fs_has_csum(sb) && fs_csum_set(sb, blk, state->icache, sb->blksz) == -1) {
+    return -1;
+  }
 
-  // ----- Root inode -----
+  return fs_write_at(sb, sb->itable * sb->blksz + ino * FS_INODE_SIZE, (void*) inode, FS_INODE_SIZE);
+}
 
-  struct inode* root_inode  = (struct inode*) malloc(blocksize);
-  
-  root_inode->mode = IMDIR;
-  root_inode->parent = SUPERBLOCK_BLK;
-  root_inode->meta = ROOT_INFO_BLK;
-  root_inode->next = 0;
+/* Fill =nodeinfo with the metadata of the entity whose first inode has
+ * already been read into =inode.  Compact images keep it in the inode block
+ * itself, so no I/O is needed there. */
+int fs_read_info(struct superblock *sb, struct inode *inode, struct nodeinfo *nodeinfo) {
+  if (!fs_is_compact(sb)) {
+    if (fs_read_blk(sb, inode->meta, (void*) nodeinfo) == -1) {
+      return -1;
+    }
 
-  for (int i=0; i<fs_inode_max_links(sb); i++) {
-    root_inode->links[i] = INVALID_BLOCK;
+    return fs_has_csum(sb) ? fs_csum_check(sb, inode->meta, nodeinfo, sb->blksz) : 0;
   }
 
-  if (fs_write_blk(sb, ROOT_INODE_BLK, (void*) root_inode) == -1)
-    return NULL;
+  struct cnodeinfo *cnodeinfo = fs_cnodeinfo(sb, inode);
 
-  free(root_inode);
+  nodeinfo->size = cnodeinfo->size;
+  memcpy(nodeinfo->name, cnodeinfo->name, fs_nodeinfo_max_name_size(sb));
 
-  // ----- Root node info -----
+  return 0;
+}
 
-  struct nodeinfo* root_info = (struct nodeinfo*) malloc(blocksize);
+/* Write the first inode of an entity, stored at =blk, and its metadata. */
+int fs_write_meta(struct superblock *sb, uint64_t blk, struct inode *inode, struct nodeinfo *nodeinfo) {
+  if (!fs_is_compact(sb)) {
+    if (fs_write_inode(sb, blk, inode) == -1)
+      return -1;
 
-  if (root_info == NULL) {
-    return NULL;
-  }
+    if (fs_has_csum(sb) && fs_csum_set(sb, inode->meta, nodeinfo, sb->blksz) == -1)
+      return -1;
 
-  strcpy((char*)&root_info->name, ROOT_DIR_NAME);
-  root_info->size = 0;
-  
-  if (fs_write_blk(sb, ROOT_INFO_BLK, (void*) root_info) == -1)
-    return NULL;
+    return fs_write_blk(sb, inode->meta, (void*) nodeinfo);
+  }
 
-  free(root_info);
+  struct cnodeinfo *cnodeinfo = fs_cnodeinfo(sb, inode);
 
-  // ----- Free list -----
+  cnodeinfo->size = nodeinfo->size;
+  memcpy(cnodeinfo->name, nodeinfo->name, fs_nodeinfo_max_name_size(sb));
 
-  struct freepage *freepage = (struct freepage*) malloc(blocksize);
+  return fs_write_inode(sb, blk, inode);
+}
 
-  freepage->count = 0;
+struct superblock * fs_state_new(void) {
+  struct fs_state *state = (struct fs_state*) calloc(1, sizeof(struct fs_state));
 
-  for (int i=sb->freelist; i<sb->blks; i++) {
-    freepage->next = (i == sb->blks - 1) ? 0 : i + 1;
-    fs_write_blk(sb, i, (void*) freepage);
+  if (state == NULL) {
+    return NULL;
   }
 
-  free(freepage);
+  state->dirty_tail = &state->dirty;
+  state->api = FS_API_COUNT;
 
-  // ----- End -----
-  
-  return sb;
+  return &state->sb;
 }
 
-struct superblock * fs_open(const char *fname) {
-  int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR);
+/* A block-sized buffer aligned to FS_SLAB_ALIGN, reused from the ones given
+ * back with fs_blk_free when possible.  Not thread safe: worker threads
+ * allocate their own buffers. */
+void * fs_blk_alloc(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+  void *buf = state->slab;
 
-  if (fd == -1) {
-    return NULL;
+  if (buf != NULL) {
+    state->slab = *(void**) buf;
+    return buf;
   }
 
-  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-    close(fd);
-    errno = EBUSY;
+  if (posix_memalign(&buf, FS_SLAB_ALIGN, sb->blksz) != 0) {
+    errno = ENOMEM;
     return NULL;
   }
 
-  struct superblock* sb = (struct superblock*) malloc(sizeof(struct superblock));
+  return buf;
+}
 
-  if (sb == NULL) {
-    flock(fd, LOCK_UN);
-    close(fd);
-    return NULL;
+void fs_blk_free(struct superblock *sb, void *buf) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (buf == NULL) {
+    return;
+  }
+
+  *(void**) buf = state->slab;
+  state->slab = buf;
+}
+
+/* Room for =n block numbers, taken from the slab when it fits in a block. */
+uint64_t * fs_blks_alloc(struct superblock *sb, uint64_t n) {
+  if (n * sizeof(uint64_t) <= sb->blksz) {
+    return (uint64_t*) fs_blk_alloc(sb);
+  }
+
+  return (uint64_t*) malloc(n * sizeof(uint64_t));
+}
+
+void fs_blks_free(struct superblock *sb, uint64_t *blks, uint64_t n) {
+  if (n * sizeof(uint64_t) <= sb->blksz) {
+    fs_blk_free(sb, blks);
+  } else {
+    free(blks);
+  }
+}
+
+/* Release the buffers kept by fs_blk_free. */
+void fs_blk_drain(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+
+  while (state->slab != NULL) {
+    void *buf = state->slab;
+    state->slab = *(void**) buf;
+    free(buf);
+  }
+}
+
+/* Number of IMCHILD inodes needed to hold =nblocks data links. */
+uint64_t fs_child_inodes(struct superblock *sb, uint64_t nblocks) {
+  uint64_t first_links = fs_inode_first_links(sb);
+
+  return nblocks <= first_links ? 0 : CEIL(nblocks - first_links, fs_inode_max_links(sb));
+}
+
+/* Take =n blocks from the free list into =blks, writing the superblock only
+ * once.  Returns zero on success, or -1 with errno set; on error the free
+ * list is left untouched. */
+int fs_get_blocks(struct superblock *sb, uint64_t n, uint64_t *blks) {
+  if (n == 0) {
+    return 0;
+  }
+
+  if (n > sb->freeblks && fs_free_merge(sb) == -1) {
+    return -1;
+  }
+
+  if (n > sb->freeblks) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  struct freepage* freepage = (struct freepage*) fs_blk_alloc(sb);
+
+  if (freepage == NULL) 
+    return -1;
+
+  uint64_t freelist = sb->freelist;
+
+  for (uint64_t i=0; i<n; i++) {
+    if (fs_read_blk(sb, freelist, (void*) freepage) == -1) {
+      fs_blk_free(sb, freepage);
+      return -1;
+    }
+
+    blks[i] = freelist;
+    freelist = freepage->next;
+
+    if (FS_STATE(sb)->defrag != NULL) {
+      FS_STATE(sb)->defrag->free[blks[i]] = 0;
+    }
+  }
+
+  fs_blk_free(sb, freepage);
+
+  sb->freelist = freelist;
+  sb->freeblks -= n;
+
+  FS_STAT_ADD(sb, blk_allocs, n);
+
+  return fs_write_sb(sb);
+}
+
+/* Generation of inode =ino (see fs_state.igen). */
+uint64_t fs_igen(struct superblock *sb, uint64_t ino) {
+  uint32_t *igen = FS_STATE(sb)->igen;
+
+  return igen == NULL ? 0 : igen[ino];
+}
+
+/* Bump the generations of the =n inodes at =inos, just allocated; the
+ * array must have been created with fs_igen_alloc. */
+void fs_igen_bump(struct superblock *sb, uint64_t n, const uint64_t *inos) {
+  for (uint64_t i=0; i<n; i++) {
+    FS_STATE(sb)->igen[inos[i]]++;
+  }
+}
+
+/* Create the generation array if needed.  Inodes allocated before it
+ * existed all had generation zero, which is still what handles on them
+ * hold. */
+int fs_igen_alloc(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (state->igen == NULL) {
+    uint64_t n = fs_has_itable(sb) ? sb->inodes : sb->blks;
+
+    if ((state->igen = (uint32_t*) calloc(n, sizeof(uint32_t))) == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Allocate =n inodes into =inos.  Without an inode table, inodes are plain
+ * blocks. */
+int fs_get_inodes(struct superblock *sb, uint64_t n, uint64_t *inos) {
+  if (fs_igen_alloc(sb) == -1) {
+    return -1;
+  }
+
+  if (!fs_has_itable(sb)) {
+    if (fs_get_blocks(sb, n, inos) == -1) {
+      return -1;
+    }
+
+    fs_igen_bump(sb, n, inos);
+
+    return 0;
+  }
+
+  if (n == 0) {
+    return 0;
+  }
+
+  if (n > sb->nifree) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  uint64_t ifree = sb->ifree;
+
+  for (uint64_t i=0; i<n; i++) {
+    if (fs_read_inode(sb, ifree, inode) == -1) {
+      fs_blk_free(sb, inode);
+      return -1;
+    }
+
+    inos[i] = ifree;
+    ifree = inode->next;
+  }
+
+  fs_blk_free(sb, inode);
+
+  sb->ifree = ifree;
+  sb->nifree -= n;
+
+  FS_STAT_ADD(sb, inode_allocs, n);
+  fs_igen_bump(sb, n, inos);
+
+  return fs_write_sb(sb);
+}
+
+int fs_put_inode(struct superblock *sb, uint64_t ino) {
+  if (!fs_has_itable(sb)) {
+    return fs_do_put_block(sb, ino);
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (inode == NULL)
+    return -1;
+
+  // Free inodes have a zero mode and are chained through =next
+  memset(inode, 0, FS_INODE_SIZE);
+  inode->next = sb->ifree;
+
+  sb->ifree = ino;
+  sb->nifree++;
+
+  FS_STAT_ADD(sb, inode_frees, 1);
+
+  if (fs_write_inode(sb, ino, inode) == -1 || fs_write_sb(sb) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  fs_blk_free(sb, inode);
+
+  return 0;
+}
+
+/* Whether =nblocks data blocks and =ninodes inode units can be allocated
+ * without touching space reserved for buffered files.  Should the
+ * reservations ever exceed what is free, nothing fits until they shrink. */
+int fs_has_space(struct superblock *sb, uint64_t nblocks, uint64_t ninodes) {
+  struct fs_state *state = FS_STATE(sb);
+
+  uint64_t avail = sb->freeblks + state->nstaged;
+  uint64_t reserved = state->reserved + (fs_has_itable(sb) ? 0 : state->ireserved);
+  uint64_t freeblks = avail > reserved ? avail - reserved : 0;
+
+  if (!fs_has_itable(sb)) {
+    return nblocks + ninodes <= freeblks;
+  }
+
+  uint64_t freeinos = sb->nifree > state->ireserved ? sb->nifree - state->ireserved : 0;
+
+  return nblocks <= freeblks && ninodes <= freeinos;
+}
+
+/* Write back the table block cached in =tc if it was changed. */
+int fs_tcache_flush(struct superblock *sb, struct fs_tcache *tc) {
+  if (!tc->dirty) {
+    return 0;
+  }
+
+  tc->dirty = 0;
+
+  return fs_write_blk(sb, tc->blk, (void*) tc->buf);
+}
+
+/* Entry of block =blk in the table starting at block =table, through the
+ * cache =tc.  The table block holding it is kept, so the neighbouring
+ * blocks of a file cost no further I/O; changes stay there until
+ * fs_tcache_flush or until another table block is needed.  Returns NULL on
+ * error. */
+uint32_t * fs_tcache_entry(struct superblock *sb, struct fs_tcache *tc, uint64_t table, uint64_t blk) {
+  uint64_t per_blk = sb->blksz / sizeof(uint32_t);
+  uint64_t tblk = table + blk / per_blk;
+
+  if (tc->buf == NULL) {
+    tc->buf = (uint32_t*) malloc(sb->blksz);
+
+    if (tc->buf == NULL) {
+      return NULL;
+    }
+  }
+
+  if (tc->blk != tblk) {
+    if (fs_tcache_flush(sb, tc) == -1) {
+      return NULL;
+    }
+
+    if (fs_read_blk(sb, tblk, (void*) tc->buf) == -1) {
+      tc->blk = 0;
+      return NULL;
+    }
+
+    tc->blk = tblk;
+  }
+
+  return &tc->buf[blk % per_blk];
+}
+
+/* Write back the cached reference count, hash and checksum table blocks. */
+int fs_tables_flush(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+  int ret = fs_tcache_flush(sb, &state->rcache);
+
+  if (fs_tcache_flush(sb, &state->hcache) == -1) {
+    ret = -1;
+  }
+
+  for (int k=0; k<FS_CSUM_CACHE; k++) {
+    if (fs_tcache_flush(sb, &state->ccache[k]) == -1) {
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
+
+uint32_t * fs_rc_entry(struct superblock *sb, uint64_t blk) {
+  return fs_tcache_entry(sb, &FS_STATE(sb)->rcache, sb->rctable, blk);
+}
+
+/* Files sharing data block =blk besides its first owner; always zero
+ * without FS_FEATURE_REFCOUNT. */
+uint32_t fs_rc_get(struct superblock *sb, uint64_t blk) {
+  if (!fs_has_refcount(sb)) {
+    return 0;
+  }
+
+  uint32_t *rc = fs_rc_entry(sb, blk);
+
+  return rc == NULL ? 0 : *rc;
+}
+
+int fs_rc_add(struct superblock *sb, uint64_t blk, int32_t n) {
+  uint32_t *rc = fs_rc_entry(sb, blk);
+
+  if (rc == NULL) {
+    return -1;
+  }
+
+  *rc += n;
+  FS_STATE(sb)->rcache.dirty = 1;
+
+  return 0;
+}
+
+/* Slicing-by-8 tables of the software CRC32C, x^(2^k) modulo the
+ * polynomial for fs_crc32c_xpow, and the implementation picked for this
+ * CPU; set up once by fs_crc32c_init. */
+uint32_t fs_crc32c_table[8][256];
+uint32_t fs_crc32c_x2n[32];
+uint32_t (*fs_crc32c_fn)(uint32_t crc, const char *buf, size_t n);
+pthread_once_t fs_crc32c_once = PTHREAD_ONCE_INIT;
+/* lane length and its fs_crc32c_xpow, packed in one word */
+uint64_t fs_crc32c_lane;
+
+/* Table-driven CRC32C, eight bytes per step. */
+uint32_t fs_crc32c_sw(uint32_t crc, const char *buf, size_t n) {
+  const uint8_t *p = (const uint8_t*) buf;
+  uint32_t (*t)[256] = fs_crc32c_table;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    crc ^= (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+      ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+  }
+
+  for (; n > 0; n--, p++) {
+    crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+/* Product of =a and =b modulo the CRC32C polynomial, bit-reflected. */
+uint32_t fs_crc32c_mul(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t) 1 << 31;
+  uint32_t p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ FS_CRC32C_POLY : b >> 1;
+  }
+
+  return p;
+}
+
+/* x^(8 * =n) modulo the polynomial: multiplying a CRC register by it is
+ * the same as feeding it =n zero bytes.  The last length asked for is
+ * remembered, as it is nearly always the block size. */
+uint32_t fs_crc32c_xpow(size_t n) {
+  uint64_t lane = __atomic_load_n(&fs_crc32c_lane, __ATOMIC_RELAXED);
+
+  if (lane >> 32 == n) {
+    return (uint32_t) lane;
+  }
+
+  uint32_t p = (uint32_t) 1 << 31;
+
+  for (size_t m=n, k=3; m > 0; m >>= 1, k++) {
+    if (m & 1) {
+      p = fs_crc32c_mul(fs_crc32c_x2n[k & 31], p);
+    }
+  }
+
+  __atomic_store_n(&fs_crc32c_lane, ((uint64_t) n << 32) | p, __ATOMIC_RELAXED);
+
+  return p;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FS_CRC32C_TARGET __attribute__((target("sse4.2")))
+#define FS_CRC32C_U64(crc, w) __builtin_ia32_crc32di(crc, w)
+#define FS_CRC32C_U8(crc, b) __builtin_ia32_crc32qi(crc, b)
+
+int fs_crc32c_has_hw(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define FS_CRC32C_TARGET
+#define FS_CRC32C_U64(crc, w) __crc32cd(crc, w)
+#define FS_CRC32C_U8(crc, b) __crc32cb(crc, b)
+
+int fs_crc32c_has_hw(void) {
+  return 1;
+}
+#else
+int fs_crc32c_has_hw(void) {
+  return 0;
+}
+#endif
+
+#ifdef FS_CRC32C_U64
+/* CRC32C with the SSE4.2 or ARMv8 CRC32C instructions.  Each one waits for
+ * the result of the previous one, so buffers of a few hundred bytes or
+ * more are cut into three lanes computed side by side, then combined. */
+FS_CRC32C_TARGET
+uint32_t fs_crc32c_hw(uint32_t crc, const char *buf, size_t n) {
+  uint64_t c0 = crc;
+
+  if (n >= 384) {
+    size_t lane = n / 24 * 8;
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+
+    for (size_t i=0; i<lane; i+=8) {
+      uint64_t w0, w1, w2;
+
+      memcpy(&w0, buf + i, sizeof(w0));
+      memcpy(&w1, buf + lane + i, sizeof(w1));
+      memcpy(&w2, buf + 2 * lane + i, sizeof(w2));
+      c0 = FS_CRC32C_U64(c0, w0);
+      c1 = FS_CRC32C_U64(c1, w1);
+      c2 = FS_CRC32C_U64(c2, w2);
+    }
+
+    uint32_t x = fs_crc32c_xpow(lane);
+
+    c0 = fs_crc32c_mul(x, (uint32_t) c0) ^ (uint32_t) c1;
+    c0 = fs_crc32c_mul(x, (uint32_t) c0) ^ (uint32_t) c2;
+    buf += 3 * lane;
+    n -= 3 * lane;
+  }
+
+  for (; n >= 8; n -= 8, buf += 8) {
+    uint64_t w;
+
+    memcpy(&w, buf, sizeof(w));
+    c0 = FS_CRC32C_U64(c0, w);
+  }
+
+  crc = (uint32_t) c0;
+
+  for (; n > 0; n--, buf++) {
+    crc = FS_CRC32C_U8(crc, (unsigned char) *buf);
+  }
+
+  return crc;
+}
+#else
+#define fs_crc32c_hw fs_crc32c_sw
+#endif
+
+void fs_crc32c_init(void) {
+  for (uint32_t i=0; i<256; i++) {
+    uint32_t crc = i;
+
+    for (int k=0; k<8; k++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? FS_CRC32C_POLY : 0);
+    }
+
+    fs_crc32c_table[0][i] = crc;
+  }
+
+  for (uint32_t i=0; i<256; i++) {
+    for (int k=1; k<8; k++) {
+      uint32_t prev = fs_crc32c_table[k - 1][i];
+
+      fs_crc32c_table[k][i] = (prev >> 8) ^ fs_crc32c_table[0][prev & 0xff];
+    }
+  }
+
+  // x^1, then each power of two squared
+  fs_crc32c_x2n[0] = (uint32_t) 1 << 30;
+
+  for (int k=1; k<32; k++) {
+    fs_crc32c_x2n[k] = fs_crc32c_mul(fs_crc32c_x2n[k - 1], fs_crc32c_x2n[k - 1]);
+  }
+
+  fs_crc32c_fn = fs_crc32c_has_hw() ? fs_crc32c_hw : fs_crc32c_sw;
+}
+
+/* Checksum of the =n bytes at =buf as stored in the checksum table: their
+ * CRC32C, or one if that is zero.  Safe to call from several threads. */
+uint32_t fs_csum(const void *buf, size_t n) {
+  pthread_once(&fs_crc32c_once, fs_crc32c_init);
+
+  uint32_t crc = ~fs_crc32c_fn(~(uint32_t) 0, (const char*) buf, n);
+
+  return crc == 0 ? 1 : crc;
+}
+
+/* Cache slot of the checksum table block holding the entry of =blk. */
+struct fs_tcache * fs_csum_cache(struct superblock *sb, uint64_t blk) {
+  return &FS_STATE(sb)->ccache[(blk / (sb->blksz / sizeof(uint32_t))) % FS_CSUM_CACHE];
+}
+
+/* Store =csum as the checksum of block =blk. */
+int fs_csum_put(struct superblock *sb, uint64_t blk, uint32_t csum) {
+  struct fs_tcache *tc = fs_csum_cache(sb, blk);
+  uint32_t *entry = fs_tcache_entry(sb, tc, sb->cstable, blk);
+
+  if (entry == NULL) {
+    return -1;
+  }
+
+  if (*entry != csum) {
+    *entry = csum;
+    tc->dirty = 1;
+  }
+
+  return 0;
+}
+
+/* Record the checksum of the =n bytes at =data, written to block =blk. */
+int fs_csum_set(struct superblock *sb, uint64_t blk, const void *data, size_t n) {
+  return fs_csum_put(sb, blk, fs_csum(data, n));
+}
+
+/* Check the =n bytes at =data, read from block =blk, against the checksum
+ * table; blocks without a checksum pass.  Returns -1 with errno set to EIO
+ * if they do not match. */
+int fs_csum_check(struct superblock *sb, uint64_t blk, const void *data, size_t n) {
+  uint32_t *entry = fs_tcache_entry(sb, fs_csum_cache(sb, blk), sb->cstable, blk);
+
+  if (entry == NULL) {
+    return -1;
+  }
+
+  if (*entry != 0 && *entry != fs_csum(data, n)) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Same as fs_csum_check for the =n bytes of block =blk in the mapping
+ * =map.  The table is read from the mapping too, unless the cached table
+ * block holds the entry, so it does no I/O of its own. */
+int fs_csum_map_check(struct superblock *sb, const char *map, uint64_t blk, size_t n) {
+  uint64_t per_blk = sb->blksz / sizeof(uint32_t);
+  uint32_t csum;
+
+  if (blk >= sb->blks) {
+    errno = EIO;
+    return -1;
+  }
+
+  struct fs_tcache *tc = fs_csum_cache(sb, blk);
+
+  if (tc->buf != NULL && tc->blk == sb->cstable + blk / per_blk) {
+    csum = tc->buf[blk % per_blk];
+  } else {
+    csum = ((const uint32_t*) (map + sb->cstable * sb->blksz))[blk];
+  }
+
+  if (csum != 0 && csum != fs_csum(map + blk * sb->blksz, n)) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* With FS_FEATURE_CSUM, fs_csum_map_check for the block holding inode =ino,
+ * whether it is an inode table block or not. */
+int fs_csum_map_ino(struct superblock *sb, const char *map, uint64_t ino) {
+  if (!fs_has_csum(sb)) {
+    return 0;
+  }
+
+  if (fs_has_itable(sb)) {
+    ino = sb->itable + ino / (sb->blksz / FS_INODE_SIZE);
+  }
+
+  return fs_csum_map_check(sb, map, ino, sb->blksz);
+}
+
+/* Hash of the =n bytes at =buf, never zero.  Four independent lanes over
+ * 64-bit words, which the compiler can keep in vector registers. */
+uint32_t fs_dd_hash(const char *buf, size_t n) {
+  uint64_t h[4] = {FS_DD_SEED, FS_DD_SEED ^ 1, FS_DD_SEED ^ 2, FS_DD_SEED ^ 3};
+  size_t i = 0;
+
+  for (; i + 4 * sizeof(uint64_t) <= n; i += 4 * sizeof(uint64_t)) {
+    for (int k=0; k<4; k++) {
+      uint64_t w;
+
+      memcpy(&w, buf + i + k * sizeof(uint64_t), sizeof(w));
+      h[k] = (h[k] ^ w) * FS_DD_PRIME;
+      h[k] ^= h[k] >> 29;
+    }
+  }
+
+  uint64_t x = h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7);
+
+  for (; i < n; i++) {
+    x = (x ^ (uint8_t) buf[i]) * FS_DD_PRIME;
+  }
+
+  x ^= x >> 32;
+  x *= FS_DD_PRIME;
+  x ^= x >> 29;
+
+  return (uint32_t) x == 0 ? 1 : (uint32_t) x;
+}
+
+/* Load the hash table of an FS_FEATURE_DEDUP image and index it by
+ * hash, once.  Returns zero on success and -1 on error. */
+int fs_dd_load(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (state->dd_hash != NULL) {
+    return 0;
+  }
+
+  uint64_t nbuckets = 1;
+
+  while (nbuckets < sb->blks) {
+    nbuckets <<= 1;
+  }
+
+  uint64_t per_blk = sb->blksz / sizeof(uint32_t);
+  uint32_t *hash = (uint32_t*) malloc(sb->rcblocks * sb->blksz);
+  uint64_t *next = (uint64_t*) malloc(sb->blks * sizeof(uint64_t));
+  uint64_t *head = (uint64_t*) malloc(nbuckets * sizeof(uint64_t));
+
+  if (hash == NULL || next == NULL || head == NULL || fs_tcache_flush(sb, &state->hcache) == -1) {
+    free(hash);
+    free(next);
+    free(head);
+    return -1;
+  }
+
+  for (uint64_t i=0; i<sb->rcblocks; i++) {
+    if (fs_read_blk(sb, sb->rctable + sb->rcblocks + i, (void*) (hash + i * per_blk)) == -1) {
+      free(hash);
+      free(next);
+      free(head);
+      return -1;
+    }
+  }
+
+  for (uint64_t k=0; k<nbuckets; k++) {
+    head[k] = INVALID_BLOCK;
+  }
+
+  for (uint64_t blk=0; blk<sb->blks; blk++) {
+    next[blk] = INVALID_BLOCK;
+
+    if (hash[blk] != 0) {
+      next[blk] = head[hash[blk] & (nbuckets - 1)];
+      head[hash[blk] & (nbuckets - 1)] = blk;
+    }
+  }
+
+  state->dd_hash = hash;
+  state->dd_next = next;
+  state->dd_head = head;
+  state->dd_mask = nbuckets - 1;
+
+  return 0;
+}
+
+/* Record =hash (zero for none) as the hash of the contents of block =blk.
+ * Returns zero on success and -1 on error. */
+int fs_dd_set(struct superblock *sb, uint64_t blk, uint32_t hash) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (fs_dd_load(sb) == -1) {
+    return -1;
+  }
+
+  uint32_t old = state->dd_hash[blk];
+
+  if (old == hash) {
+    return 0;
+  }
+
+  uint32_t *entry = fs_tcache_entry(sb, &state->hcache, sb->rctable + sb->rcblocks, blk);
+
+  if (entry == NULL) {
+    return -1;
+  }
+
+  *entry = hash;
+  state->hcache.dirty = 1;
+
+  if (old != 0) {
+    uint64_t *p = &state->dd_head[old & state->dd_mask];
+
+    while (*p != blk) {
+      p = &state->dd_next[*p];
+    }
+
+    *p = state->dd_next[blk];
+  }
+
+  if (hash != 0) {
+    state->dd_next[blk] = state->dd_head[hash & state->dd_mask];
+    state->dd_head[hash & state->dd_mask] = blk;
+  }
+
+  state->dd_hash[blk] = hash;
+
+  return 0;
+}
+
+/* A data block holding the same =sb->blksz bytes as =data, whose hash is
+ * =hash, but none of the =nskip sorted blocks in =skip; INVALID_BLOCK if
+ * there is none.  Candidates are compared in full, read into =tmp. */
+uint64_t fs_dd_find(struct superblock *sb, uint32_t hash, const char *data, const uint64_t *skip, uint64_t nskip, char *tmp) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (fs_dd_load(sb) == -1) {
+    return INVALID_BLOCK;
+  }
+
+  for (uint64_t blk = state->dd_head[hash & state->dd_mask]; blk != INVALID_BLOCK; blk = state->dd_next[blk]) {
+    if (state->dd_hash[blk] != hash || bsearch(&blk, skip, nskip, sizeof(uint64_t), fs_blk_cmp) != NULL) {
+      continue;
+    }
+
+    if (fs_read_blk(sb, blk, tmp) == 0 && memcmp(tmp, data, sb->blksz) == 0) {
+      return blk;
+    }
+  }
+
+  return INVALID_BLOCK;
+}
+
+/* Drop a reference to data block =blk, which goes back to the free list
+ * once no file uses it any more. */
+int fs_put_data_block(struct superblock *sb, uint64_t blk) {
+  if (fs_rc_get(sb, blk) > 0) {
+    return fs_rc_add(sb, blk, -1);
+  }
+
+  return fs_do_put_block(sb, blk);
+}
+
+/* Number of the first =n data links of the file whose first inode has been
+ * read into =inode that need a new block to be written, given the blocks
+ * the new contents keep in =kept and =zero (as for fs_kept) and those
+ * linked to existing blocks in =dd (as for fs_dd_plan, or NULL): those
+ * shared with other files, which are copied first, and holes. */
+uint64_t fs_rewrite_blocks(struct superblock *sb, struct inode *inode, uint64_t n, const uint32_t *kept,
+                           const uint8_t *zero, const uint64_t *dd) {
+  if ((!fs_has_refcount(sb) && !(inode->mode & IMCOMP) && !fs_has_sparse(sb)) || n == 0) {
+    return 0;
+  }
+
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct inode *cur = inode;
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t rewrite = 0;
+
+  for (uint64_t j=0, i=0; j<n; j++, i++) {
+    if (i == cap) {
+      if (fs_read_inode(sb, cur->next, child) == -1) {
+        break;
+      }
+
+      cur = child;
+      cap = fs_inode_max_links(sb);
+      i = 0;
+    }
+
+    if (fs_kept(sb, kept, zero, j) && (dd == NULL || dd[j] == INVALID_BLOCK)) {
+      rewrite += cur->links[i] == INVALID_BLOCK || fs_rc_get(sb, cur->links[i]) > 0;
+    }
+  }
+
+  fs_blk_free(sb, child);
+
+  return rewrite;
+}
+
+/* Number of the first =n data links of the file whose first inode has been
+ * read into =inode that hold no block. */
+uint64_t fs_hole_blocks(struct superblock *sb, struct inode *inode, uint64_t n) {
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct inode *cur = inode;
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t holes = 0;
+
+  for (uint64_t j=0, i=0; j<n; j++, i++) {
+    if (i == cap) {
+      if (fs_read_inode(sb, cur->next, child) == -1) {
+        break;
+      }
+
+      cur = child;
+      cap = fs_inode_max_links(sb);
+      i = 0;
+    }
+
+    holes += cur->links[i] == INVALID_BLOCK;
+  }
+
+  fs_blk_free(sb, child);
+
+  return holes;
+}
+
+int fs_is_invalid_name(const char *name) {
+  return strlen(name) == 0 \
+    || strncmp(name, ROOT_DIR_NAME, strlen(ROOT_DIR_NAME)) != 0 \
+    || strchr(name, ' ') != NULL;
+}
+
+/* Like fs_is_invalid_name, for names given to the fs_*at calls, with =at
+ * NULL for the path-based calls.  Names relative to a handle may be empty,
+ * naming the directory itself. */
+int fs_is_invalid_name_at(const struct fs_dir *at, const char *name) {
+  if (at == NULL || *name == DIR_DELIM_CHR) {
+    return fs_is_invalid_name(name);
+  }
+
+  return strchr(name, ' ') != NULL;
+}
+
+/* Whether =name, given to an fs_*at call with handle =at, cannot be
+ * changed because it is below a snapshot, with errno set to EROFS, or to
+ * the error met while finding out.  Snapshots are not reachable from the
+ * root, so only relative names need checking, by following the parents
+ * of =at up to the root or to the snapshots directory; the handle's
+ * FS_DIR_RDONLY flag is not trusted. */
+int fs_is_rdonly_at(struct superblock *sb, const struct fs_dir *at, const char *name) {
+  if (at == NULL || *name == DIR_DELIM_CHR || sb->snapshots == 0) {
+    return 0;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  uint64_t blk = at->blk;
+  int ret = 0;
+
+  // Entities in no directory are not in a snapshot either; a stale handle
+  // is then left for fs_walk to notice.  A corrupt image could loop, but no
+  // chain is longer than the image.
+  for (uint64_t n = 0; blk != sb->root && blk != SUPERBLOCK_BLK; n++) {
+    if (blk == sb->snapshots) {
+      errno = EROFS;
+      ret = 1;
+      break;
+    }
+
+    if (n == sb->blks) {
+      errno = EIO;
+      ret = 1;
+      break;
+    }
+
+    if (fs_read_inode(sb, blk, inode) == -1) {
+      ret = 1;
+      break;
+    }
+
+    blk = inode->parent;
+  }
+
+  fs_blk_free(sb, inode);
+
+  return ret;
+}
+
+/* Return the next used link of a directory, or INVALID_BLOCK after the
+ * last one.  =inode holds the directory's inode numbered =*ino and =*i is the
+ * next slot to look at; both move along the IMCHILD chain as needed, so
+ * =inode is overwritten with later inodes of the chain.  An inode of the
+ * chain that cannot be read also ends the walk, with =*ino set to
+ * INVALID_BLOCK and errno set. */
+uint64_t fs_dir_next(struct superblock *sb, struct inode *inode, uint64_t *ino, uint64_t *i) {
+  for (;;) {
+    uint64_t cap = (inode->mode & IMCHILD) ? fs_inode_max_links(sb) : fs_inode_first_links(sb);
+
+    while (*i < cap) {
+      uint64_t link = inode->links[(*i)++];
+
+      if (link != INVALID_BLOCK) {
+        return link;
+      }
+    }
+
+    if (inode->next == 0) {
+      return INVALID_BLOCK;
+    }
+
+    *ino = inode->next;
+    *i = 0;
+
+    if (fs_read_inode(sb, *ino, inode) == -1) {
+      *ino = INVALID_BLOCK;
+      return INVALID_BLOCK;
+    }
+  }
+}
+
+/* Next component of a path after =*p, skipping repeated delimiters.  Sets
+ * =*len and moves =*p past it; returns NULL at the end of the path. */
+const char * fs_path_next(const char **p, size_t *len) {
+  const char *c = *p;
+
+  while (*c == DIR_DELIM_CHR) {
+    c++;
+  }
+
+  if (*c == '\0') {
+    return NULL;
+  }
+
+  *len = strcspn(c, DIR_DELIM_STR);
+  *p = c + *len;
+
+  return c;
+}
+
+/* =at, or a handle on the root in =root if =at is NULL, so that the fs_*at
+ * calls look relative names up from the root when given no handle. */
+const struct fs_dir * fs_at(struct superblock *sb, const struct fs_dir *at, struct fs_dir *root) {
+  if (at != NULL) {
+    return at;
+  }
+
+  root->blk = sb->root;
+  root->meta = 0;
+  root->gen = 0;
+  root->flags = 0;
+
+  return root;
+}
+
+/* Resolve =path in one pass over its components, filling =w with the entity
+ * and its parent directory.  Absolute paths start at the root; others at
+ * the directory handle =at, or the root if =at is NULL.  When only the last
+ * component is missing, =blk is INVALID_BLOCK with errno ENOENT while
+ * =parent still names the directory it would be created in; a trailing
+ * delimiter leaves no parent.  A stale handle fails with ENOENT. */
+int fs_walk(struct superblock *sb, const struct fs_dir *at, const char *path, struct fs_walk *w) {
+  if (at == NULL || *path == DIR_DELIM_CHR) {
+    at = NULL;
+  }
+
+  w->blk = at == NULL ? sb->root : at->blk;
+  w->parent = INVALID_BLOCK;
+  w->name = path + strlen(path);
+  w->namelen = 0;
+
+  const char *p = path;
+  size_t len;
+  const char *token = fs_path_next(&p, &len);
+
+  if (token == NULL && at == NULL) {
+    return 0;
+  }
+
+  struct inode *dir = (struct inode*) fs_blk_alloc(sb);
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  int ret = 0;
+
+  if (fs_read_inode(sb, w->blk, dir) == -1 || (token != NULL && fs_read_info(sb, dir, nodeinfo) == -1)) {
+    w->blk = INVALID_BLOCK;
+    token = NULL;
+    ret = -1;
+  } else if (at != NULL && at->blk != sb->root
+             && (dir->mode != IMDIR || dir->meta != at->meta || fs_igen(sb, at->blk) != at->gen)) {
+    // The handle's directory may have been removed and its inode reused,
+    // maybe by a directory with the same =meta
+    w->blk = INVALID_BLOCK;
+    errno = ENOENT;
+    token = NULL;
+    ret = -1;
+  }
+
+  while (token != NULL) {
+    uint64_t pos = w->blk;
+    uint64_t i = 0;
+    uint64_t link = INVALID_BLOCK;
+    int err = ENOENT;
+
+    w->parent = w->blk;
+    w->name = token;
+    w->namelen = len;
+    w->blk = INVALID_BLOCK;
+
+    for (uint64_t j=nodeinfo->size; j > 0; j--) {
+      link = fs_dir_next(sb, dir, &pos, &i);
+
+      if (link == INVALID_BLOCK) {
+        err = pos == INVALID_BLOCK ? errno : err;
+        break;
+      }
+
+      // An entry that cannot be read may be the one looked for
+      if (fs_read_inode(sb, link, child) == -1 || fs_read_info(sb, child, nodeinfo) == -1) {
+        err = errno;
+        continue;
+      }
+
+      if (strncmp(nodeinfo->name, token, len) == 0 && nodeinfo->name[len] == '\0') {
+        w->blk = link;
+        break;
+      }
+    }
+
+    token = fs_path_next(&p, &len);
+
+    if (w->blk == INVALID_BLOCK) {
+      if (token != NULL || *p != '\0' || err != ENOENT) {
+        w->parent = INVALID_BLOCK;
+      }
+
+      errno = err;
+      ret = -1;
+      break;
+    }
+
+    if (token == NULL) {
+      if (*p != '\0') {
+        w->parent = INVALID_BLOCK;
+      }
+
+      break;
+    }
+
+    if (child->mode != IMDIR) {
+      w->blk = INVALID_BLOCK;
+      w->parent = INVALID_BLOCK;
+      errno = ENOTDIR;
+      ret = -1;
+      break;
+    }
+
+    struct inode *tmp = dir;
+    dir = child;
+    child = tmp;
+  }
+
+  fs_blk_free(sb, dir);
+  fs_blk_free(sb, child);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+uint64_t fs_find_blk_at(struct superblock *sb, const struct fs_dir *at, const char *name) {
+  struct fs_walk w;
+
+  fs_walk(sb, at, name, &w);
+
+  return w.blk;
+}
+
+uint64_t fs_find_blk(struct superblock *sb, const char *name) {
+  return fs_find_blk_at(sb, NULL, name);
+}
+
+/* Add =link_blk to the directory =parent_blk, in the first free slot of its
+ * inode chain.  A full directory grows by one IMCHILD inode. */
+int fs_link_blk(struct superblock *sb, uint64_t parent_blk, uint64_t link_blk) {
+  struct inode *first = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, parent_blk, first) == -1) {
+    fs_blk_free(sb, first);
+    return -1;
+  }
+
+  if (first->mode != IMDIR) {
+    fs_blk_free(sb, first);
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  memcpy(inode, first, sb->blksz);
+
+  uint64_t ino = parent_blk;
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t max_links = fs_inode_max_links(sb);
+  uint64_t i;
+  int ret = -1;
+
+  if (fs_read_info(sb, first, nodeinfo) == -1) {
+    goto out;
+  }
+
+  for (;;) {
+    for (i=0; i<cap && inode->links[i] != INVALID_BLOCK; i++);
+
+    if (i < cap || inode->next == 0) {
+      break;
+    }
+
+    ino = inode->next;
+
+    if (fs_read_inode(sb, ino, inode) == -1) {
+      goto out;
+    }
+
+    cap = max_links;
+  }
+
+  ret = 0;
+
+  if (i < cap) {
+    inode->links[i] = link_blk;
+
+    if (ino == parent_blk) {
+      first->links[i] = link_blk;
+    } else {
+      ret = fs_write_inode(sb, ino, inode);
+    }
+  } else {
+    uint64_t child_ino;
+
+    if (!fs_has_space(sb, 0, 1)) {
+      ret = -1;
+      errno = ENOSPC;
+    } else if ((ret = fs_get_inodes(sb, 1, &child_ino)) == 0) {
+      struct inode *child = (struct inode*) fs_blk_alloc(sb);
+
+      child->mode = IMCHILD;
+      child->parent = parent_blk;
+      child->meta = ino;
+      child->next = 0;
+      child->links[0] = link_blk;
+
+      for (uint64_t k=1; k<max_links; k++) {
+        child->links[k] = INVALID_BLOCK;
+      }
+
+      ret = fs_write_inode(sb, child_ino, child);
+      fs_blk_free(sb, child);
+
+      if (ino == parent_blk) {
+        first->next = child_ino;
+      } else if (ret == 0) {
+        inode->next = child_ino;
+        ret = fs_write_inode(sb, ino, inode);
+      }
+    }
+  }
+
+  if (ret == 0) {
+    nodeinfo->size++;
+    ret = fs_write_meta(sb, parent_blk, first, nodeinfo);
+  }
+
+out:
+  fs_blk_free(sb, first);
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+/* Replace the link to =link_blk in the directory =parent_blk by =new_blk,
+ * or drop it if =new_blk is INVALID_BLOCK. */
+int fs_relink_blk(struct superblock *sb, uint64_t parent_blk, uint64_t link_blk, uint64_t new_blk) {
+  struct inode *first = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, parent_blk, first) == -1) {
+    fs_blk_free(sb, first);
+    return -1;
+  }
+
+  if (first->mode != IMDIR) {
+    fs_blk_free(sb, first);
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  memcpy(inode, first, sb->blksz);
+
+  uint64_t ino = parent_blk;
+  uint64_t i = 0;
+  uint64_t link;
+  int ret = -1;
+
+  if (fs_read_info(sb, first, nodeinfo) == -1) {
+    goto out;
+  }
+
+  while ((link = fs_dir_next(sb, inode, &ino, &i)) != INVALID_BLOCK) {
+    if (link != link_blk) {
+      continue;
+    }
+
+    if (ino == parent_blk) {
+      first->links[i - 1] = new_blk;
+    } else {
+      inode->links[i - 1] = new_blk;
+
+      if (fs_write_inode(sb, ino, inode) == -1) {
+        goto out;
+      }
+    }
+
+    if (new_blk == INVALID_BLOCK) {
+      nodeinfo->size--;
+    }
+
+    break;
+  }
+
+  if (ino == INVALID_BLOCK) {
+    goto out;
+  }
+
+  ret = fs_write_meta(sb, parent_blk, first, nodeinfo);
+
+out:
+  fs_blk_free(sb, first);
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+int fs_unlink_blk(struct superblock *sb, uint64_t parent_blk, uint64_t link_blk) {
+  return fs_relink_blk(sb, parent_blk, link_blk, INVALID_BLOCK);
+}
+
+/* Free the inodes, nodeinfo and data blocks of the entity whose first inode
+ * =blk has been read into =inode, which is overwritten.  The entity must
+ * already be unlinked from its directory.  An inode of the chain that
+ * cannot be read stops the walk, leaking what it links to until fs_fsck. */
+int fs_free_node(struct superblock *sb, uint64_t blk, struct inode *inode) {
+  int ret = 0;
+
+  if (!(inode->mode & IMREG)) {
+    if (!fs_is_compact(sb) && fs_do_put_block(sb, inode->meta) == -1) {
+      ret = -1;
+    }
+
+    // Entries may have grown the directory by IMCHILD inodes
+    uint64_t next = inode->next;
+
+    if (fs_put_inode(sb, blk) == -1) {
+      ret = -1;
+    }
+
+    while (next != 0) {
+      blk = next;
+
+      if (fs_read_inode(sb, blk, inode) == -1) {
+        return -1;
+      }
+
+      next = inode->next;
+
+      if (fs_put_inode(sb, blk) == -1) {
+        ret = -1;
+      }
+    }
+
+    return ret;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  if (!fs_is_compact(sb) && fs_do_put_block(sb, inode->meta) == -1) {
+    ret = -1;
+  }
+
+  uint64_t nlinks = fs_data_blocks(sb, inode, nodeinfo);
+
+  fs_blk_free(sb, nodeinfo);
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<nlinks; j++) {
+    if (j - base == cap) {
+      uint64_t next = inode->next;
+
+      if (fs_put_inode(sb, blk) == -1) {
+        ret = -1;
+      }
+
+      blk = next;
+
+      if (fs_read_inode(sb, blk, inode) == -1) {
+        fs_tables_flush(sb);
+        return -1;
+      }
+
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    if (inode->links[j - base] != INVALID_BLOCK && fs_put_data_block(sb, inode->links[j - base]) == -1) {
+      ret = -1;
+    }
+  }
+
+  if (fs_put_inode(sb, blk) == -1) {
+    ret = -1;
+  }
+
+  if (fs_tables_flush(sb) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+struct fs_dirty * fs_dirty_find(struct superblock *sb, uint64_t blk) {
+  struct fs_dirty *dirty = FS_STATE(sb)->dirty;
+
+  while (dirty != NULL && dirty->blk != blk) {
+    dirty = dirty->next;
+  }
+
+  return dirty;
+}
+
+/* Forget the buffered contents of the file whose first inode is =blk,
+ * releasing its reservation. */
+void fs_dirty_drop(struct superblock *sb, uint64_t blk) {
+  struct fs_state *state = FS_STATE(sb);
+  struct fs_dirty **prev = &state->dirty;
+
+  while (*prev != NULL && (*prev)->blk != blk) {
+    prev = &(*prev)->next;
+  }
+
+  if (*prev == NULL) {
+    return;
+  }
+
+  struct fs_dirty *dirty = *prev;
+  *prev = dirty->next;
+
+  if (state->dirty_tail == &dirty->next) {
+    state->dirty_tail = prev;
+  }
+
+  state->reserved -= dirty->reserved;
+  state->ireserved -= dirty->ireserved;
+
+  free(dirty->data);
+  free(dirty);
+}
+
+/* Buffer =cnt bytes of =buf as the new contents of the file whose first
+ * inode is =blk.  =reserve free blocks and =ireserve inodes are set aside so
+ * the later flush cannot fail with ENOSPC. */
+int fs_dirty_set(struct superblock *sb, uint64_t blk, const char *buf, size_t cnt, uint64_t reserve, uint64_t ireserve) {
+  struct fs_state *state = FS_STATE(sb);
+
+  char *data = (char*) malloc(cnt + 1);
+
+  if (data == NULL) {
+    return -1;
+  }
+
+  memcpy(data, buf, cnt);
+
+  struct fs_dirty *dirty = fs_dirty_find(sb, blk);
+
+  if (dirty == NULL) {
+    dirty = (struct fs_dirty*) calloc(1, sizeof(struct fs_dirty));
+
+    if (dirty == NULL) {
+      free(data);
+      return -1;
+    }
+
+    dirty->blk = blk;
+    *state->dirty_tail = dirty;
+    state->dirty_tail = &dirty->next;
+  } else {
+    free(dirty->data);
+  }
+
+  state->reserved = state->reserved - dirty->reserved + reserve;
+  state->ireserved = state->ireserved - dirty->ireserved + ireserve;
+
+  dirty->reserved = reserve;
+  dirty->ireserved = ireserve;
+  dirty->data = data;
+  dirty->cnt = cnt;
+
+  return 0;
+}
+
+/* Link slots of a compressed chunk. */
+uint64_t fs_chunk_blocks(struct superblock *sb) {
+  return MAX(1, FS_COMP_CHUNK / sb->blksz);
+}
+
+/* Whether link slot =j of a file holds a block, given the blocks kept by
+ * each chunk in =kept (NULL if the file is not compressed) and the blocks
+ * left as holes in =zero (NULL if there are none). */
+int fs_kept(struct superblock *sb, const uint32_t *kept, const uint8_t *zero, uint64_t j) {
+  uint64_t c = fs_chunk_blocks(sb);
+
+  return (kept == NULL || j % c < kept[j / c]) && (zero == NULL || !zero[j]);
+}
+
+/* Whether the =n bytes at =buf are all zero.  They are ORed together 64
+ * bytes at a time in vector registers, stopping at the first group that
+ * is not zero. */
+int fs_is_zero(const char *buf, size_t n) {
+  size_t k = 0;
+
+#if defined(__x86_64__) && defined(__SSE2__)
+  for (; k + 64 <= n; k += 64) {
+    const __m128i *p = (const __m128i*) (buf + k);
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                             _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+      return 0;
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; k + 64 <= n; k += 64) {
+    const uint8_t *p = (const uint8_t*) (buf + k);
+    uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)), vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+
+    if (vmaxvq_u8(v) != 0) {
+      return 0;
+    }
+  }
+#endif
+
+  for (; k + 8 <= n; k += 8) {
+    uint64_t w;
+
+    memcpy(&w, buf + k, sizeof(w));
+
+    if (w != 0) {
+      return 0;
+    }
+  }
+
+  for (; k < n; k++) {
+    if (buf[k] != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Mark in =zero the blocks of the =cnt bytes at =buf that are all zero.
+ * Returns the number of them. */
+uint64_t fs_zero_map(struct superblock *sb, const char *buf, uint64_t cnt, uint8_t *zero) {
+  uint64_t holes = 0;
+
+  for (uint64_t j=0; j * sb->blksz < cnt; j++) {
+    zero[j] = (uint8_t) fs_is_zero(buf + j * sb->blksz, MIN(sb->blksz, cnt - j * sb->blksz));
+    holes += zero[j];
+  }
+
+  return holes;
+}
+
+uint32_t fs_lz_read32(const uint8_t *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return v;
+}
+
+/* Append length =n as the extra bytes of an LZ4 token field. */
+uint8_t * fs_lz_put_len(uint8_t *op, size_t n) {
+  for (; n >= 255; n -= 255) {
+    *op++ = 255;
+  }
+
+  *op++ = (uint8_t) n;
+
+  return op;
+}
+
+/* Compress the =n bytes at =src into at most =cap bytes at =dst, in the LZ4
+ * block format.  Returns the compressed size, or zero if it does not fit. */
+size_t fs_lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+  uint32_t table[1 << FS_LZ_HASH_BITS];
+
+  memset(table, 0, sizeof(table));
+
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + n;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  // The format wants the last match to start 12 bytes before the end and
+  // the last 5 bytes to be literals
+  const uint8_t *mflimit = n > 12 ? end - 12 : src;
+
+  while (ip < mflimit) {
+    uint32_t seq = fs_lz_read32(ip);
+    uint32_t h = (seq * 2654435761U) >> (32 - FS_LZ_HASH_BITS);
+    const uint8_t *ref = src + table[h];
+
+    table[h] = (uint32_t) (ip - src);
+
+    if (ref >= ip || ip - ref > 65535 || fs_lz_read32(ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    const uint8_t *mp = ip + 4;
+
+    while (mp < end - 5 && *mp == ref[mp - ip]) {
+      mp++;
+    }
+
+    size_t lit = ip - anchor;
+    size_t mlen = mp - ip - 4;
+
+    if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) {
+      return 0;
+    }
+
+    uint8_t *token = op++;
+
+    *token = (uint8_t) ((MIN(lit, 15) << 4) | MIN(mlen, 15));
+
+    if (lit >= 15) {
+      op = fs_lz_put_len(op, lit - 15);
+    }
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    *op++ = (uint8_t) ((ip - ref) & 0xff);
+    *op++ = (uint8_t) ((ip - ref) >> 8);
+
+    if (mlen >= 15) {
+      op = fs_lz_put_len(op, mlen - 15);
+    }
+
+    ip = mp;
+    anchor = ip;
+  }
+
+  size_t lit = end - anchor;
+
+  if (op + 1 + lit / 255 + 1 + lit > oend) {
+    return 0;
+  }
+
+  *op++ = (uint8_t) (MIN(lit, 15) << 4);
+
+  if (lit >= 15) {
+    op = fs_lz_put_len(op, lit - 15);
+  }
+
+  memcpy(op, anchor, lit);
+  op += lit;
+
+  return op - dst;
+}
+
+/* Decompress the =clen bytes at =src, which must expand to exactly =n bytes
+ * at =dst.  Returns zero on success and -1 if the input is corrupt. */
+int fs_lz_decompress(const uint8_t *src, size_t clen, uint8_t *dst, size_t n) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + clen;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + n;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t lit = token >> 4;
+
+    if (lit == 15) {
+      uint8_t b;
+
+      do {
+        if (ip == iend) {
+          return -1;
+        }
+
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+
+    if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) {
+      return -1;
+    }
+
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+
+    // The last sequence has no match
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+
+    size_t off = ip[0] | (ip[1] << 8);
+    size_t mlen = token & 15;
+
+    ip += 2;
+
+    if (off == 0 || off > (size_t) (op - dst)) {
+      return -1;
+    }
+
+    if (mlen == 15) {
+      uint8_t b;
+
+      do {
+        if (ip == iend) {
+          return -1;
+        }
+
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+
+    mlen += 4;
+
+    if (mlen > (size_t) (oend - op)) {
+      return -1;
+    }
+
+    // Matches may overlap what they copy
+    const uint8_t *ref = op - off;
+
+    for (size_t k=0; k<mlen; k++) {
+      op[k] = ref[k];
+    }
+
+    op += mlen;
+  }
+
+  return op == oend ? 0 : -1;
+}
+
+/* Compress the =cnt bytes at =buf chunk by chunk into =stage, laid out like
+ * the file's link slots, and record the blocks each chunk keeps in =kept;
+ * with FS_FEATURE_SPARSE, chunks of zeros keep none.  Returns the number
+ * of blocks saved. */
+uint64_t fs_comp_encode(struct superblock *sb, const char *buf, uint64_t cnt, char *stage, uint32_t *kept) {
+  uint64_t chunk = fs_chunk_blocks(sb) * sb->blksz;
+  uint64_t saved = 0;
+
+  for (uint64_t c=0; c * chunk < cnt; c++) {
+    uint64_t off = c * chunk;
+    uint64_t len = MIN(chunk, cnt - off);
+    uint64_t raw = CEIL(len, sb->blksz);
+    uint64_t clen = 0;
+
+    if (fs_has_sparse(sb) && fs_is_zero(buf + off, len)) {
+      kept[c] = 0;
+      saved += raw;
+      continue;
+    }
+
+    // Only worth it if at least one block is saved
+    if (raw > 1) {
+      clen = fs_lz_compress((const uint8_t*) buf + off, len, (uint8_t*) stage + off + sizeof(uint32_t),
+                            (raw - 1) * sb->blksz - sizeof(uint32_t));
+    }
+
+    if (clen == 0) {
+      memcpy(stage + off, buf + off, len);
+      kept[c] = raw;
+      continue;
+    }
+
+    uint32_t hdr = (uint32_t) clen;
+    uint64_t k = CEIL(clen + sizeof(hdr), sb->blksz);
+
+    memcpy(stage + off, &hdr, sizeof(hdr));
+    memset(stage + off + sizeof(hdr) + clen, 0, k * sb->blksz - sizeof(hdr) - clen);
+
+    kept[c] = k;
+    saved += raw - k;
+  }
+
+  return saved;
+}
+
+/* Chunks of a compressed file gathered from the mapping, decoded by
+ * fs_comp_worker threads. */
+struct fs_comp_job {
+  struct superblock *sb;
+  const char *stage; /* chunk =c0 + c at c * chunk bytes */
+  const uint32_t *kept;
+  uint64_t size; /* of the file */
+  uint64_t c0;
+  uint64_t nchunks;
+  uint64_t offset; /* of the bytes wanted, in the file */
+  uint64_t len;
+  char *out;
+  uint64_t next; /* next chunk to decode */
+  int failed;
+};
+
+/* Decode chunk =c of =job into the wanted part of its output. */
+int fs_comp_decode(struct fs_comp_job *job, uint64_t c) {
+  struct superblock *sb = job->sb;
+  uint64_t chunk = fs_chunk_blocks(sb) * sb->blksz;
+  uint64_t off = (job->c0 + c) * chunk;
+  uint64_t len = MIN(chunk, job->size - off);
+  const char *src = job->stage + c * chunk;
+
+  uint64_t lo = MAX(off, job->offset);
+  uint64_t hi = MIN(off + len, job->offset + job->len);
+
+  // Chunks of zeros are holes
+  if (job->kept[c] == 0) {
+    memset(job->out + (lo - job->offset), 0, hi - lo);
+    return 0;
+  }
+
+  if (job->kept[c] == CEIL(len, sb->blksz)) {
+    memcpy(job->out + (lo - job->offset), src + (lo - off), hi - lo);
+    return 0;
+  }
+
+  uint32_t clen;
+
+  memcpy(&clen, src, sizeof(clen));
+
+  if (clen > job->kept[c] * sb->blksz - sizeof(clen)) {
+    return -1;
+  }
+
+  // Chunks cut by the range go through a buffer of their own
+  int whole = lo == off && hi == off + len;
+  char *dst = whole ? job->out + (off - job->offset) : (char*) malloc(len);
+
+  if (dst == NULL) {
+    return -1;
+  }
+
+  int ret = fs_lz_decompress((const uint8_t*) src + sizeof(clen), clen, (uint8_t*) dst, len);
+
+  if (!whole) {
+    memcpy(job->out + (lo - job->offset), dst + (lo - off), hi - lo);
+    free(dst);
+  }
+
+  return ret;
+}
+
+void * fs_comp_worker(void *arg) {
+  struct fs_comp_job *job = (struct fs_comp_job*) arg;
+
+  for (;;) {
+    uint64_t c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+
+    if (c >= job->nchunks) {
+      break;
+    }
+
+    if (fs_comp_decode(job, c) == -1) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+/* Read =len bytes at =offset of the compressed file of =size bytes whose
+ * first inode is =inode into =out.  The blocks of the chunks involved are
+ * gathered from the mapping =map, then the chunks are decoded, by several
+ * threads when there are many of them.  Does not use the block slab, so
+ * it may run outside of public calls.  Returns zero on success and -1 with
+ * errno set to EIO if the file is damaged. */
+int fs_comp_read(struct superblock *sb, char *map, struct inode *inode, uint64_t size, uint64_t offset, uint64_t len, char *out) {
+  if (len == 0) {
+    return 0;
+  }
+
+  uint64_t cblks = fs_chunk_blocks(sb);
+  uint64_t chunk = cblks * sb->blksz;
+  uint64_t c0 = offset / chunk;
+  uint64_t nchunks = (offset + len - 1) / chunk - c0 + 1;
+  uint64_t first = c0 * cblks;
+  uint64_t last = MIN(first + nchunks * cblks, CEIL(size, sb->blksz));
+
+  struct fs_comp_job job;
+
+  memset(&job, 0, sizeof(job));
+  job.sb = sb;
+  job.size = size;
+  job.c0 = c0;
+  job.nchunks = nchunks;
+  job.offset = offset;
+  job.len = len;
+  job.out = out;
+
+  char *stage = (char*) malloc(nchunks * chunk);
+  uint32_t *kept = (uint32_t*) calloc(nchunks, sizeof(uint32_t));
+
+  if (stage == NULL || kept == NULL) {
+    free(stage);
+    free(kept);
+    return -1;
+  }
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<last; j++) {
+    if (j - base == cap) {
+      if (!fs_export_valid_ino(sb, inode->next) || fs_csum_map_ino(sb, map, inode->next) == -1) {
+        job.failed = 1;
+        break;
+      }
+
+      inode = fs_map_inode(sb, map, inode->next);
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    uint64_t blk = inode->links[j - base];
+
+    if (j < first || blk == INVALID_BLOCK) {
+      continue;
+    }
+
+    if (blk < fs_first_data_blk(sb) || blk >= sb->blks) {
+      job.failed = 1;
+      break;
+    }
+
+    if (fs_has_dcsum(sb) && fs_csum_map_check(sb, map, blk, MIN(sb->blksz, size - j * sb->blksz)) == -1) {
+      job.failed = 1;
+      break;
+    }
+
+    memcpy(stage + (j - first) * sb->blksz, map + blk * sb->blksz, sb->blksz);
+    kept[(j - first) / cblks]++;
+  }
+
+  job.stage = stage;
+  job.kept = kept;
+
+  int nthreads = 1;
+
+  if (nchunks >= 2 * FS_COMP_THREAD_CHUNKS) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (int) MIN(MIN(nchunks / FS_COMP_THREAD_CHUNKS, FS_COMP_MAX_THREADS), MAX(ncpus, 1));
+  }
+
+  pthread_t threads[FS_COMP_MAX_THREADS];
+  int started = 1;
+
+  while (!job.failed && started < nthreads && pthread_create(&threads[started], NULL, fs_comp_worker, &job) == 0) {
+    started++;
+  }
+
+  // The caller decodes too
+  if (!job.failed) {
+    fs_comp_worker(&job);
+  }
+
+  for (int i=1; i<started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(stage);
+  free(kept);
+
+  if (job.failed) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Read =len bytes at =offset of the file of =size bytes whose first inode
+ * is =inode into =out, from the mapping =map; holes read as zeros.  Like
+ * fs_comp_read, it does not use the block slab.  Returns zero on success
+ * and -1 with errno set to EIO if the file is damaged. */
+int fs_map_read(struct superblock *sb, char *map, struct inode *inode, uint64_t size, uint64_t offset, uint64_t len, char *out) {
+  if (len == 0) {
+    return 0;
+  }
+
+  uint64_t first = offset / sb->blksz;
+  uint64_t last = (offset + len - 1) / sb->blksz;
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<=last; j++) {
+    if (j - base == cap) {
+      if (!fs_export_valid_ino(sb, inode->next) || fs_csum_map_ino(sb, map, inode->next) == -1) {
+        errno = EIO;
+        return -1;
+      }
+
+      inode = fs_map_inode(sb, map, inode->next);
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    if (j < first) {
+      continue;
+    }
+
+    uint64_t blk = inode->links[j - base];
+    uint64_t start = (j == first) ? offset % sb->blksz : 0;
+    uint64_t end = (j == last) ? (offset + len - 1) % sb->blksz + 1 : sb->blksz;
+    char *dst = out + (j * sb->blksz + start - offset);
+
+    if (blk == INVALID_BLOCK) {
+      memset(dst, 0, end - start);
+      continue;
+    }
+
+    if (blk < fs_first_data_blk(sb) || blk >= sb->blks
+        || (fs_has_dcsum(sb) && fs_csum_map_check(sb, map, blk, MIN(sb->blksz, size - j * sb->blksz)) == -1)) {
+      errno = EIO;
+      return -1;
+    }
+
+    memcpy(dst, map + blk * sb->blksz + start, end - start);
+  }
+
+  return 0;
+}
+
+/* Copy the first =n data links of the file whose first inode has been read
+ * into =inode to =links. */
+int fs_read_links(struct superblock *sb, struct inode *inode, uint64_t n, uint64_t *links) {
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct inode *cur = inode;
+  uint64_t cap = fs_inode_first_links(sb);
+  int ret = 0;
+
+  for (uint64_t j=0, i=0; j<n; j++, i++) {
+    if (i == cap) {
+      if (fs_read_inode(sb, cur->next, child) == -1) {
+        ret = -1;
+        break;
+      }
+
+      cur = child;
+      cap = fs_inode_max_links(sb);
+      i = 0;
+    }
+
+    links[j] = cur->links[i];
+  }
+
+  fs_blk_free(sb, child);
+
+  return ret;
+}
+
+/* Find, for each full block of the =cnt bytes at =buf about to replace the
+ * contents of the file whose first inode has been read into =inode, and
+ * which has =used data links, where its contents already are.  =dd[j] is
+ * set to the block holding them, which may be the file's own block =j if
+ * it is unchanged, to FS_DD_PREV plus the index of an earlier block of
+ * =buf with the same contents, or to INVALID_BLOCK if block =j must be
+ * written; =hashes[j] is set to its hash, or zero for the last, partial
+ * block.  The file's other blocks are not linked to, since they may be
+ * rewritten or freed by this write.  Only blocks kept by =kept and =zero
+ * are considered.  Returns zero on success and -1 on error. */
+int fs_dd_plan(struct superblock *sb, struct inode *inode, uint64_t used, const char *buf, size_t cnt,
+               const uint32_t *kept, const uint8_t *zero, uint64_t *dd, uint32_t *hashes) {
+  struct fs_state *state = FS_STATE(sb);
+  uint64_t needed = CEIL(cnt, sb->blksz);
+  uint64_t nslots = 1;
+
+  while (nslots < 2 * needed) {
+    nslots <<= 1;
+  }
+
+  uint64_t *old = (uint64_t*) malloc((used + 1) * sizeof(uint64_t));
+  uint64_t *own = (uint64_t*) malloc((used + 1) * sizeof(uint64_t));
+  uint64_t *slots = (uint64_t*) malloc(nslots * sizeof(uint64_t));
+  char *tmp = (char*) fs_blk_alloc(sb);
+  int ret = -1;
+
+  if (old == NULL || own == NULL || slots == NULL || fs_dd_load(sb) == -1 || fs_read_links(sb, inode, used, old) == -1) {
+    goto out;
+  }
+
+  memcpy(own, old, used * sizeof(uint64_t));
+  qsort(own, used, sizeof(uint64_t), fs_blk_cmp);
+
+  for (uint64_t k=0; k<nslots; k++) {
+    slots[k] = INVALID_BLOCK;
+  }
+
+  for (uint64_t j=0; j<needed; j++) {
+    dd[j] = INVALID_BLOCK;
+    hashes[j] = 0;
+
+    if (!fs_kept(sb, kept, zero, j) || (j + 1) * sb->blksz > cnt) {
+      continue;
+    }
+
+    const char *data = buf + j * sb->blksz;
+    uint32_t h = fs_dd_hash(data, sb->blksz);
+    uint64_t prev = INVALID_BLOCK;
+    uint64_t slot = h & (nslots - 1);
+
+    hashes[j] = h;
+
+    for (; slots[slot] != INVALID_BLOCK; slot = (slot + 1) & (nslots - 1)) {
+      uint64_t k = slots[slot];
+
+      if (hashes[k] == h && memcmp(buf + k * sb->blksz, data, sb->blksz) == 0) {
+        prev = k;
+        break;
+      }
+    }
+
+    if (j < used && old[j] != INVALID_BLOCK && state->dd_hash[old[j]] == h
+        && fs_read_blk(sb, old[j], tmp) == 0 && memcmp(tmp, data, sb->blksz) == 0) {
+      dd[j] = old[j];
+    } else if (prev != INVALID_BLOCK) {
+      dd[j] = FS_DD_PREV | prev;
+    } else {
+      dd[j] = fs_dd_find(sb, h, data, own, used, tmp);
+    }
+
+    if (prev == INVALID_BLOCK) {
+      slots[slot] = j;
+    }
+  }
+
+  ret = 0;
+
+out:
+  free(old);
+  free(own);
+  free(slots);
+  fs_blk_free(sb, tmp);
+
+  return ret;
+}
+
+/* Replace the data of the regular file whose first inode is =blk with =cnt
+ * bytes from =buf.  Contents small enough are stored inline in the file's
+ * nodeinfo block and use no data block at all, and with
+ * FS_FEATURE_COMPRESS the others are compressed first.  Blocks already
+ * owned by the file are rewritten in place, except those shared with other
+ * files, which are copied to new blocks; missing data blocks are taken from
+ * =data_blks if it is not NULL, or else allocated here as a single batch
+ * ahead of any new IMCHILD inode, so that the file's data is laid out
+ * contiguously.  With FS_FEATURE_DEDUP, blocks whose contents are already
+ * in the image are linked to instead, and with FS_FEATURE_SPARSE blocks
+ * that are all zero are left as holes.  Blocks no longer needed are
+ * returned to the free list, and so are those of the =ndata blocks at
+ * =data_blks that end up unused, even on error.  =data_blks must be NULL
+ * with FS_FEATURE_COMPRESS, FS_FEATURE_DEDUP or FS_FEATURE_SPARSE, since
+ * the number of blocks needed is only known here. */
+int fs_write_data(struct superblock *sb, uint64_t blk, const char *buf, size_t cnt, const uint64_t *data_blks, uint64_t ndata) {
+  uint64_t max_links = fs_inode_max_links(sb);
+
+  struct inode *first = (struct inode*) fs_blk_alloc(sb);
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, blk, first) == -1 || fs_read_info(sb, first, nodeinfo) == -1) {
+    for (uint64_t k=0; k<ndata; k++) {
+      fs_do_put_block(sb, data_blks[k]);
+    }
+
+    fs_blk_free(sb, first);
+    fs_blk_free(sb, child);
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  int inline_data = cnt <= fs_inline_max_size(sb, strlen(nodeinfo->name));
+
+  uint64_t used_blocks = fs_data_blocks(sb, first, nodeinfo);
+  uint64_t needed_blocks = inline_data ? 0 : CEIL(cnt, sb->blksz);
+
+  // Compressed chunks keep only some of their link slots
+  uint32_t *kept = NULL;
+  char *stage = NULL;
+
+  if (fs_has_compress(sb) && needed_blocks > 1) {
+    kept = (uint32_t*) malloc(CEIL(needed_blocks, fs_chunk_blocks(sb)) * sizeof(uint32_t));
+    stage = (char*) malloc(needed_blocks * sb->blksz);
+
+    if (kept == NULL || stage == NULL || fs_comp_encode(sb, buf, cnt, stage, kept) == 0) {
+      free(kept);
+      free(stage);
+      kept = NULL;
+      stage = NULL;
+    } else {
+      buf = stage;
+    }
+  }
+
+  // Blocks of zeros are not stored; compressed chunks have their own holes
+  uint8_t *zero = NULL;
+
+  if (fs_has_sparse(sb) && kept == NULL && needed_blocks > 0) {
+    zero = (uint8_t*) malloc(needed_blocks);
+
+    if (zero != NULL && fs_zero_map(sb, buf, cnt, zero) == 0) {
+      free(zero);
+      zero = NULL;
+    }
+  }
+
+  // Blocks whose contents are already in the image are not written
+  uint64_t *dd = NULL;
+  uint32_t *hashes = NULL;
+
+  if (fs_has_dedup(sb) && needed_blocks > 0) {
+    dd = (uint64_t*) malloc(needed_blocks * sizeof(uint64_t));
+    hashes = (uint32_t*) malloc(needed_blocks * sizeof(uint32_t));
+
+    if (dd == NULL || hashes == NULL || fs_dd_plan(sb, first, used_blocks, buf, cnt, kept, zero, dd, hashes) == -1) {
+      free(dd);
+      free(hashes);
+      dd = NULL;
+      hashes = NULL;
+    }
+  }
+
+  // Before the mode changes: holes and shared blocks need new blocks
+  uint64_t nrewrite = fs_rewrite_blocks(sb, first, MIN(used_blocks, needed_blocks), kept, zero, dd);
+  uint64_t old_mode = first->mode;
+
+  first->mode = inline_data ? (IMREG | IMINLINE) : kept != NULL ? (IMREG | IMCOMP) : IMREG;
+
+  uint64_t used_child_blocks = fs_child_inodes(sb, used_blocks);
+  uint64_t needed_child_blocks = fs_child_inodes(sb, needed_blocks);
+
+  uint64_t new_blocks = 0;
+
+  for (uint64_t j=used_blocks; j<needed_blocks; j++) {
+    new_blocks += fs_kept(sb, kept, zero, j) && (dd == NULL || dd[j] == INVALID_BLOCK);
+  }
+
+  uint64_t new_child_blocks = needed_child_blocks > used_child_blocks ? needed_child_blocks - used_child_blocks : 0;
+
+  // Blocks for rewritten slots are allocated with the new ones
+  uint64_t nalloc = (data_blks == NULL ? new_blocks : 0) + nrewrite;
+
+  uint64_t nblks = nalloc + new_child_blocks + 1;
+  uint64_t *blks = fs_blks_alloc(sb, nblks);
+  uint64_t *child_blks = blks + nalloc;
+
+  if (fs_get_blocks(sb, nalloc, blks) == -1) {
+    for (uint64_t k=0; k<ndata; k++) {
+      fs_do_put_block(sb, data_blks[k]);
+    }
+
+    fs_blks_free(sb, blks, nblks);
+    free(kept);
+    free(stage);
+    free(zero);
+    free(dd);
+    free(hashes);
+    fs_blk_free(sb, first);
+    fs_blk_free(sb, child);
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  if (fs_get_inodes(sb, new_child_blocks, child_blks) == -1) {
+    for (uint64_t k=0; k<nalloc; k++) {
+      fs_do_put_block(sb, blks[k]);
+    }
+
+    for (uint64_t k=0; k<ndata; k++) {
+      fs_do_put_block(sb, data_blks[k]);
+    }
+
+    fs_blks_free(sb, blks, nblks);
+    free(kept);
+    free(stage);
+    free(zero);
+    free(dd);
+    free(hashes);
+    fs_blk_free(sb, first);
+    fs_blk_free(sb, child);
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  uint64_t *rewrite_blks = blks;
+  int ret = 0;
+
+  if (data_blks == NULL) {
+    data_blks = blks + nrewrite;
+    ndata = new_blocks;
+  }
+
+  const uint64_t *data_end = data_blks + ndata;
+
+  // =inode holds the file's links [base, base + cap); the first inode is
+  // only written at the end, together with the nodeinfo
+  struct inode *inode = first;
+  uint64_t block = blk;
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<needed_blocks; j++) {
+    if (j - base == cap) {
+      uint64_t next_block;
+
+      if (j < used_blocks) {
+        // Reuse the child inode the file already has
+        next_block = inode->next;
+
+        if (inode != first) {
+          fs_write_inode(sb, block, inode);
+        }
+
+        if (fs_read_inode(sb, next_block, child) == -1) {
+          ret = -1;
+          break;
+        }
+      } else {
+        next_block = *child_blks++;
+
+        inode->next = next_block;
+
+        if (inode != first) {
+          fs_write_inode(sb, block, inode);
+        }
+
+        child->mode = IMCHILD;
+        child->parent = blk;
+        child->meta = block;
+        child->next = 0;
+
+        for (uint64_t k=0; k<max_links; k++) {
+          child->links[k] = INVALID_BLOCK;
+        }
+      }
+
+      inode = child;
+      block = next_block;
+      base = j;
+      cap = max_links;
+    }
+
+    uint64_t i = j - base;
+
+    if (!fs_kept(sb, kept, zero, j)) {
+      if (j < used_blocks && inode->links[i] != INVALID_BLOCK) {
+        fs_put_data_block(sb, inode->links[i]);
+      }
+
+      inode->links[i] = INVALID_BLOCK;
+      continue;
+    }
+
+    uint64_t target = dd == NULL ? INVALID_BLOCK : dd[j];
+
+    if (target != INVALID_BLOCK && (target & FS_DD_PREV)) {
+      target = dd[target & ~FS_DD_PREV];
+    }
+
+    if (target != INVALID_BLOCK) {
+      if (inode->links[i] != target) {
+        if (j < used_blocks && inode->links[i] != INVALID_BLOCK) {
+          fs_put_data_block(sb, inode->links[i]);
+        }
+
+        fs_rc_add(sb, target, 1);
+        FS_STAT_ADD(sb, dedup_blocks, 1);
+        inode->links[i] = target;
+      }
+
+      dd[j] = target;
+      continue;
+    }
+
+    if (j >= used_blocks) {
+      inode->links[i] = *data_blks++;
+    } else if (inode->links[i] == INVALID_BLOCK) {
+      inode->links[i] = *rewrite_blks++;
+    } else if (nrewrite > 0 && fs_rc_get(sb, inode->links[i]) > 0) {
+      fs_rc_add(sb, inode->links[i], -1);
+      inode->links[i] = *rewrite_blks++;
+    }
+
+    uint64_t n = (j < needed_blocks - 1) ? sb->blksz : cnt - j * sb->blksz;
+    fs_write_blk_sz(sb, inode->links[i], (void*)(buf + j * sb->blksz), n);
+
+    if (fs_has_dcsum(sb)) {
+      fs_csum_set(sb, inode->links[i], buf + j * sb->blksz, n);
+    }
+
+    if (dd != NULL) {
+      dd[j] = inode->links[i];
+      fs_dd_set(sb, inode->links[i], hashes[j]);
+    }
+  }
+
+  // A block linked twice by the file is copied only once
+  while (rewrite_blks < blks + nrewrite) {
+    fs_do_put_block(sb, *rewrite_blks++);
+  }
+
+  while (data_blks < data_end) {
+    fs_do_put_block(sb, *data_blks++);
+  }
+
+  if (ret == -1) {
+    // The rest of the chain could not be read, so it is kept, along with
+    // the file's size and mode; the contents are a mix of old and new
+    // data, but every block is accounted for
+    while (child_blks < blks + nblks - 1) {
+      fs_put_inode(sb, *child_blks++);
+    }
+
+    fs_blks_free(sb, blks, nblks);
+
+    first->mode = old_mode;
+    fs_write_meta(sb, blk, first, nodeinfo);
+    fs_tables_flush(sb);
+
+    goto out;
+  }
+
+  fs_blks_free(sb, blks, nblks);
+
+  // Cleaning remaining links of the last inode in use
+  for (uint64_t i=needed_blocks - base; i<cap; i++) {
+    if (base + i < used_blocks && inode->links[i] != INVALID_BLOCK) {
+      fs_put_data_block(sb, inode->links[i]);
+    }
+
+    inode->links[i] = INVALID_BLOCK;
+  }
+
+  uint64_t next_block = needed_blocks < used_blocks ? inode->next : 0;
+
+  inode->next = 0;
+
+  if (inode != first) {
+    fs_write_inode(sb, block, inode);
+  }
+
+  // Cleaning remaining allocated child blocks; those that cannot be read
+  // are left for fs_fsck
+  while (next_block != 0) {
+    block = next_block;
+
+    if (fs_read_inode(sb, block, child) == -1) {
+      ret = -1;
+      break;
+    }
+
+    for (uint64_t i=0; i<max_links; i++) {
+      if (child->links[i] != INVALID_BLOCK) {
+        fs_put_data_block(sb, child->links[i]);
+      }
+    }
+
+    next_block = child->next;
+    fs_put_inode(sb, block);
+  }
+
+  if (inline_data) {
+    memcpy(fs_inline_data(nodeinfo), buf, cnt);
+  }
+
+  nodeinfo->size = cnt;
+  fs_write_meta(sb, blk, first, nodeinfo);
+  fs_tables_flush(sb);
+
+out:
+  free(kept);
+  free(stage);
+  free(zero);
+  free(dd);
+  free(hashes);
+  fs_blk_free(sb, first);
+  fs_blk_free(sb, child);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+/* Allocate data blocks for every buffered file and write them out.  The data
+ * blocks of all files are taken from the free list in one batch, in the order
+ * the files were written, so each file's data ends up in one run and IMCHILD
+ * inodes are kept out of the way.  Files that cannot be written stay
+ * buffered, with their reservation, and -1 is returned. */
+int fs_dirty_flush(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (state->dirty == NULL) {
+    return 0;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  int late = fs_has_compress(sb) || fs_has_dedup(sb) || fs_has_sparse(sb);
+  uint64_t total = 0;
+  int ret = 0;
+
+  for (struct fs_dirty *dirty = state->dirty; dirty != NULL; dirty = dirty->next) {
+    dirty->nnew = 0;
+    dirty->unread = fs_read_inode(sb, dirty->blk, inode) == -1 || fs_read_info(sb, inode, nodeinfo) == -1;
+
+    if (dirty->unread) {
+      ret = -1;
+      continue;
+    }
+
+    uint64_t used_blocks = fs_data_blocks(sb, inode, nodeinfo);
+    uint64_t needed_blocks = CEIL(dirty->cnt, sb->blksz);
+
+    // Compressed, deduplicated or sparse data needs fewer blocks, only
+    // known then
+    dirty->nnew = late || needed_blocks <= used_blocks ? 0 : needed_blocks - used_blocks;
+    total += dirty->nnew;
+  }
+
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  uint64_t *blks = (uint64_t*) malloc((total + 1) * sizeof(uint64_t));
+
+  if (blks == NULL || fs_get_blocks(sb, total, blks) == -1) {
+    free(blks);
+    return -1;
+  }
+
+  uint64_t *data_blks = blks;
+  struct fs_dirty **prev = &state->dirty;
+
+  // Blocks set aside for a file that fails are returned by fs_write_data
+  while (*prev != NULL) {
+    struct fs_dirty *dirty = *prev;
+    uint64_t *file_blks = data_blks;
+
+    data_blks += dirty->nnew;
+
+    // A file that cannot be read is not written, but the others are
+    if (dirty->unread) {
+      prev = &dirty->next;
+      continue;
+    }
+
+    if (fs_write_data(sb, dirty->blk, dirty->data, dirty->cnt, late ? NULL : file_blks, dirty->nnew) == -1) {
+      prev = &dirty->next;
+      ret = -1;
+      continue;
+    }
+
+    *prev = dirty->next;
+
+    state->reserved -= dirty->reserved;
+    state->ireserved -= dirty->ireserved;
+
+    free(dirty->data);
+    free(dirty);
+  }
+
+  state->dirty_tail = prev;
+
+  free(blks);
+
+  return ret;
+}
+
+/* Create an empty entity of type =mode (IMREG or IMDIR) named by the
+ * =namelen bytes at =name inside the directory whose inode is =parent_blk,
+ * or in no directory if =parent_blk is SUPERBLOCK_BLK.  Returns the new
+ * entity's inode block, or INVALID_BLOCK on error. */
+uint64_t fs_create_node(struct superblock *sb, uint64_t parent_blk, const char *name, size_t namelen, uint64_t mode) {
+  uint64_t blks[2];
+
+  if (fs_get_inodes(sb, 1, blks) == -1) {
+    return INVALID_BLOCK;
+  }
+
+  if (!fs_is_compact(sb) && fs_get_blocks(sb, 1, blks + 1) == -1) {
+    fs_put_inode(sb, blks[0]);
+    return INVALID_BLOCK;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  inode->mode = mode;
+  inode->parent = parent_blk;
+  inode->meta = fs_is_compact(sb) ? blks[0] : blks[1];
+  inode->next = 0;
+
+  for (int i=0; i<fs_inode_first_links(sb); i++) {
+    inode->links[i] = INVALID_BLOCK;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  nodeinfo->size = 0;
+  memcpy(nodeinfo->name, name, namelen);
+  nodeinfo->name[namelen] = '\0';
+
+  fs_write_meta(sb, blks[0], inode, nodeinfo);
+
+  fs_blk_free(sb, nodeinfo);
+
+  // Entities whose parent is the superblock are only linked from it
+  if (parent_blk != SUPERBLOCK_BLK && fs_link_blk(sb, parent_blk, blks[0]) == -1) {
+    if (!fs_is_compact(sb)) {
+      fs_do_put_block(sb, inode->meta);
+    }
+
+    fs_put_inode(sb, blks[0]);
+    fs_blk_free(sb, inode);
+    return INVALID_BLOCK;
+  }
+
+  fs_blk_free(sb, inode);
+
+  return blks[0];
+}
+
+/* The image mapped read-only, created on first use and kept until
+ * fs_close.  The mapping is shared, so it sees every later write. */
+char * fs_map(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+
+  if (state->map == NULL) {
+    void *map = mmap(NULL, sb->blks * sb->blksz, PROT_READ, MAP_SHARED, sb->fd, 0);
+
+    if (map == MAP_FAILED) {
+      return NULL;
+    }
+
+    state->map = (char*) map;
+  }
+
+  return state->map;
+}
+
+/* A view holding a private copy of =cnt bytes of =data. */
+struct fs_view * fs_view_copy(const char *data, size_t cnt) {
+  struct fs_view *view = (struct fs_view*) calloc(1, sizeof(struct fs_view) + sizeof(struct iovec));
+
+  if (view == NULL) {
+    return NULL;
+  }
+
+  view->iov = (struct iovec*) (view + 1);
+  view->len = cnt;
+
+  if (cnt > 0) {
+    if ((view->copy = malloc(cnt)) == NULL) {
+      free(view);
+      return NULL;
+    }
+
+    memcpy(view->copy, data, cnt);
+    view->iov[0].iov_base = view->copy;
+    view->iov[0].iov_len = cnt;
+    view->iovcnt = 1;
+  }
+
+  return view;
+}
+
+/* Inode =ino, read in place from the mapping of the image. */
+struct inode * fs_map_inode(struct superblock *sb, char *map, uint64_t ino) {
+  if (fs_has_itable(sb)) {
+    return (struct inode*) (map + sb->itable * sb->blksz + ino * FS_INODE_SIZE);
+  }
+
+  return (struct inode*) (map + ino * sb->blksz);
+}
+
+/* Size field of the nodeinfo of the entity whose first inode is =inode. */
+uint64_t fs_map_size(struct superblock *sb, char *map, struct inode *inode) {
+  if (fs_is_compact(sb)) {
+    return fs_cnodeinfo(sb, inode)->size;
+  }
+
+  return ((struct nodeinfo*) (map + inode->meta * sb->blksz))->size;
+}
+
+/* Per-thread work queue of fs_fsck: the owner pushes and pops entities at
+ * the tail, idle threads steal from the head. */
+struct fs_fsck_queue {
+  pthread_mutex_t lock;
+  uint64_t (*items)[2]; /* inode, parent */
+  uint64_t head;
+  uint64_t tail;
+  uint64_t cap;
+};
+
+struct fs_fsck {
+  struct superblock *sb;
+  char *map;
+  uint64_t first; /* fs_first_data_blk */
+  uint32_t *refs; /* references to each block */
+  uint32_t *irefs; /* references to each inode (FS_FEATURE_ITABLE) */
+  uint8_t *free; /* blocks on the free list */
+  uint8_t *ifree; /* inodes on the free inode list */
+  const uint32_t *csums; /* checksum table (FS_FEATURE_CSUM), or NULL */
+  struct fs_fsck_queue *queues;
+  int nthreads;
+  uint64_t pending; /* entities queued but not checked yet */
+  int nomem;
+  struct fs_fsck_report *report;
+};
+
+struct fs_fsck_worker {
+  struct fs_fsck *ck;
+  int id;
+  pthread_t thread;
+};
+
+#define FSCK_COUNT(ck, field) __atomic_fetch_add(&(ck)->report->field, 1, __ATOMIC_RELAXED)
+
+int fs_fsck_valid_blk(struct fs_fsck *ck, uint64_t blk) {
+  return blk >= ck->first && blk < ck->sb->blks;
+}
+
+int fs_fsck_valid_ino(struct fs_fsck *ck, uint64_t ino) {
+  if (fs_has_itable(ck->sb)) {
+    return ino > 0 && ino < ck->sb->inodes;
+  }
+
+  return fs_fsck_valid_blk(ck, ino);
+}
+
+/* Count a reference to block =blk; returns the references it had before. */
+uint32_t fs_fsck_claim_blk(struct fs_fsck *ck, uint64_t blk) {
+  return __atomic_fetch_add(&ck->refs[blk], 1, __ATOMIC_RELAXED);
+}
+
+uint32_t fs_fsck_claim_ino(struct fs_fsck *ck, uint64_t ino) {
+  if (fs_has_itable(ck->sb)) {
+    return __atomic_fetch_add(&ck->irefs[ino], 1, __ATOMIC_RELAXED);
+  }
+
+  return fs_fsck_claim_blk(ck, ino);
+}
+
+/* Count block =blk if its first =n bytes do not match its checksum. */
+void fs_fsck_csum(struct fs_fsck *ck, uint64_t blk, size_t n) {
+  uint32_t csum = ck->csums == NULL ? 0 : ck->csums[blk];
+
+  if (csum != 0 && csum != fs_csum(ck->map + blk * ck->sb->blksz, n)) {
+    FSCK_COUNT(ck, bad_csums);
+  }
+}
+
+/* Check the block of inode =ino, unless it is in the inode table, whose
+ * blocks are checked once by fs_fsck. */
+void fs_fsck_csum_ino(struct fs_fsck *ck, uint64_t ino) {
+  if (!fs_has_itable(ck->sb)) {
+    fs_fsck_csum(ck, ino, ck->sb->blksz);
+  }
+}
+
+void fs_fsck_push(struct fs_fsck *ck, int id, uint64_t ino, uint64_t parent) {
+  struct fs_fsck_queue *q = &ck->queues[id];
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->tail == q->cap) {
+    // Reclaim the space freed by steals before growing
+    if (q->head > 0) {
+      memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(q->items[0]));
+      q->tail -= q->head;
+      q->head = 0;
+    }
+
+    if (q->tail == q->cap) {
+      uint64_t cap = q->cap ? 2 * q->cap : 256;
+      void *items = realloc(q->items, cap * sizeof(q->items[0]));
+
+      if (items == NULL) {
+        pthread_mutex_unlock(&q->lock);
+        ck->nomem = 1;
+        return;
+      }
+
+      q->items = items;
+      q->cap = cap;
+    }
+  }
+
+  q->items[q->tail][0] = ino;
+  q->items[q->tail][1] = parent;
+  q->tail++;
+
+  __atomic_fetch_add(&ck->pending, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Take an entity from the own queue's tail, or steal one from another
+ * queue's head.  Returns zero if every queue is empty. */
+int fs_fsck_take(struct fs_fsck *ck, int id, uint64_t *ino, uint64_t *parent) {
+  for (int k=0; k<ck->nthreads; k++) {
+    struct fs_fsck_queue *q = &ck->queues[(id + k) % ck->nthreads];
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->head < q->tail) {
+      uint64_t i = (k == 0) ? --q->tail : q->head++;
+
+      *ino = q->items[i][0];
+      *parent = q->items[i][1];
+      found = 1;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (found) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Check the entity whose first inode is =ino, linked from directory
+ * =parent, and queue its directory entries. */
+void fs_fsck_entity(struct fs_fsck *ck, int id, uint64_t ino, uint64_t parent) {
+  struct superblock *sb = ck->sb;
+  struct inode *inode = fs_map_inode(sb, ck->map, ino);
+
+  if (fs_fsck_claim_ino(ck, ino) > 0) {
+    FSCK_COUNT(ck, cross_linked);
+    return;
+  }
+
+  fs_fsck_csum_ino(ck, ino);
+
+  if ((inode->mode & IMCHILD) || !(inode->mode & (IMREG | IMDIR)) || inode->parent != parent) {
+    FSCK_COUNT(ck, bad_nodes);
+
+    if ((inode->mode & IMCHILD) || !(inode->mode & (IMREG | IMDIR))) {
+      return;
+    }
+  }
+
+  if (!fs_is_compact(sb)) {
+    if (!fs_fsck_valid_blk(ck, inode->meta)) {
+      FSCK_COUNT(ck, bad_links);
+      return;
+    }
+
+    if (fs_fsck_claim_blk(ck, inode->meta) > 0) {
+      FSCK_COUNT(ck, cross_linked);
+    } else {
+      fs_fsck_csum(ck, inode->meta, sb->blksz);
+    }
+  }
+
+  uint64_t size = fs_map_size(sb, ck->map, inode);
+  int dir = (inode->mode & IMDIR) != 0;
+
+  if (dir) {
+    FSCK_COUNT(ck, dirs);
+  } else {
+    FSCK_COUNT(ck, files);
+  }
+
+  // Files need their first CEIL(size, blksz) links; directories use any slot
+  uint64_t nlinks = dir ? UINT64_MAX : (inode->mode & IMINLINE) ? 0 : CEIL(size, sb->blksz);
+  int comp = (inode->mode & IMCOMP) != 0;
+  uint64_t entries = 0;
+  uint64_t j = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t cur = ino;
+
+  for (;;) {
+    for (uint64_t i=0; i<cap && j<nlinks; i++, j++) {
+      uint64_t link = inode->links[i];
+
+      if (dir) {
+        if (link == INVALID_BLOCK) {
+          continue;
+        }
+
+        if (!fs_fsck_valid_ino(ck, link)) {
+          FSCK_COUNT(ck, bad_links);
+          continue;
+        }
+
+        entries++;
+        fs_fsck_push(ck, id, link, ino);
+      } else if ((comp || fs_has_sparse(sb)) && link == INVALID_BLOCK) {
+        // Compressed chunks leave their last slots empty; holes have none
+      } else if (!fs_fsck_valid_blk(ck, link)) {
+        FSCK_COUNT(ck, bad_links);
+      } else if (fs_fsck_claim_blk(ck, link) > 0) {
+        // Shared data blocks are checked against the table afterwards
+        if (!fs_has_refcount(sb)) {
+          FSCK_COUNT(ck, cross_linked);
+        }
+      } else if (fs_has_dcsum(sb)) {
+        fs_fsck_csum(ck, link, MIN(sb->blksz, size - j * sb->blksz));
+      }
+    }
+
+    if (inode->next == 0) {
+      break;
+    }
+
+    if (!fs_fsck_valid_ino(ck, inode->next)) {
+      FSCK_COUNT(ck, bad_links);
+      break;
+    }
+
+    uint64_t next = inode->next;
+
+    if (fs_fsck_claim_ino(ck, next) > 0) {
+      FSCK_COUNT(ck, cross_linked);
+      break;
+    }
+
+    fs_fsck_csum_ino(ck, next);
+    inode = fs_map_inode(sb, ck->map, next);
+
+    if (!(inode->mode & IMCHILD) || inode->parent != ino || inode->meta != cur) {
+      FSCK_COUNT(ck, bad_nodes);
+    }
+
+    cur = next;
+    cap = fs_inode_max_links(sb);
+  }
+
+  if (dir ? entries != size : j < nlinks) {
+    FSCK_COUNT(ck, bad_nodes);
+  }
+}
+
+void * fs_fsck_worker(void *arg) {
+  struct fs_fsck_worker *w = (struct fs_fsck_worker*) arg;
+  struct fs_fsck *ck = w->ck;
+  uint64_t ino, parent;
+
+  for (;;) {
+    if (fs_fsck_take(ck, w->id, &ino, &parent)) {
+      fs_fsck_entity(ck, w->id, ino, parent);
+      __atomic_fetch_sub(&ck->pending, 1, __ATOMIC_SEQ_CST);
+    } else if (__atomic_load_n(&ck->pending, __ATOMIC_SEQ_CST) == 0) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+/* Mark the blocks on the free list; fails on blocks outside of the data
+ * area, loops and lists shorter than the superblock says. */
+int fs_fsck_free_list(struct fs_fsck *ck) {
+  struct superblock *sb = ck->sb;
+  uint64_t blk = sb->freelist;
+
+  for (uint64_t i=0; i<sb->freeblks; i++) {
+    if (!fs_fsck_valid_blk(ck, blk) || ck->free[blk]) {
+      return -1;
+    }
+
+    ck->free[blk] = 1;
+    blk = ((struct freepage*) (ck->map + blk * sb->blksz))->next;
+  }
+
+  return 0;
+}
+
+int fs_fsck_inode_list(struct fs_fsck *ck) {
+  struct superblock *sb = ck->sb;
+  uint64_t ino = sb->ifree;
+
+  for (uint64_t i=0; i<sb->nifree; i++) {
+    if (!fs_fsck_valid_ino(ck, ino) || ck->ifree[ino]) {
+      return -1;
+    }
+
+    ck->ifree[ino] = 1;
+    ino = fs_map_inode(sb, ck->map, ino)->next;
+  }
+
+  return 0;
+}
+
+/* Rebuild the free lists from the reference counts, in ascending order. */
+int fs_fsck_rebuild(struct fs_fsck *ck) {
+  struct superblock *sb = ck->sb;
+  struct freepage *freepage = (struct freepage*) calloc(1, sb->blksz);
+
+  if (freepage == NULL) {
+    return -1;
+  }
+
+  uint64_t head = 0;
+  uint64_t n = 0;
+
+  for (uint64_t blk=sb->blks-1; blk>=ck->first; blk--) {
+    if (ck->refs[blk] > 0) {
+      continue;
+    }
+
+    freepage->next = head;
+
+    if (fs_write_blk(sb, blk, (void*) freepage) == -1) {
+      free(freepage);
+      return -1;
+    }
+
+    head = blk;
+    n++;
+  }
+
+  free(freepage);
+
+  sb->freelist = head;
+  sb->freeblks = n;
+
+  if (fs_has_itable(sb)) {
+    struct inode *inode = (struct inode*) calloc(1, FS_INODE_SIZE);
+
+    if (inode == NULL) {
+      return -1;
+    }
+
+    head = 0;
+    n = 0;
+
+    for (uint64_t ino=sb->inodes-1; ino>0; ino--) {
+      if (ck->irefs[ino] > 0) {
+        continue;
+      }
+
+      inode->next = head;
+
+      if (fs_write_inode(sb, ino, inode) == -1) {
+        free(inode);
+        return -1;
+      }
+
+      head = ino;
+      n++;
+    }
+
+    free(inode);
+
+    sb->ifree = head;
+    sb->nifree = n;
+  }
+
+  return fs_write_sb(sb);
+}
+
+/* Rewrite the reference count table from the references found. */
+int fs_fsck_rebuild_rc(struct fs_fsck *ck) {
+  struct superblock *sb = ck->sb;
+  uint64_t per_blk = sb->blksz / sizeof(uint32_t);
+  uint32_t *rblk = (uint32_t*) malloc(sb->blksz);
+
+  if (rblk == NULL) {
+    return -1;
+  }
+
+  // The cached table block is about to be overwritten
+  FS_STATE(sb)->rcache.blk = 0;
+  FS_STATE(sb)->rcache.dirty = 0;
+
+  for (uint64_t i=0; i<sb->rcblocks; i++) {
+    for (uint64_t k=0; k<per_blk; k++) {
+      uint64_t blk = i * per_blk + k;
+
+      rblk[k] = blk < sb->blks && ck->refs[blk] > 0 ? ck->refs[blk] - 1 : 0;
+    }
+
+    if (fs_write_blk(sb, sb->rctable + i, (void*) rblk) == -1) {
+      free(rblk);
+      return -1;
+    }
+  }
+
+  free(rblk);
+
+  return 0;
+}
+
+/* Rewrite the hash table without the entries of blocks no file uses. */
+int fs_fsck_rebuild_hashes(struct fs_fsck *ck) {
+  struct superblock *sb = ck->sb;
+  struct fs_state *state = FS_STATE(sb);
+  uint64_t per_blk = sb->blksz / sizeof(uint32_t);
+  const uint32_t *hash = (const uint32_t*) (ck->map + (sb->rctable + sb->rcblocks) * sb->blksz);
+  uint32_t *hblk = (uint32_t*) malloc(sb->blksz);
+
+  if (hblk == NULL) {
+    return -1;
+  }
+
+  // The index is loaded again from the new table
+  free(state->dd_hash);
+  free(state->dd_next);
+  free(state->dd_head);
+  state->dd_hash = NULL;
+  state->dd_next = NULL;
+  state->dd_head = NULL;
+  state->hcache.blk = 0;
+  state->hcache.dirty = 0;
+
+  for (uint64_t i=0; i<sb->rcblocks; i++) {
+    for (uint64_t k=0; k<per_blk; k++) {
+      uint64_t blk = i * per_blk + k;
+
+      hblk[k] = blk < sb->blks && ck->refs[blk] > 0 ? hash[blk] : 0;
+    }
+
+    if (fs_write_blk(sb, sb->rctable + sb->rcblocks + i, (void*) hblk) == -1) {
+      free(hblk);
+      return -1;
+    }
+  }
+
+  free(hblk);
+
+  return 0;
+}
+
+/* Point free block =blk at =next on the free list. */
+int fs_free_link(struct superblock *sb, uint64_t blk, uint64_t next) {
+  struct freepage freepage = {next, 0};
+
+  return fs_write_blk_sz(sb, blk, (void*) &freepage, sizeof(freepage));
+}
+
+/* Highest free block below =blk, or zero; only during a defrag pass. */
+uint64_t fs_free_before(struct superblock *sb, uint64_t blk) {
+  uint8_t *free = FS_STATE(sb)->defrag->free;
+  uint64_t first = fs_first_data_blk(sb);
+
+  while (blk-- > first) {
+    if (free[blk]) {
+      return blk;
+    }
+  }
+
+  return 0;
+}
+
+/* Lowest free block at or above =blk, or zero. */
+uint64_t fs_free_from(struct superblock *sb, uint64_t blk) {
+  uint8_t *free = FS_STATE(sb)->defrag->free;
+
+  for (; blk < sb->blks; blk++) {
+    if (free[blk]) {
+      return blk;
+    }
+  }
+
+  return 0;
+}
+
+/* Add =blk to the sorted free list of a defrag pass. */
+int fs_free_insert(struct superblock *sb, uint64_t blk) {
+  uint64_t prev = fs_free_before(sb, blk);
+
+  if (fs_free_link(sb, blk, fs_free_from(sb, blk + 1)) == -1) {
+    return -1;
+  }
+
+  if (prev != 0) {
+    if (fs_free_link(sb, prev, blk) == -1) {
+      return -1;
+    }
+  } else {
+    sb->freelist = blk;
+  }
+
+  FS_STATE(sb)->defrag->free[blk] = 1;
+  sb->freeblks++;
+
+  return fs_write_sb(sb);
+}
+
+/* Take the free run [=start, =start + =n) off the sorted free list. */
+int fs_free_take(struct superblock *sb, uint64_t start, uint64_t n) {
+  uint64_t prev = fs_free_before(sb, start);
+  uint64_t next = fs_free_from(sb, start + n);
+
+  if (prev != 0) {
+    if (fs_free_link(sb, prev, next) == -1) {
+      return -1;
+    }
+  } else {
+    sb->freelist = next;
+  }
+
+  memset(FS_STATE(sb)->defrag->free + start, 0, n);
+  sb->freeblks -= n;
+
+  FS_STAT_ADD(sb, blk_allocs, n);
+
+  return fs_write_sb(sb);
+}
+
+/* Lowest run of =n free blocks, or zero if there is none. */
+uint64_t fs_free_run(struct superblock *sb, uint64_t n) {
+  uint8_t *free = FS_STATE(sb)->defrag->free;
+  uint64_t run = 0;
+
+  for (uint64_t blk=fs_first_data_blk(sb); blk<sb->blks; blk++) {
+    run = free[blk] ? run + 1 : 0;
+
+    if (run == n) {
+      return blk + 1 - n;
+    }
+  }
+
+  return 0;
+}
+
+int fs_blk_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Put the blocks staged by FS_OPT_SORTFREE at the head of the free list, in
+ * ascending order, so the next allocations walk them upwards. */
+int fs_free_merge(struct superblock *sb) {
+  struct fs_state *state = FS_STATE(sb);
+  uint64_t n = state->nstaged;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  qsort(state->staged, n, sizeof(uint64_t), fs_blk_cmp);
+
+  // Linked from the tail, so the list stays valid if a write fails
+  uint64_t next = sb->freelist;
+
+  for (uint64_t i=n; i-->0;) {
+    if (fs_free_link(sb, state->staged[i], next) == -1) {
+      return -1;
+    }
+
+    next = state->staged[i];
+  }
+
+  sb->freelist = next;
+  sb->freeblks += n;
+  state->nstaged = 0;
+
+  return fs_write_sb(sb);
+}
+
+struct fs_free_entry {
+  uint64_t blk;
+  uint64_t next;
+};
+
+int fs_free_entry_cmp(const void *a, const void *b) {
+  uint64_t x = ((const struct fs_free_entry*) a)->blk;
+  uint64_t y = ((const struct fs_free_entry*) b)->blk;
+
+  return (x > y) - (x < y);
+}
+
+void fs_defrag_end(struct superblock *sb) {
+  struct fs_defrag *d = FS_STATE(sb)->defrag;
+
+  if (d == NULL) {
+    return;
+  }
+
+  free(d->free);
+  free(d->dirs);
+  free(d);
+
+  FS_STATE(sb)->defrag = NULL;
+}
+
+int fs_defrag_push(struct fs_defrag *d, uint64_t dir) {
+  if (d->ndirs == d->capdirs) {
+    uint64_t cap = d->capdirs ? 2 * d->capdirs : 64;
+    uint64_t *dirs = (uint64_t*) realloc(d->dirs, cap * sizeof(uint64_t));
+
+    if (dirs == NULL) {
+      return -1;
+    }
+
+    d->dirs = dirs;
+    d->capdirs = cap;
+  }
+
+  d->dirs[d->ndirs++] = dir;
+
+  return 0;
+}
+
+/* Start a defrag pass: sort the free list, rewriting only the free blocks
+ * whose successor changes, and queue the root directory. */
+int fs_defrag_start(struct superblock *sb) {
+  if (fs_free_merge(sb) == -1) {
+    return -1;
+  }
+
+  struct fs_defrag *d = (struct fs_defrag*) calloc(1, sizeof(struct fs_defrag));
+  struct fs_free_entry *entries = (struct fs_free_entry*) malloc((sb->freeblks + 1) * sizeof(struct fs_free_entry));
+
+  if (d == NULL || entries == NULL || (d->free = (uint8_t*) calloc(sb->blks, 1)) == NULL) {
+    free(entries);
+    free(d);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  FS_STATE(sb)->defrag = d;
+
+  struct freepage freepage;
+  uint64_t blk = sb->freelist;
+  uint64_t n = sb->freeblks;
+
+  for (uint64_t i=0; i<n; i++) {
+    if (fs_read_blk_sz(sb, blk, (void*) &freepage, sizeof(freepage)) == -1) {
+      free(entries);
+      fs_defrag_end(sb);
+      return -1;
+    }
+
+    entries[i].blk = blk;
+    entries[i].next = freepage.next;
+    blk = freepage.next;
+  }
+
+  qsort(entries, n, sizeof(struct fs_free_entry), fs_free_entry_cmp);
+
+  for (uint64_t i=0; i<n; i++) {
+    uint64_t next = (i + 1 < n) ? entries[i + 1].blk : 0;
+
+    d->free[entries[i].blk] = 1;
+
+    if (entries[i].next != next && fs_free_link(sb, entries[i].blk, next) == -1) {
+      free(entries);
+      fs_defrag_end(sb);
+      return -1;
+    }
+  }
+
+  if (n > 0) {
+    sb->freelist = entries[0].blk;
+  }
+
+  free(entries);
+
+  if (fs_defrag_push(d, sb->root) == -1 || fs_write_sb(sb) == -1) {
+    fs_defrag_end(sb);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Next entity of the pass's depth-first walk, or INVALID_BLOCK when the
+ * walk is over.  The walk resumes across calls, so a directory changed in
+ * between is revalidated and skipped if it is gone. */
+uint64_t fs_defrag_next(struct superblock *sb, struct inode *inode) {
+  struct fs_defrag *d = FS_STATE(sb)->defrag;
+
+  for (;;) {
+    if (d->dir == 0) {
+      if (d->ndirs == 0) {
+        return INVALID_BLOCK;
+      }
+
+      d->dir = d->pos = d->dirs[--d->ndirs];
+      d->slot = 0;
+    }
+
+    // The inode of a directory gone since may hold anything by now, even
+    // data that fails its checksum, so a directory that cannot be read is
+    // skipped like one that changed; the pass then moves on
+    if (fs_read_inode(sb, d->pos, inode) == -1) {
+      d->dir = 0;
+      continue;
+    }
+
+    int valid = (d->pos == d->dir) ? inode->mode == IMDIR : (inode->mode & IMCHILD) && inode->parent == d->dir;
+    uint64_t link = valid ? fs_dir_next(sb, inode, &d->pos, &d->slot) : INVALID_BLOCK;
+
+    if (link != INVALID_BLOCK) {
+      return link;
+    }
+
+    d->dir = 0;
+  }
+}
+
+/* Move the data blocks of the file whose first inode =ino is in =inode to
+ * the lowest run of free blocks that holds them.  Without an inode table,
+ * its IMCHILD inodes are rebuilt right after the data.  Files that are
+ * already laid out that way, inline, compressed or buffered files are left
+ * alone.
+ * Returns 1 if the file moved, 0 if not and -1 on error. */
+int fs_defrag_file(struct superblock *sb, uint64_t ino, struct inode *inode) {
+  if (!(inode->mode & IMREG) || (inode->mode & (IMINLINE | IMCOMP)) || fs_dirty_find(sb, ino) != NULL) {
+    return 0;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  uint64_t nblocks = CEIL(nodeinfo->size, sb->blksz);
+
+  fs_blk_free(sb, nodeinfo);
+
+  if (nblocks == 0) {
+    return 0;
+  }
+
+  int itable = fs_has_itable(sb);
+  uint64_t first_links = fs_inode_first_links(sb);
+  uint64_t max_links = fs_inode_max_links(sb);
+  uint64_t nchild = fs_child_inodes(sb, nblocks);
+
+  uint64_t *blks = (uint64_t*) malloc(nblocks * sizeof(uint64_t));
+  uint64_t *children = (uint64_t*) malloc((nchild + 1) * sizeof(uint64_t));
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  char *buf = NULL;
+  int ret = -1;
+
+  // Current layout: data links and the inodes of the chain
+  uint64_t nchain = 0;
+  uint64_t cap = first_links;
+  uint64_t base = 0;
+
+  memcpy(child, inode, fs_inode_size(sb));
+
+  for (;;) {
+    for (uint64_t i=0; i<cap && base + i<nblocks; i++) {
+      blks[base + i] = child->links[i];
+    }
+
+    base += cap;
+
+    if (base >= nblocks || child->next == 0) {
+      break;
+    }
+
+    children[nchain++] = child->next;
+
+    if (nchain > nchild || fs_read_inode(sb, child->next, child) == -1) {
+      goto out;
+    }
+
+    cap = max_links;
+  }
+
+  // Leave files whose chain does not match their size to fs_fsck
+  if (base < nblocks || child->next != 0) {
+    ret = 0;
+    goto out;
+  }
+
+  // Moving a shared block would take it away from the other files, and
+  // holes would be filled
+  for (uint64_t k=0; k<nblocks; k++) {
+    if (blks[k] == INVALID_BLOCK || fs_rc_get(sb, blks[k]) > 0) {
+      ret = 0;
+      goto out;
+    }
+  }
+
+  // The hashes of the contents move with them, from the index
+  if (fs_has_dedup(sb) && fs_dd_load(sb) == -1) {
+    goto out;
+  }
+
+  // Contiguous data, followed by the chain when it lives in blocks
+  uint64_t len = nblocks + (itable ? 0 : nchild);
+  int laid_out = 1;
+
+  for (uint64_t k=1; k<nblocks; k++) {
+    laid_out &= blks[k] == blks[0] + k;
+  }
+
+  for (uint64_t c=0; !itable && c<nchain; c++) {
+    laid_out &= children[c] == blks[0] + nblocks + c;
+  }
+
+  uint64_t start = laid_out ? 0 : fs_free_run(sb, len);
+
+  if (start == 0 || !fs_has_space(sb, len, 0)) {
+    ret = 0;
+    goto out;
+  }
+
+  if (fs_free_take(sb, start, len) == -1) {
+    goto out;
+  }
+
+  // Copy the data in runs of up to 64 blocks, one write per run
+  uint64_t chunk = MIN(nblocks, 64);
+
+  if ((buf = (char*) malloc(chunk * sb->blksz)) == NULL) {
+    goto out;
+  }
+
+  for (uint64_t k=0; k<nblocks; k+=chunk) {
+    uint64_t n = MIN(chunk, nblocks - k);
+
+    for (uint64_t j=0; j<n; j++) {
+      if (fs_read_blk(sb, blks[k + j], buf + j * sb->blksz) == -1) {
+        goto out;
+      }
+    }
+
+    if (fs_write_at(sb, (start + k) * sb->blksz, buf, n * sb->blksz) == -1) {
+      goto out;
+    }
+
+    // The checksums move with the data
+    for (uint64_t j=0; fs_has_dcsum(sb) && j<n; j++) {
+      uint32_t *csum = fs_tcache_entry(sb, fs_csum_cache(sb, blks[k + j]), sb->cstable, blks[k + j]);
+
+      if (csum == NULL || fs_csum_put(sb, start + k + j, *csum) == -1) {
+        goto out;
+      }
+    }
+  }
+
+  // New chain first, the first inode last, then free the old blocks
+  uint64_t prev = ino;
+
+  base = first_links;
+
+  for (uint64_t c=0; c<nchain; c++) {
+    uint64_t cino = itable ? children[c] : start + nblocks + c;
+
+    if (itable && fs_read_inode(sb, cino, child) == -1) {
+      goto out;
+    }
+
+    child->mode = IMCHILD;
+    child->parent = ino;
+    child->meta = prev;
+    child->next = (c + 1 < nchain) ? (itable ? children[c + 1] : cino + 1) : 0;
+
+    for (uint64_t i=0; i<max_links; i++) {
+      child->links[i] = (base + i < nblocks) ? start + base + i : INVALID_BLOCK;
+    }
+
+    if (fs_write_inode(sb, cino, child) == -1) {
+      goto out;
+    }
+
+    prev = cino;
+    base += max_links;
+  }
+
+  for (uint64_t i=0; i<first_links && i<nblocks; i++) {
+    inode->links[i] = start + i;
+  }
+
+  if (!itable) {
+    inode->next = nchain ? start + nblocks : 0;
+  }
+
+  if (fs_write_inode(sb, ino, inode) == -1) {
+    goto out;
+  }
+
+  for (uint64_t k=0; k<nblocks; k++) {
+    // The hash of the contents moves with them
+    if (fs_has_dedup(sb) && fs_dd_set(sb, start + k, FS_STATE(sb)->dd_hash[blks[k]]) == -1) {
+      goto out;
+    }
+
+    if (fs_do_put_block(sb, blks[k]) == -1) {
+      goto out;
+    }
+  }
+
+  for (uint64_t c=0; !itable && c<nchain; c++) {
+    if (fs_do_put_block(sb, children[c]) == -1) {
+      goto out;
+    }
+  }
+
+  if (fs_tables_flush(sb) == -1) {
+    goto out;
+  }
+
+  FS_STAT_ADD(sb, defrag_files, 1);
+
+  ret = 1;
+
+out:
+  free(blks);
+  free(children);
+  fs_blk_free(sb, child);
+  free(buf);
+
+  return ret;
+}
+
+/* An entity of the host tree given to fs_import.  Entries are kept in
+ * breadth-first order, so parents come before their children and the
+ * children of a directory are contiguous. */
+struct fs_import_entry {
+  char *path; /* on the host */
+  const char *name; /* last component of =path */
+  uint64_t parent; /* index of the parent entry, INVALID_BLOCK at the top */
+  int dir;
+  int inline_data;
+  uint64_t size; /* bytes, or number of entries for directories */
+  uint64_t first; /* index of a directory's first child entry */
+  uint64_t ino; /* first inode */
+  uint64_t meta; /* nodeinfo block */
+  uint64_t child; /* index of the first IMCHILD inode in =inos */
+  uint64_t blk; /* index of the first data block in =blks */
+  char *data; /* contents of inline files */
+};
+
+struct fs_import {
+  struct superblock *sb;
+  struct fs_import_entry *entries;
+  uint64_t n;
+  uint64_t cap;
+  /* blocks and inodes taken off the free lists, in list order, and what
+   * the lists continue with; without an inode table =inos is =blks */
+  uint64_t *blks;
+  uint64_t nblks;
+  uint64_t rest;
+  uint64_t *inos;
+  uint64_t ninos;
+  uint64_t irest;
+  uint64_t chunk; /* blocks per data request */
+  /* FS_FEATURE_DCSUM: checksums of the data blocks in =blks, filled in by
+   * the workers */
+  uint32_t *csums;
+  uint64_t next; /* next entry for the data workers */
+  int err; /* errno of the first failed worker */
+};
+
+/* Coalesces writes to adjacent offsets into requests of up to
+ * FS_IMPORT_CHUNK bytes. */
+struct fs_import_out {
+  uint64_t off;
+  size_t len;
+  size_t cap;
+  char *buf;
+};
+
+int fs_import_entry_cmp(const void *a, const void *b) {
+  return strcmp(((const struct fs_import_entry*) a)->name, ((const struct fs_import_entry*) b)->name);
+}
+
+/* Append the entries of host directory =path, whose entry is =parent, sorted
+ * by name.  Anything but regular files and directories is skipped. */
+int fs_import_scan(struct fs_import *im, const char *path, uint64_t parent) {
+  DIR *dir = opendir(path);
+
+  if (dir == NULL) {
+    return -1;
+  }
+
+  uint64_t first = im->n;
+  uint64_t max_name = fs_nodeinfo_max_name_size(im->sb);
+  struct dirent *de;
+  struct stat st;
+
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    char *child = (char*) malloc(strlen(path) + strlen(de->d_name) + 2);
+
+    if (child == NULL) {
+      closedir(dir);
+      return -1;
+    }
+
+    sprintf(child, "%s/%s", path, de->d_name);
+
+    if (lstat(child, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+      free(child);
+      continue;
+    }
+
+    if (strchr(de->d_name, ' ') != NULL || strlen(de->d_name) >= max_name) {
+      errno = strlen(de->d_name) >= max_name ? ENAMETOOLONG : EINVAL;
+      free(child);
+      closedir(dir);
+      return -1;
+    }
+
+    if (im->n == im->cap) {
+      uint64_t cap = im->cap ? 2 * im->cap : 256;
+      struct fs_import_entry *entries = (struct fs_import_entry*) realloc(im->entries, cap * sizeof(struct fs_import_entry));
+
+      if (entries == NULL) {
+        free(child);
+        closedir(dir);
+        return -1;
+      }
+
+      im->entries = entries;
+      im->cap = cap;
+    }
+
+    struct fs_import_entry *e = &im->entries[im->n++];
+
+    memset(e, 0, sizeof(*e));
+    e->path = child;
+    e->name = child + strlen(path) + 1;
+    e->parent = parent;
+    e->dir = S_ISDIR(st.st_mode);
+    e->size = e->dir ? 0 : (uint64_t) st.st_size;
+    e->inline_data = !e->dir && e->size <= fs_inline_max_size(im->sb, strlen(e->name));
+  }
+
+  closedir(dir);
+
+  qsort(im->entries + first, im->n - first, sizeof(struct fs_import_entry), fs_import_entry_cmp);
+
+  if (parent != INVALID_BLOCK) {
+    im->entries[parent].first = first;
+    im->entries[parent].size = im->n - first;
+  }
+
+  return 0;
+}
+
+/* Links held by the entity of =e: directory entries or data blocks. */
+uint64_t fs_import_nlinks(struct fs_import *im, struct fs_import_entry *e) {
+  if (e->dir) {
+    return e->size;
+  }
+
+  return e->inline_data ? 0 : CEIL(e->size, im->sb->blksz);
+}
+
+uint64_t fs_import_link(struct fs_import *im, struct fs_import_entry *e, uint64_t k) {
+  return e->dir ? im->entries[e->first + k].ino : im->blks[e->blk + k];
+}
+
+/* Take the blocks and inodes the whole tree needs off the head of the free
+ * lists, and assign them: metadata first, in entry order, then the data of
+ * every file.  On a freshly formatted image both come out ascending. */
+int fs_import_layout(struct fs_import *im, char *map, uint64_t extra) {
+  struct superblock *sb = im->sb;
+  uint64_t ninodes = 0;
+  uint64_t ndata = 0;
+
+  for (uint64_t i=0; i<im->n; i++) {
+    struct fs_import_entry *e = &im->entries[i];
+
+    ninodes += 1 + fs_child_inodes(sb, fs_import_nlinks(im, e));
+
+    if (!e->dir) {
+      ndata += fs_import_nlinks(im, e);
+    }
+  }
+
+  uint64_t nmeta = fs_is_compact(sb) ? 0 : im->n;
+
+  if (!fs_has_space(sb, ndata + nmeta, ninodes + extra)) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  im->nblks = ndata + nmeta + (fs_has_itable(sb) ? 0 : ninodes);
+  im->blks = (uint64_t*) malloc((im->nblks + 1) * sizeof(uint64_t));
+
+  if (fs_has_itable(sb)) {
+    im->ninos = ninodes;
+    im->inos = (uint64_t*) malloc((ninodes + 1) * sizeof(uint64_t));
+  } else {
+    im->inos = im->blks;
+  }
+
+  if (im->blks == NULL || im->inos == NULL) {
+    return -1;
+  }
+
+  uint64_t blk = sb->freelist;
+
+  for (uint64_t i=0; i<im->nblks; i++) {
+    im->blks[i] = blk;
+    blk = ((struct freepage*) (map + blk * sb->blksz))->next;
+  }
+
+  im->rest = blk;
+
+  uint64_t ino = sb->ifree;
+
+  for (uint64_t i=0; i<im->ninos; i++) {
+    im->inos[i] = ino;
+    ino = fs_map_inode(sb, map, ino)->next;
+  }
+
+  im->irest = ino;
+
+  uint64_t b = 0;
+  uint64_t k = 0;
+  uint64_t *next_ino = fs_has_itable(sb) ? &k : &b;
+
+  for (uint64_t i=0; i<im->n; i++) {
+    struct fs_import_entry *e = &im->entries[i];
+
+    e->ino = im->inos[(*next_ino)++];
+    e->meta = fs_is_compact(sb) ? e->ino : im->blks[b++];
+    e->child = *next_ino;
+    *next_ino += fs_child_inodes(sb, fs_import_nlinks(im, e));
+  }
+
+  for (uint64_t i=0; i<im->n; i++) {
+    struct fs_import_entry *e = &im->entries[i];
+
+    if (!e->dir) {
+      e->blk = b;
+      b += fs_import_nlinks(im, e);
+    }
+  }
+
+  return 0;
+}
+
+/* Read exactly =sz bytes; a source that shrank since the scan is an error. */
+int fs_import_read(int fd, char *buf, size_t sz) {
+  while (sz > 0) {
+    ssize_t n = read(fd, buf, sz);
+
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+
+      return -1;
+    }
+
+    buf += n;
+    sz -= n;
+  }
+
+  return 0;
+}
+
+/* Blocks of the next data request of =e, starting at its block =j: a run
+ * of adjacent blocks, at most =im->chunk of them. */
+uint64_t fs_import_run(struct fs_import *im, struct fs_import_entry *e, uint64_t j) {
+  uint64_t *blks = im->blks + e->blk;
+  uint64_t n = fs_import_nlinks(im, e);
+  uint64_t run = 1;
+
+  while (j + run < n && run < im->chunk && blks[j + run] == blks[j] + run) {
+    run++;
+  }
+
+  return run;
+}
+
+int fs_import_file(struct fs_import *im, struct fs_import_entry *e, char *buf) {
+  struct superblock *sb = im->sb;
+  int fd = open(e->path, O_RDONLY);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  int ret = 0;
+
+  if (e->inline_data) {
+    e->data = (char*) malloc(e->size + 1);
+    ret = e->data == NULL ? -1 : fs_import_read(fd, e->data, e->size);
+  }
+
+  for (uint64_t j=0; ret == 0 && j<fs_import_nlinks(im, e); ) {
+    uint64_t run = fs_import_run(im, e, j);
+    size_t sz = MIN(run * sb->blksz, e->size - j * sb->blksz);
+
+    if (fs_import_read(fd, buf, sz) == -1) {
+      ret = -1;
+    } else if (pwrite(sb->fd, buf, sz, im->blks[e->blk + j] * sb->blksz) != (ssize_t) sz) {
+      ret = -1;
+    }
+
+    for (uint64_t k=0; ret == 0 && im->csums != NULL && k<run; k++) {
+      im->csums[e->blk + j + k] = fs_csum(buf + k * sb->blksz, MIN(sb->blksz, sz - k * sb->blksz));
+    }
+
+    j += run;
+  }
+
+  close(fd);
+
+  return ret;
+}
+
+/* Copy file contents from the host, one file at a time per thread. */
+void * fs_import_worker(void *arg) {
+  struct fs_import *im = (struct fs_import*) arg;
+  char *buf = (char*) malloc(im->chunk * im->sb->blksz);
+
+  if (buf == NULL) {
+    int zero = 0;
+    __atomic_compare_exchange_n(&im->err, &zero, ENOMEM, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return NULL;
+  }
+
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&im->next, 1, __ATOMIC_RELAXED);
+
+    if (i >= im->n || __atomic_load_n(&im->err, __ATOMIC_SEQ_CST) != 0) {
+      break;
+    }
+
+    struct fs_import_entry *e = &im->entries[i];
+
+    if (!e->dir && e->size > 0 && fs_import_file(im, e, buf) == -1) {
+      int zero = 0;
+      __atomic_compare_exchange_n(&im->err, &zero, errno ? errno : EIO, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/* Write out the buffered request.  With FS_FEATURE_CSUM, the blocks it
+ * covers get their checksums, those it only covers in part (inode table
+ * blocks) once they are read back. */
+int fs_import_flush(struct superblock *sb, struct fs_import_out *out) {
+  int ret = out->len > 0 ? fs_write_at(sb, out->off, out->buf, out->len) : 0;
+
+  if (ret == 0 && out->len > 0 && fs_has_csum(sb)) {
+    char *tmp = (char*) fs_blk_alloc(sb);
+
+    for (uint64_t blk=out->off / sb->blksz; ret == 0 && blk<CEIL(out->off + out->len, sb->blksz); blk++) {
+      uint64_t off = blk * sb->blksz;
+
+      if (off >= out->off && off + sb->blksz <= out->off + out->len) {
+        ret = fs_csum_set(sb, blk, out->buf + (off - out->off), sb->blksz);
+      } else {
+        ret = fs_read_blk(sb, blk, tmp) == -1 ? -1 : fs_csum_set(sb, blk, tmp, sb->blksz);
+      }
+    }
+
+    fs_blk_free(sb, tmp);
+  }
+
+  out->len = 0;
+
+  return ret;
+}
+
+int fs_import_put(struct superblock *sb, struct fs_import_out *out, uint64_t off, void *data, size_t sz) {
+  if (out->len > 0 && (off != out->off + out->len || out->len + sz > out->cap)) {
+    if (fs_import_flush(sb, out) == -1) {
+      return -1;
+    }
+  }
+
+  if (out->len == 0) {
+    out->off = off;
+  }
+
+  memcpy(out->buf + out->len, data, sz);
+  out->len += sz;
+
+  return 0;
+}
+
+int fs_import_put_inode(struct superblock *sb, struct fs_import_out *out, uint64_t ino, struct inode *inode) {
+  uint64_t off = fs_has_itable(sb) ? sb->itable * sb->blksz + ino * FS_INODE_SIZE : ino * sb->blksz;
+
+  return fs_import_put(sb, out, off, inode, fs_inode_size(sb));
+}
+
+/* Write the inodes and metadata of entry =e, as fs_write_meta would. */
+int fs_import_meta(struct fs_import *im, struct fs_import_out *out, struct fs_import_entry *e,
+    uint64_t dir, struct inode *inode, struct nodeinfo *nodeinfo) {
+  struct superblock *sb = im->sb;
+  uint64_t nlinks = fs_import_nlinks(im, e);
+  uint64_t nchild = fs_child_inodes(sb, nlinks);
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t max_links = fs_inode_max_links(sb);
+  uint64_t k = 0;
+
+  memset(inode, 0, sb->blksz);
+  memset(nodeinfo, 0, sb->blksz);
+
+  inode->mode = e->dir ? IMDIR : (e->inline_data ? (IMREG | IMINLINE) : IMREG);
+  inode->parent = e->parent == INVALID_BLOCK ? dir : im->entries[e->parent].ino;
+  inode->meta = e->meta;
+  inode->next = nchild > 0 ? im->inos[e->child] : 0;
+
+  for (uint64_t i=0; i<cap; i++, k++) {
+    inode->links[i] = k < nlinks ? fs_import_link(im, e, k) : INVALID_BLOCK;
+  }
+
+  nodeinfo->size = e->size;
+  strcpy(nodeinfo->name, e->name);
+
+  if (e->inline_data && e->size > 0) {
+    memcpy(fs_inline_data(nodeinfo), e->data, e->size);
+  }
+
+  if (fs_is_compact(sb)) {
+    struct cnodeinfo *cnodeinfo = fs_cnodeinfo(sb, inode);
+
+    cnodeinfo->size = nodeinfo->size;
+    memcpy(cnodeinfo->name, nodeinfo->name, fs_nodeinfo_max_name_size(sb));
+  }
+
+  if (fs_import_put_inode(sb, out, e->ino, inode) == -1) {
+    return -1;
+  }
+
+  if (!fs_is_compact(sb) && fs_import_put(sb, out, e->meta * sb->blksz, nodeinfo, sb->blksz) == -1) {
+    return -1;
+  }
+
+  for (uint64_t c=0; c<nchild; c++) {
+    memset(inode, 0, sb->blksz);
+
+    inode->mode = IMCHILD;
+    inode->parent = e->ino;
+    inode->meta = c == 0 ? e->ino : im->inos[e->child + c - 1];
+    inode->next = c + 1 < nchild ? im->inos[e->child + c + 1] : 0;
+
+    for (uint64_t i=0; i<max_links; i++, k++) {
+      inode->links[i] = k < nlinks ? fs_import_link(im, e, k) : INVALID_BLOCK;
+    }
+
+    if (fs_import_put_inode(sb, out, im->inos[e->child + c], inode) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Put back the free list links the import overwrote. */
+void fs_import_restore(struct fs_import *im) {
+  struct superblock *sb = im->sb;
+
+  for (uint64_t i=0; i<im->nblks; i++) {
+    fs_free_link(sb, im->blks[i], i + 1 < im->nblks ? im->blks[i + 1] : im->rest);
+  }
+
+  struct inode *inode = (struct inode*) calloc(1, FS_INODE_SIZE);
+
+  for (uint64_t i=0; inode != NULL && i<im->ninos; i++) {
+    inode->next = i + 1 < im->ninos ? im->inos[i + 1] : im->irest;
+    fs_write_inode(sb, im->inos[i], inode);
+  }
+
+  free(inode);
+}
+
+/* IMCHILD inodes directory =dir needs to take =n more entries, or
+ * INVALID_BLOCK if its inodes cannot be read. */
+uint64_t fs_import_dir_growth(struct superblock *sb, uint64_t dir, uint64_t n) {
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  uint64_t ret = INVALID_BLOCK;
+
+  if (fs_read_inode(sb, dir, inode) == -1 || fs_read_info(sb, inode, nodeinfo) == -1) {
+    goto out;
+  }
+
+  uint64_t slots = fs_inode_first_links(sb);
+
+  while (inode->next != 0) {
+    if (fs_read_inode(sb, inode->next, inode) == -1) {
+      goto out;
+    }
+
+    slots += fs_inode_max_links(sb);
+  }
+
+  uint64_t free_slots = slots - nodeinfo->size;
+
+  ret = n > free_slots ? CEIL(n - free_slots, fs_inode_max_links(sb)) : 0;
+
+out:
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+/* A directory being walked by fs_export: the chain inode holding its next
+ * entry, read in place from the mapping, and where its path ends. */
+struct fs_export_frame {
+  struct inode *inode;
+  uint64_t i;
+  uint64_t cap;
+  size_t pathlen;
+};
+
+struct fs_export {
+  struct superblock *sb;
+  char *map;
+  int fd; /* tar stream, or -1 when exporting to a host directory */
+  char *path; /* entry being exported, relative to the exported directory
+               * or prefixed by the host directory */
+  size_t pathcap;
+  struct fs_export_frame *frames;
+  uint64_t nframes;
+  uint64_t capframes;
+  uint64_t count;
+};
+
+/* A range of the image to copy out, read ahead of the one being written. */
+struct fs_export_run {
+  uint64_t off;
+  size_t len;
+};
+
+/* Name of the entity whose first inode is =inode, read from the mapping. */
+char * fs_map_name(struct superblock *sb, char *map, struct inode *inode) {
+  if (fs_is_compact(sb)) {
+    return fs_cnodeinfo(sb, inode)->name;
+  }
+
+  return ((struct nodeinfo*) (map + inode->meta * sb->blksz))->name;
+}
+
+int fs_export_valid_ino(struct superblock *sb, uint64_t ino) {
+  if (fs_has_itable(sb)) {
+    return ino > 0 && ino < sb->inodes;
+  }
+
+  return ino >= fs_first_data_blk(sb) && ino < sb->blks;
+}
+
+int fs_export_write(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Append "/=name" (or just =name at the top of a tar stream) to the path
+ * of the entry being exported. */
+int fs_export_path(struct fs_export *ex, size_t pathlen, const char *name) {
+  // Room for a separator, a trailing slash and the NUL
+  size_t len = pathlen + strlen(name) + 3;
+
+  if (len > ex->pathcap) {
+    char *path = (char*) realloc(ex->path, 2 * len);
+
+    if (path == NULL) {
+      return -1;
+    }
+
+    ex->path = path;
+    ex->pathcap = 2 * len;
+  }
+
+  sprintf(ex->path + pathlen, "%s%s", pathlen > 0 ? DIR_DELIM_STR : "", name);
+
+  return 0;
+}
+
+void fs_tar_octal(char *field, size_t width, uint64_t value) {
+  snprintf(field, width, "%0*" PRIo64, (int) width - 1, value);
+}
+
+/* Append one pax record "<len> <key>=<value>\n" to =buf at =*len. */
+void fs_tar_pax_record(char *buf, size_t *len, const char *key, const char *value) {
+  size_t body = strlen(key) + strlen(value) + 3;
+  size_t digits = 1;
+
+  // The length counts its own digits
+  while (snprintf(NULL, 0, "%zu", body + digits) > digits) {
+    digits++;
+  }
+
+  *len += sprintf(buf + *len, "%zu %s=%s\n", body + digits, key, value);
+}
+
+/* Write the ustar header of an entry of type =type ('0' for files, '5' for
+ * directories), preceded by a pax extended header when its path or size do
+ * not fit in the ustar fields. */
+int fs_tar_header(int fd, const char *path, char type, uint64_t size) {
+  char header[512];
+  size_t len = strlen(path);
+  size_t prefix = 0;
+
+  // Long paths are split at a slash into the prefix and name fields
+  if (len > 100) {
+    const char *slash = strchr(path, DIR_DELIM_CHR);
+
+    while (slash != NULL && len - (slash - path) - 1 > 100) {
+      slash = strchr(slash + 1, DIR_DELIM_CHR);
+    }
+
+    prefix = (slash != NULL && slash > path && slash - path <= 155) ? slash - path : 0;
+  }
+
+  int pax_path = len - (prefix ? prefix + 1 : 0) > 100;
+  int pax_size = size > 077777777777ULL;
+
+  if (pax_path || pax_size) {
+    char *pax = (char*) malloc(len + 64);
+    char digits[24];
+    size_t paxlen = 0;
+
+    if (pax == NULL) {
+      return -1;
+    }
+
+    if (pax_path) {
+      fs_tar_pax_record(pax, &paxlen, "path", path);
+    }
+
+    if (pax_size) {
+      sprintf(digits, "%" PRIu64, size);
+      fs_tar_pax_record(pax, &paxlen, "size", digits);
+    }
+
+    int ret = fs_tar_header(fd, "././@PaxHeader", 'x', paxlen);
+
+    if (ret == 0) {
+      ret = fs_export_write(fd, pax, paxlen);
+    }
+
+    memset(header, 0, sizeof(header));
+
+    if (ret == 0 && paxlen % 512 != 0) {
+      ret = fs_export_write(fd, header, 512 - paxlen % 512);
+    }
+
+    free(pax);
+
+    if (ret == -1) {
+      return -1;
+    }
+  }
+
+  memset(header, 0, sizeof(header));
+
+  // With a pax path, the ustar fields keep its last 100 characters
+  const char *name = pax_path ? path + len - 100 : path + (prefix ? prefix + 1 : 0);
+
+  memcpy(header, name, strlen(name));
+  memcpy(header + 345, path, pax_path ? 0 : prefix);
+  fs_tar_octal(header + 100, 8, type == '5' ? 0755 : 0644);
+  fs_tar_octal(header + 108, 8, 0);
+  fs_tar_octal(header + 116, 8, 0);
+  fs_tar_octal(header + 124, 12, pax_size ? 0 : size);
+  fs_tar_octal(header + 136, 12, 0);
+  memset(header + 148, ' ', 8);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  uint64_t sum = 0;
+
+  for (int i=0; i<512; i++) {
+    sum += (unsigned char) header[i];
+  }
+
+  fs_tar_octal(header + 148, 7, sum);
+
+  return fs_export_write(fd, header, sizeof(header));
+}
+
+/* Open the output of a file entry: its tar header, or a host file. */
+int fs_export_open(struct fs_export *ex, uint64_t size) {
+  if (ex->fd < 0) {
+    return open(ex->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+
+  return fs_tar_header(ex->fd, ex->path, '0', size) == -1 ? -1 : ex->fd;
+}
+
+/* Copy out =run while the kernel reads =ahead, the run after it. */
+int fs_export_run(struct fs_export *ex, int out, struct fs_export_run *run, struct fs_export_run *ahead) {
+  if (ahead->len > 0) {
+    uint64_t start = ahead->off & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+    posix_madvise(ex->map + start, ahead->off + ahead->len - start, POSIX_MADV_WILLNEED);
+  }
+
+  return run->len > 0 ? fs_export_write(out, ex->map + run->off, run->len) : 0;
+}
+
+/* Skip =len bytes of a hole: host files get a hole of their own, tar
+ * archives get zeros. */
+int fs_export_hole(struct fs_export *ex, int out, uint64_t len) {
+  if (ex->fd < 0) {
+    return lseek(out, (off_t) len, SEEK_CUR) == (off_t) -1 ? -1 : 0;
+  }
+
+  static const char zeros[4096];
+
+  for (uint64_t n; len > 0; len -= n) {
+    n = MIN(len, sizeof(zeros));
+
+    if (fs_export_write(out, zeros, n) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Stream the contents of the file whose first inode is =inode: adjacent
+ * blocks are merged into runs of up to FS_IMPORT_CHUNK bytes, each one
+ * written straight from the mapping, and holes are skipped. */
+int fs_export_file(struct fs_export *ex, struct inode *inode, uint64_t size) {
+  struct superblock *sb = ex->sb;
+  int out = fs_export_open(ex, size);
+
+  if (out == -1) {
+    return -1;
+  }
+
+  int ret = 0;
+
+  if (inode->mode & IMINLINE) {
+    char *name = fs_map_name(sb, ex->map, inode);
+    ret = fs_export_write(out, name + strlen(name) + 1, size);
+  } else if (inode->mode & IMCOMP) {
+    char *data = (char*) malloc(size);
+
+    ret = data == NULL ? -1 : fs_comp_read(sb, ex->map, inode, size, 0, size, data);
+
+    if (ret == 0) {
+      ret = fs_export_write(out, data, size);
+    }
+
+    free(data);
+  } else {
+    struct fs_export_run run = {0, 0};
+    uint64_t nblocks = CEIL(size, sb->blksz);
+    uint64_t base = 0;
+    uint64_t cap = fs_inode_first_links(sb);
+
+    for (uint64_t j=0; ret == 0 && j<nblocks; j++) {
+      if (j - base == cap) {
+        if (!fs_export_valid_ino(sb, inode->next) || fs_csum_map_ino(sb, ex->map, inode->next) == -1) {
+          errno = EIO;
+          ret = -1;
+          break;
+        }
+
+        inode = fs_map_inode(sb, ex->map, inode->next);
+        base = j;
+        cap = fs_inode_max_links(sb);
+      }
+
+      uint64_t blk = inode->links[j - base];
+      size_t len = MIN(sb->blksz, size - j * sb->blksz);
+
+      if (blk == INVALID_BLOCK) {
+        struct fs_export_run none = {0, 0};
+
+        ret = fs_export_run(ex, out, &run, &none);
+        run = none;
+        ret = ret == -1 ? -1 : fs_export_hole(ex, out, len);
+        continue;
+      }
+
+      if (blk < fs_first_data_blk(sb) || blk >= sb->blks
+          || (fs_has_dcsum(sb) && fs_csum_map_check(sb, ex->map, blk, len) == -1)) {
+        errno = EIO;
+        ret = -1;
+        break;
+      }
+
+      if (run.len > 0 && run.off + run.len == blk * sb->blksz && run.len + len <= FS_IMPORT_CHUNK) {
+        run.len += len;
+        continue;
+      }
+
+      struct fs_export_run next = {blk * sb->blksz, len};
+
+      ret = fs_export_run(ex, out, &run, &next);
+      run = next;
+    }
+
+    struct fs_export_run none = {0, 0};
+
+    if (ret == 0) {
+      ret = fs_export_run(ex, out, &run, &none);
+    }
+  }
+
+  if (ex->fd < 0) {
+    // A trailing hole leaves the host file short
+    if (ret == 0 && ftruncate(out, (off_t) size) == -1) {
+      ret = -1;
+    }
+
+    if (close(out) == -1) {
+      ret = -1;
+    }
+  } else if (ret == 0 && size % 512 != 0) {
+    char pad[512];
+
+    memset(pad, 0, sizeof(pad));
+    ret = fs_export_write(out, pad, 512 - size % 512);
+  }
+
+  return ret;
+}
+
+/* Create the output of a directory entry. */
+int fs_export_mkdir(struct fs_export *ex) {
+  if (ex->fd >= 0) {
+    size_t len = strlen(ex->path);
+    int ret;
+
+    // Directory names end with a slash in tar streams
+    ex->path[len] = DIR_DELIM_CHR;
+    ex->path[len + 1] = '\0';
+    ret = fs_tar_header(ex->fd, ex->path, '5', 0);
+    ex->path[len] = '\0';
+
+    return ret;
+  }
+
+  return mkdir(ex->path, 0755) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+int fs_export_push(struct fs_export *ex, struct inode *inode, size_t pathlen) {
+  if (ex->nframes == ex->capframes) {
+    uint64_t cap = ex->capframes ? 2 * ex->capframes : 16;
+    struct fs_export_frame *frames = (struct fs_export_frame*) realloc(ex->frames, cap * sizeof(struct fs_export_frame));
+
+    if (frames == NULL) {
+      return -1;
+    }
+
+    ex->frames = frames;
+    ex->capframes = cap;
+  }
+
+  struct fs_export_frame *f = &ex->frames[ex->nframes++];
+
+  f->inode = inode;
+  f->i = 0;
+  f->cap = fs_inode_first_links(ex->sb);
+  f->pathlen = pathlen;
+
+  return 0;
+}
+
+/* Depth-first walk from directory =dir, in the order of its slots.  Only
+ * one frame per level is kept, so memory is bounded by the tree's depth. */
+int fs_export_walk(struct fs_export *ex, uint64_t dir) {
+  struct superblock *sb = ex->sb;
+
+  if (fs_export_push(ex, fs_map_inode(sb, ex->map, dir), ex->path ? strlen(ex->path) : 0) == -1) {
+    return -1;
+  }
+
+  while (ex->nframes > 0) {
+    struct fs_export_frame *f = &ex->frames[ex->nframes - 1];
+
+    if (f->i == f->cap) {
+      if (f->inode->next == 0) {
+        ex->nframes--;
+        continue;
+      }
+
+      if (!fs_export_valid_ino(sb, f->inode->next) || fs_csum_map_ino(sb, ex->map, f->inode->next) == -1) {
+        errno = EIO;
+        return -1;
+      }
+
+      f->inode = fs_map_inode(sb, ex->map, f->inode->next);
+      f->i = 0;
+      f->cap = fs_inode_max_links(sb);
+    }
+
+    uint64_t link = f->inode->links[f->i++];
+
+    if (link == INVALID_BLOCK) {
+      continue;
+    }
+
+    if (!fs_export_valid_ino(sb, link) || fs_csum_map_ino(sb, ex->map, link) == -1) {
+      errno = EIO;
+      return -1;
+    }
+
+    struct inode *inode = fs_map_inode(sb, ex->map, link);
+
+    if (fs_has_csum(sb) && !fs_is_compact(sb) && fs_csum_map_check(sb, ex->map, inode->meta, sb->blksz) == -1) {
+      return -1;
+    }
+
+    size_t pathlen = f->pathlen;
+
+    if (fs_export_path(ex, pathlen, fs_map_name(sb, ex->map, inode)) == -1) {
+      return -1;
+    }
+
+    ex->count++;
+
+    if (inode->mode == IMDIR) {
+      if (fs_export_mkdir(ex) == -1 || fs_export_push(ex, inode, strlen(ex->path)) == -1) {
+        return -1;
+      }
+    } else if (fs_export_file(ex, inode, fs_map_size(sb, ex->map, inode)) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Export directory =dname to the tar stream =fd, or to the host directory
+ * =path when =fd is negative. */
+ssize_t fs_export_tree(struct superblock *sb, const char *dname, int fd, const char *path) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name(dname)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  uint64_t dir = fs_find_blk(sb, dname);
+
+  if (dir == INVALID_BLOCK) {
+    return -1;
+  }
+
+  // Buffered files must reach the image before it is read in place
+  char *map = fs_dirty_flush(sb) == -1 ? NULL : fs_map(sb);
+
+  if (map == NULL) {
+    return -1;
+  }
+
+  if (fs_map_inode(sb, map, dir)->mode != IMDIR) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  struct fs_export ex;
+
+  memset(&ex, 0, sizeof(ex));
+  ex.sb = sb;
+  ex.map = map;
+  ex.fd = fd;
+
+  if (fd < 0 && ((mkdir(path, 0755) == -1 && errno != EEXIST) || fs_export_path(&ex, 0, path) == -1)) {
+    return -1;
+  }
+
+  ssize_t ret = fs_export_walk(&ex, dir) == -1 ? -1 : (ssize_t) ex.count;
+
+  // A tar stream ends with two zero blocks
+  if (ret >= 0 && fd >= 0) {
+    char *end = (char*) calloc(2, 512);
+
+    if (end == NULL || fs_export_write(fd, end, 2 * 512) == -1) {
+      ret = -1;
+    }
+
+    free(end);
+  }
+
+  free(ex.path);
+  free(ex.frames);
+
+  return ret;
+}
+
+/****************************************************************************
+ * external functions
+ ***************************************************************************/
+
+struct superblock * fs_format(const char *fname, uint64_t blocksize) {
+  return fs_format_features(fname, blocksize, 0);
+}
+
+struct superblock * fs_format_features(const char *fname, uint64_t blocksize, uint64_t features) {
+  if (blocksize < MIN_BLOCK_SIZE || (features & ~FS_FEATURES_KNOWN)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Packed inodes always embed their nodeinfo
+  if (features & FS_FEATURE_ITABLE) {
+    if (blocksize % FS_INODE_SIZE != 0) {
+      errno = EINVAL;
+      return NULL;
+    }
+
+    features |= FS_FEATURE_COMPACT;
+  }
+
+  // Deduplicated blocks are shared like cloned ones
+  if (features & FS_FEATURE_DEDUP) {
+    features |= FS_FEATURE_REFCOUNT;
+  }
+
+  if (features & FS_FEATURE_DCSUM) {
+    features |= FS_FEATURE_CSUM;
+  }
+
+  int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR);
+
+  off_t fsize = lseek(fd, 0, SEEK_END);
+
+  long nblocks = fsize / blocksize;
+
+  if (nblocks < MIN_BLOCK_COUNT) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    close(fd);
+    errno = EBUSY;
+    return NULL;
+  }
+
+  lseek(fd, 0, SEEK_SET);
+
+  // ----- Superblock -----
+
+  struct superblock *sb = fs_state_new();
+
+  if (sb == NULL) {
+    return NULL;
+  }
+  
+  sb->magic = SUPERBLOCK_MAGIC;
+  sb->version = FS_VERSION_2;
+  sb->features = features;
+  sb->blksz = blocksize;
+  sb->blks = nblocks;
+  sb->freeblks = nblocks - 1 - fs_meta_blocks(sb);
+  sb->root = ROOT_INODE_BLK;
+  sb->freelist = ROOT_INODE_BLK + fs_meta_blocks(sb);
+  sb->fd = fd;
+
+  // ----- Inode table -----
+
+  if (fs_has_itable(sb)) {
+    uint64_t per_blk = blocksize / FS_INODE_SIZE;
+    uint64_t itblks = CEIL(CEIL(nblocks, ITABLE_BLOCKS_PER_INODE), per_blk);
+
+    sb->itable = ITABLE_BLK;
+    sb->inodes = itblks * per_blk;
+    // Inode 0 is never used, so that =next can be zero-terminated
+    sb->ifree = ROOT_INODE_BLK + 1;
+    sb->nifree = sb->inodes - 2;
+    sb->freelist = ITABLE_BLK + itblks;
+    sb->freeblks = nblocks - 1 - itblks;
+
+    char *iblk = (char*) malloc(blocksize);
+
+    for (uint64_t i=0; i<itblks; i++) {
+      memset(iblk, 0, blocksize);
+
+      for (uint64_t k=0; k<per_blk; k++) {
+        uint64_t ino = i * per_blk + k;
+        struct inode *inode = (struct inode*) (iblk + k * FS_INODE_SIZE);
+
+        if (ino >= sb->ifree) {
+          inode->next = (ino == sb->inodes - 1) ? 0 : ino + 1;
+        }
+      }
+
+      fs_write_blk(sb, ITABLE_BLK + i, (void*) iblk);
+    }
+
+    free(iblk);
+  }
+
+  // ----- Reference count and hash tables -----
+
+  if (features & FS_FEATURE_REFCOUNT) {
+    sb->rcblocks = CEIL(nblocks * sizeof(uint32_t), blocksize);
+    sb->rctable = fs_has_itable(sb) ? sb->freelist : ROOT_INODE_BLK;
+
+    uint64_t tblocks = sb->rcblocks * ((features & FS_FEATURE_DEDUP) ? 2 : 1);
+
+    // Without an inode table the root goes after them, with the data
+    if (!fs_has_itable(sb)) {
+      sb->root += tblocks;
+    }
+
+    sb->freelist += tblocks;
+
+    if (sb->freelist >= nblocks) {
+      errno = ENOSPC;
+      return NULL;
+    }
+
+    sb->freeblks -= tblocks;
+
+    char *rblk = (char*) calloc(1, blocksize);
+
+    for (uint64_t i=0; i<tblocks; i++) {
+      fs_write_blk(sb, sb->rctable + i, (void*) rblk);
+    }
+
+    free(rblk);
+  }
+
+  // ----- Checksum table -----
+
+  if (features & FS_FEATURE_CSUM) {
+    uint64_t cblocks = fs_csum_blocks(sb);
+
+    sb->cstable = fs_has_itable(sb) ? sb->freelist : sb->root;
+
+    if (!fs_has_itable(sb)) {
+      sb->root += cblocks;
+    }
+
+    sb->freelist += cblocks;
+
+    if (sb->freelist >= nblocks) {
+      errno = ENOSPC;
+      return NULL;
+    }
+
+    sb->freeblks -= cblocks;
+
+    char *cblk = (char*) calloc(1, blocksize);
+
+    for (uint64_t i=0; i<cblocks; i++) {
+      fs_write_blk(sb, sb->cstable + i, (void*) cblk);
+    }
+
+    // The inode table was written before the table existed
+    for (uint64_t blk=sb->itable; fs_has_itable(sb) && blk<sb->itable + sb->inodes / (blocksize / FS_INODE_SIZE); blk++) {
+      if (fs_read_blk(sb, blk, cblk) == -1 || fs_csum_set(sb, blk, cblk, blocksize) == -1) {
+        free(cblk);
+        return NULL;
+      }
+    }
+
+    free(cblk);
+  }
+
+  if (fs_write_sb(sb) == -1) 
+    return NULL;
+
+  // ----- Root inode and node info -----
+
+  struct inode* root_inode  = (struct inode*) malloc(blocksize);
+  
+  root_inode->mode = IMDIR;
+  root_inode->parent = SUPERBLOCK_BLK;
+  root_inode->meta = fs_is_compact(sb) ? sb->root : sb->root + 1;
+  root_inode->next = 0;
+
+  for (int i=0; i<fs_inode_first_links(sb); i++) {
+    root_inode->links[i] = INVALID_BLOCK;
+  }
+
+  struct nodeinfo* root_info = (struct nodeinfo*) malloc(blocksize);
+
+  if (root_info == NULL) {
+    return NULL;
+  }
+
+  strcpy((char*)&root_info->name, ROOT_DIR_NAME);
+  root_info->size = 0;
+  
+  if (fs_write_meta(sb, sb->root, root_inode, root_info) == -1)
+    return NULL;
+
+  free(root_inode);
+  free(root_info);
+
+  // ----- Free list -----
+
+  struct freepage *freepage = (struct freepage*) malloc(blocksize);
+
+  freepage->count = 0;
+
+  for (int i=sb->freelist; i<sb->blks; i++) {
+    freepage->next = (i == sb->blks - 1) ? 0 : i + 1;
+    fs_write_blk(sb, i, (void*) freepage);
+  }
+
+  free(freepage);
+
+  if (fs_tables_flush(sb) == -1)
+    return NULL;
+
+  // ----- End -----
+  
+  return sb;
+}
+
+struct superblock * fs_open(const char *fname) {
+  int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR);
+
+  if (fd == -1) {
+    return NULL;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    close(fd);
+    errno = EBUSY;
+    return NULL;
+  }
+
+  struct superblock* sb = fs_state_new();
+
+  if (sb == NULL) {
+    flock(fd, LOCK_UN);
+    close(fd);
+    return NULL;
   }
 
   if (read(fd, (void*) sb, sizeof(struct superblock)) == -1) {
     flock(fd, LOCK_UN);
     close(fd);
-    free(sb);
+    free(sb);
+    return NULL;
+  }
+
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    flock(fd, LOCK_UN);
+    close(fd);
+    free(sb);
+    errno = EBADF;
+    return NULL;
+  }
+
+  // Images older than FS_VERSION_2 have no feature flags, and whatever
+  // follows =fd in their first block is junk
+  if (sb->version != FS_VERSION_2) {
+    sb->version = FS_VERSION_1;
+    sb->features = 0;
+    memset(&sb->itable, 0,
+           sizeof(struct superblock) - offsetof(struct superblock, itable));
+  }
+
+  if (sb->features & ~FS_FEATURES_KNOWN) {
+    flock(fd, LOCK_UN);
+    close(fd);
+    free(sb);
+    errno = EBADF;
+    return NULL;
+  }
+
+  sb->fd = fd;
+
+  return sb;
+}
+
+int fs_close(struct superblock *sb) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  // Flushing buffered files may free blocks, so staged ones go last
+  int ret = fs_dirty_flush(sb);
+
+  // Files that could not be flushed are lost with the handle
+  while (FS_STATE(sb)->dirty != NULL) {
+    fs_dirty_drop(sb, FS_STATE(sb)->dirty->blk);
+  }
+
+  if (fs_free_merge(sb) == -1 || fs_tables_flush(sb) == -1) {
+    ret = -1;
+  }
+
+  if (fs_trace_stop(sb) == -1) {
+    ret = -1;
+  }
+
+  fs_defrag_end(sb);
+
+  flock(sb->fd, LOCK_UN);
+  close(sb->fd);
+  
+  if (FS_STATE(sb)->map != NULL) {
+    munmap(FS_STATE(sb)->map, sb->blks * sb->blksz);
+  }
+
+  free(FS_STATE(sb)->icache);
+  free(FS_STATE(sb)->rcache.buf);
+  free(FS_STATE(sb)->hcache.buf);
+
+  for (int k=0; k<FS_CSUM_CACHE; k++) {
+    free(FS_STATE(sb)->ccache[k].buf);
+  }
+
+  free(FS_STATE(sb)->dd_hash);
+  free(FS_STATE(sb)->dd_next);
+  free(FS_STATE(sb)->dd_head);
+  free(FS_STATE(sb)->igen);
+  free(FS_STATE(sb)->staged);
+  fs_blk_drain(sb);
+  free(sb);
+
+  return ret;
+}
+
+int fs_do_sync(struct superblock *sb) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_dirty_flush(sb) == -1 || fs_free_merge(sb) == -1) {
+    return -1;
+  }
+
+  return FS_STATE(sb)->trace != NULL ? fs_trace_flush(sb) : 0;
+}
+
+int fs_sync(struct superblock *sb) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SYNC);
+  int ret = fs_do_sync(sb);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_set_options(struct superblock *sb, uint64_t opts) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  struct fs_state *state = FS_STATE(sb);
+
+  // Leaving delayed allocation mode: nothing may stay buffered
+  if ((state->opts & FS_OPT_DELALLOC) && !(opts & FS_OPT_DELALLOC)) {
+    if (fs_dirty_flush(sb) == -1) {
+      return -1;
+    }
+  }
+
+  // Leaving sorted staging: staged blocks go back to the free list
+  if ((state->opts & FS_OPT_SORTFREE) && !(opts & FS_OPT_SORTFREE)) {
+    if (fs_free_merge(sb) == -1) {
+      return -1;
+    }
+  }
+
+  if ((opts & FS_OPT_SORTFREE) && state->staged == NULL) {
+    state->staged = (uint64_t*) malloc(FS_FREE_STAGE * sizeof(uint64_t));
+
+    if (state->staged == NULL) {
+      return -1;
+    }
+  }
+
+  // Statistics restart from zero whenever they are turned on
+  if (!(state->opts & FS_OPT_STATS) && (opts & FS_OPT_STATS)) {
+    memset(&state->stats, 0, sizeof(state->stats));
+  }
+
+  state->opts = opts;
+
+  return 0;
+}
+
+int fs_fsck(struct superblock *sb, int flags, int nthreads, struct fs_fsck_report *report) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  memset(report, 0, sizeof(*report));
+
+  // Buffered files, staged frees and cached table blocks must reach the
+  // image before it is walked
+  if (fs_dirty_flush(sb) == -1 || fs_free_merge(sb) == -1 || fs_tables_flush(sb) == -1) {
+    return -1;
+  }
+
+  char *map = fs_map(sb);
+
+  if (map == NULL) {
+    return -1;
+  }
+
+  // Let the kernel read the image ahead in large sequential chunks
+  posix_madvise(map, sb->blks * sb->blksz, POSIX_MADV_WILLNEED);
+
+  if (nthreads <= 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  nthreads = MAX(1, MIN(nthreads, FS_FSCK_MAX_THREADS));
+
+  struct fs_fsck ck;
+
+  memset(&ck, 0, sizeof(ck));
+  ck.sb = sb;
+  ck.map = map;
+  ck.first = fs_first_data_blk(sb);
+  ck.nthreads = nthreads;
+  ck.report = report;
+  ck.csums = fs_has_csum(sb) ? (const uint32_t*) (map + sb->cstable * sb->blksz) : NULL;
+  ck.refs = (uint32_t*) calloc(sb->blks, sizeof(uint32_t));
+  ck.free = (uint8_t*) calloc(sb->blks, sizeof(uint8_t));
+  ck.queues = (struct fs_fsck_queue*) calloc(nthreads, sizeof(struct fs_fsck_queue));
+
+  struct fs_fsck_worker *workers = (struct fs_fsck_worker*) calloc(nthreads, sizeof(struct fs_fsck_worker));
+
+  if (fs_has_itable(sb)) {
+    ck.irefs = (uint32_t*) calloc(sb->inodes, sizeof(uint32_t));
+    ck.ifree = (uint8_t*) calloc(sb->inodes, sizeof(uint8_t));
+  }
+
+  int ret = 0;
+
+  if (ck.refs == NULL || ck.free == NULL || ck.queues == NULL || workers == NULL
+      || (fs_has_itable(sb) && (ck.irefs == NULL || ck.ifree == NULL))) {
+    errno = ENOMEM;
+    ret = -1;
+    goto out;
+  }
+
+  for (int i=0; i<nthreads; i++) {
+    pthread_mutex_init(&ck.queues[i].lock, NULL);
+    workers[i].ck = &ck;
+    workers[i].id = i;
+  }
+
+  fs_fsck_push(&ck, 0, sb->root, SUPERBLOCK_BLK);
+
+  if (sb->snapshots != 0) {
+    fs_fsck_push(&ck, 0, sb->snapshots, SUPERBLOCK_BLK);
+  }
+
+  // The caller is worker 0; workers that fail to start are not needed
+  int started = 1;
+
+  while (started < nthreads && pthread_create(&workers[started].thread, NULL, fs_fsck_worker, &workers[started]) == 0) {
+    started++;
+  }
+
+  fs_fsck_worker(&workers[0]);
+
+  for (int i=1; i<started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (int i=0; i<nthreads; i++) {
+    pthread_mutex_destroy(&ck.queues[i].lock);
+    free(ck.queues[i].items);
+  }
+
+  if (ck.nomem) {
+    errno = ENOMEM;
+    ret = -1;
+    goto out;
+  }
+
+  if (fs_fsck_free_list(&ck) == -1) {
+    report->bad_free_lists++;
+  }
+
+  if (fs_has_itable(sb) && fs_fsck_inode_list(&ck) == -1) {
+    report->bad_free_lists++;
+  }
+
+  for (uint64_t blk=ck.first; blk<sb->blks; blk++) {
+    report->used += ck.refs[blk] > 0;
+    report->free += ck.free[blk];
+    report->leaked += ck.refs[blk] == 0 && !ck.free[blk];
+    report->used_free += ck.refs[blk] > 0 && ck.free[blk];
+  }
+
+  // Each extra reference to a block must be recorded in the table
+  const uint32_t *rc = fs_has_refcount(sb) ? (const uint32_t*) (map + sb->rctable * sb->blksz) : NULL;
+
+  for (uint64_t blk=0; rc != NULL && blk<sb->blks; blk++) {
+    uint32_t want = ck.refs[blk] > 0 ? ck.refs[blk] - 1 : 0;
+
+    report->bad_refcounts += rc[blk] != want;
+  }
+
+  // Only blocks in use may be linked to for their contents
+  const uint32_t *hash = fs_has_dedup(sb) ? rc + sb->rcblocks * sb->blksz / sizeof(uint32_t) : NULL;
+
+  for (uint64_t blk=0; hash != NULL && blk<sb->blks; blk++) {
+    report->bad_hashes += hash[blk] != 0 && ck.refs[blk] == 0;
+  }
+
+  // Inode table blocks hold inodes of many entities, so they are checked here
+  uint64_t itblks = fs_has_itable(sb) ? sb->inodes / (sb->blksz / FS_INODE_SIZE) : 0;
+
+  for (uint64_t blk=sb->itable; ck.csums != NULL && blk<sb->itable + itblks; blk++) {
+    fs_fsck_csum(&ck, blk, sb->blksz);
+  }
+
+  for (uint64_t ino=1; ck.irefs != NULL && ino<sb->inodes; ino++) {
+    report->used += ck.irefs[ino] > 0;
+    report->free += ck.ifree[ino];
+    report->leaked += ck.irefs[ino] == 0 && !ck.ifree[ino];
+    report->used_free += ck.irefs[ino] > 0 && ck.ifree[ino];
+  }
+
+  if ((flags & FS_FSCK_REPAIR) && (report->leaked || report->used_free || report->bad_free_lists)) {
+    // A defrag pass in progress would not know about the new free list
+    fs_defrag_end(sb);
+    ret = fs_fsck_rebuild(&ck);
+    report->repaired = (ret == 0);
+  }
+
+  if ((flags & FS_FSCK_REPAIR) && report->bad_refcounts && ret == 0) {
+    ret = fs_fsck_rebuild_rc(&ck);
+    report->repaired = (ret == 0);
+  }
+
+  if ((flags & FS_FSCK_REPAIR) && report->bad_hashes && ret == 0) {
+    ret = fs_fsck_rebuild_hashes(&ck);
+    report->repaired = (ret == 0);
+  }
+
+  // Rebuilt inode lists update the checksums of the inode table
+  if (report->repaired && fs_tables_flush(sb) == -1) {
+    ret = -1;
+  }
+
+out:
+  free(ck.refs);
+  free(ck.free);
+  free(ck.irefs);
+  free(ck.ifree);
+  free(ck.queues);
+  free(workers);
+
+  return ret;
+}
+
+int fs_defrag(struct superblock *sb, uint64_t budget) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  struct fs_state *state = FS_STATE(sb);
+  uint64_t nio = state->nio;
+
+  if (state->defrag == NULL && fs_defrag_start(sb) == -1) {
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (inode == NULL) {
+    return -1;
+  }
+
+  // The budget is checked between steps, each moving at most one file
+  while (budget == 0 || state->nio - nio < budget) {
+    uint64_t ino = fs_defrag_next(sb, inode);
+
+    if (ino == INVALID_BLOCK) {
+      fs_blk_free(sb, inode);
+      fs_defrag_end(sb);
+      return 0;
+    }
+
+    if (ino >= (fs_has_itable(sb) ? sb->inodes : sb->blks)) {
+      continue;
+    }
+
+    if (fs_read_inode(sb, ino, inode) == -1) {
+      fs_blk_free(sb, inode);
+      return -1;
+    }
+
+    // Entries of a directory changed since the walk got there are skipped
+    if (inode->parent != state->defrag->dir || (inode->mode & IMCHILD)) {
+      continue;
+    }
+
+    if (inode->mode == IMDIR) {
+      if (fs_defrag_push(state->defrag, ino) == -1) {
+        fs_blk_free(sb, inode);
+        return -1;
+      }
+    } else if (fs_defrag_file(sb, ino, inode) == -1) {
+      fs_blk_free(sb, inode);
+      return -1;
+    }
+  }
+
+  fs_blk_free(sb, inode);
+
+  return 1;
+}
+
+ssize_t fs_import(struct superblock *sb, const char *dname, const char *path, int nthreads) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name(dname)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  uint64_t dir = fs_find_blk(sb, dname);
+
+  if (dir == INVALID_BLOCK) {
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct fs_import_out out = {0, 0, MAX(FS_IMPORT_CHUNK, sb->blksz), NULL};
+  struct fs_import im;
+  uint64_t top = 0;
+  ssize_t ret = -1;
+
+  memset(&im, 0, sizeof(im));
+  im.sb = sb;
+  im.chunk = MAX(1, FS_IMPORT_CHUNK / sb->blksz);
+
+  if (inode == NULL || nodeinfo == NULL || fs_read_inode(sb, dir, inode) == -1) {
+    goto out;
+  }
+
+  if (inode->mode != IMDIR) {
+    errno = ENOTDIR;
+    goto out;
+  }
+
+  // The layout is taken straight off the free lists, so everything
+  // buffered or staged must be on them first, and a defrag pass restarts
+  if (fs_dirty_flush(sb) == -1 || fs_free_merge(sb) == -1) {
+    goto out;
+  }
+
+  fs_defrag_end(sb);
+
+  if (fs_import_scan(&im, path, INVALID_BLOCK) == -1) {
+    goto out;
+  }
+
+  top = im.n;
+
+  for (uint64_t i=0; i<im.n; i++) {
+    if (im.entries[i].dir && fs_import_scan(&im, im.entries[i].path, i) == -1) {
+      goto out;
+    }
+  }
+
+  for (uint64_t i=0; i<top; i++) {
+    char *name = (char*) malloc(strlen(dname) + strlen(im.entries[i].name) + 2);
+
+    sprintf(name, "%s%s%s", dname, strlen(dname) > 1 ? DIR_DELIM_STR : "", im.entries[i].name);
+
+    uint64_t blk = fs_find_blk(sb, name);
+    free(name);
+
+    if (blk != INVALID_BLOCK) {
+      errno = EEXIST;
+      goto out;
+    }
+
+    if (errno != ENOENT) {
+      goto out;
+    }
+  }
+
+  uint64_t growth = fs_import_dir_growth(sb, dir, top);
+  char *map = growth == INVALID_BLOCK ? NULL : fs_map(sb);
+
+  if (map == NULL || fs_import_layout(&im, map, growth) == -1) {
+    goto out;
+  }
+
+  if (fs_has_dcsum(sb) && (im.csums = (uint32_t*) calloc(im.nblks, sizeof(uint32_t))) == NULL) {
+    goto out;
+  }
+
+  // File contents go first, straight from the worker threads; nothing
+  // points at them until the metadata is written
+  if (nthreads <= 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  nthreads = MAX(1, MIN(nthreads, FS_IMPORT_MAX_THREADS));
+
+  pthread_t workers[FS_IMPORT_MAX_THREADS];
+  int started = 1;
+
+  while (started < nthreads && pthread_create(&workers[started], NULL, fs_import_worker, &im) == 0) {
+    started++;
+  }
+
+  fs_import_worker(&im);
+
+  for (int i=1; i<started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (uint64_t i=0; i<im.n; i++) {
+    struct fs_import_entry *e = &im.entries[i];
+
+    for (uint64_t j=0; !e->dir && j<fs_import_nlinks(&im, e); ) {
+      uint64_t run = fs_import_run(&im, e, j);
+      size_t sz = MIN(run * sb->blksz, e->size - j * sb->blksz);
+
+      FS_STATE(sb)->nio++;
+      FS_STAT_ADD(sb, writes, 1);
+      FS_STAT_ADD(sb, bytes_written, sz);
+      FS_STAT_ADD(sb, syscalls, 1);
+
+      if (FS_STATE(sb)->trace != NULL) {
+        fs_trace_add(sb, FS_TRACE_WRITE, im.blks[e->blk + j], sz);
+      }
+
+      j += run;
+    }
+  }
+
+  if (im.err != 0) {
+    errno = im.err;
+    fs_import_restore(&im);
+    goto out;
+  }
+
+  for (uint64_t k=0; im.csums != NULL && k<im.nblks; k++) {
+    if (im.csums[k] != 0 && fs_csum_put(sb, im.blks[k], im.csums[k]) == -1) {
+      fs_import_restore(&im);
+      goto out;
+    }
+  }
+
+  out.buf = (char*) malloc(out.cap);
+
+  if (out.buf == NULL) {
+    fs_import_restore(&im);
+    goto out;
+  }
+
+  for (uint64_t i=0; i<im.n; i++) {
+    if (fs_import_meta(&im, &out, &im.entries[i], dir, inode, nodeinfo) == -1) {
+      fs_import_restore(&im);
+      goto out;
+    }
+  }
+
+  if (fs_import_flush(sb, &out) == -1) {
+    fs_import_restore(&im);
+    goto out;
+  }
+
+  // The inode table was written around the cache
+  FS_STATE(sb)->icache_blk = 0;
+
+  sb->freelist = im.rest;
+  sb->freeblks -= im.nblks;
+  FS_STAT_ADD(sb, blk_allocs, im.nblks);
+
+  if (fs_has_itable(sb)) {
+    sb->ifree = im.irest;
+    sb->nifree -= im.ninos;
+    FS_STAT_ADD(sb, inode_allocs, im.ninos);
+  }
+
+  if (fs_write_sb(sb) == -1) {
+    goto out;
+  }
+
+  for (uint64_t i=0; i<top; i++) {
+    if (fs_link_blk(sb, dir, im.entries[i].ino) == -1) {
+      goto out;
+    }
+  }
+
+  if (fs_tables_flush(sb) == -1) {
+    goto out;
+  }
+
+  ret = (ssize_t) im.n;
+
+out:
+  for (uint64_t i=0; i<im.n; i++) {
+    free(im.entries[i].path);
+    free(im.entries[i].data);
+  }
+
+  if (im.inos != im.blks) {
+    free(im.inos);
+  }
+
+  free(im.blks);
+  free(im.entries);
+  free(im.csums);
+  free(out.buf);
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
+}
+
+ssize_t fs_export_tar(struct superblock *sb, const char *dname, int fd) {
+  if (fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  return fs_export_tree(sb, dname, fd, NULL);
+}
+
+ssize_t fs_export_dir(struct superblock *sb, const char *dname, const char *path) {
+  return fs_export_tree(sb, dname, -1, path);
+}
+
+int fs_trace(struct superblock *sb, const char *fname) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  struct fs_state *state = FS_STATE(sb);
+
+  if (fs_trace_stop(sb) == -1) {
+    return -1;
+  }
+
+  if (fname == NULL) {
+    return 0;
+  }
+
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct fs_trace_header header = {FS_TRACE_MAGIC, sb->blksz};
+  struct fs_trace_rec *ring = (struct fs_trace_rec*) malloc(FS_TRACE_RING * sizeof(struct fs_trace_rec));
+
+  if (ring == NULL || write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header)) {
+    free(ring);
+    close(fd);
+    return -1;
+  }
+
+  state->trace = ring;
+  state->ntrace = 0;
+  state->trace_fd = fd;
+
+  return 0;
+}
+
+int fs_get_stats(struct superblock *sb, struct fs_stats *stats) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  memcpy(stats, &FS_STATE(sb)->stats, sizeof(*stats));
+
+  return 0;
+}
+
+uint64_t fs_do_get_block(struct superblock *sb) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return INVALID_BLOCK;
+  }
+
+  // Blocks promised to buffered files are not free to hand out
+  if (!fs_has_space(sb, 1, 0))
+    return 0;
+
+  if (sb->freeblks == 0 && fs_free_merge(sb) == -1)
+    return INVALID_BLOCK;
+
+  if (sb->freeblks == 0) 
+    return 0;
+
+  struct freepage* freepage = (struct freepage*) fs_blk_alloc(sb);
+
+  if (freepage == NULL) 
+    return INVALID_BLOCK;
+
+  if (fs_read_blk(sb, sb->freelist, (void *) freepage) == -1) {
+    fs_blk_free(sb, freepage);
+    return INVALID_BLOCK;
+  }
+
+  uint64_t block = sb->freelist;
+
+  sb->freeblks--;
+  sb->freelist = freepage->next;
+
+  if (FS_STATE(sb)->defrag != NULL) {
+    FS_STATE(sb)->defrag->free[block] = 0;
+  }
+
+  FS_STAT_ADD(sb, blk_allocs, 1);
+
+  if (fs_write_sb(sb) == -1) {
+    fs_blk_free(sb, freepage);
+    return INVALID_BLOCK;
+  }
+
+  fs_blk_free(sb, freepage);
+
+  return block;
+}
+
+uint64_t fs_get_block(struct superblock *sb) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_GET_BLOCK);
+  uint64_t ret = fs_do_get_block(sb);
+
+  // The block is left for fs_fsck if its checksums did not make it
+  if (fs_call_end(sb, t0, ret == 0 || ret == INVALID_BLOCK, 0) == -1) {
+    ret = INVALID_BLOCK;
+  }
+
+  return ret;
+}
+
+int fs_do_put_block(struct superblock *sb, uint64_t block) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  // Its contents are no longer there to be linked to
+  if (fs_has_dedup(sb) && block < sb->blks && fs_dd_set(sb, block, 0) == -1) {
+    return -1;
+  }
+
+  // A defrag pass keeps the free list sorted
+  if (FS_STATE(sb)->defrag != NULL) {
+    FS_STAT_ADD(sb, blk_frees, 1);
+    return fs_free_insert(sb, block);
+  }
+
+  // Sorted staging defers the free list update to fs_free_merge
+  if (FS_STATE(sb)->opts & FS_OPT_SORTFREE) {
+    FS_STATE(sb)->staged[FS_STATE(sb)->nstaged++] = block;
+    FS_STAT_ADD(sb, blk_frees, 1);
+    return FS_STATE(sb)->nstaged < FS_FREE_STAGE ? 0 : fs_free_merge(sb);
+  }
+
+  struct freepage* freepage = (struct freepage*) fs_blk_alloc(sb);
+
+  if (freepage == NULL) 
+    return -1;
+
+  freepage->count = 0;
+  freepage->next = sb->freelist;
+
+  sb->freelist = block;
+  sb->freeblks++;
+
+  FS_STAT_ADD(sb, blk_frees, 1);
+
+  if (fs_write_blk(sb, block, (void *) freepage) == -1 \
+  || fs_write_sb(sb) == -1) {
+    fs_blk_free(sb, freepage);
+    return -1;
+  }
+
+  fs_blk_free(sb, freepage);
+
+  return 0;
+}
+
+int fs_put_block(struct superblock *sb, uint64_t block) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_PUT_BLOCK);
+  int ret = fs_do_put_block(sb, block);
+  ret = ret == 0 ? fs_tables_flush(sb) : ret;
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_write_file(struct superblock *sb, const struct fs_dir *at, const char *fname, char *buf, size_t cnt) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name_at(at, fname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (fs_is_rdonly_at(sb, at, fname)) {
+    return -1;
+  }
+
+  struct fs_state *state = FS_STATE(sb);
+
+  struct fs_walk w;
+
+  if (fs_walk(sb, at, fname, &w) == -1 && w.parent == INVALID_BLOCK) {
+    // Only a stale handle fails before naming anything
+    errno = errno == ENOENT && w.namelen != 0 ? ENOTDIR : errno;
+    return -1;
+  }
+
+  int inline_data = cnt <= fs_inline_max_size(sb, w.namelen);
+
+  uint64_t used_blocks = 0;
+  uint64_t needed_blocks = inline_data ? 0 : CEIL(cnt, sb->blksz);
+
+  // Inode and nodeinfo of a file that does not exist yet
+  uint64_t meta_blocks = 0;
+  // Blocks shared with other files are copied before being written, and
+  // holes need new blocks
+  uint64_t rewrite_blocks = 0;
+
+  uint64_t block = w.blk;
+
+  // If file already exists
+  if (block != INVALID_BLOCK) {
+    struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+    if (fs_read_inode(sb, block, inode) == -1) {
+      fs_blk_free(sb, inode);
+      return -1;
+    }
+
+    if (!(inode->mode & IMREG)) {
+      fs_blk_free(sb, inode);
+      errno = EISDIR;
+      return -1;
+    }
+
+    struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+    if (fs_read_info(sb, inode, nodeinfo) == -1) {
+      fs_blk_free(sb, inode);
+      fs_blk_free(sb, nodeinfo);
+      return -1;
+    }
+
+    used_blocks = fs_data_blocks(sb, inode, nodeinfo);
+    rewrite_blocks = fs_rewrite_blocks(sb, inode, MIN(used_blocks, needed_blocks), NULL, NULL, NULL);
+
+    fs_blk_free(sb, inode);
+    fs_blk_free(sb, nodeinfo);
+  } else {
+    if (w.namelen >= fs_nodeinfo_max_name_size(sb)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    meta_blocks = fs_meta_blocks(sb);
+  }
+
+  uint64_t used_child_blocks = fs_child_inodes(sb, used_blocks);
+  uint64_t needed_child_blocks = fs_child_inodes(sb, needed_blocks);
+
+  uint64_t real_needed_blocks = (needed_blocks > used_blocks ? needed_blocks - used_blocks : 0) + rewrite_blocks;
+  uint64_t real_needed_child_blocks = needed_child_blocks > used_child_blocks ? needed_child_blocks - used_child_blocks : 0;
+
+  // Space promised to this file's buffered contents is available again
+  struct fs_dirty *dirty = fs_dirty_find(sb, block);
+
+  if (dirty != NULL) {
+    state->reserved -= dirty->reserved;
+    state->ireserved -= dirty->ireserved;
+  }
+
+  int has_space = fs_has_space(sb, real_needed_blocks, meta_blocks + real_needed_child_blocks);
+
+  if (dirty != NULL) {
+    state->reserved += dirty->reserved;
+    state->ireserved += dirty->ireserved;
+  }
+
+  if (!has_space) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  // If block not exists
+  if (block == INVALID_BLOCK) {
+    block = fs_create_node(sb, w.parent, w.name, w.namelen, IMREG);
+
+    if (block == INVALID_BLOCK) {
+      return -1;
+    }
+  }
+
+  // Inline contents need no allocation, so there is nothing to delay
+  if ((state->opts & FS_OPT_DELALLOC) && !inline_data) {
+    return fs_dirty_set(sb, block, buf, cnt, real_needed_blocks, real_needed_child_blocks);
+  }
+
+  fs_dirty_drop(sb, block);
+
+  return fs_write_data(sb, block, buf, cnt, NULL, 0);
+}
+
+int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_WRITE_FILE);
+  int ret = fs_do_write_file(sb, NULL, fname, buf, cnt);
+
+  if (fs_call_end(sb, t0, ret < 0, ret < 0 ? 0 : cnt) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_write_fileat(struct superblock *sb, const struct fs_dir *at, const char *fname, char *buf, size_t cnt) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_WRITE_FILE);
+  int ret = fs_do_write_file(sb, fs_at(sb, at, &root), fname, buf, cnt);
+
+  if (fs_call_end(sb, t0, ret < 0, ret < 0 ? 0 : cnt) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+ssize_t fs_do_read_file(struct superblock *sb, const struct fs_dir *at, const char *fname, char *buf, size_t bufsz) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (bufsz == 0) {
+    return 0;
+  }
+
+  if (fs_is_invalid_name_at(at, fname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  uint64_t block = fs_find_blk_at(sb, at, fname);
+
+  if (block == INVALID_BLOCK) {
+    errno = errno == EIO ? EIO : ENOENT;
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, block, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  if (!(inode->mode & IMREG)) {
+    fs_blk_free(sb, inode);
+    errno = EISDIR;
+    return -1;
+  }
+
+  // Contents not flushed yet are served from memory
+  struct fs_dirty *dirty = fs_dirty_find(sb, block);
+
+  if (dirty != NULL) {
+    fs_blk_free(sb, inode);
+    memcpy(buf, dirty->data, MIN(dirty->cnt, bufsz));
+    return MIN(dirty->cnt, bufsz);
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, nodeinfo);
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  uint64_t size = nodeinfo->size;
+  uint64_t nbytes = MIN(size, bufsz);
+
+  if (inode->mode & IMINLINE) {
+    memcpy(buf, fs_inline_data(nodeinfo), nbytes);
+    fs_blk_free(sb, nodeinfo);
+    fs_blk_free(sb, inode);
+    return nbytes;
+  }
+
+  fs_blk_free(sb, nodeinfo);
+
+  if (inode->mode & IMCOMP) {
+    char *map = fs_map(sb);
+    int ret = map == NULL ? -1 : fs_comp_read(sb, map, inode, size, 0, nbytes, buf);
+    fs_blk_free(sb, inode);
+    return ret == -1 ? -1 : (ssize_t) nbytes;
+  }
+
+  uint64_t nlinks = CEIL(nbytes, sb->blksz);
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<nlinks; j++) {
+    if (j - base == cap) {
+      if (fs_read_inode(sb, inode->next, inode) == -1) {
+        fs_blk_free(sb, inode);
+        return -1;
+      }
+
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    uint64_t blk = inode->links[j - base];
+    uint64_t n = (j < nlinks - 1) ? sb->blksz : nbytes - j * sb->blksz;
+
+    // Holes are not read at all
+    if (blk == INVALID_BLOCK) {
+      memset(buf + j * sb->blksz, 0, n);
+      continue;
+    }
+
+    if (!fs_has_dcsum(sb)) {
+      fs_read_blk_sz(sb, blk, buf + j * sb->blksz, n);
+      continue;
+    }
+
+    // The checksum covers all the file bytes the block holds
+    uint64_t stored = MIN(sb->blksz, size - j * sb->blksz);
+    char *data = n < stored ? (char*) fs_blk_alloc(sb) : buf + j * sb->blksz;
+    int ret = fs_read_blk_sz(sb, blk, data, stored) == -1 ? -1 : fs_csum_check(sb, blk, data, stored);
+
+    if (n < stored) {
+      memcpy(buf + j * sb->blksz, data, n);
+      fs_blk_free(sb, data);
+    }
+
+    if (ret == -1) {
+      fs_blk_free(sb, inode);
+      return -1;
+    }
+  }
+
+  fs_blk_free(sb, inode);
+  
+  return nbytes;
+}
+
+ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_READ_FILE);
+  ssize_t ret = fs_do_read_file(sb, NULL, fname, buf, bufsz);
+
+  if (fs_call_end(sb, t0, ret < 0, ret < 0 ? 0 : ret) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+ssize_t fs_read_fileat(struct superblock *sb, const struct fs_dir *at, const char *fname, char *buf, size_t bufsz) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_READ_FILE);
+  ssize_t ret = fs_do_read_file(sb, fs_at(sb, at, &root), fname, buf, bufsz);
+
+  if (fs_call_end(sb, t0, ret < 0, ret < 0 ? 0 : ret) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+struct fs_view * fs_do_read_view(struct superblock *sb, const char *fname, uint64_t offset, size_t len) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return NULL;
+  }
+
+  if (fs_is_invalid_name(fname)) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  uint64_t block = fs_find_blk(sb, fname);
+
+  if (block == INVALID_BLOCK) {
+    errno = errno == EIO ? EIO : ENOENT;
+    return NULL;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, block, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return NULL;
+  }
+
+  if (!(inode->mode & IMREG)) {
+    fs_blk_free(sb, inode);
+    errno = EISDIR;
+    return NULL;
+  }
+
+  // Contents not in the image yet are copied, like inline data below
+  struct fs_dirty *dirty = fs_dirty_find(sb, block);
+
+  if (dirty != NULL) {
+    fs_blk_free(sb, inode);
+    offset = MIN(offset, dirty->cnt);
+    return fs_view_copy(dirty->data + offset, MIN(len, dirty->cnt - offset));
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, nodeinfo);
+    fs_blk_free(sb, inode);
+    return NULL;
+  }
+
+  offset = MIN(offset, nodeinfo->size);
+  len = MIN(len, nodeinfo->size - offset);
+
+  if ((inode->mode & IMINLINE) || len == 0) {
+    char *data = (inode->mode & IMINLINE) ? fs_inline_data(nodeinfo) + offset : NULL;
+    struct fs_view *view = fs_view_copy(data, data ? len : 0);
+    fs_blk_free(sb, nodeinfo);
+    fs_blk_free(sb, inode);
+    return view;
+  }
+
+  uint64_t size = nodeinfo->size;
+
+  fs_blk_free(sb, nodeinfo);
+
+  char *map = fs_map(sb);
+
+  if (map == NULL) {
+    fs_blk_free(sb, inode);
+    return NULL;
+  }
+
+  // Compressed data has no bytes in the image to point at
+  if (inode->mode & IMCOMP) {
+    char *data = (char*) malloc(len);
+    struct fs_view *view = NULL;
+
+    if (data != NULL && fs_comp_read(sb, map, inode, size, offset, len, data) == 0) {
+      view = fs_view_copy(data, len);
+    }
+
+    free(data);
+    fs_blk_free(sb, inode);
+    return view;
+  }
+
+  uint64_t first = offset / sb->blksz;
+  uint64_t last = (offset + len - 1) / sb->blksz;
+
+  // At worst one iovec per block; adjacent blocks share one
+  uint64_t n = last - first + 1;
+  struct fs_view *view = (struct fs_view*) calloc(1, sizeof(struct fs_view) + n * (sizeof(struct iovec) + sizeof(uint64_t)));
+
+  if (view == NULL) {
+    fs_blk_free(sb, inode);
     return NULL;
   }
 
+  view->iov = (struct iovec*) (view + 1);
+  view->off = (uint64_t*) (view->iov + n);
+  view->len = len;
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+  uint64_t prev = INVALID_BLOCK;
+  int holes = 0;
+
+  for (uint64_t j=0; j<=last; j++) {
+    if (j - base == cap) {
+      if (fs_read_inode(sb, inode->next, inode) == -1) {
+        free(view);
+        fs_blk_free(sb, inode);
+        return NULL;
+      }
+
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    if (j < first) {
+      continue;
+    }
+
+    uint64_t blk = inode->links[j - base];
+
+    // Holes have no bytes in the image either
+    if (blk == INVALID_BLOCK) {
+      holes = 1;
+      break;
+    }
+
+    // The view points at the blocks, so they are checked up front
+    if (fs_has_dcsum(sb) && fs_csum_map_check(sb, map, blk, MIN(sb->blksz, size - j * sb->blksz)) == -1) {
+      free(view);
+      fs_blk_free(sb, inode);
+      return NULL;
+    }
+
+    uint64_t start = (j == first) ? offset % sb->blksz : 0;
+    uint64_t end = (j == last) ? (offset + len - 1) % sb->blksz + 1 : sb->blksz;
+
+    if (prev != INVALID_BLOCK && blk == prev + 1) {
+      view->iov[view->iovcnt - 1].iov_len += end - start;
+    } else {
+      view->iov[view->iovcnt].iov_base = map + blk * sb->blksz + start;
+      view->iov[view->iovcnt].iov_len = end - start;
+      view->off[view->iovcnt] = blk * sb->blksz + start;
+      view->iovcnt++;
+    }
+
+    prev = blk;
+  }
+
+  fs_blk_free(sb, inode);
+
+  if (holes) {
+    char *data = (char*) malloc(len);
+
+    free(view);
+    view = NULL;
+
+    if (data != NULL && fs_map_read(sb, map, fs_map_inode(sb, map, block), size, offset, len, data) == 0) {
+      view = fs_view_copy(data, len);
+    }
+
+    free(data);
+  }
+
+  return view;
+}
+
+struct fs_view * fs_read_view(struct superblock *sb, const char *fname, uint64_t offset, size_t len) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_READ_VIEW);
+  struct fs_view *ret = fs_do_read_view(sb, fname, offset, len);
+
+  if (fs_call_end(sb, t0, ret == NULL, ret == NULL ? 0 : ret->len) == -1) {
+    fs_release_view(ret);
+    ret = NULL;
+  }
+
+  return ret;
+}
+
+void fs_release_view(struct fs_view *view) {
+  if (view == NULL) {
+    return;
+  }
+
+  free(view->copy);
+  free(view);
+}
+
+/* Offset of the first byte of =fname at or after =offset that is data (if
+ * =data is set) or in a hole. */
+ssize_t fs_do_seek(struct superblock *sb, const char *fname, uint64_t offset, int data) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name(fname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  uint64_t block = fs_find_blk(sb, fname);
+
+  if (block == INVALID_BLOCK) {
+    errno = errno == EIO ? EIO : ENOENT;
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, block, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  if (!(inode->mode & IMREG)) {
+    fs_blk_free(sb, inode);
+    errno = EISDIR;
+    return -1;
+  }
+
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, nodeinfo);
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  uint64_t size = nodeinfo->size;
+
+  fs_blk_free(sb, nodeinfo);
+
+  // Contents not in the image yet have no holes
+  struct fs_dirty *dirty = fs_dirty_find(sb, block);
+
+  if (dirty != NULL) {
+    size = dirty->cnt;
+  }
+
+  if (offset >= size) {
+    fs_blk_free(sb, inode);
+    errno = ENXIO;
+    return -1;
+  }
+
+  if (dirty != NULL || (inode->mode & IMINLINE)) {
+    fs_blk_free(sb, inode);
+    return data ? (ssize_t) offset : (ssize_t) size;
+  }
+
+  // A compressed chunk is a hole as a whole, if its first slot is empty
+  uint64_t cblks = (inode->mode & IMCOMP) ? fs_chunk_blocks(sb) : 1;
+  uint64_t nlinks = CEIL(size, sb->blksz);
+  ssize_t ret = data ? -1 : (ssize_t) size;
+  int hole = 0;
+
+  // =inode holds the file's links [base, base + cap)
+  uint64_t base = 0;
+  uint64_t cap = fs_inode_first_links(sb);
+
+  for (uint64_t j=0; j<nlinks; j++) {
+    if (j - base == cap) {
+      if (fs_read_inode(sb, inode->next, inode) == -1) {
+        fs_blk_free(sb, inode);
+        return -1;
+      }
+
+      base = j;
+      cap = fs_inode_max_links(sb);
+    }
+
+    if (j % cblks == 0) {
+      hole = inode->links[j - base] == INVALID_BLOCK;
+    }
+
+    if ((j + 1) * sb->blksz > offset && hole != data) {
+      ret = (ssize_t) MAX(offset, j * sb->blksz);
+      break;
+    }
+  }
+
+  fs_blk_free(sb, inode);
+
+  if (ret == -1) {
+    errno = ENXIO;
+  }
+
+  return ret;
+}
+
+ssize_t fs_seek_data(struct superblock *sb, const char *fname, uint64_t offset) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SEEK);
+  ssize_t ret = fs_do_seek(sb, fname, offset, 1);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+ssize_t fs_seek_hole(struct superblock *sb, const char *fname, uint64_t offset) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SEEK);
+  ssize_t ret = fs_do_seek(sb, fname, offset, 0);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_stat(struct superblock *sb, const char *name, struct fs_stat *st) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name(name)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  uint64_t block = fs_find_blk(sb, name);
+
+  if (block == INVALID_BLOCK) {
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, block, inode) == -1 || fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, inode);
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  st->ino = block;
+  st->mode = inode->mode & (IMREG | IMDIR);
+  st->size = nodeinfo->size;
+  st->blocks = (inode->mode & IMREG) ? fs_data_blocks(sb, inode, nodeinfo) : 0;
+
+  if ((inode->mode & IMCOMP) || fs_has_sparse(sb)) {
+    st->blocks -= fs_hole_blocks(sb, inode, st->blocks);
+  }
+
+  // Buffered contents have no blocks yet
+  struct fs_dirty *dirty = fs_dirty_find(sb, block);
+
+  if (dirty != NULL) {
+    st->size = dirty->cnt;
+    st->blocks = 0;
+  }
+
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return 0;
+}
+
+int fs_stat(struct superblock *sb, const char *name, struct fs_stat *st) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_STAT);
+  int ret = fs_do_stat(sb, name, st);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_opendir(struct superblock *sb, const struct fs_dir *at, const char *dname, struct fs_dir *dir) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name_at(at, dname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  uint64_t blk = fs_find_blk_at(sb, at, dname);
+
+  if (blk == INVALID_BLOCK) {
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, blk, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  int ret = 0;
+
+  if (inode->mode != IMDIR) {
+    errno = ENOTDIR;
+    ret = -1;
+  } else {
+    dir->blk = blk;
+    dir->meta = inode->meta;
+    dir->gen = fs_igen(sb, blk);
+    dir->flags = (at != NULL && *dname != DIR_DELIM_CHR) ? at->flags : 0;
+  }
+
+  fs_blk_free(sb, inode);
+
+  return ret;
+}
+
+int fs_opendir(struct superblock *sb, const char *dname, struct fs_dir *dir) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_OPENDIR);
+  int ret = fs_do_opendir(sb, NULL, dname, dir);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_opendirat(struct superblock *sb, const struct fs_dir *at, const char *dname, struct fs_dir *dir) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_OPENDIR);
+  int ret = fs_do_opendir(sb, fs_at(sb, at, &root), dname, dir);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_unlink(struct superblock *sb, const struct fs_dir *at, const char *fname) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fs_is_invalid_name_at(at, fname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (fs_is_rdonly_at(sb, at, fname)) {
+    return -1;
+  }
+
+  uint64_t block = fs_find_blk_at(sb, at, fname);
+
+  if (block == INVALID_BLOCK) {
+    errno = errno == EIO ? EIO : ENOENT;
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, block, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
+
+  if (!(inode->mode & IMREG)) {
+    fs_blk_free(sb, inode);
+    errno = EISDIR;
+    return -1;
+  }
+
+  int ret = fs_unlink_blk(sb, inode->parent, block);
+
+  if (ret == 0) {
+    fs_dirty_drop(sb, block);
+    ret = fs_free_node(sb, block, inode);
+  }
+
+  fs_blk_free(sb, inode);
+
+  return ret;
+}
+
+int fs_unlink(struct superblock *sb, const char *fname) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_UNLINK);
+  int ret = fs_do_unlink(sb, NULL, fname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_unlinkat(struct superblock *sb, const struct fs_dir *at, const char *fname) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_UNLINK);
+  int ret = fs_do_unlink(sb, fs_at(sb, at, &root), fname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_mkdir(struct superblock *sb, const struct fs_dir *at, const char *dname) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
-    flock(fd, LOCK_UN);
-    close(fd);
-    free(sb);
     errno = EBADF;
-    return NULL;
+    return -1;
   }
 
-  sb->fd = fd;
+  if (fs_is_invalid_name_at(at, dname)) {
+    errno = ENOTDIR;
+    return -1;
+  }
 
-  return sb;
+  if (fs_is_rdonly_at(sb, at, dname)) {
+    return -1;
+  }
+
+  if (!fs_has_space(sb, 0, fs_meta_blocks(sb))) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  struct fs_walk w;
+
+  if (fs_walk(sb, at, dname, &w) == 0) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  if (w.parent == INVALID_BLOCK) {
+    // Only a stale handle fails before naming anything
+    errno = errno == ENOENT && w.namelen != 0 ? ENOTDIR : errno;
+    return -1;
+  }
+
+  if (w.namelen >= fs_nodeinfo_max_name_size(sb)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (fs_create_node(sb, w.parent, w.name, w.namelen, IMDIR) == INVALID_BLOCK) {
+    return -1;
+  }
+
+  return 0;
 }
 
-int fs_close(struct superblock *sb) {
+int fs_mkdir(struct superblock *sb, const char *dname) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_MKDIR);
+  int ret = fs_do_mkdir(sb, NULL, dname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_mkdirat(struct superblock *sb, const struct fs_dir *at, const char *dname) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_MKDIR);
+  int ret = fs_do_mkdir(sb, fs_at(sb, at, &root), dname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+int fs_do_rmdir(struct superblock *sb, const char *dname) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
     errno = EBADF;
     return -1;
   }
 
-  flock(sb->fd, LOCK_UN);
-  close(sb->fd);
+  if (fs_is_invalid_name(dname)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  uint64_t blk = fs_find_blk(sb, dname);
+
+  if (blk == INVALID_BLOCK) {
+    errno = errno == EIO ? EIO : EEXIST;
+    return -1;
+  }
+
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, blk, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
+  }
   
-  free(sb);
+  if (inode->mode != IMDIR) {
+    fs_blk_free(sb, inode);
+    errno = ENOTDIR;
+    return -1;
+  }
+  
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
 
-  return 0;
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, inode);
+    fs_blk_free(sb, nodeinfo);
+    return -1;
+  }
+
+  if (nodeinfo->size > 0) {
+    fs_blk_free(sb, inode);
+    fs_blk_free(sb, nodeinfo);
+    errno = ENOTEMPTY;
+    return -1;
+  }
+
+  int ret = fs_unlink_blk(sb, inode->parent, blk);
+
+  if (ret == 0) {
+    ret = fs_free_node(sb, blk, inode);
+  }
+
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret;
 }
 
-uint64_t fs_get_block(struct superblock *sb) {
+int fs_rmdir(struct superblock *sb, const char *dname) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_RMDIR);
+  int ret = fs_do_rmdir(sb, dname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/* Whether directory =dir is =blk or lies below it, or -1 if one of the
+ * directories in between cannot be read. */
+int fs_is_below(struct superblock *sb, uint64_t dir, uint64_t blk) {
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  int below = 0;
+
+  while (!below && dir != sb->root) {
+    below = dir == blk;
+
+    if (fs_read_inode(sb, dir, inode) == -1) {
+      below = -1;
+      break;
+    }
+
+    dir = inode->parent;
+  }
+
+  fs_blk_free(sb, inode);
+
+  return below;
+}
+
+int fs_do_rename(struct superblock *sb, const char *oldname, const char *newname) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
     errno = EBADF;
-    return INVALID_BLOCK;
+    return -1;
   }
 
-  if (sb->freeblks == 0) 
+  if (fs_is_invalid_name(oldname) || fs_is_invalid_name(newname)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  struct fs_walk from, to;
+
+  if (fs_walk(sb, NULL, oldname, &from) == -1) {
+    return -1;
+  }
+
+  if (from.blk == sb->root) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (fs_walk(sb, NULL, newname, &to) == -1 && errno != ENOENT) {
+    return -1;
+  }
+
+  if (to.blk == from.blk) {
     return 0;
+  }
 
-  struct freepage* freepage = (struct freepage*) malloc(sb->blksz);
+  if (to.blk == sb->root) {
+    errno = EBUSY;
+    return -1;
+  }
 
-  if (freepage == NULL) 
-    return INVALID_BLOCK;
+  if (to.parent == INVALID_BLOCK) {
+    errno = ENOTDIR;
+    return -1;
+  }
 
-  if (fs_read_blk(sb, sb->freelist, (void *) freepage) == -1) {
-    free(freepage);
-    return INVALID_BLOCK;
+  if (to.namelen >= fs_nodeinfo_max_name_size(sb)) {
+    errno = ENAMETOOLONG;
+    return -1;
   }
 
-  uint64_t block = sb->freelist;
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct inode *target = (struct inode*) fs_blk_alloc(sb);
+  char *tmp = (char*) fs_blk_alloc(sb);
+  int ret = -1;
 
-  sb->freeblks--;
-  sb->freelist = freepage->next;
+  if (fs_read_inode(sb, from.blk, inode) == -1 || fs_read_info(sb, inode, nodeinfo) == -1) {
+    goto out;
+  }
 
-  if (fs_write_blk(sb, SUPERBLOCK_BLK, (void *) sb) == -1) {
-    free(freepage);
-    return INVALID_BLOCK;
+  int below = inode->mode == IMDIR ? fs_is_below(sb, to.parent, from.blk) : 0;
+
+  if (below != 0) {
+    errno = below == -1 ? errno : EINVAL;
+    goto out;
   }
 
-  free(freepage);
+  if (to.blk != INVALID_BLOCK) {
+    if (fs_read_inode(sb, to.blk, target) == -1 || fs_read_info(sb, target, (struct nodeinfo*) tmp) == -1) {
+      goto out;
+    }
+
+    if (inode->mode == IMDIR && target->mode != IMDIR) {
+      errno = ENOTDIR;
+      goto out;
+    }
+
+    if (inode->mode != IMDIR && target->mode == IMDIR) {
+      errno = EISDIR;
+      goto out;
+    }
+
+    if (target->mode == IMDIR && ((struct nodeinfo*) tmp)->size > 0) {
+      errno = ENOTEMPTY;
+      goto out;
+    }
+  }
+
+  // Inline data follows the name, so a longer name may push it out
+  uint64_t moved_blocks = 0;
+
+  if ((inode->mode & IMINLINE) && nodeinfo->size > fs_inline_max_size(sb, to.namelen)) {
+    moved_blocks = CEIL(nodeinfo->size, sb->blksz);
+
+    if (!fs_has_space(sb, moved_blocks, to.blk == INVALID_BLOCK ? 1 : 0)) {
+      errno = ENOSPC;
+      goto out;
+    }
+  }
+
+  // The new name is published before the old one goes away, and an
+  // existing target is replaced in place
+  if (to.blk != INVALID_BLOCK) {
+    if (fs_relink_blk(sb, to.parent, to.blk, from.blk) == -1 || fs_unlink_blk(sb, inode->parent, from.blk) == -1) {
+      goto out;
+    }
+  } else if (to.parent != inode->parent) {
+    if (fs_link_blk(sb, to.parent, from.blk) == -1 || fs_unlink_blk(sb, inode->parent, from.blk) == -1) {
+      goto out;
+    }
+  }
+
+  if (moved_blocks > 0) {
+    memcpy(tmp, fs_inline_data(nodeinfo), nodeinfo->size);
+  } else if (inode->mode & IMINLINE) {
+    memmove(nodeinfo->name + to.namelen + 1, fs_inline_data(nodeinfo), nodeinfo->size);
+  }
+
+  memcpy(nodeinfo->name, to.name, to.namelen);
+  nodeinfo->name[to.namelen] = '\0';
+  inode->parent = to.parent;
+
+  ret = fs_write_meta(sb, from.blk, inode, nodeinfo);
+
+  if (to.blk != INVALID_BLOCK) {
+    fs_dirty_drop(sb, to.blk);
+
+    if (fs_free_node(sb, to.blk, target) == -1) {
+      ret = -1;
+    }
+  }
+
+  if (ret == 0 && moved_blocks > 0) {
+    ret = fs_write_data(sb, from.blk, tmp, nodeinfo->size, NULL, 0);
+  }
+
+out:
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+  fs_blk_free(sb, target);
+  fs_blk_free(sb, tmp);
+
+  return ret;
+}
+
+int fs_rename(struct superblock *sb, const char *oldname, const char *newname) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_RENAME);
+  int ret = fs_do_rename(sb, oldname, newname);
+
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/* Create a file named by the =namelen bytes at =name in directory =parent
+ * sharing the data blocks of file =src, whose buffered contents, if any,
+ * must have been written out. */
+int fs_clone_node(struct superblock *sb, uint64_t src, uint64_t parent, const char *name, size_t namelen) {
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+  struct inode *first = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *info = (struct nodeinfo*) fs_blk_alloc(sb);
+  uint64_t *children = NULL;
+  uint64_t nchild = 0;
+  uint64_t *links = NULL;
+  uint64_t nblocks = 0;
+  int ret = -1;
+
+  if (fs_read_inode(sb, src, inode) == -1) {
+    goto out;
+  }
+
+  if (!(inode->mode & IMREG)) {
+    errno = EISDIR;
+    goto out;
+  }
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    goto out;
+  }
+
+  uint64_t size = nodeinfo->size;
+
+  nblocks = fs_data_blocks(sb, inode, nodeinfo);
+
+  // Inline contents are copied, and may not fit inline under the new name
+  if (inode->mode & IMINLINE) {
+    uint64_t needed = size > fs_inline_max_size(sb, namelen) ? CEIL(size, sb->blksz) : 0;
+
+    if (!fs_has_space(sb, needed, fs_meta_blocks(sb) + fs_child_inodes(sb, needed))) {
+      errno = ENOSPC;
+      goto out;
+    }
+
+    uint64_t blk = fs_create_node(sb, parent, name, namelen, IMREG);
+
+    if (blk != INVALID_BLOCK) {
+      ret = fs_write_data(sb, blk, fs_inline_data(nodeinfo), size, NULL, 0);
+    }
+
+    goto out;
+  }
+
+  uint64_t first_links = fs_inode_first_links(sb);
+  uint64_t max_links = fs_inode_max_links(sb);
+  uint64_t comp = inode->mode & IMCOMP;
+
+  nchild = fs_child_inodes(sb, nblocks);
+  children = fs_blks_alloc(sb, nchild);
+  links = fs_blks_alloc(sb, nblocks);
+
+  if (children == NULL || links == NULL) {
+    errno = ENOMEM;
+    goto out;
+  }
+
+  // The whole source chain is read before anything is created, so that a
+  // bad inode leaves no half-built clone behind
+  uint64_t j = 0;
+
+  for (; j<first_links && j<nblocks; j++) {
+    links[j] = inode->links[j];
+  }
+
+  for (uint64_t c=0; c<nchild; c++) {
+    if (fs_read_inode(sb, inode->next, inode) == -1) {
+      goto out;
+    }
+
+    for (uint64_t i=0; i<max_links && j<nblocks; i++, j++) {
+      links[j] = inode->links[i];
+    }
+  }
+
+  if (!fs_has_space(sb, 0, fs_meta_blocks(sb) + nchild)) {
+    errno = ENOSPC;
+    goto out;
+  }
+
+  uint64_t blk = fs_create_node(sb, parent, name, namelen, IMREG);
+
+  if (blk == INVALID_BLOCK) {
+    goto out;
+  }
+
+  if (fs_get_inodes(sb, nchild, children) == -1) {
+    if (fs_unlink_blk(sb, parent, blk) == 0 && fs_read_inode(sb, blk, first) == 0) {
+      fs_free_node(sb, blk, first);
+    }
+
+    goto out;
+  }
+
+  if (fs_read_inode(sb, blk, first) == -1 || fs_read_info(sb, first, info) == -1) {
+    for (uint64_t c=0; c<nchild; c++) {
+      fs_put_inode(sb, children[c]);
+    }
+
+    if (fs_unlink_blk(sb, parent, blk) == 0 && fs_read_inode(sb, blk, first) == 0) {
+      fs_free_node(sb, blk, first);
+    }
+
+    fs_tables_flush(sb);
+    goto out;
+  }
+
+  // The new chain has the same shape as the source's: only the inode
+  // numbers differ, and every data block gains a reference
+  for (j=0; j<nblocks; j++) {
+    if (links[j] != INVALID_BLOCK) {
+      fs_rc_add(sb, links[j], 1);
+    }
+  }
+
+  for (uint64_t i=0; i<first_links; i++) {
+    first->links[i] = i < nblocks ? links[i] : INVALID_BLOCK;
+  }
+
+  first->mode |= comp;
+  first->next = nchild > 0 ? children[0] : 0;
+
+  for (uint64_t c=0; c<nchild; c++) {
+    inode->mode = IMCHILD;
+    inode->parent = blk;
+    inode->meta = c == 0 ? blk : children[c - 1];
+    inode->next = c + 1 < nchild ? children[c + 1] : 0;
 
-  return block;
-}
+    for (uint64_t i=0; i<max_links; i++) {
+      j = first_links + c * max_links + i;
+      inode->links[i] = j < nblocks ? links[j] : INVALID_BLOCK;
+    }
 
-int fs_put_block(struct superblock *sb, uint64_t block) {
-  if (sb->magic != SUPERBLOCK_MAGIC) {
-    errno = EBADF;
-    return -1;
+    fs_write_inode(sb, children[c], inode);
   }
 
-  struct freepage* freepage = (struct freepage*) malloc(sb->blksz);
+  info->size = size;
 
-  if (freepage == NULL) 
-    return -1;
+  ret = fs_write_meta(sb, blk, first, info);
 
-  freepage->count = 0;
-  freepage->next = sb->freelist;
+  if (fs_tables_flush(sb) == -1) {
+    ret = -1;
+  }
 
-  sb->freelist = block;
-  sb->freeblks++;
+out:
+  if (children != NULL) {
+    fs_blks_free(sb, children, nchild);
+  }
 
-  if (fs_write_blk(sb, block, (void *) freepage) == -1 \
-  || fs_write_blk(sb, SUPERBLOCK_BLK, (void *) sb) == -1) {
-    free(freepage);
-    return -1;
+  if (links != NULL) {
+    fs_blks_free(sb, links, nblocks);
   }
 
-  free(freepage);
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+  fs_blk_free(sb, first);
+  fs_blk_free(sb, info);
 
-  return 0;
+  return ret;
 }
 
-int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
+int fs_do_clone(struct superblock *sb, const char *src, const char *dst) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
     errno = EBADF;
     return -1;
   }
 
-  if (fs_is_invalid_name(fname)) {
+  if (fs_is_invalid_name(src) || fs_is_invalid_name(dst)) {
     errno = ENOENT;
     return -1;
   }
 
-  uint64_t max_links = fs_inode_max_links(sb);
-
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  
-  uint64_t used_blocks = 0;
-  uint64_t used_child_blocks = 0;
-
-  uint64_t needed_blocks = CEIL(cnt, sb->blksz);
-  uint64_t needed_child_blocks = MAX(CEIL(needed_blocks, max_links) - 1, 0);
-
-  int new_inode = 0;
+  if (!fs_has_refcount(sb)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
 
-  uint64_t block = fs_find_blk(sb, fname);
+  struct fs_walk from, to;
 
-  // If file already exists
-  if (block != INVALID_BLOCK) {
-    fs_read_blk(sb, block, (void*) inode);
+  if (fs_walk(sb, NULL, src, &from) == -1) {
+    return -1;
+  }
 
-    if (inode->mode != IMREG) {
-      free(inode);
-      free(nodeinfo);
-      errno = EISDIR;
-      return -1;
-    }
+  if (fs_walk(sb, NULL, dst, &to) == -1 && errno != ENOENT) {
+    return -1;
+  }
 
-    fs_read_blk(sb, inode->meta, (void*) nodeinfo);
+  if (to.blk != INVALID_BLOCK) {
+    errno = EEXIST;
+    return -1;
+  }
 
-    used_blocks = CEIL(nodeinfo->size, sb->blksz);
-    used_child_blocks = MAX(CEIL(used_blocks, max_links) - 1, 0);
+  if (to.parent == INVALID_BLOCK) {
+    errno = ENOTDIR;
+    return -1;
   }
 
-  uint64_t real_needed_blocks = needed_blocks > used_blocks ? needed_blocks - used_blocks : 0;
-  uint64_t real_needed_child_blocks = needed_child_blocks > used_child_blocks ? needed_child_blocks - used_child_blocks : 0;
+  if (to.namelen >= fs_nodeinfo_max_name_size(sb)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
 
-  if (real_needed_blocks + real_needed_child_blocks > sb->freeblks) {
-    free(inode);
-    free(nodeinfo);
-    errno = ENOSPC;
+  // Buffered contents are written out first, so that they can be shared
+  if (fs_dirty_find(sb, from.blk) != NULL && fs_dirty_flush(sb) == -1) {
     return -1;
   }
 
-  // If block not exists
-  if (block == INVALID_BLOCK) {
-    char *basedir = fs_get_basedir(fname);
+  return fs_clone_node(sb, from.blk, to.parent, to.name, to.namelen);
+}
 
-    uint64_t parent_block = fs_find_blk(sb, basedir);
+int fs_clone(struct superblock *sb, const char *src, const char *dst) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_CLONE);
+  int ret = fs_do_clone(sb, src, dst);
 
-    free(basedir);
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
 
-    if (parent_block == INVALID_BLOCK) {
-      free(inode);
-      free(nodeinfo);
-      errno = ENOTDIR;
+  return ret;
+}
+
+/* Fill =dir with a handle on the directory holding the snapshots, which
+ * is created first if =create is set. */
+int fs_snapshots_dir(struct superblock *sb, int create, struct fs_dir *dir) {
+  if (sb->snapshots == 0) {
+    if (!create) {
+      errno = ENOENT;
       return -1;
     }
-    
-    char *basename = fs_get_basename(fname);
 
-    if (strlen(basename) > fs_nodeinfo_max_name_size(sb)) {
-      free(basename);
-      free(inode);
-      free(nodeinfo);
-      errno = ENAMETOOLONG;
+    if (!fs_has_space(sb, 0, fs_meta_blocks(sb))) {
+      errno = ENOSPC;
       return -1;
     }
 
-    block = fs_get_block(sb);
+    const char *name = "snapshots";
+    uint64_t blk = fs_create_node(sb, SUPERBLOCK_BLK, name, strlen(name), IMDIR);
 
-    if (fs_link_blk(sb, parent_block, block) == -1) {
-      free(basename);
-      free(inode);
-      free(nodeinfo);
-      fs_put_block(sb, block);
+    if (blk == INVALID_BLOCK) {
       return -1;
     }
 
-    inode->mode = IMREG;
-    inode->parent = parent_block;
-    inode->next = 0;
-    inode->meta = fs_get_block(sb);
+    sb->snapshots = blk;
 
-    strcpy((char*)&nodeinfo->name, basename);
+    if (fs_write_sb(sb) == -1) {
+      return -1;
+    }
+  }
 
-    free(basename);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
 
-    new_inode = 1;
+  if (fs_read_inode(sb, sb->snapshots, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return -1;
   }
 
-  nodeinfo->size = cnt;
-  fs_write_blk(sb, inode->meta, (void*) nodeinfo);
-  free(nodeinfo);
+  dir->blk = sb->snapshots;
+  dir->meta = inode->meta;
+  dir->gen = fs_igen(sb, sb->snapshots);
+  dir->flags = 0;
 
-  uint64_t base_block = block;
+  fs_blk_free(sb, inode);
 
-  for (int j=0; j<needed_blocks; j++) {
-    int i = j % max_links;
+  return 0;
+}
 
-    if (i == 0 && j != 0) {
-      // If inode already has a child
-      if (inode->next != 0) {
-        fs_write_blk(sb, block, (void*) inode);
-        block = inode->next;
-        fs_read_blk(sb, block, (void*) inode);
-      } else {
-        uint64_t next_block = fs_get_block(sb);
+/* Snapshot names are single path components. */
+int fs_is_invalid_snapshot_name(const char *name) {
+  return *name == '\0' || strchr(name, DIR_DELIM_CHR) != NULL || strchr(name, ' ') != NULL;
+}
 
-        inode->next = next_block;
+/* Inode units taken by a copy of the tree below directory =dir, as made by
+ * fs_snapshot_copy, or INVALID_BLOCK if part of the tree cannot be read. */
+uint64_t fs_snapshot_size(struct superblock *sb, uint64_t dir) {
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  uint64_t n = 0;
+  uint64_t entries = 0;
+  uint64_t ino = dir;
+  uint64_t i = 0;
+  uint64_t link;
+
+  if (fs_read_inode(sb, dir, inode) == -1) {
+    ino = INVALID_BLOCK;
+  }
 
-        fs_write_blk(sb, block, (void*) inode);
+  while (ino != INVALID_BLOCK && (link = fs_dir_next(sb, inode, &ino, &i)) != INVALID_BLOCK) {
+    entries++;
 
-        inode->mode = IMCHILD;
-        inode->parent = base_block;
-        inode->meta = block;
-        inode->next = 0;
+    if (fs_read_inode(sb, link, child) == -1) {
+      ino = INVALID_BLOCK;
+      break;
+    }
 
-        block = next_block;
+    if (child->mode == IMDIR) {
+      uint64_t sub = fs_snapshot_size(sb, link);
 
-        new_inode = 1;
+      if (sub == INVALID_BLOCK) {
+        ino = INVALID_BLOCK;
+        break;
       }
+
+      n += sub;
+      continue;
     }
 
-    if (inode->links[i] == INVALID_BLOCK || new_inode) {
-      inode->links[i] = fs_get_block(sb);
+    if (fs_read_info(sb, child, nodeinfo) == -1) {
+      ino = INVALID_BLOCK;
+      break;
     }
 
-    uint64_t n = (j < needed_blocks - 1) ? sb->blksz : cnt - j * sb->blksz;
-    fs_write_blk_sz(sb, inode->links[i], (void*)(buf + j * sb->blksz), n);
+    n += fs_meta_blocks(sb) + fs_child_inodes(sb, fs_data_blocks(sb, child, nodeinfo));
   }
 
-  for (int i=(needed_blocks % max_links); i<max_links; i++) {
-    // Cleaning remaining allocated link blocks
-    if (!new_inode && inode->links[i] != INVALID_BLOCK) {
-      fs_put_block(sb, inode->links[i]);
-    }
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, child);
+  fs_blk_free(sb, nodeinfo);
 
-    inode->links[i] = INVALID_BLOCK;
+  return ino == INVALID_BLOCK ? INVALID_BLOCK : n + fs_meta_blocks(sb) + fs_child_inodes(sb, entries);
+}
+
+/* Copy directory =dir into a new directory named by the =namelen bytes at
+ * =name in =parent: directories below it are copied and files cloned.
+ * Returns the copy, or INVALID_BLOCK on error. */
+uint64_t fs_snapshot_copy(struct superblock *sb, uint64_t dir, uint64_t parent, const char *name, size_t namelen) {
+  uint64_t copy = fs_create_node(sb, parent, name, namelen, IMDIR);
+
+  if (copy == INVALID_BLOCK) {
+    return INVALID_BLOCK;
   }
 
-  fs_write_blk(sb, block, (void*)inode);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
 
-  // Cleaning remaining allocated child blocks
-  while (inode->next != 0) {
-    uint64_t next_block = inode->next;
+  uint64_t ino = dir;
+  uint64_t i = 0;
+  uint64_t link;
+  int ret = fs_read_inode(sb, dir, inode);
 
-    inode->next = 0;
-    fs_write_blk(sb, block, (void*) inode);
+  while (ret == 0 && (link = fs_dir_next(sb, inode, &ino, &i)) != INVALID_BLOCK) {
+    if (fs_read_inode(sb, link, child) == -1 || fs_read_info(sb, child, nodeinfo) == -1) {
+      ret = -1;
+      break;
+    }
 
-    block = next_block;
-    fs_read_blk(sb, block, (void*) inode);
+    size_t len = strlen(nodeinfo->name);
 
-    for (int i=0; i<max_links; i++) {
-      if (inode->links[i] != INVALID_BLOCK) {
-        fs_put_block(sb, inode->links[i]);
-      }
+    if (child->mode == IMDIR) {
+      ret = fs_snapshot_copy(sb, link, copy, nodeinfo->name, len) == INVALID_BLOCK ? -1 : 0;
+    } else {
+      ret = fs_clone_node(sb, link, copy, nodeinfo->name, len);
     }
-    
-    fs_put_block(sb, block);
   }
 
-  free(inode);
+  if (ino == INVALID_BLOCK) {
+    ret = -1;
+  }
 
-  return 0;
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, child);
+  fs_blk_free(sb, nodeinfo);
+
+  return ret == 0 ? copy : INVALID_BLOCK;
 }
 
-ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
-  if (sb->magic != SUPERBLOCK_MAGIC) {
-    errno = EBADF;
-    return -1;
+/* Free directory =dir of a snapshot and everything below it.  It must
+ * already be unlinked from its parent.  The walk stops at the first inode
+ * that cannot be read, leaving the rest for fs_fsck. */
+int fs_snapshot_free(struct superblock *sb, uint64_t dir) {
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+  struct inode *child = (struct inode*) fs_blk_alloc(sb);
+
+  uint64_t ino = dir;
+  uint64_t i = 0;
+  uint64_t link;
+  int ret = fs_read_inode(sb, dir, inode);
+
+  while (ret == 0 && (link = fs_dir_next(sb, inode, &ino, &i)) != INVALID_BLOCK) {
+    if (fs_read_inode(sb, link, child) == -1) {
+      ret = -1;
+    } else if (child->mode == IMDIR) {
+      ret = fs_snapshot_free(sb, link);
+    } else {
+      ret = fs_free_node(sb, link, child);
+    }
   }
 
-  if (bufsz == 0) {
-    return 0;
+  if (ret == 0 && ino == INVALID_BLOCK) {
+    ret = -1;
   }
 
-  if (fs_is_invalid_name(fname)) {
-    errno = ENOENT;
-    return -1;
+  // The directory itself goes only once all it holds is gone
+  if (ret == 0 && (ret = fs_read_inode(sb, dir, inode)) == 0) {
+    ret = fs_free_node(sb, dir, inode);
   }
 
-  uint64_t block = fs_find_blk(sb, fname);
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, child);
 
-  if (block == INVALID_BLOCK) {
-    errno = ENOENT;
+  return ret;
+}
+
+int fs_do_snapshot_create(struct superblock *sb, const char *name) {
+  if (sb->magic != SUPERBLOCK_MAGIC) {
+    errno = EBADF;
     return -1;
   }
 
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-
-  fs_read_blk(sb, block, (void*) inode);
-
-  if (inode->mode != IMREG) {
-    free(inode);
-    errno = EISDIR;
+  if (!fs_has_refcount(sb)) {
+    errno = EOPNOTSUPP;
     return -1;
   }
 
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
-
-  uint64_t nbytes = MIN(nodeinfo->size, bufsz);
-
-  free(nodeinfo);
-
-  uint64_t max_links = fs_inode_max_links(sb);
-
-  uint64_t nlinks = CEIL(nbytes, sb->blksz);
-
-  for (int j=0; j<nlinks; j++) {
-    int i = j % max_links;
-
-    if (i == 0 && j != 0) {
-      fs_read_blk(sb, inode->next, (void*) inode);
-    }
-
-    uint64_t n = (j < nlinks - 1) ? sb->blksz : nbytes - j * sb->blksz;
-
-    fs_read_blk_sz(sb, inode->links[i], buf + j * sb->blksz, n);
+  if (fs_is_invalid_snapshot_name(name)) {
+    errno = EINVAL;
+    return -1;
   }
 
-  free(inode);
-  
-  return nbytes;
-}
+  size_t namelen = strlen(name);
 
-int fs_unlink(struct superblock *sb, const char *fname) {
-  if (sb->magic != SUPERBLOCK_MAGIC) {
-    errno = EBADF;
+  if (namelen >= fs_nodeinfo_max_name_size(sb)) {
+    errno = ENAMETOOLONG;
     return -1;
   }
 
-  if (fs_is_invalid_name(fname)) {
-    errno = ENOENT;
+  // Buffered contents are part of the tree the snapshot is taken of
+  if (fs_dirty_flush(sb) == -1) {
     return -1;
   }
 
-  uint64_t block = fs_find_blk(sb, fname);
+  struct fs_dir snaps;
+  struct fs_walk w;
 
-  if (block == INVALID_BLOCK) {
-    errno = ENOENT;
+  if (fs_snapshots_dir(sb, 1, &snaps) == -1) {
     return -1;
   }
 
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-
-  fs_read_blk(sb, block, (void*) inode);
+  if (fs_walk(sb, &snaps, name, &w) == 0) {
+    errno = EEXIST;
+    return -1;
+  }
 
-  if (inode->mode != IMREG) {
-    free(inode);
-    errno = EISDIR;
+  if (errno != ENOENT) {
     return -1;
   }
 
-  fs_unlink_blk(sb, inode->parent, block);
+  uint64_t size = fs_snapshot_size(sb, sb->root);
 
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
+  if (size == INVALID_BLOCK) {
+    return -1;
+  }
 
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
-  fs_put_block(sb, inode->meta);
+  // One more inode in case the directory of snapshots grows
+  if (!fs_has_space(sb, 0, size + 1)) {
+    errno = ENOSPC;
+    return -1;
+  }
 
-  uint64_t max_links = fs_inode_max_links(sb);
-  uint64_t nlinks = CEIL(nodeinfo->size, sb->blksz);
+  if (fs_snapshot_copy(sb, sb->root, sb->snapshots, name, namelen) != INVALID_BLOCK) {
+    return 0;
+  }
 
-  free(nodeinfo);
+  // Do not leave half a snapshot behind
+  if (fs_walk(sb, &snaps, name, &w) == 0) {
+    fs_unlink_blk(sb, sb->snapshots, w.blk);
+    fs_snapshot_free(sb, w.blk);
+  }
 
-  for (int j=0; j<nlinks; j++) {
-    int i = j % max_links;
+  return -1;
+}
 
-    if (i == 0 && j != 0) {
-      fs_put_block(sb, block);
-      block = inode->next;
-      fs_read_blk(sb, inode->next, (void*) inode);
-    }
+int fs_snapshot_create(struct superblock *sb, const char *name) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SNAPSHOT);
+  int ret = fs_do_snapshot_create(sb, name);
 
-    fs_put_block(sb, inode->links[i]);
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
   }
 
-  fs_put_block(sb, block);
-
-  free(inode);
-
-  return 0;
+  return ret;
 }
 
-int fs_mkdir(struct superblock *sb, const char *dname) {
+/* Find snapshot =name, filling =w. */
+int fs_snapshot_find(struct superblock *sb, const char *name, struct fs_walk *w) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
     errno = EBADF;
     return -1;
   }
 
-  if (fs_is_invalid_name(dname)) {
-    errno = ENOTDIR;
-    return -1;
-  }
-
-  if (sb->freeblks < 2) {
-    errno = EBUSY;
+  if (!fs_has_refcount(sb)) {
+    errno = EOPNOTSUPP;
     return -1;
   }
 
-  if (fs_find_blk(sb, dname) != INVALID_BLOCK) {
-    errno = EEXIST;
+  if (fs_is_invalid_snapshot_name(name)) {
+    errno = EINVAL;
     return -1;
   }
 
-  char *name = fs_get_basename(dname);
+  struct fs_dir snaps;
 
-  if (strlen(name) > fs_nodeinfo_max_name_size(sb)) {
-    free(name);
-    errno = ENAMETOOLONG;
+  if (fs_snapshots_dir(sb, 0, &snaps) == -1) {
     return -1;
   }
 
-  char *parent_name = fs_get_basedir(dname);
+  return fs_walk(sb, &snaps, name, w);
+}
 
-  uint64_t parent_blk = fs_find_blk(sb, parent_name);
-  free(parent_name);
+int fs_do_snapshot_open(struct superblock *sb, const char *name, struct fs_dir *dir) {
+  struct fs_walk w;
 
-  if (parent_blk == INVALID_BLOCK) {
-    free(name);
-    errno = ENOTDIR;
+  if (fs_snapshot_find(sb, name, &w) == -1) {
     return -1;
   }
 
-  uint64_t inode_blk = fs_get_block(sb);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
 
-  if (fs_link_blk(sb, parent_blk, inode_blk) == -1) {
-    free(name);
-    fs_put_block(sb, inode_blk);
+  if (fs_read_inode(sb, w.blk, inode) == -1) {
+    fs_blk_free(sb, inode);
     return -1;
   }
 
-  uint64_t nodeinfo_blk = fs_get_block(sb);
-
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  nodeinfo->size = 0;
-  strcpy((char*)&nodeinfo->name, name);
-
-  free(name);
-
-  fs_write_blk(sb, nodeinfo_blk, (void *) nodeinfo);
-
-  free(nodeinfo);
-
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  inode->mode = IMDIR;
-  inode->next = 0;
-  inode->parent = parent_blk;
-  inode->meta = nodeinfo_blk;
+  dir->blk = w.blk;
+  dir->meta = inode->meta;
+  dir->gen = fs_igen(sb, w.blk);
+  dir->flags = FS_DIR_RDONLY;
 
-  for (int i=0; i<fs_inode_max_links(sb); i++) {
-    inode->links[i] = INVALID_BLOCK;
-  }
-  
-  fs_write_blk(sb, inode_blk, (void *) inode);
-  
-  free(inode);
+  fs_blk_free(sb, inode);
 
   return 0;
 }
 
-int fs_rmdir(struct superblock *sb, const char *dname) {
-  if (sb->magic != SUPERBLOCK_MAGIC) {
-    errno = EBADF;
-    return -1;
-  }
+int fs_snapshot_open(struct superblock *sb, const char *name, struct fs_dir *dir) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SNAPSHOT);
+  int ret = fs_do_snapshot_open(sb, name, dir);
 
-  if (fs_is_invalid_name(dname)) {
-    errno = ENOTDIR;
-    return -1;
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
   }
 
-  uint64_t blk = fs_find_blk(sb, dname);
+  return ret;
+}
 
-  if (blk == INVALID_BLOCK) {
-    errno = EEXIST;
-    return -1;
-  }
+int fs_do_snapshot_delete(struct superblock *sb, const char *name) {
+  struct fs_walk w;
 
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  fs_read_blk(sb, blk, (void*) inode);
-  
-  if (inode->mode != IMDIR) {
-    free(inode);
-    errno = ENOTDIR;
+  if (fs_snapshot_find(sb, name, &w) == -1) {
     return -1;
   }
-  
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
 
-  if (nodeinfo->size > 0) {
-    free(inode);
-    free(nodeinfo);
-    errno = ENOTEMPTY;
+  if (fs_unlink_blk(sb, sb->snapshots, w.blk) == -1) {
     return -1;
   }
 
-  fs_unlink_blk(sb, inode->parent, blk);
+  return fs_snapshot_free(sb, w.blk);
+}
 
-  fs_put_block(sb, inode->meta);
-  fs_put_block(sb, blk);
+int fs_snapshot_delete(struct superblock *sb, const char *name) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_SNAPSHOT);
+  int ret = fs_do_snapshot_delete(sb, name);
 
-  free(inode);
-  free(nodeinfo);
+  if (fs_call_end(sb, t0, ret < 0, 0) == -1) {
+    ret = -1;
+  }
 
-  return 0;
+  return ret;
 }
 
-char * fs_list_dir(struct superblock *sb, const char *dname) {
+char * fs_do_list_dir(struct superblock *sb, const struct fs_dir *at, const char *dname) {
   if (sb->magic != SUPERBLOCK_MAGIC) {
     errno = EBADF;
     return NULL;
   }
 
-  if (fs_is_invalid_name(dname)) {
+  if (fs_is_invalid_name_at(at, dname)) {
     errno = ENOTDIR;
-    return -1;
+    return NULL;
   }
 
-  uint64_t blk = fs_find_blk(sb, dname);
+  uint64_t blk = fs_find_blk_at(sb, at, dname);
 
   if (blk == INVALID_BLOCK) {
-    errno = EEXIST;
+    errno = errno == EIO ? EIO : EEXIST;
     return NULL;
   }
 
-  struct inode *inode = (struct inode*) malloc(sb->blksz);
-  fs_read_blk(sb, blk, (void*) inode);
+  struct inode *inode = (struct inode*) fs_blk_alloc(sb);
+
+  if (fs_read_inode(sb, blk, inode) == -1) {
+    fs_blk_free(sb, inode);
+    return NULL;
+  }
   
   if (inode->mode != IMDIR) {
-    free(inode);
+    fs_blk_free(sb, inode);
     errno = ENOTDIR;
     return NULL;
   }
   
-  struct nodeinfo *nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
-  fs_read_blk(sb, inode->meta, (void*) nodeinfo);
+  struct nodeinfo *nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
+
+  if (fs_read_info(sb, inode, nodeinfo) == -1) {
+    fs_blk_free(sb, inode);
+    fs_blk_free(sb, nodeinfo);
+    return NULL;
+  }
 
-  struct inode *link_inode = (struct inode*) malloc(sb->blksz);
-  struct nodeinfo *link_nodeinfo = (struct nodeinfo*) malloc(sb->blksz);
+  struct inode *link_inode = (struct inode*) fs_blk_alloc(sb);
+  struct nodeinfo *link_nodeinfo = (struct nodeinfo*) fs_blk_alloc(sb);
 
-  char *result = (char*) malloc(100 * sizeof(char));
+  size_t cap = 100;
+  size_t len = 0;
+  char *result = (char*) malloc(cap * sizeof(char));
   *result = '\0';
 
-  uint64_t max_links = fs_inode_max_links(sb);
+  uint64_t i = 0;
+  uint64_t link;
 
-  int i = -1;
-  int j = 0;
+  for (uint64_t j=0; j<nodeinfo->size; j++) {
+    if ((link = fs_dir_next(sb, inode, &blk, &i)) == INVALID_BLOCK) {
+      break;
+    }
 
-  while (j < nodeinfo->size && ++i < max_links) {
-    if (inode->links[i] == INVALID_BLOCK) {
-      continue;
+    if (fs_read_inode(sb, link, link_inode) == -1 || fs_read_info(sb, link_inode, link_nodeinfo) == -1) {
+      blk = INVALID_BLOCK;
+      break;
     }
 
-    fs_read_blk(sb, inode->links[i], (void*) link_inode);
-    fs_read_blk(sb, link_inode->meta, (void*) link_nodeinfo);
+    // Room for a separator, the name, a directory delimiter and the NUL
+    size_t need = len + strlen(link_nodeinfo->name) + 3;
 
-    strcat(result, link_nodeinfo->name);
+    if (need > cap) {
+      while (need > cap) {
+        cap *= 2;
+      }
 
-    if (link_inode->mode == IMDIR) {
-      strcat(result, DIR_DELIM_STR);
+      result = (char*) realloc(result, cap * sizeof(char));
     }
 
-    if (i < nodeinfo->size - 1) {
-      strcat(result, " ");
+    if (j > 0) {
+      strcat(result + len, " ");
+    }
+
+    strcat(result + len, link_nodeinfo->name);
+
+    if (link_inode->mode == IMDIR) {
+      strcat(result + len, DIR_DELIM_STR);
     }
 
-    j++;
+    len += strlen(result + len);
   }
 
-  free(inode);
-  free(nodeinfo);
-  free(link_inode);
-  free(link_nodeinfo);
+  // A listing missing entries that cannot be read is not returned
+  if (blk == INVALID_BLOCK) {
+    free(result);
+    result = NULL;
+  }
+
+  fs_blk_free(sb, inode);
+  fs_blk_free(sb, nodeinfo);
+  fs_blk_free(sb, link_inode);
+  fs_blk_free(sb, link_nodeinfo);
 
   return result;
-}
\ No newline at end of file
+}
+
+char * fs_list_dir(struct superblock *sb, const char *dname) {
+  uint64_t t0 = fs_call_begin(sb, FS_API_LIST_DIR);
+  char *ret = fs_do_list_dir(sb, NULL, dname);
+
+  if (fs_call_end(sb, t0, ret == NULL, 0) == -1) {
+    free(ret);
+    ret = NULL;
+  }
+
+  return ret;
+}
+
+char * fs_list_dirat(struct superblock *sb, const struct fs_dir *at, const char *dname) {
+  struct fs_dir root;
+  uint64_t t0 = fs_call_begin(sb, FS_API_LIST_DIR);
+  char *ret = fs_do_list_dir(sb, fs_at(sb, at, &root), dname);
+
+  if (fs_call_end(sb, t0, ret == NULL, 0) == -1) {
+    free(ret);
+    ret = NULL;
+  }
+
+  return ret;
+}
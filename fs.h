@@ -5,11 +5,14 @@
  *
  * EFBIG (file too large)
  * EEXIST (file exists)
+ * EOPNOTSUPP (operation not supported)
+ * EROFS (read-only file system)
  * EISDIR (is a directory)
  * EBUSY (device is busy)
  * EBADF (bad file descriptor)
  * ENAMETOOLONG (filename too long)
  * ENOENT (no such file or directory)
+ * ENXIO (no such device or address)
  * ENOSPC (no space left on device)
  * ENOTDIR (not a directory)
  * ENOTEMPTY (directory not empty)
@@ -19,10 +22,13 @@
  */
 
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #define IMREG 1   /* regular inode */
 #define IMDIR 2   /* directory inode */
 #define IMCHILD 4 /* child inode */
+#define IMINLINE 8 /* with IMREG: file data is stored in its nodeinfo */
+#define IMCOMP 16 /* with IMREG: file data is stored in compressed chunks */
 
 struct superblock {
 	uint64_t magic; /* 0xdcc605f5 */
@@ -32,8 +38,79 @@ struct superblock {
 	uint64_t freelist; /* pointer to free block list */
 	uint64_t root; /* pointer to root directory's inode */
 	int fd; /* file descriptor for the filesystem image */
+	uint32_t version; /* FS_VERSION_2; anything else is FS_VERSION_1 */
+	uint64_t features; /* FS_FEATURE_* flags; zero before FS_VERSION_2 */
+	/* fields below are only used with FS_FEATURE_ITABLE */
+	uint64_t itable; /* first block of the inode table */
+	uint64_t inodes; /* number of inodes in the inode table */
+	uint64_t ifree; /* first free inode; free inodes are linked by =next */
+	uint64_t nifree; /* number of free inodes */
+	/* fields below are only used with FS_FEATURE_REFCOUNT */
+	uint64_t rctable; /* first block of the reference count table */
+	uint64_t rcblocks; /* number of blocks in the reference count table */
+	uint64_t snapshots; /* directory of snapshots, zero if none */
+	/* only used with FS_FEATURE_CSUM: first block of the checksum table */
+	uint64_t cstable;
 };
 
+#define FS_VERSION_1 0xdcc60001 /* images without =features */
+#define FS_VERSION_2 0xdcc60002
+
+/* On-disk format features, chosen when the image is formatted. */
+#define FS_FEATURE_COMPACT 1 /* nodeinfo embedded in the first inode */
+#define FS_FEATURE_ITABLE 2 /* FS_INODE_SIZE inodes packed in a table */
+#define FS_FEATURE_REFCOUNT 4 /* data blocks may be shared by files */
+#define FS_FEATURE_COMPRESS 8 /* file data is compressed when written */
+#define FS_FEATURE_DEDUP 16 /* identical data blocks are stored once */
+#define FS_FEATURE_CSUM 32 /* inodes and metadata blocks are checksummed */
+#define FS_FEATURE_DCSUM 64 /* file data blocks are checksummed too */
+#define FS_FEATURE_SPARSE 128 /* all-zero data blocks are not stored */
+#define FS_FEATURES_KNOWN (FS_FEATURE_COMPACT | FS_FEATURE_ITABLE | FS_FEATURE_REFCOUNT \
+                           | FS_FEATURE_COMPRESS | FS_FEATURE_DEDUP | FS_FEATURE_CSUM \
+                           | FS_FEATURE_DCSUM | FS_FEATURE_SPARSE)
+
+/* with FS_FEATURE_ITABLE, inodes are FS_INODE_SIZE bytes long and packed in
+ * a table of =inodes entries starting at block =itable.  every reference to
+ * an inode (root, directory links, =parent, =meta and =next) is then an
+ * inode number, i.e. an index in that table, rather than a block number;
+ * data links are still block numbers.  such images are always compact. */
+#define FS_INODE_SIZE 256
+
+/* with FS_FEATURE_REFCOUNT, a table of =rcblocks blocks starting at block
+ * =rctable holds one uint32_t per block of the image: the number of files
+ * sharing that data block besides its first owner.  entries of blocks
+ * owned by a single file, and of free blocks, are zero. */
+
+/* with FS_FEATURE_DEDUP, which implies FS_FEATURE_REFCOUNT, a second table
+ * of =rcblocks blocks follows the reference count table.  it holds one
+ * uint32_t per block of the image: a hash of the contents of the full data
+ * blocks written by fs_write_file, or zero.  a block about to be written
+ * with the same contents as one of those is linked to it instead, its
+ * reference count growing by one. */
+
+/* with FS_FEATURE_COMPRESS, the data of files written with fs_write_file is
+ * cut into chunks of FS_COMP_CHUNK bytes (or of one block, if larger), each
+ * compressed on its own in the LZ4 block format.  a chunk that saves at
+ * least one block is stored as a uint32_t holding the compressed length
+ * followed by the compressed bytes, in the first blocks of the chunk's link
+ * slots; the chunk's remaining slots are INVALID_BLOCK.  other chunks are
+ * stored as is.  files where no chunk was compressed are plain IMREG files,
+ * the others have IMCOMP set. */
+#define FS_COMP_CHUNK 65536
+
+/* with FS_FEATURE_CSUM, a table of CEIL(blks * 4, blksz) blocks starting at
+ * block =cstable, after the other tables, holds one uint32_t per block of
+ * the image: the CRC32C of the inode (or inode table) block or metadata
+ * block stored there, with FS_FEATURE_DCSUM also of data blocks, where it
+ * covers the file bytes the block holds.  zero means no checksum was
+ * recorded; a checksum of zero is stored as one.  reads of a block whose
+ * checksum does not match fail with EIO. */
+
+/* with FS_FEATURE_SPARSE, fs_write_file does not store the blocks of a file
+ * whose bytes are all zero: their link slots hold INVALID_BLOCK, and such
+ * holes read as zeros.  in compressed files, a chunk whose bytes are all
+ * zero is a hole as a whole, with INVALID_BLOCK in all of its slots. */
+
 struct inode {
 	uint64_t mode;
 	/* if =mode does not contain IMCHILD, then =parent points to the
@@ -49,8 +126,10 @@ struct inode {
 	 * the next inode for this entity; otherwise =next should be zero. */
 	uint64_t next;
 	/* if =mode contains IMDIR, then entries in =links point to inode's
-	 * for each entity in the directory.  otherwise, if =mode contains
-	 * IMREG, then entries in =links point to this file's data blocks. */
+	 * for each entity in the directory; large directories continue in
+	 * IMCHILD inodes like files do, and unused entries hold
+	 * INVALID_BLOCK.  otherwise, if =mode contains IMREG, then entries
+	 * in =links point to this file's data blocks. */
 	uint64_t links[];
 };
 
@@ -62,7 +141,21 @@ struct nodeinfo {
 	/* reserving some space to implement security and ownership in the
 	 * future. */
 	uint64_t reserved[7];
-	/* remainder of block used to store this entity's name. */
+	/* remainder of block used to store this entity's name.  if the
+	 * inode's =mode contains IMINLINE, the file's =size bytes of data
+	 * follow the NUL terminating the name, and the inode has no links. */
+	char name[];
+};
+
+/* in images with FS_FEATURE_COMPACT, the first inode of each entity holds its
+ * own metadata and its =meta points back to itself.  its =links array is
+ * shortened to half of the space after the inode header, and a struct
+ * cnodeinfo fills the rest of the block.  child inodes are unchanged.  stat
+ * and lookup operations then need a single block read per entity. */
+struct cnodeinfo {
+	uint64_t size; /* same as in struct nodeinfo */
+	/* remainder of block used to store this entity's name (and inline
+	 * data, see IMINLINE). */
 	char name[];
 };
 
@@ -79,6 +172,67 @@ struct freepage {
 #define MIN_BLOCK_SIZE 128
 #define MIN_BLOCK_COUNT 32
 
+/* Runtime options (see fs_set_options). */
+#define FS_OPT_DELALLOC 1 /* delayed allocation of file data blocks */
+#define FS_OPT_STATS 2 /* collect struct fs_stats counters */
+#define FS_OPT_SORTFREE 4 /* stage freed blocks and return them sorted */
+
+/* API entry points, as indexed in struct fs_stats */
+enum fs_api {
+	FS_API_WRITE_FILE,
+	FS_API_READ_FILE,
+	FS_API_READ_VIEW,
+	FS_API_UNLINK,
+	FS_API_MKDIR,
+	FS_API_RMDIR,
+	FS_API_LIST_DIR,
+	FS_API_GET_BLOCK,
+	FS_API_PUT_BLOCK,
+	FS_API_SYNC,
+	FS_API_STAT,
+	FS_API_OPENDIR,
+	FS_API_RENAME,
+	FS_API_CLONE,
+	FS_API_SNAPSHOT,
+	FS_API_SEEK,
+	FS_API_COUNT
+};
+
+#define FS_STATS_BUCKETS 24
+
+struct fs_api_stats {
+	uint64_t calls;
+	uint64_t errors; /* calls that returned an error */
+	uint64_t ns; /* cumulative latency */
+	/* =hist[k] counts calls that took less than 2^k microseconds, but
+	 * not less than 2^(k-1); the last bucket also counts slower calls. */
+	uint64_t hist[FS_STATS_BUCKETS];
+};
+
+/* Counters kept while FS_OPT_STATS is set (see fs_get_stats). */
+struct fs_stats {
+	uint64_t reads; /* read requests issued to the image */
+	uint64_t writes; /* write requests issued to the image */
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t syscalls; /* system calls made for those requests */
+	/* lookups in the inode table block cache (FS_FEATURE_ITABLE) */
+	uint64_t icache_hits;
+	uint64_t icache_misses;
+	/* blocks taken from and returned to the free list, inodes included
+	 * unless the image has FS_FEATURE_ITABLE */
+	uint64_t blk_allocs;
+	uint64_t blk_frees;
+	/* inode table entries (FS_FEATURE_ITABLE) */
+	uint64_t inode_allocs;
+	uint64_t inode_frees;
+	uint64_t defrag_files; /* files moved by fs_defrag */
+	/* FS_FEATURE_DEDUP: data blocks linked to an existing block with the
+	 * same contents instead of being written */
+	uint64_t dedup_blocks;
+	struct fs_api_stats api[FS_API_COUNT];
+};
+
 /* Build a new filesystem image in =fname (the file =fname should be present
  * in the OS's filesystem).  The new filesystem should use =blocksize as its
  * block size; the number of blocks in the filesystem will be automatically
@@ -90,9 +244,18 @@ struct freepage {
  * =fname, then the function fails and sets errno to ENOSPC. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize);
 
+/* Same as fs_format, but the image uses the on-disk format features in
+ * =features (a combination of FS_FEATURE_* flags).  Fails with EINVAL if
+ * =features contains an unknown flag.  FS_FEATURE_ITABLE implies
+ * FS_FEATURE_COMPACT, FS_FEATURE_DEDUP implies FS_FEATURE_REFCOUNT, and
+ * FS_FEATURE_DCSUM implies FS_FEATURE_CSUM. */
+struct superblock * fs_format_features(const char *fname, uint64_t blocksize,
+                                       uint64_t features);
+
 /* Open the filesystem in =fname and return its superblock.  Returns NULL on
  * error, and sets errno accordingly.  If =fname does not contain a
- * 0xdcc605fs, then errno is set to EBADF. */
+ * 0xdcc605fs, or if it uses format features unknown to this implementation,
+ * then errno is set to EBADF. */
 struct superblock * fs_open(const char *fname);
 
 /* Close the filesystem pointed to by =sb.  Returns zero on success and a
@@ -100,10 +263,169 @@ struct superblock * fs_open(const char *fname);
  * and errno is set appropriately. */
 int fs_close(struct superblock *sb);
 
+/* Write out everything buffered in memory for the filesystem pointed to by
+ * =sb.  Returns zero on success and a negative number on error. */
+int fs_sync(struct superblock *sb);
+
+/* Replace the runtime options of =sb with =opts, a combination of the
+ * FS_OPT_* flags.  Options are not stored in the image.
+ *
+ * With FS_OPT_DELALLOC, fs_write_file only creates the file's metadata and
+ * keeps its contents in memory; data blocks are allocated when the contents
+ * are flushed by fs_sync, fs_close or by clearing the option.  All buffered
+ * files then get their data blocks in one batch, each file in a single run,
+ * with IMCHILD inodes allocated after them.  Space is still reserved at
+ * write time, so fs_write_file reports ENOSPC as usual.
+ *
+ * With FS_OPT_SORTFREE, blocks freed by fs_put_block, fs_unlink and friends
+ * are staged in memory instead of being pushed on the free list one by
+ * one.  Staged blocks are sorted and linked in ascending order at the head
+ * of the free list once enough of them pile up, when an allocation needs
+ * them, and on fs_sync, fs_close or by clearing the option, so files
+ * written afterwards get ascending, mostly contiguous blocks.  Until then
+ * they are not counted in =freeblks, and a crash leaks them until fs_fsck
+ * repairs the image.  Returns zero on success and a negative number on
+ * error. */
+int fs_set_options(struct superblock *sb, uint64_t opts);
+
+#define FS_FSCK_REPAIR 1 /* rebuild the free lists if they are wrong */
+
+/* What fs_fsck found.  Unless noted, counts cover both blocks and, with
+ * FS_FEATURE_ITABLE, inode table entries. */
+struct fs_fsck_report {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t used; /* referenced from the directory tree */
+	uint64_t free; /* on a free list */
+	uint64_t leaked; /* neither referenced nor free */
+	uint64_t used_free; /* referenced and free at once */
+	/* referenced more than once, besides data blocks shared as recorded
+	 * with FS_FEATURE_REFCOUNT */
+	uint64_t cross_linked;
+	/* FS_FEATURE_REFCOUNT: data blocks whose reference count table entry
+	 * does not match the files that use them */
+	uint64_t bad_refcounts;
+	/* FS_FEATURE_DEDUP: hash table entries of blocks holding no data */
+	uint64_t bad_hashes;
+	/* FS_FEATURE_CSUM: blocks in use whose checksum does not match; they
+	 * are reported, not repaired */
+	uint64_t bad_csums;
+	uint64_t bad_links; /* links outside of the image's data area */
+	/* inodes with a wrong mode, parent or chain, and entities whose
+	 * size does not match their links */
+	uint64_t bad_nodes;
+	/* free lists that loop, leave the data area or are shorter than the
+	 * superblock says */
+	uint64_t bad_free_lists;
+	int repaired; /* the free lists or reference counts were rebuilt */
+};
+
+/* Check the consistency of the filesystem pointed to by =sb.  The
+ * directory tree and every IMCHILD chain are walked from the root by
+ * =nthreads threads (one per CPU if =nthreads is not positive), reading the
+ * image through a read-only mapping; references are then compared with
+ * the free lists.  Results go to =report.  With FS_FSCK_REPAIR in =flags,
+ * leaked and used-but-free blocks and inodes are fixed by rebuilding the
+ * free lists, in ascending order, from what the tree references, and bad
+ * reference counts by rewriting the table from it; other problems are
+ * only reported.  Returns zero if the check ran (whatever it found) and a
+ * negative number on error. */
+int fs_fsck(struct superblock *sb, int flags, int nthreads,
+            struct fs_fsck_report *report);
+
+/* Defragment the filesystem pointed to by =sb, issuing about =budget read
+ * and write requests to the image (no limit if =budget is zero).  A pass
+ * first sorts the free list, then walks the directory tree and moves the
+ * data blocks of each fragmented file into the lowest free run that holds
+ * them, followed by its IMCHILD inodes when those are blocks.  Calls
+ * resume where the previous one stopped, so a pass can be spread over
+ * many calls between normal operations.  The budget is checked between
+ * files, so a call can exceed it by the cost of moving one file (or of
+ * sorting the free list).  While a pass is in progress the free list is
+ * kept sorted: fs_get_block returns ascending blocks and freeing a block
+ * costs an extra write.  Returns 1 if the pass is not finished, 0 once it
+ * is, and a negative number on error. */
+int fs_defrag(struct superblock *sb, uint64_t budget);
+
+/* Copy the host directory tree at =path into the existing directory =dname
+ * of the filesystem pointed to by =sb, which must not contain any of the
+ * names at the top of the tree.  Regular files and directories are
+ * imported; anything else is skipped.  The whole layout is computed up
+ * front from the head of the free lists: inodes and metadata of every
+ * entity come first, in breadth-first order, followed by the data of every
+ * file, so a freshly formatted image is filled sequentially.  File
+ * contents are read by =nthreads threads (one per CPU if =nthreads is not
+ * positive) and written in requests of up to a megabyte, then the metadata
+ * is written out in requests just as large.  Fails with EINVAL if a name
+ * contains a space, ENAMETOOLONG if it is too long and ENOSPC if the tree
+ * does not fit, in which case the image is left unchanged.  Returns the
+ * number of entities imported, or a negative number on error. */
+ssize_t fs_import(struct superblock *sb, const char *dname, const char *path,
+                  int nthreads);
+
+/* Write the tree under directory =dname of the filesystem pointed to by
+ * =sb to =fd as a POSIX tar archive (ustar, with pax headers for long
+ * paths and large files).  Entries are named relative to =dname and come
+ * in a single depth-first walk, directories before their contents.  The
+ * image is read in place through a read-only mapping: runs of adjacent
+ * data blocks are written straight from it, up to a megabyte at a time,
+ * while the next run is read ahead.  Memory use only grows with the depth
+ * of the tree.  Returns the number of entities exported, or a negative
+ * number on error. */
+ssize_t fs_export_tar(struct superblock *sb, const char *dname, int fd);
+
+/* Like fs_export_tar, but recreate the tree inside host directory =path,
+ * which is created if needed.  Existing files are overwritten. */
+ssize_t fs_export_dir(struct superblock *sb, const char *dname,
+                      const char *path);
+
+/* Block trace file format.  A trace starts with a struct fs_trace_header
+ * followed by struct fs_trace_rec entries in host byte order. */
+#define FS_TRACE_MAGIC 0xdcc6057a
+
+#define FS_TRACE_READ 1 /* read from the image */
+#define FS_TRACE_WRITE 2 /* write to the image */
+#define FS_TRACE_CALL 3 /* end of a public call */
+
+struct fs_trace_header {
+	uint64_t magic; /* FS_TRACE_MAGIC */
+	uint64_t blksz;
+};
+
+struct fs_trace_rec {
+	uint64_t ns; /* monotonic clock */
+	/* for FS_TRACE_READ and FS_TRACE_WRITE, the block containing the
+	 * first byte accessed and the number of bytes.  for FS_TRACE_CALL,
+	 * =size counts the file data the call read or wrote for its caller
+	 * (for fs_read_file, fs_read_view and fs_write_file). */
+	uint64_t blk;
+	uint32_t size;
+	uint8_t op; /* FS_TRACE_* */
+	/* public call the access was made for (enum fs_api), or
+	 * FS_API_COUNT for work done outside of them, like flushing buffered
+	 * files from fs_close */
+	uint8_t api;
+	uint16_t pad;
+};
+
+/* Start tracing every read and write =sb makes to its image into the file
+ * =fname, which is created or truncated.  Records are buffered in memory
+ * and written out when the buffer fills, on fs_sync and when tracing
+ * stops.  A NULL =fname stops tracing; fs_close stops it too.  Returns zero
+ * on success and a negative number on error. */
+int fs_trace(struct superblock *sb, const char *fname);
+
+/* Copy the statistics of =sb into =stats.  Counters are only updated while
+ * FS_OPT_STATS is set, and restart from zero each time it gets set; with
+ * the option clear they cost one test per I/O request and API call.
+ * Returns zero on success and a negative number on error. */
+int fs_get_stats(struct superblock *sb, struct fs_stats *stats);
+
 /* Get a free block in the filesystem.  This block shall be removed from the
  * list of free blocks in the filesystem.  If there are no free blocks, zero
- * is returned.  If an error occurs, (uint64_t)-1 is returned and errno is set
- * appropriately. */
+ * is returned; blocks reserved for files buffered by FS_OPT_DELALLOC do not
+ * count as free.  If an error occurs, (uint64_t)-1 is returned and errno is
+ * set appropriately. */
 uint64_t fs_get_block(struct superblock *sb);
 
 /* Put =block back into the filesystem as a free block.  Returns zero on
@@ -117,12 +439,152 @@ int fs_write_file(struct superblock *sb, const char *fname, char *buf,
 ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
                      size_t bufsz);
 
+/* Read-only view of part of a file, returned by fs_read_view.  The =iovcnt
+ * entries of =iov cover =len bytes in file order and can be handed to
+ * writev(2) or sendmsg(2) directly.  Unless the contents were copied, =off
+ * holds the offset of each entry in the image, for splice(2) and friends
+ * on the superblock's =fd; it is NULL otherwise. */
+struct fs_view {
+	struct iovec *iov;
+	int iovcnt;
+	size_t len;
+	uint64_t *off;
+	void *copy; /* private */
+};
+
+/* Return a view of at most =len bytes of =fname starting at =offset, or NULL
+ * on error with errno set as for fs_read_file.  The view is shorter than
+ * =len if the file ends first, and empty if =offset is past the end.  Data
+ * stored in blocks is not copied: the iovecs point into a read-only mapping
+ * of the image.  Inline and not yet flushed contents are copied into the
+ * view, and so are ranges that cross a hole.  The view must be released
+ * with fs_release_view before fs_close; its contents are unspecified if
+ * the file is written or removed in the meantime. */
+struct fs_view * fs_read_view(struct superblock *sb, const char *fname,
+                              uint64_t offset, size_t len);
+
+/* Return the offset of the first byte of =fname at or after =offset that
+ * is stored in a data block (fs_seek_data) or lies in a hole
+ * (fs_seek_hole), like lseek(2) with SEEK_DATA and SEEK_HOLE.  Holes are
+ * whole blocks, or whole chunks in compressed files, and the end of the
+ * file counts as a hole; inline and not yet flushed contents are all
+ * data.  Fails with ENXIO if =offset is not below the size of the file,
+ * or if there is no data after it, and otherwise with errno set as for
+ * fs_read_file.  Returns a negative number on error. */
+ssize_t fs_seek_data(struct superblock *sb, const char *fname, uint64_t offset);
+
+ssize_t fs_seek_hole(struct superblock *sb, const char *fname, uint64_t offset);
+
+/* Release a view returned by fs_read_view. */
+void fs_release_view(struct fs_view *view);
+
+struct fs_stat {
+	uint64_t ino; /* first inode; stable while the entity exists */
+	uint64_t mode; /* IMREG or IMDIR */
+	uint64_t size; /* bytes for files, entries for directories */
+	uint64_t blocks; /* data blocks in the image */
+};
+
+/* Fill =st with the attributes of the file or directory =name.  Returns
+ * zero on success and a negative number on error, with errno set to
+ * ENOENT or ENOTDIR if =name cannot be found. */
+int fs_stat(struct superblock *sb, const char *name, struct fs_stat *st);
+
 int fs_unlink(struct superblock *sb, const char *fname);
 
 int fs_mkdir(struct superblock *sb, const char *dname);
 
 int fs_rmdir(struct superblock *sb, const char *dname);
 
+/* Move the file or directory =oldname to =newname, which may be in another
+ * directory, without copying any data: the entity is relinked and keeps
+ * its inode.  An existing =newname is replaced in place, so it never
+ * disappears; it must be a file if =oldname is a file, and an empty
+ * directory if =oldname is a directory.  Fails with EINVAL when moving a
+ * directory below itself, EBUSY for the root, and as fs_write_file for a
+ * missing parent or a name too long.  Renaming an entity to itself does
+ * nothing.  Returns zero on success and a negative number on error. */
+int fs_rename(struct superblock *sb, const char *oldname, const char *newname);
+
+/* Create the file =dst with the contents of the file =src without copying
+ * them: both files share the data blocks of =src, and a shared block is
+ * only copied when one of the files writes it.  The image must have
+ * FS_FEATURE_REFCOUNT, or the call fails with EOPNOTSUPP.  =dst must not
+ * exist (EEXIST) and =src must be a file (EISDIR); other errors are as for
+ * fs_write_file.  Returns zero on success and a negative number on
+ * error. */
+int fs_clone(struct superblock *sb, const char *src, const char *dst);
+
 char * fs_list_dir(struct superblock *sb, const char *dname);
 
+/* Handle on a directory, for the fs_*at calls.  Handles hold no resources
+ * and need no closing; they can be copied freely, but only used with the
+ * =sb they were made with. */
+struct fs_dir {
+	uint64_t blk; /* first inode of the directory */
+	uint64_t meta; /* its nodeinfo block, to notice a reused inode */
+	uint64_t gen; /* times the inode was allocated, likewise */
+	uint64_t flags; /* FS_DIR_* flags */
+};
+
+/* in a snapshot: names below it cannot change.  Only informs the caller;
+ * the calls find out by themselves. */
+#define FS_DIR_RDONLY 1
+
+/* Fill =dir with a handle on directory =dname.  Returns zero on success and
+ * a negative number on error, with errno set to ENOENT or ENOTDIR if
+ * =dname is not a directory. */
+int fs_opendir(struct superblock *sb, const char *dname, struct fs_dir *dir);
+
+/* The fs_*at calls behave like their path-based counterparts, except that
+ * a name not starting with a delimiter is looked up from the directory
+ * =at, or from the root if =at is NULL, so their cost does not depend on
+ * the depth of =at.  Once the image has snapshots, calls that change a name
+ * also follow the parents of =at to check it is not in one.  An empty name
+ * refers to =at itself.  A handle must not be used once its directory is
+ * removed; calls that notice the inode was freed or reused fail with
+ * ENOENT. */
+int fs_opendirat(struct superblock *sb, const struct fs_dir *at,
+                 const char *dname, struct fs_dir *dir);
+
+int fs_write_fileat(struct superblock *sb, const struct fs_dir *at,
+                    const char *fname, char *buf, size_t cnt);
+
+ssize_t fs_read_fileat(struct superblock *sb, const struct fs_dir *at,
+                       const char *fname, char *buf, size_t bufsz);
+
+int fs_unlinkat(struct superblock *sb, const struct fs_dir *at,
+                const char *fname);
+
+int fs_mkdirat(struct superblock *sb, const struct fs_dir *at,
+               const char *dname);
+
+char * fs_list_dirat(struct superblock *sb, const struct fs_dir *at,
+                     const char *dname);
+
+/* Snapshots are read-only copies of the whole tree as it was when they
+ * were taken, kept outside of it under a name of their own.  Files in a
+ * snapshot share their data blocks with the tree, and the tree's files
+ * write such blocks to new ones (see fs_clone), so taking a snapshot
+ * copies only inodes and the snapshot keeps its data while writes go on.
+ * They need FS_FEATURE_REFCOUNT and fail with EOPNOTSUPP otherwise. */
+
+/* Take a snapshot of the tree called =name, which must not contain
+ * delimiters (EINVAL) nor be taken already (EEXIST).  Buffered files are
+ * written out first.  Returns zero on success and a negative number on
+ * error. */
+int fs_snapshot_create(struct superblock *sb, const char *name);
+
+/* Fill =dir with a handle on the root of snapshot =name, for the fs_*at
+ * calls.  Relative names below it can be read and listed, but calls that
+ * would change them fail with EROFS.  Fails with ENOENT if there is no
+ * such snapshot.  Returns zero on success and a negative number on
+ * error. */
+int fs_snapshot_open(struct superblock *sb, const char *name, struct fs_dir *dir);
+
+/* Delete snapshot =name, releasing the blocks only it still uses.  Handles
+ * on it must not be used any more.  Returns zero on success and a negative
+ * number on error. */
+int fs_snapshot_delete(struct superblock *sb, const char *name);
+
 #endif
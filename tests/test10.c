@@ -0,0 +1,183 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_delalloc_test(struct superblock **sb, uint64_t blksz);
+int fs_reserve_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_delalloc_test(&sb, blksz)) ERROR("FAIL fs_delalloc_test\n");
+	if(fs_reserve_test(sb, blksz)) ERROR("FAIL fs_reserve_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	return 0;
+}
+/*}}}*/
+
+
+int fs_delalloc_test(struct superblock **sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = (*sb)->freeblks;
+	uint64_t size = 10 * blksz + 7;
+	int i;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	assert(data && buf);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_set_options(*sb, FS_OPT_DELALLOC)) ERROR("FAIL fs_set_options\n");
+
+	if(fs_write_file(*sb, "/small", "small", 6) < 0)
+		ERROR("FAIL fs_write_file /small\n");
+	if(fs_write_file(*sb, "/big", data, size) < 0)
+		ERROR("FAIL fs_write_file /big\n");
+	if(fs_write_file(*sb, "/gone", data, size) < 0)
+		ERROR("FAIL fs_write_file /gone\n");
+
+	/* buffered contents must be visible before any flush */
+	if(fs_read_file(*sb, "/big", buf, size) != size)
+		ERROR("FAIL fs_read_file /big before sync\n");
+	if(memcmp(buf, data, size)) ERROR("FAIL /big content before sync\n");
+
+	char *dir = fs_list_dir(*sb, "/");
+	if(strcmp(dir, "small big gone")) ERROR("FAIL fs_list_dir before sync\n");
+	free(dir);
+
+	if(fs_unlink(*sb, "/gone") < 0) ERROR("FAIL fs_unlink buffered file\n");
+
+	if(fs_sync(*sb)) ERROR("FAIL fs_sync\n");
+
+	/* data blocks of /big are allocated as one ascending run */
+	struct inode *inode = malloc(blksz);
+	assert(inode);
+	lseek((*sb)->fd, (*sb)->root * blksz, SEEK_SET);
+	read((*sb)->fd, inode, blksz);
+	lseek((*sb)->fd, inode->links[1] * blksz, SEEK_SET);
+	read((*sb)->fd, inode, blksz);
+	uint64_t nlinks = (blksz - sizeof(struct inode)) / sizeof(uint64_t);
+	for(i = 1; i < 11 && i < nlinks; i++) {
+		if(inode->links[i] != inode->links[i-1] + 1)
+			ERROR("FAIL /big data blocks are not contiguous\n");
+	}
+	free(inode);
+
+	/* rewrite while buffered, then make sure fs_close flushes */
+	if(fs_write_file(*sb, "/small", data, size) < 0)
+		ERROR("FAIL fs_write_file /small\n");
+	if(fs_write_file(*sb, "/small", data, 100) < 0)
+		ERROR("FAIL fs_write_file /small\n");
+	if(fs_close(*sb)) ERROR("FAIL fs_close\n");
+	*sb = fs_open(fname);
+	if(!*sb) ERROR("FAIL fs_open\n");
+
+	if(fs_read_file(*sb, "/small", buf, size) != 100)
+		ERROR("FAIL fs_read_file /small after reopen\n");
+	if(memcmp(buf, data, 100)) ERROR("FAIL /small content after reopen\n");
+	if(fs_read_file(*sb, "/big", buf, size) != size)
+		ERROR("FAIL fs_read_file /big after reopen\n");
+	if(memcmp(buf, data, size)) ERROR("FAIL /big content after reopen\n");
+
+	if(fs_unlink(*sb, "/small") < 0) ERROR("FAIL fs_unlink /small\n");
+	if(fs_unlink(*sb, "/big") < 0) ERROR("FAIL fs_unlink /big\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after fs_delalloc_test\n");
+
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_reserve_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t size = 100 * blksz;
+	uint64_t n = 0;
+	uint64_t i;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	uint64_t *blks = malloc(freeblks * sizeof(uint64_t));
+	assert(data && buf && blks);
+	for(i = 0; i < size; i++) data[i] = 'A' + (i % 26);
+
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL fs_set_options\n");
+	if(fs_write_file(sb, "/a", data, size) < 0)
+		ERROR("FAIL fs_write_file /a\n");
+
+	/* blocks reserved for /a must not be handed out */
+	for(;;) {
+		uint64_t blk = fs_get_block(sb);
+		if(blk == (uint64_t)-1) ERROR("FAIL fs_get_block\n");
+		if(blk == 0) break;
+		if(n == freeblks) ERROR("FAIL fs_get_block never ran out\n");
+		blks[n++] = blk;
+	}
+	if(n + 100 > freeblks) ERROR("FAIL fs_get_block took reserved blocks\n");
+
+	if(fs_sync(sb)) ERROR("FAIL fs_sync after draining free blocks\n");
+	if(fs_read_file(sb, "/a", buf, size) != size)
+		ERROR("FAIL fs_read_file /a after sync\n");
+	if(memcmp(buf, data, size)) ERROR("FAIL /a content after sync\n");
+
+	for(i = 0; i < n; i++) {
+		if(fs_put_block(sb, blks[i])) ERROR("FAIL fs_put_block\n");
+	}
+	if(fs_unlink(sb, "/a") < 0) ERROR("FAIL fs_unlink /a\n");
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_reserve_test\n");
+
+	free(blks);
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
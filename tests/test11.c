@@ -0,0 +1,111 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_inline_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_inline_test(sb, blksz)) ERROR("FAIL fs_inline_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	return 0;
+}
+/*}}}*/
+
+
+int fs_inline_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t size = 3 * blksz;
+	char buf[16];
+	int i;
+
+	char *data = malloc(size);
+	char *big = malloc(size);
+	assert(data && big);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	/* a tiny file takes only its inode and nodeinfo blocks */
+	if(fs_write_file(sb, "/tiny", "0123456789", 10) < 0)
+		ERROR("FAIL fs_write_file /tiny\n");
+	if(freeblks - sb->freeblks != 2) ERROR("FAIL /tiny used a data block\n");
+	if(fs_read_file(sb, "/tiny", buf, sizeof(buf)) != 10)
+		ERROR("FAIL fs_read_file /tiny\n");
+	if(memcmp(buf, "0123456789", 10)) ERROR("FAIL /tiny content mismatch\n");
+
+	/* growing moves the data to blocks, shrinking moves it back inline */
+	if(fs_write_file(sb, "/tiny", data, size) < 0)
+		ERROR("FAIL fs_write_file /tiny (grow)\n");
+	if(freeblks - sb->freeblks != 5) ERROR("FAIL /tiny grown block count\n");
+	if(fs_read_file(sb, "/tiny", big, size) != size)
+		ERROR("FAIL fs_read_file /tiny (grow)\n");
+	if(memcmp(big, data, size)) ERROR("FAIL /tiny grown content mismatch\n");
+
+	if(fs_write_file(sb, "/tiny", "abc", 3) < 0)
+		ERROR("FAIL fs_write_file /tiny (shrink)\n");
+	if(freeblks - sb->freeblks != 2) ERROR("FAIL /tiny shrunk block count\n");
+	if(fs_read_file(sb, "/tiny", buf, sizeof(buf)) != 3)
+		ERROR("FAIL fs_read_file /tiny (shrink)\n");
+	if(memcmp(buf, "abc", 3)) ERROR("FAIL /tiny shrunk content mismatch\n");
+
+	if(fs_write_file(sb, "/empty", "", 0) < 0)
+		ERROR("FAIL fs_write_file /empty\n");
+	if(fs_read_file(sb, "/empty", buf, sizeof(buf)) != 0)
+		ERROR("FAIL fs_read_file /empty\n");
+
+	if(fs_unlink(sb, "/tiny") < 0) ERROR("FAIL fs_unlink /tiny\n");
+	if(fs_unlink(sb, "/empty") < 0) ERROR("FAIL fs_unlink /empty\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_inline_test\n");
+
+	free(data);
+	free(big);
+	return 0;
+}
+/*}}}*/
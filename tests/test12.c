@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_compact_test(struct superblock *sb, uint64_t blksz);
+int fs_legacy_test(uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format_features(fname, blksz, FS_FEATURE_COMPACT);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->version != FS_VERSION_2) ERROR("FAIL version\n");
+	if(fsize/blksz - sb->freeblks != 2) ERROR("FAIL compact empty fs block count\n");
+
+	if(fs_compact_test(sb, blksz)) ERROR("FAIL fs_compact_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(sb->features != FS_FEATURE_COMPACT) ERROR("FAIL features after reopen\n");
+	if(fs_compact_test(sb, blksz)) ERROR("FAIL fs_compact_test after reopen\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	if(fs_legacy_test(blksz)) ERROR("FAIL fs_legacy_test\n");
+
+	return 0;
+}
+/*}}}*/
+
+
+int fs_compact_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t sizes[] = {10, blksz, 7 * blksz + 3, 40 * blksz, 300 * blksz + 1};
+	uint64_t size = 300 * blksz + 1;
+	int i, k;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	assert(data && buf);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_mkdir(sb, "/dir") < 0) ERROR("FAIL fs_mkdir /dir\n");
+	if(fs_mkdir(sb, "/dir/sub") < 0) ERROR("FAIL fs_mkdir /dir/sub\n");
+
+	/* grow and shrink across the first inode and child inodes */
+	for(k = 0; k < NELEMS(sizes); k++) {
+		if(fs_write_file(sb, "/dir/sub/f", data, sizes[k]) < 0)
+			ERROR("FAIL fs_write_file /dir/sub/f\n");
+		if(fs_read_file(sb, "/dir/sub/f", buf, size) != sizes[k])
+			ERROR("FAIL fs_read_file /dir/sub/f\n");
+		if(memcmp(buf, data, sizes[k])) ERROR("FAIL /dir/sub/f content\n");
+	}
+	for(k = NELEMS(sizes) - 1; k >= 0; k--) {
+		if(fs_write_file(sb, "/dir/sub/f", data, sizes[k]) < 0)
+			ERROR("FAIL fs_write_file /dir/sub/f\n");
+		if(fs_read_file(sb, "/dir/sub/f", buf, size) != sizes[k])
+			ERROR("FAIL fs_read_file /dir/sub/f\n");
+		if(memcmp(buf, data, sizes[k])) ERROR("FAIL /dir/sub/f content\n");
+	}
+
+	if(fs_write_file(sb, "/g", data, 2 * blksz) < 0) ERROR("FAIL fs_write_file /g\n");
+
+	char *dir = fs_list_dir(sb, "/");
+	if(strcmp(dir, "dir/ g")) ERROR("FAIL fs_list_dir /\n");
+	free(dir);
+	dir = fs_list_dir(sb, "/dir");
+	if(strcmp(dir, "sub/")) ERROR("FAIL fs_list_dir /dir\n");
+	free(dir);
+
+	if(fs_rmdir(sb, "/dir/sub") == 0) ERROR("FAIL removed non-empty dir\n");
+	if(fs_unlink(sb, "/dir/sub/f") < 0) ERROR("FAIL fs_unlink /dir/sub/f\n");
+	if(fs_unlink(sb, "/g") < 0) ERROR("FAIL fs_unlink /g\n");
+	if(fs_rmdir(sb, "/dir/sub") < 0) ERROR("FAIL fs_rmdir /dir/sub\n");
+	if(fs_rmdir(sb, "/dir") < 0) ERROR("FAIL fs_rmdir /dir\n");
+
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_compact_test\n");
+
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_legacy_test(uint64_t blksz)/*{{{*/
+{
+	/* images written before versioned superblocks have junk after =fd */
+	struct superblock *sb = fs_format(fname, blksz);
+	if(!sb) ERROR("FAIL fs_format\n");
+	if(fs_write_file(sb, "/old", "old", 4) < 0) ERROR("FAIL fs_write_file /old\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	char *junk = malloc(blksz - 52);
+	assert(junk);
+	for(uint64_t i = 0; i < blksz - 52; i++) junk[i] = 0x80 | (char)(i * 37);
+	int fd = open(fname, O_WRONLY);
+	if(fd < 0 || lseek(fd, 52, SEEK_SET) != 52
+			|| write(fd, junk, blksz - 52) != (ssize_t)(blksz - 52))
+		ERROR("FAIL junk after fd\n");
+	close(fd);
+	free(junk);
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open legacy image\n");
+	if(sb->version != FS_VERSION_1 || sb->features != 0)
+		ERROR("FAIL legacy image version\n");
+
+	char buf[4];
+	if(fs_read_file(sb, "/old", buf, 4) != 4 || strcmp(buf, "old"))
+		ERROR("FAIL fs_read_file on legacy image\n");
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.used_free || r.cross_linked)
+		ERROR("FAIL fs_fsck on legacy image\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,173 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_itable_test(struct superblock *sb, uint64_t blksz);
+int fs_inode_exhaustion_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format_features(fname, blksz, FS_FEATURE_ITABLE);
+	if(blksz % FS_INODE_SIZE) {
+		if(sb != NULL || errno != EINVAL) ERROR("FAIL formatted unaligned inode table\n");
+		return 0;
+	}
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->features != (FS_FEATURE_ITABLE | FS_FEATURE_COMPACT))
+		ERROR("FAIL inode table implies compact\n");
+	if(sb->inodes * FS_INODE_SIZE / blksz + 1 + sb->freeblks != fsize/blksz)
+		ERROR("FAIL inode table size\n");
+
+	if(fs_itable_test(sb, blksz)) ERROR("FAIL fs_itable_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(fs_itable_test(sb, blksz)) ERROR("FAIL fs_itable_test after reopen\n");
+	if(fs_inode_exhaustion_test(sb)) ERROR("FAIL fs_inode_exhaustion_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	return 0;
+}
+/*}}}*/
+
+
+int fs_itable_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t nifree = sb->nifree;
+	uint64_t size = 100 * blksz + 5;
+	int i;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	assert(data && buf);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir /d\n");
+	if(fs_write_file(sb, "/d/small", "small", 6) < 0)
+		ERROR("FAIL fs_write_file /d/small\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL metadata used data blocks\n");
+	if(nifree - sb->nifree != 2) ERROR("FAIL inode count\n");
+
+	if(fs_write_file(sb, "/d/big", data, size) < 0)
+		ERROR("FAIL fs_write_file /d/big\n");
+	if(freeblks - sb->freeblks != 101) ERROR("FAIL /d/big block count\n");
+	if(fs_read_file(sb, "/d/big", buf, size) != size)
+		ERROR("FAIL fs_read_file /d/big\n");
+	if(memcmp(buf, data, size)) ERROR("FAIL /d/big content\n");
+
+	if(fs_write_file(sb, "/d/big", data, size / 3) < 0)
+		ERROR("FAIL fs_write_file /d/big (shrink)\n");
+	if(fs_read_file(sb, "/d/big", buf, size) != size / 3)
+		ERROR("FAIL fs_read_file /d/big (shrink)\n");
+	if(memcmp(buf, data, size / 3)) ERROR("FAIL /d/big shrunk content\n");
+
+	char buf2[8];
+	if(fs_read_file(sb, "/d/small", buf2, 8) != 6 || strcmp(buf2, "small"))
+		ERROR("FAIL fs_read_file /d/small\n");
+
+	char *dir = fs_list_dir(sb, "/d");
+	if(strcmp(dir, "small big")) ERROR("FAIL fs_list_dir /d\n");
+	free(dir);
+
+	if(fs_unlink(sb, "/d/small") < 0) ERROR("FAIL fs_unlink /d/small\n");
+	if(fs_unlink(sb, "/d/big") < 0) ERROR("FAIL fs_unlink /d/big\n");
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir /d\n");
+
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_itable_test\n");
+	if(sb->nifree != nifree) ERROR("FAIL nifree after fs_itable_test\n");
+
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_inode_exhaustion_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t nifree = sb->nifree;
+	char name[32];
+	uint64_t i, n = 0;
+
+	/* a single directory grows past one inode's worth of links */
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir /d\n");
+	for(;;) {
+		sprintf(name, "/d/f%d", (int)n);
+		if(fs_write_file(sb, name, "x", 1) < 0) {
+			if(errno != ENOSPC) ERROR("FAIL fs_write_file\n");
+			break;
+		}
+		n++;
+	}
+	if(sb->nifree != 0) ERROR("FAIL ENOSPC with free inodes\n");
+	if(fs_mkdir(sb, "/full") == 0) ERROR("FAIL fs_mkdir when out of inodes\n");
+
+	char *dir = fs_list_dir(sb, "/d");
+	char *p = dir;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "f%d", (int)i);
+		if(strncmp(p, name, strlen(name))) ERROR("FAIL fs_list_dir /d\n");
+		p += strlen(name);
+		if(*p == ' ') p++;
+	}
+	if(*p != '\0') ERROR("FAIL fs_list_dir /d trailing entries\n");
+	free(dir);
+
+	sprintf(name, "/d/f%d", (int)(n - 1));
+	if(fs_read_file(sb, name, name, sizeof(name)) != 1)
+		ERROR("FAIL fs_read_file last entry\n");
+
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/d/f%d", (int)i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir /d\n");
+	if(sb->nifree != nifree) ERROR("FAIL inode accounting\n");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_view_test(struct superblock *sb, uint64_t blksz);
+int check_view(struct superblock *sb, const char *fname, char *data,
+               uint64_t size, uint64_t offset, size_t len);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_view_test(sb, blksz)) ERROR("FAIL fs_view_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* the view of [offset, offset+len) must match the file's contents */
+int check_view(struct superblock *sb, const char *fname, char *data,/*{{{*/
+               uint64_t size, uint64_t offset, size_t len)
+{
+	uint64_t expect = offset >= size ? 0 : (len < size - offset ? len : size - offset);
+	struct fs_view *view = fs_read_view(sb, fname, offset, len);
+	uint64_t pos = offset;
+	int i;
+	if(view == NULL) ERROR("FAIL fs_read_view\n");
+	if(view->len != expect) ERROR("FAIL fs_read_view length\n");
+	for(i = 0; i < view->iovcnt; i++) {
+		if(memcmp(view->iov[i].iov_base, data + pos, view->iov[i].iov_len))
+			ERROR("FAIL fs_read_view content\n");
+		if(view->off) {
+			char *buf = malloc(view->iov[i].iov_len);
+			assert(buf);
+			if(lseek(sb->fd, view->off[i], SEEK_SET) < 0
+					|| read(sb->fd, buf, view->iov[i].iov_len) != view->iov[i].iov_len
+					|| memcmp(buf, data + pos, view->iov[i].iov_len))
+				ERROR("FAIL fs_read_view offsets\n");
+			free(buf);
+		}
+		pos += view->iov[i].iov_len;
+	}
+	if(pos - offset != expect) ERROR("FAIL fs_read_view iovecs\n");
+	fs_release_view(view);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_view_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t size = 20 * blksz + 7;
+	uint64_t offsets[] = {0, 1, blksz - 1, blksz, 3 * blksz + 5};
+	size_t lens[] = {1, blksz, 2 * blksz + 3, 1 << 30};
+	int i, j;
+
+	char *data = malloc(size);
+	assert(data);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_write_file(sb, "/big", data, size) < 0) ERROR("FAIL fs_write_file /big\n");
+	if(fs_write_file(sb, "/tiny", data, 10) < 0) ERROR("FAIL fs_write_file /tiny\n");
+
+	for(i = 0; i < NELEMS(offsets); i++) {
+		for(j = 0; j < NELEMS(lens); j++) {
+			if(check_view(sb, "/big", data, size, offsets[i], lens[j])) return -1;
+			if(check_view(sb, "/tiny", data, 10, offsets[i], lens[j])) return -1;
+		}
+	}
+	if(check_view(sb, "/big", data, size, size, 10)) return -1;
+
+	/* a file written in one go on a fresh image is one contiguous run */
+	struct fs_view *view = fs_read_view(sb, "/big", 0, size);
+	if(!view || view->iovcnt != 1) ERROR("FAIL fs_read_view did not merge blocks\n");
+	fs_release_view(view);
+
+	/* buffered contents are visible before they reach the image */
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL fs_set_options\n");
+	if(fs_write_file(sb, "/big", data + 1, size - 1) < 0)
+		ERROR("FAIL fs_write_file /big (delalloc)\n");
+	if(check_view(sb, "/big", data + 1, size - 1, blksz, 3 * blksz)) return -1;
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options\n");
+	if(check_view(sb, "/big", data + 1, size - 1, blksz, 3 * blksz)) return -1;
+
+	if(fs_read_view(sb, "/", 0, 1) != NULL || errno != EISDIR)
+		ERROR("FAIL fs_read_view on a directory\n");
+	if(fs_read_view(sb, "/none", 0, 1) != NULL || errno != ENOENT)
+		ERROR("FAIL fs_read_view on a missing file\n");
+
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink /big\n");
+	if(fs_unlink(sb, "/tiny") < 0) ERROR("FAIL fs_unlink /tiny\n");
+	free(data);
+	return 0;
+}
+/*}}}*/
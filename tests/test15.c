@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_stats_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_stats_test(sb, blksz)) ERROR("FAIL fs_stats_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int fs_stats_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stats st;
+	uint64_t size = 10 * blksz;
+	uint64_t freeblks;
+	uint64_t calls;
+	int i;
+
+	char *data = malloc(size);
+	assert(data);
+	memset(data, 'x', size);
+
+	/* nothing is counted while the option is off */
+	if(fs_write_file(sb, "/a", data, size) < 0) ERROR("FAIL fs_write_file /a\n");
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats\n");
+	if(st.writes || st.api[FS_API_WRITE_FILE].calls) ERROR("FAIL counted while off\n");
+
+	if(fs_set_options(sb, FS_OPT_STATS)) ERROR("FAIL fs_set_options\n");
+	freeblks = sb->freeblks;
+	if(fs_write_file(sb, "/b", data, size) < 0) ERROR("FAIL fs_write_file /b\n");
+	if(fs_read_file(sb, "/b", data, size) != size) ERROR("FAIL fs_read_file /b\n");
+	if(fs_read_file(sb, "/none", data, size) != -1) ERROR("FAIL fs_read_file /none\n");
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir /d\n");
+	free(fs_list_dir(sb, "/"));
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats\n");
+
+	if(st.api[FS_API_WRITE_FILE].calls != 1) ERROR("FAIL write calls\n");
+	if(st.api[FS_API_READ_FILE].calls != 2) ERROR("FAIL read calls\n");
+	if(st.api[FS_API_READ_FILE].errors != 1) ERROR("FAIL read errors\n");
+	if(st.api[FS_API_MKDIR].calls != 1) ERROR("FAIL mkdir calls\n");
+	if(st.api[FS_API_LIST_DIR].calls != 1) ERROR("FAIL list_dir calls\n");
+	if(st.api[FS_API_UNLINK].calls != 0) ERROR("FAIL unlink calls\n");
+	if(st.blk_allocs - st.blk_frees != freeblks - sb->freeblks)
+		ERROR("FAIL block allocation counters\n");
+	if(st.bytes_read < size || st.bytes_written < size) ERROR("FAIL byte counters\n");
+	if(st.reads == 0 || st.syscalls < st.reads + st.writes) ERROR("FAIL request counters\n");
+	if((sb->features & FS_FEATURE_ITABLE) && (st.icache_hits == 0 || st.inode_allocs != 2))
+		ERROR("FAIL inode table counters\n");
+	for(calls = 0, i = 0; i < FS_STATS_BUCKETS; i++)
+		calls += st.api[FS_API_READ_FILE].hist[i];
+	if(calls != 2) ERROR("FAIL latency histogram\n");
+
+	/* counters restart when the option is set again */
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options\n");
+	if(fs_unlink(sb, "/b") < 0) ERROR("FAIL fs_unlink /b\n");
+	if(fs_set_options(sb, FS_OPT_STATS)) ERROR("FAIL fs_set_options\n");
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats\n");
+	if(st.reads || st.api[FS_API_WRITE_FILE].calls || st.api[FS_API_UNLINK].calls)
+		ERROR("FAIL counters not reset\n");
+
+	if(fs_unlink(sb, "/a") < 0) ERROR("FAIL fs_unlink /a\n");
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir /d\n");
+	free(data);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_trace_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+static char *tname = "img.trace";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_trace_test(sb, blksz)) ERROR("FAIL fs_trace_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(tname);
+
+	return 0;
+}
+/*}}}*/
+
+
+int fs_trace_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_trace_header header;
+	struct fs_trace_rec rec;
+	uint64_t size = 5 * blksz + 3;
+	uint64_t reads = 0, bytes = 0, calls = 0, nrec = 0;
+
+	char *data = malloc(size);
+	assert(data);
+	memset(data, 'x', size);
+
+	if(fs_write_file(sb, "/untraced", data, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_trace(sb, tname)) ERROR("FAIL fs_trace\n");
+	if(fs_read_file(sb, "/untraced", data, size) != size) ERROR("FAIL fs_read_file\n");
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_trace(sb, NULL)) ERROR("FAIL fs_trace stop\n");
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+
+	FILE *fp = fopen(tname, "rb");
+	if(!fp) ERROR("FAIL no trace file\n");
+	if(fread(&header, sizeof(header), 1, fp) != 1) ERROR("FAIL trace header\n");
+	if(header.magic != FS_TRACE_MAGIC || header.blksz != blksz)
+		ERROR("FAIL trace header contents\n");
+	while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+		nrec++;
+		if(rec.api == FS_API_RMDIR) ERROR("FAIL traced after stop\n");
+		if(rec.op == FS_TRACE_CALL) {
+			calls++;
+			if(rec.api == FS_API_READ_FILE && rec.size != size)
+				ERROR("FAIL call record size\n");
+		} else if(rec.op == FS_TRACE_READ && rec.api == FS_API_READ_FILE) {
+			reads++;
+			bytes += rec.size;
+			if(rec.blk == 0 || rec.blk >= sb->blks) ERROR("FAIL traced block\n");
+		} else if(rec.op != FS_TRACE_READ && rec.op != FS_TRACE_WRITE) {
+			ERROR("FAIL trace op\n");
+		}
+	}
+	fclose(fp);
+	if(calls != 2) ERROR("FAIL call records\n");
+	if(reads < 6 || bytes < size) ERROR("FAIL fs_read_file accesses\n");
+	if(nrec == calls + reads) ERROR("FAIL fs_mkdir accesses\n");
+
+	if(fs_unlink(sb, "/untraced") < 0) ERROR("FAIL fs_unlink\n");
+	free(data);
+	return 0;
+}
+/*}}}*/
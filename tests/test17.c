@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_fsck_test(struct superblock *sb, uint64_t blksz);
+int fs_clean(struct superblock *sb, int flags, struct fs_fsck_report *r);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_fsck_test(sb, blksz)) ERROR("FAIL fs_fsck_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* run fs_fsck with a few threads and tell whether it found nothing */
+int fs_clean(struct superblock *sb, int flags, struct fs_fsck_report *r)/*{{{*/
+{
+	if(fs_fsck(sb, flags, 4, r)) return 0;
+	return !r->leaked && !r->used_free && !r->cross_linked && !r->bad_links
+			&& !r->bad_nodes && !r->bad_free_lists;
+}
+/*}}}*/
+
+
+int fs_fsck_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_fsck_report r;
+	char name[64];
+	uint64_t size = 40 * blksz + 1;
+	uint64_t blk;
+	int i, j;
+
+	char *data = malloc(size);
+	assert(data);
+	memset(data, 'x', size);
+
+	if(!fs_clean(sb, 0, &r)) ERROR("FAIL fresh image\n");
+	if(r.files != 0 || r.dirs != 1) ERROR("FAIL fresh image counts\n");
+
+	for(i = 0; i < 5; i++) {
+		sprintf(name, "/d%d", i);
+		if(fs_mkdir(sb, name) < 0) ERROR("FAIL fs_mkdir\n");
+		for(j = 0; j < 20; j++) {
+			sprintf(name, "/d%d/f%d", i, j);
+			if(fs_write_file(sb, name, data, (j % 3) ? size / (j + 1) : 5) < 0)
+				ERROR("FAIL fs_write_file\n");
+		}
+	}
+	if(fs_unlink(sb, "/d0/f1") < 0) ERROR("FAIL fs_unlink\n");
+	if(!fs_clean(sb, 0, &r)) ERROR("FAIL populated image\n");
+	if(r.files != 99 || r.dirs != 6) ERROR("FAIL populated image counts\n");
+
+	/* a block taken off the free list and never used leaks */
+	blk = fs_get_block(sb);
+	if(blk == 0 || blk == (uint64_t)-1) ERROR("FAIL fs_get_block\n");
+	if(fs_clean(sb, 0, &r) || r.leaked != 1) ERROR("FAIL leak not found\n");
+	if(fs_clean(sb, FS_FSCK_REPAIR, &r) || !r.repaired) ERROR("FAIL leak not repaired\n");
+	if(!fs_clean(sb, 0, &r)) ERROR("FAIL image after repair\n");
+
+	/* freeing a block twice loops the free list */
+	blk = fs_get_block(sb);
+	if(fs_put_block(sb, blk) || fs_put_block(sb, blk)) ERROR("FAIL fs_put_block\n");
+	if(fs_clean(sb, 0, &r) || !r.bad_free_lists) ERROR("FAIL loop not found\n");
+	if(fs_clean(sb, FS_FSCK_REPAIR, &r) || !r.repaired) ERROR("FAIL loop not repaired\n");
+	if(!fs_clean(sb, 0, &r)) ERROR("FAIL image after repair\n");
+
+	/* free the inode of root's first entry behind the filesystem's back */
+	if(!(sb->features & FS_FEATURE_ITABLE)) {
+		struct inode *root = malloc(blksz);
+		int fd = open(fname, O_RDONLY);
+		if(fd < 0 || lseek(fd, sb->root * blksz, SEEK_SET) < 0 || read(fd, root, blksz) != blksz)
+			ERROR("FAIL reading the root inode\n");
+		close(fd);
+		if(fs_put_block(sb, root->links[0])) ERROR("FAIL fs_put_block\n");
+		free(root);
+		if(fs_clean(sb, 0, &r) || r.used_free == 0) ERROR("FAIL used block on free list not found\n");
+		if(fs_clean(sb, FS_FSCK_REPAIR, &r) || !r.repaired) ERROR("FAIL not repaired\n");
+		if(fs_fsck(sb, 0, 1, &r) || r.used_free || r.leaked || r.bad_free_lists)
+			ERROR("FAIL free lists after repair\n");
+	}
+
+	free(data);
+	return 0;
+}
+/*}}}*/
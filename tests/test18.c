@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_defrag_test(struct superblock *sb, uint64_t blksz);
+int contiguous(struct superblock *sb, const char *name);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_defrag_test(sb, blksz)) ERROR("FAIL fs_defrag_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* whether the data of =name is one run of blocks */
+int contiguous(struct superblock *sb, const char *name)/*{{{*/
+{
+	struct fs_view *view = fs_read_view(sb, name, 0, (size_t)-1);
+	int ret = view && view->iovcnt == 1;
+	fs_release_view(view);
+	return ret;
+}
+/*}}}*/
+
+
+int fs_defrag_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_fsck_report r;
+	uint64_t size = 30 * blksz + 7, small = 2 * blksz;
+	uint64_t blks[3];
+	char name[32];
+	int i, calls;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	assert(data && buf);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	/* churn leaves the free list scattered */
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "/s%d", i);
+		if(fs_write_file(sb, name, data + i, small) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	for(i = 0; i < 40; i += 2) {
+		sprintf(name, "/s%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_write_file(sb, "/big", data, size) < 0) ERROR("FAIL fs_write_file /big\n");
+	if(contiguous(sb, "/big")) ERROR("FAIL /big is not fragmented\n");
+
+	/* small budgets spread the pass over many calls; the filesystem
+	 * stays usable in between */
+	for(calls = 1; (i = fs_defrag(sb, 20)) == 1; calls++) {
+		if(calls == 2 && fs_unlink(sb, "/s1") < 0) ERROR("FAIL fs_unlink /s1\n");
+		if(calls == 3 && fs_write_file(sb, "/new", data, small) < 0)
+			ERROR("FAIL fs_write_file /new\n");
+	}
+	if(i != 0) ERROR("FAIL fs_defrag\n");
+	if(calls < 3) ERROR("FAIL budget not honored\n");
+
+	if(!contiguous(sb, "/big")) ERROR("FAIL /big still fragmented\n");
+	if(fs_read_file(sb, "/big", buf, size) != size || memcmp(buf, data, size))
+		ERROR("FAIL /big content\n");
+	for(i = 3; i < 40; i += 2) {
+		sprintf(name, "/s%d", i);
+		if(fs_read_file(sb, name, buf, size) != small || memcmp(buf, data + i, small))
+			ERROR("FAIL small file content\n");
+	}
+	if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.used_free || r.cross_linked
+			|| r.bad_links || r.bad_nodes || r.bad_free_lists)
+		ERROR("FAIL fs_fsck after fs_defrag\n");
+
+	/* the pass leaves a sorted free list behind */
+	for(i = 0; i < 3; i++) blks[i] = fs_get_block(sb);
+	if(blks[1] != blks[0] + 1 || blks[2] != blks[1] + 1) ERROR("FAIL free list not sorted\n");
+	for(i = 0; i < 3; i++) fs_put_block(sb, blks[i]);
+
+	/* a second pass has nothing left to move */
+	if(fs_defrag(sb, 0) != 0) ERROR("FAIL second fs_defrag\n");
+
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
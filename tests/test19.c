@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_sortfree_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	struct fs_fsck_report r;
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_sortfree_test(sb, blksz)) ERROR("FAIL fs_sortfree_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+		/* fs_close merges whatever is still staged */
+		sb = fs_open(fname);
+		if(sb == NULL) ERROR("FAIL fs_open\n");
+		if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.bad_free_lists)
+			ERROR("FAIL blocks lost on fs_close\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int fs_sortfree_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_fsck_report r;
+	uint64_t size = 64 * blksz, freeblks, merged, blks[64];
+	char name[32];
+	int i, n;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	assert(data && buf);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_set_options(sb, FS_OPT_SORTFREE)) ERROR("FAIL fs_set_options\n");
+
+	for(i = 0; i < 20; i++) {
+		sprintf(name, "/f%d", i);
+		if(fs_write_file(sb, name, data, 3 * blksz) < 0) ERROR("FAIL fs_write_file\n");
+	}
+
+	/* staged blocks stay off the free list until they are merged */
+	freeblks = sb->freeblks;
+	for(i = 19; i >= 0; i--) {
+		sprintf(name, "/f%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks freed before merge\n");
+	if(fs_sync(sb)) ERROR("FAIL fs_sync\n");
+	if(sb->freeblks <= freeblks) ERROR("FAIL blocks not merged on fs_sync\n");
+
+	/* files were unlinked last to first, yet come back ascending */
+	merged = sb->freeblks;
+	n = merged - freeblks < NELEMS(blks) ? merged - freeblks : NELEMS(blks);
+	for(i = 0; i < n; i++) {
+		blks[i] = fs_get_block(sb);
+		if(i > 0 && blks[i] <= blks[i-1]) ERROR("FAIL blocks not ascending\n");
+	}
+	for(i = 0; i < n; i++) fs_put_block(sb, blks[i]);
+	if(sb->freeblks != merged - n) ERROR("FAIL fs_put_block not staged\n");
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options 0\n");
+	if(sb->freeblks != merged) ERROR("FAIL blocks not merged on clearing the option\n");
+	if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.used_free || r.bad_free_lists)
+		ERROR("FAIL fs_fsck after merge\n");
+
+	/* an allocation that needs staged blocks merges them first */
+	if(fs_set_options(sb, FS_OPT_SORTFREE)) ERROR("FAIL fs_set_options\n");
+	for(n = 0; ; n++) {
+		sprintf(name, "/g%d", n);
+		if(fs_write_file(sb, name, data, size) < 0) break;
+	}
+	for(; ; n++) {
+		sprintf(name, "/g%d", n);
+		if(fs_write_file(sb, name, data, blksz) < 0) break;
+	}
+	if(errno != ENOSPC || n < 2) ERROR("FAIL filling the image\n");
+	if(fs_unlink(sb, "/g0") < 0) ERROR("FAIL fs_unlink /g0\n");
+	if(fs_write_file(sb, "/h", data, size) < 0) ERROR("FAIL fs_write_file after unlink\n");
+	if(fs_read_file(sb, "/h", buf, size) != size || memcmp(buf, data, size))
+		ERROR("FAIL /h content\n");
+	for(i = 1; i < n; i++) {
+		sprintf(name, "/g%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_unlink(sb, "/h") < 0) ERROR("FAIL fs_unlink /h\n");
+
+	free(data);
+	free(buf);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,197 @@
+#define _XOPEN_SOURCE 700
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_import_test(struct superblock *sb, uint64_t blksz);
+int check_tree(struct superblock *sb, const char *dir, uint64_t blksz);
+void put_file(const char *path, uint64_t size);
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_import_test(sb, blksz)) ERROR("FAIL fs_import_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* file whose i-th byte is 'a' + (i + size) % 26 */
+void put_file(const char *path, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	FILE *fp = fopen(path, "w");
+	assert(fp);
+	for(i = 0; i < size; i++) fputc('a' + (i + size) % 26, fp);
+	fclose(fp);
+}
+/*}}}*/
+
+
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)/*{{{*/
+{
+	return remove(path);
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	char *buf = malloc(size + 1);
+	assert(buf);
+	ssize_t n = fs_read_file(sb, name, buf, size + 1);
+	for(i = 0; n == size && i < size; i++)
+		if(buf[i] != 'a' + (i + size) % 26) n = -1;
+	free(buf);
+	return n == size ? 0 : -1;
+}
+/*}}}*/
+
+
+int check_tree(struct superblock *sb, const char *dir, uint64_t blksz)/*{{{*/
+{
+	char name[64];
+	int i;
+	struct { const char *name; uint64_t size; } files[] = {
+		{"a", 0}, {"b", 10}, {"big", 100 * blksz + 5},
+		{"d1/c", 3 * blksz + 1}, {"d1/d2/e", blksz},
+	};
+	for(i = 0; i < NELEMS(files); i++) {
+		sprintf(name, "%s/%s", dir, files[i].name);
+		if(check_file(sb, name, files[i].size)) ERROR("FAIL file content\n");
+	}
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "%s/many/f%d", dir, i);
+		if(check_file(sb, name, 1)) ERROR("FAIL file content in /many\n");
+	}
+	sprintf(name, "%s/d1", dir);
+	char *list = fs_list_dir(sb, name);
+	if(list == NULL || strcmp(list, "c d2/ empty/") != 0) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	sprintf(name, "%s/d1/empty", dir);
+	list = fs_list_dir(sb, name);
+	if(list == NULL || strcmp(list, "") != 0) ERROR("FAIL empty directory\n");
+	free(list);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_import_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_fsck_report r;
+	uint64_t freeblks, nifree;
+	char name[64];
+	int i;
+
+	nftw("img.d", rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	mkdir("img.d", 0755);
+	mkdir("img.d/d1", 0755);
+	mkdir("img.d/d1/d2", 0755);
+	mkdir("img.d/d1/empty", 0755);
+	mkdir("img.d/many", 0755);
+	put_file("img.d/a", 0);
+	put_file("img.d/b", 10);
+	put_file("img.d/big", 100 * blksz + 5);
+	put_file("img.d/d1/c", 3 * blksz + 1);
+	put_file("img.d/d1/d2/e", blksz);
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "img.d/many/f%d", i);
+		put_file(name, 1);
+	}
+
+	if(fs_import(sb, "/", "img.d", 4) != 49) ERROR("FAIL fs_import\n");
+	if(check_tree(sb, "", blksz)) ERROR("FAIL imported tree\n");
+
+	/* a fresh image is filled sequentially */
+	struct fs_view *view = fs_read_view(sb, "/big", 0, (size_t)-1);
+	if(view == NULL || view->iovcnt != 1) ERROR("FAIL /big not contiguous\n");
+	fs_release_view(view);
+
+	/* into an existing directory, with a single thread */
+	if(fs_mkdir(sb, "/sub") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_import(sb, "/sub", "img.d", 1) != 49) ERROR("FAIL fs_import /sub\n");
+	if(check_tree(sb, "/sub", blksz)) ERROR("FAIL tree imported in /sub\n");
+	if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.used_free || r.cross_linked
+			|| r.bad_links || r.bad_nodes || r.bad_free_lists)
+		ERROR("FAIL fs_fsck after fs_import\n");
+	if(r.files != 90 || r.dirs != 10) ERROR("FAIL fs_fsck counts\n");
+
+	/* failures leave the image unchanged */
+	freeblks = sb->freeblks;
+	nifree = sb->nifree;
+	if(fs_import(sb, "/", "img.d", 2) >= 0 || errno != EEXIST) ERROR("FAIL EEXIST\n");
+	if(fs_import(sb, "/b", "img.d", 2) >= 0 || errno != ENOTDIR) ERROR("FAIL ENOTDIR\n");
+	if(fs_import(sb, "/none", "img.d", 2) >= 0) ERROR("FAIL missing directory\n");
+	if(fs_import(sb, "/sub/d1/empty", "img.none", 2) >= 0 || errno != ENOENT)
+		ERROR("FAIL ENOENT\n");
+	put_file("img.d/d1/d2/x y", 1);
+	if(fs_import(sb, "/sub/d1/empty", "img.d", 2) >= 0 || errno != EINVAL) ERROR("FAIL EINVAL\n");
+	remove("img.d/d1/d2/x y");
+	put_file("img.d/d1/huge", (sb->freeblks + 1) * blksz);
+	if(fs_import(sb, "/sub/d1/empty", "img.d", 2) >= 0) ERROR("FAIL no ENOSPC\n");
+	if(errno != ENOSPC) ERROR("FAIL ENOSPC\n");
+	if(sb->freeblks != freeblks || sb->nifree != nifree) ERROR("FAIL space taken on failure\n");
+	if(fs_fsck(sb, 0, 1, &r) || r.leaked || r.used_free || r.bad_free_lists)
+		ERROR("FAIL fs_fsck after failed fs_import\n");
+
+	nftw("img.d", rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
+/*}}}*/
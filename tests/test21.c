@@ -0,0 +1,265 @@
+#define _XOPEN_SOURCE 700
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_export_test(struct superblock *sb, uint64_t blksz);
+int check_tar(struct superblock *sb, const char *tarname, ssize_t count);
+int has_entry(const char *list, const char *entry);
+int same_file(struct superblock *sb, const char *a, const char *b);
+int same_tree(struct superblock *sb, const char *a, const char *b);
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_export_test(sb, blksz)) ERROR("FAIL fs_export_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)/*{{{*/
+{
+	return remove(path);
+}
+/*}}}*/
+
+
+/* walk the archive and compare every file in it with the image */
+int check_tar(struct superblock *sb, const char *tarname, ssize_t count)/*{{{*/
+{
+	char header[512], path[1024], name[1100];
+	char *data = NULL, *buf = NULL;
+	ssize_t entries = 0;
+	int ret = -1, pax = 0;
+	FILE *fp = fopen(tarname, "r");
+	assert(fp);
+	for(;;) {
+		if(fread(header, 1, 512, fp) != 512) goto out;
+		if(header[0] == 0) break;
+		uint64_t size = strtoull(header + 124, NULL, 8), sum = 0;
+		int i;
+		for(i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+		if(sum != strtoull(header + 148, NULL, 8)) goto out;
+		if(memcmp(header + 257, "ustar", 6)) goto out;
+		free(data);
+		data = malloc(size + 512);
+		if(fread(data, 1, (size + 511) / 512 * 512, fp) != (size + 511) / 512 * 512) goto out;
+		if(header[156] == 'x') {
+			/* only "<len> path=<path>\n" records are written here */
+			data[size] = 0;
+			char *p = strstr(data, " path=");
+			if(p == NULL) goto out;
+			sprintf(path, "%.*s", (int)strcspn(p + 6, "\n"), p + 6);
+			pax = 1;
+			continue;
+		}
+		if(!pax) {
+			if(header[345]) sprintf(path, "%.155s/%.100s", header + 345, header);
+			else sprintf(path, "%.100s", header);
+		}
+		pax = 0;
+		entries++;
+		sprintf(name, "/%s", path);
+		if(header[156] == '5') {
+			name[strlen(name) - 1] = 0;
+			char *list = fs_list_dir(sb, name);
+			if(list == NULL) goto out;
+			free(list);
+			continue;
+		}
+		if(header[156] != '0') goto out;
+		free(buf);
+		buf = malloc(size + 1);
+		if(fs_read_file(sb, name, buf, size + 1) != size || memcmp(buf, data, size)) goto out;
+	}
+	ret = entries == count ? 0 : -1;
+out:
+	free(data);
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+/*}}}*/
+
+
+/* whether =entry is one of the space-separated names in =list */
+int has_entry(const char *list, const char *entry)/*{{{*/
+{
+	size_t len = strlen(entry);
+	const char *p;
+	for(p = strstr(list, entry); p; p = strstr(p + 1, entry))
+		if((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == 0))
+			return 1;
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *a, const char *b)/*{{{*/
+{
+	struct fs_view *va = fs_read_view(sb, a, 0, (size_t)-1);
+	struct fs_view *vb = fs_read_view(sb, b, 0, (size_t)-1);
+	int ret = -1;
+	if(va && vb && va->len == vb->len) {
+		char *da = malloc(va->len + 1), *db = malloc(vb->len + 1);
+		if(fs_read_file(sb, a, da, va->len + 1) == va->len
+				&& fs_read_file(sb, b, db, vb->len + 1) == vb->len
+				&& memcmp(da, db, va->len) == 0)
+			ret = 0;
+		free(da);
+		free(db);
+	}
+	fs_release_view(va);
+	fs_release_view(vb);
+	return ret;
+}
+/*}}}*/
+
+
+/* whether directories =a and =b of the image hold the same tree; entries
+ * may be listed in a different order */
+int same_tree(struct superblock *sb, const char *a, const char *b)/*{{{*/
+{
+	char *la = fs_list_dir(sb, a), *lb = fs_list_dir(sb, b);
+	char *entry, *save;
+	int ret = la && lb && strlen(la) == strlen(lb) ? 0 : -1;
+	for(entry = ret ? NULL : strtok_r(la, " ", &save); !ret && entry; entry = strtok_r(NULL, " ", &save)) {
+		char pa[1024], pb[1024];
+		if(!has_entry(lb, entry)) ret = -1;
+		sprintf(pa, "%s/%s", a, entry);
+		sprintf(pb, "%s/%s", b, entry);
+		if(ret == 0 && entry[strlen(entry) - 1] == '/') {
+			pa[strlen(pa) - 1] = 0;
+			pb[strlen(pb) - 1] = 0;
+			ret = same_tree(sb, pa, pb);
+		} else if(ret == 0) {
+			ret = same_file(sb, pa, pb);
+		}
+	}
+	free(la);
+	free(lb);
+	return ret;
+}
+/*}}}*/
+
+
+int fs_export_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t size = 20 * blksz + 3;
+	char name[512], *p;
+	ssize_t n;
+	int i, fd;
+
+	char *data = malloc(size);
+	assert(data);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_mkdir(sb, "/t") < 0) ERROR("FAIL fs_mkdir /t\n");
+	if(fs_write_file(sb, "/t/empty", data, 0) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/t/small", data, 5) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/t/big", data, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_mkdir(sb, "/t/many") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < 30; i++) {
+		sprintf(name, "/t/many/f%d", i);
+		if(fs_write_file(sb, name, data + i, blksz / 2 + i) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	/* deep enough for both ustar prefixes and pax paths */
+	strcpy(name, "/t");
+	for(i = 0; i < 8; i++) {
+		p = name + strlen(name);
+		sprintf(p, "/%039d", i);
+		if(fs_mkdir(sb, name) < 0) ERROR("FAIL fs_mkdir deep\n");
+		strcat(name, "/f");
+		if(fs_write_file(sb, name, data, blksz + i) < 0) ERROR("FAIL fs_write_file deep\n");
+		*(name + strlen(name) - 2) = 0;
+	}
+	if(fs_unlink(sb, "/t/many/f3") < 0) ERROR("FAIL fs_unlink\n");
+
+	fd = open("img.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) ERROR("FAIL open img.tar\n");
+	n = fs_export_tar(sb, "/t", fd);
+	close(fd);
+	if(n != 3 + 1 + 29 + 16) ERROR("FAIL fs_export_tar\n");
+	if(check_tar(sb, "img.tar", n) == 0) ERROR("FAIL names not relative to /t\n");
+
+	/* the same archive from the root also has the /t entry */
+	fd = open("img.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	n = fs_export_tar(sb, "/", fd);
+	close(fd);
+	if(n != 3 + 1 + 29 + 16 + 1) ERROR("FAIL fs_export_tar /\n");
+	if(check_tar(sb, "img.tar", n)) ERROR("FAIL archive content\n");
+	remove("img.tar");
+
+	/* out to a host directory and back in */
+	nftw("img.d", rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	if(fs_export_dir(sb, "/t", "img.d") != n - 1) ERROR("FAIL fs_export_dir\n");
+	if(fs_mkdir(sb, "/copy") < 0) ERROR("FAIL fs_mkdir /copy\n");
+	if(fs_import(sb, "/copy", "img.d", 2) != n - 1) ERROR("FAIL fs_import\n");
+	if(fs_unlink(sb, "/copy/small") < 0 || !same_tree(sb, "/t", "/copy")) ERROR("FAIL same_tree\n");
+	if(fs_write_file(sb, "/copy/small", data, 5) < 0 || same_tree(sb, "/t", "/copy")) ERROR("FAIL round trip\n");
+	nftw("img.d", rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	if(fs_export_tar(sb, "/t/big", 1) >= 0 || errno != ENOTDIR) ERROR("FAIL ENOTDIR\n");
+	if(fs_export_tar(sb, "/none", 1) >= 0) ERROR("FAIL missing directory\n");
+	if(fs_export_tar(sb, "/t", -1) >= 0 || errno != EBADF) ERROR("FAIL EBADF\n");
+
+	free(data);
+	return 0;
+}
+/*}}}*/
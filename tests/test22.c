@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_stat_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_stat_test(sb, blksz)) ERROR("FAIL fs_stat_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int fs_stat_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stat st, st2;
+	uint64_t size = 5 * blksz + 1;
+	int i;
+
+	char *data = malloc(size);
+	assert(data);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_stat(sb, "/", &st) || st.mode != IMDIR || st.size != 0 || st.ino != sb->root)
+		ERROR("FAIL fs_stat /\n");
+
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/d/big", data, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/d/tiny", data, 3) < 0) ERROR("FAIL fs_write_file\n");
+
+	if(fs_stat(sb, "/d", &st) || st.mode != IMDIR || st.size != 2 || st.blocks != 0)
+		ERROR("FAIL fs_stat /d\n");
+	if(fs_stat(sb, "/d/big", &st) || st.mode != IMREG || st.size != size || st.blocks != 6)
+		ERROR("FAIL fs_stat /d/big\n");
+	if(fs_stat(sb, "/d/tiny", &st2) || st2.mode != IMREG || st2.size != 3 || st2.blocks != 0)
+		ERROR("FAIL fs_stat inline file\n");
+	if(st.ino == st2.ino) ERROR("FAIL inode numbers\n");
+
+	/* buffered contents count before they get blocks */
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL fs_set_options\n");
+	if(fs_write_file(sb, "/d/big", data, size - 1) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_stat(sb, "/d/big", &st2) || st2.size != size - 1 || st2.ino != st.ino)
+		ERROR("FAIL fs_stat buffered file\n");
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options\n");
+	if(fs_stat(sb, "/d/big", &st2) || st2.size != size - 1 || st2.blocks != 5)
+		ERROR("FAIL fs_stat after flush\n");
+
+	if(fs_stat(sb, "/d/none", &st) == 0 || errno != ENOENT) ERROR("FAIL ENOENT\n");
+	if(fs_stat(sb, "/d/big/x", &st) == 0 || errno != ENOTDIR) ERROR("FAIL ENOTDIR\n");
+	if(fs_stat(sb, "d", &st) == 0 || errno != ENOENT) ERROR("FAIL relative path\n");
+
+	free(data);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_walk_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_walk_test(sb, blksz)) ERROR("FAIL fs_walk_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int fs_walk_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stat st, st2;
+	char name[64], buf[16];
+	int i;
+
+	/* deep enough that each level is read through the previous one */
+	strcpy(name, "");
+	for(i = 0; i < 8; i++) {
+		strcat(name, "/d");
+		if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir nested\n");
+	}
+	if(fs_write_file(sb, "/d/d/d/d/d/d/d/d/f", "abc", 3) < 0) ERROR("FAIL fs_write_file nested\n");
+	if(fs_read_file(sb, "/d/d/d/d/d/d/d/d/f", buf, sizeof(buf)) != 3) ERROR("FAIL fs_read_file nested\n");
+
+	/* repeated and trailing delimiters name the same entities */
+	if(fs_stat(sb, "/d/d/d/d/d/d/d/d/f", &st)) ERROR("FAIL fs_stat\n");
+	if(fs_stat(sb, "//d///d/d/d/d/d/d/d//f", &st2) || st2.ino != st.ino)
+		ERROR("FAIL repeated delimiters\n");
+	if(fs_stat(sb, "/d/d/", &st) || fs_stat(sb, "/d/d", &st2) || st.ino != st2.ino)
+		ERROR("FAIL trailing delimiter\n");
+	if(fs_write_file(sb, "//d//g", "x", 1) < 0 || fs_stat(sb, "/d/g", &st))
+		ERROR("FAIL create with repeated delimiters\n");
+
+	/* a trailing delimiter cannot name something to create */
+	if(fs_write_file(sb, "/d/h/", "x", 1) == 0 || errno != ENOTDIR) ERROR("FAIL create file/\n");
+	if(fs_mkdir(sb, "/d/h/") == 0 || errno != ENOTDIR) ERROR("FAIL mkdir dir/\n");
+	if(fs_stat(sb, "/d/h", &st) == 0) ERROR("FAIL created with trailing delimiter\n");
+
+	/* components only match whole names */
+	if(fs_write_file(sb, "/d/foo", "x", 1) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_stat(sb, "/d/fo", &st) == 0 || errno != ENOENT) ERROR("FAIL prefix matched\n");
+	if(fs_stat(sb, "/d/foo2", &st) == 0 || errno != ENOENT) ERROR("FAIL longer name matched\n");
+	if(fs_write_file(sb, "/d/fo", "y", 1) < 0) ERROR("FAIL create prefix\n");
+	if(fs_read_file(sb, "/d/foo", buf, sizeof(buf)) != 1 || buf[0] != 'x') ERROR("FAIL foo changed\n");
+
+	/* missing and non-directory intermediates */
+	if(fs_write_file(sb, "/none/f", "x", 1) == 0 || errno != ENOTDIR) ERROR("FAIL missing parent\n");
+	if(fs_mkdir(sb, "/d/foo/e") == 0 || errno != ENOTDIR) ERROR("FAIL file as parent\n");
+	if(fs_stat(sb, "/d/foo/e", &st) == 0 || errno != ENOTDIR) ERROR("FAIL file as directory\n");
+	if(fs_mkdir(sb, "/d/d") == 0 || errno != EEXIST) ERROR("FAIL EEXIST\n");
+
+	/* entries past the first inode of a directory */
+	for(i = 0; i < (int)(blksz / 8 + 2); i++) {
+		sprintf(name, "/d/d/e%d", i);
+		if(fs_write_file(sb, name, name, strlen(name)) < 0) ERROR("FAIL fill directory\n");
+	}
+	for(i = 0; i < (int)(blksz / 8 + 2); i++) {
+		sprintf(name, "/d/d/e%d", i);
+		if(fs_read_file(sb, name, buf, sizeof(buf)) != strlen(name) || memcmp(buf, name, strlen(name)))
+			ERROR("FAIL read back directory\n");
+	}
+
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_at_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_at_test(sb, blksz)) ERROR("FAIL fs_at_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+uint64_t reads_for(struct superblock *sb, const struct fs_dir *at, const char *fname)/*{{{*/
+{
+	struct fs_stats st;
+	char buf[16];
+	if(fs_set_options(sb, FS_OPT_STATS)) return 0;
+	if(fs_read_fileat(sb, at, fname, buf, sizeof(buf)) < 0) return 0;
+	if(fs_get_stats(sb, &st)) return 0;
+	if(fs_set_options(sb, 0)) return 0;
+	return st.reads + st.icache_hits;
+}
+/*}}}*/
+
+
+int fs_at_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_dir top, deep, e, f;
+	char name[64], buf[16];
+	char *list;
+	int i;
+
+	strcpy(name, "");
+	for(i = 0; i < 8; i++) {
+		strcat(name, "/d");
+		if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir\n");
+	}
+	if(fs_opendir(sb, "/d", &top)) ERROR("FAIL fs_opendir /d\n");
+	if(fs_opendir(sb, name, &deep)) ERROR("FAIL fs_opendir deep\n");
+
+	/* names relative to the handle */
+	if(fs_write_fileat(sb, &deep, "f", "abc", 3) < 0) ERROR("FAIL fs_write_fileat\n");
+	if(fs_read_file(sb, "/d/d/d/d/d/d/d/d/f", buf, sizeof(buf)) != 3 || memcmp(buf, "abc", 3))
+		ERROR("FAIL fs_write_fileat content\n");
+	if(fs_write_fileat(sb, &top, "g", "xy", 2) < 0) ERROR("FAIL fs_write_fileat top\n");
+	if(fs_read_fileat(sb, &top, "g", buf, sizeof(buf)) != 2) ERROR("FAIL fs_read_fileat top\n");
+	if(fs_mkdirat(sb, &deep, "e") < 0) ERROR("FAIL fs_mkdirat\n");
+	if(fs_write_fileat(sb, &deep, "e/h", "h", 1) < 0) ERROR("FAIL fs_write_fileat e/h\n");
+	if(fs_read_fileat(sb, &top, "d/d/d/d/d/d/d/e/h", buf, sizeof(buf)) != 1 || buf[0] != 'h')
+		ERROR("FAIL fs_read_fileat relative path\n");
+
+	/* lookups do not depend on the depth of the handle */
+	if(fs_opendirat(sb, &deep, "e", &e)) ERROR("FAIL fs_opendirat\n");
+	if(fs_mkdir(sb, "/s") || fs_opendir(sb, "/s", &f)) ERROR("FAIL fs_opendir /s\n");
+	if(fs_write_fileat(sb, &f, "h", "h", 1) < 0) ERROR("FAIL fs_write_fileat /s/h\n");
+	if(reads_for(sb, &e, "h") == 0 || reads_for(sb, &e, "h") != reads_for(sb, &f, "h"))
+		ERROR("FAIL cost depends on depth\n");
+	if(reads_for(sb, NULL, "/d/d/d/d/d/d/d/d/e/h") <= reads_for(sb, &e, "h"))
+		ERROR("FAIL absolute lookup as cheap\n");
+
+	/* listing, with the empty name for the directory itself */
+	list = fs_list_dirat(sb, &deep, "");
+	if(list == NULL || strcmp(list, "f e/")) ERROR("FAIL fs_list_dirat\n");
+	free(list);
+	list = fs_list_dirat(sb, &deep, "e");
+	if(list == NULL || strcmp(list, "h")) ERROR("FAIL fs_list_dirat e\n");
+	free(list);
+
+	/* absolute names and a NULL handle start at the root */
+	if(fs_read_fileat(sb, &e, "/d/g", buf, sizeof(buf)) != 2) ERROR("FAIL absolute name\n");
+	if(fs_write_fileat(sb, NULL, "r", "r", 1) < 0) ERROR("FAIL NULL handle\n");
+	if(fs_read_file(sb, "/r", buf, sizeof(buf)) != 1) ERROR("FAIL NULL handle content\n");
+
+	/* errors */
+	if(fs_opendirat(sb, &deep, "f", &f) == 0 || errno != ENOTDIR) ERROR("FAIL opendir on a file\n");
+	if(fs_opendirat(sb, &deep, "none", &f) == 0 || errno != ENOENT) ERROR("FAIL opendir ENOENT\n");
+	if(fs_read_fileat(sb, &deep, "none", buf, sizeof(buf)) >= 0 || errno != ENOENT)
+		ERROR("FAIL fs_read_fileat ENOENT\n");
+	if(fs_mkdirat(sb, &deep, "e") == 0 || errno != EEXIST) ERROR("FAIL fs_mkdirat EEXIST\n");
+	if(fs_write_fileat(sb, &deep, "", "x", 1) == 0 || errno != EISDIR) ERROR("FAIL write to handle\n");
+	if(fs_write_fileat(sb, &deep, "a b", "x", 1) == 0) ERROR("FAIL name with space\n");
+
+	if(fs_unlinkat(sb, &e, "h") < 0) ERROR("FAIL fs_unlinkat\n");
+	if(fs_read_file(sb, "/d/d/d/d/d/d/d/d/e/h", buf, sizeof(buf)) >= 0) ERROR("FAIL unlinked file\n");
+	if(fs_unlinkat(sb, &deep, "e") == 0 || errno != EISDIR) ERROR("FAIL fs_unlinkat dir\n");
+
+	/* a freed inode is noticed */
+	if(fs_rmdir(sb, "/d/d/d/d/d/d/d/d/e")) ERROR("FAIL fs_rmdir\n");
+	if(fs_read_fileat(sb, &e, "h", buf, sizeof(buf)) >= 0 || errno != ENOENT) ERROR("FAIL stale handle\n");
+
+	/* and so is a reused one, even with the same nodeinfo block */
+	if(fs_mkdir(sb, "/d/d/d/d/d/d/d/d/e")) ERROR("FAIL fs_mkdir again\n");
+	if(fs_write_file(sb, "/d/d/d/d/d/d/d/d/e/h", "new", 3) < 0) ERROR("FAIL write in new dir\n");
+	errno = 0;
+	if(fs_read_fileat(sb, &e, "h", buf, sizeof(buf)) >= 0 || errno != ENOENT) ERROR("FAIL reused handle\n");
+	errno = 0;
+	if(fs_write_fileat(sb, &e, "i", "x", 1) == 0 || errno != ENOENT) ERROR("FAIL write with reused handle\n");
+	errno = 0;
+	if(fs_mkdirat(sb, &e, "i") == 0 || errno != ENOENT) ERROR("FAIL mkdir with reused handle\n");
+	if(fs_opendirat(sb, &deep, "e", &f)) ERROR("FAIL reopen\n");
+	if(fs_read_fileat(sb, &f, "h", buf, sizeof(buf)) != 3) ERROR("FAIL new handle\n");
+
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_rename_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_COMPACT, FS_FEATURE_ITABLE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_rename_test(sb, blksz)) ERROR("FAIL fs_rename_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int fs_rename_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stat st, st2;
+	struct fs_stats stats;
+	struct fs_fsck_report report;
+	uint64_t size = 20 * blksz, inl, freeblks;
+	char *list;
+	int i;
+
+	char *data = malloc(size);
+	assert(data);
+	for(i = 0; i < size; i++) data[i] = 'a' + (i % 26);
+
+	if(fs_mkdir(sb, "/a") || fs_mkdir(sb, "/b") || fs_mkdir(sb, "/b/c")) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/a/f", data, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_stat(sb, "/a/f", &st)) ERROR("FAIL fs_stat\n");
+
+	/* moves relink the inode without touching the data */
+	freeblks = sb->freeblks;
+	if(fs_set_options(sb, FS_OPT_STATS)) ERROR("FAIL fs_set_options\n");
+	if(fs_rename(sb, "/a/f", "/b/c/g")) ERROR("FAIL fs_rename\n");
+	if(fs_get_stats(sb, &stats) || stats.api[FS_API_RENAME].calls != 1) ERROR("FAIL stats\n");
+	if(stats.writes > 8) ERROR("FAIL fs_rename wrote data\n");
+	if(fs_set_options(sb, 0)) ERROR("FAIL fs_set_options\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL fs_rename allocated\n");
+	if(fs_stat(sb, "/b/c/g", &st2) || st2.ino != st.ino) ERROR("FAIL inode changed\n");
+	if(!same_file(sb, "/b/c/g", data, size)) ERROR("FAIL content after move\n");
+	if(fs_stat(sb, "/a/f", &st) == 0 || errno != ENOENT) ERROR("FAIL old name left\n");
+	if(fs_stat(sb, "/a", &st) || st.size != 0) ERROR("FAIL old parent size\n");
+	if(fs_stat(sb, "/b/c", &st) || st.size != 1) ERROR("FAIL new parent size\n");
+
+	/* within a directory, and to itself */
+	if(fs_rename(sb, "/b/c/g", "/b/c/h")) ERROR("FAIL rename in place\n");
+	if(fs_rename(sb, "/b/c/h", "/b/c/h")) ERROR("FAIL rename to itself\n");
+	list = fs_list_dir(sb, "/b/c");
+	if(strcmp(list, "h")) ERROR("FAIL fs_list_dir after rename\n");
+	free(list);
+
+	/* an existing file is replaced and its blocks freed */
+	if(fs_write_file(sb, "/a/new", data, 3 * blksz) < 0) ERROR("FAIL fs_write_file\n");
+	freeblks = sb->freeblks;
+	if(fs_rename(sb, "/a/new", "/b/c/h")) ERROR("FAIL replace\n");
+	if(sb->freeblks < freeblks + 20) ERROR("FAIL replaced file not freed\n");
+	if(!same_file(sb, "/b/c/h", data, 3 * blksz)) ERROR("FAIL replaced content\n");
+	if(fs_stat(sb, "/b/c", &st) || st.size != 1 || fs_stat(sb, "/a", &st) || st.size != 0)
+		ERROR("FAIL sizes after replace\n");
+
+	/* directories move with their contents */
+	if(fs_rename(sb, "/b/c", "/a/c")) ERROR("FAIL move directory\n");
+	if(!same_file(sb, "/a/c/h", data, 3 * blksz)) ERROR("FAIL content in moved directory\n");
+	if(fs_write_file(sb, "/a/c/k", "k", 1) < 0) ERROR("FAIL write in moved directory\n");
+	if(fs_rename(sb, "/a/c", "/a/c/d") == 0 || errno != EINVAL) ERROR("FAIL moved below itself\n");
+	if(fs_rename(sb, "/a", "/a/c/d") == 0 || errno != EINVAL) ERROR("FAIL moved below itself\n");
+	if(fs_mkdir(sb, "/e")) ERROR("FAIL fs_mkdir /e\n");
+	if(fs_rename(sb, "/a/c", "/e")) ERROR("FAIL replace empty directory\n");
+	if(fs_rename(sb, "/b", "/e") == 0 || errno != ENOTEMPTY) ERROR("FAIL ENOTEMPTY\n");
+	if(fs_rename(sb, "/b", "/e/h") == 0 || errno != ENOTDIR) ERROR("FAIL dir onto file\n");
+	if(fs_rename(sb, "/e/h", "/b") == 0 || errno != EISDIR) ERROR("FAIL file onto dir\n");
+
+	/* other errors */
+	if(fs_rename(sb, "/none", "/x") == 0 || errno != ENOENT) ERROR("FAIL ENOENT\n");
+	if(fs_rename(sb, "/e/h", "/none/x") == 0 || errno != ENOTDIR) ERROR("FAIL missing parent\n");
+	if(fs_rename(sb, "/", "/x") == 0 || errno != EBUSY) ERROR("FAIL moved root\n");
+	if(fs_rename(sb, "/e/h", "/") == 0 || errno != EBUSY) ERROR("FAIL replaced root\n");
+
+	/* inline data that no longer fits next to a longer name */
+	for(inl = 1; inl < blksz; inl++) {
+		if(fs_write_file(sb, "/i", data, inl + 1) < 0 || fs_stat(sb, "/i", &st)) ERROR("FAIL /i\n");
+		if(st.blocks) break;
+	}
+	if(fs_write_file(sb, "/i", data, inl) < 0) ERROR("FAIL fs_write_file /i\n");
+	if(fs_rename(sb, "/i", "/b/ii")) ERROR("FAIL rename inline\n");
+	if(!same_file(sb, "/b/ii", data, inl)) ERROR("FAIL inline content\n");
+	if(fs_rename(sb, "/b/ii", "/b/iiiiiiii")) ERROR("FAIL rename inline longer\n");
+	if(!same_file(sb, "/b/iiiiiiii", data, inl)) ERROR("FAIL inline pushed out\n");
+	if(fs_stat(sb, "/b/iiiiiiii", &st) || st.blocks != 1) ERROR("FAIL inline not moved\n");
+
+	if(fs_fsck(sb, 0, 1, &report)) ERROR("FAIL fs_fsck\n");
+	if(report.leaked || report.used_free || report.cross_linked || report.bad_nodes)
+		ERROR("FAIL fsck after renames\n");
+
+	free(data);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_clone_test(struct superblock *sb, uint64_t blksz);
+int fs_noclone_test(uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {FS_FEATURE_REFCOUNT, FS_FEATURE_COMPACT | FS_FEATURE_REFCOUNT, FS_FEATURE_ITABLE | FS_FEATURE_REFCOUNT};
+	int i;
+	if(fs_noclone_test(blksz)) ERROR("FAIL fs_noclone_test\n");
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_clone_test(sb, blksz)) ERROR("FAIL fs_clone_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_links && !r.bad_nodes && !r.bad_free_lists;
+}
+/*}}}*/
+
+
+int fs_clone_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t nblocks = 40, size = nblocks * blksz - 3;
+	uint64_t freeblks = sb->freeblks;
+	char *data = malloc(size), *data2 = malloc(size);
+	assert(data && data2);
+	for(uint64_t k = 0; k < size; k++) data[k] = (char) (k * 7 + 1);
+	memcpy(data2, data, size);
+	data2[size / 2] ^= 1;
+
+	/* everything goes below /d, so that the root does not grow */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL mkdir");
+	if(fs_write_file(sb, "/d/a", data, size) != 0) ERROR("FAIL write a");
+
+	/* the clone takes no data block */
+	uint64_t before = sb->freeblks;
+	if(fs_clone(sb, "/d/a", "/d/b")) ERROR("FAIL clone a");
+	if(before - sb->freeblks >= nblocks / 2) ERROR("FAIL clone copied data");
+	if(!same_file(sb, "/d/b", data, size)) ERROR("FAIL clone contents");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after clone");
+
+	/* writing either file leaves the other one alone */
+	if(fs_write_file(sb, "/d/b", data2, size) != 0) ERROR("FAIL write b");
+	if(!same_file(sb, "/d/a", data, size)) ERROR("FAIL source changed");
+	if(!same_file(sb, "/d/b", data2, size)) ERROR("FAIL clone not written");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after copy on write");
+
+	/* the data stays until its last user goes */
+	if(fs_clone(sb, "/d/a", "/d/c")) ERROR("FAIL clone a again");
+	before = sb->freeblks;
+	if(fs_unlink(sb, "/d/a")) ERROR("FAIL unlink a");
+	if(sb->freeblks - before >= nblocks / 2) ERROR("FAIL shared data freed");
+	if(!same_file(sb, "/d/c", data, size)) ERROR("FAIL clone lost its data");
+	if(fs_write_file(sb, "/d/c", data, size / 2) != 0) ERROR("FAIL truncate c");
+	if(!same_file(sb, "/d/c", data, size / 2)) ERROR("FAIL truncated clone");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after unlink");
+
+	/* errors */
+	errno = 0;
+	if(fs_clone(sb, "/d/c", "/d/b") != -1 || errno != EEXIST) ERROR("FAIL clone onto a file");
+	errno = 0;
+	if(fs_clone(sb, "/d", "/d/e") != -1 || errno != EISDIR) ERROR("FAIL clone of a dir");
+	errno = 0;
+	if(fs_clone(sb, "/d/x", "/d/e") != -1 || errno != ENOENT) ERROR("FAIL clone of nothing");
+	errno = 0;
+	if(fs_clone(sb, "/d/c", "/d/x/e") != -1 || errno != ENOTDIR) ERROR("FAIL clone into nothing");
+
+	/* inline and buffered sources */
+	if(fs_write_file(sb, "/d/s", "tiny", 4) != 0) ERROR("FAIL write s");
+	if(fs_clone(sb, "/d/s", "/d/t")) ERROR("FAIL clone inline");
+	if(!same_file(sb, "/d/t", "tiny", 4)) ERROR("FAIL inline clone contents");
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+	if(fs_write_file(sb, "/d/u", data2, size) != 0) ERROR("FAIL write u");
+	if(fs_clone(sb, "/d/u", "/d/v")) ERROR("FAIL clone buffered");
+	if(fs_write_file(sb, "/d/v", data, size) != 0) ERROR("FAIL write v");
+	if(fs_sync(sb)) ERROR("FAIL sync");
+	if(!same_file(sb, "/d/u", data2, size)) ERROR("FAIL buffered source");
+	if(!same_file(sb, "/d/v", data, size)) ERROR("FAIL buffered clone");
+	if(fs_set_options(sb, 0)) ERROR("FAIL options");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after buffered clone");
+
+	/* a wrong table entry is found and repaired */
+	struct fs_fsck_report r;
+	uint32_t one = 1;
+	lseek(sb->fd, sb->rctable * blksz + (sb->blks - 1) * sizeof(one), SEEK_SET);
+	if(write(sb->fd, &one, sizeof(one)) != sizeof(one)) ERROR("FAIL corrupt table");
+	if(fs_fsck(sb, FS_FSCK_REPAIR, 0, &r) || r.bad_refcounts != 1 || !r.repaired) ERROR("FAIL fsck repair");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after repair");
+
+	/* nothing is left behind */
+	const char *names[] = {"/d/b", "/d/c", "/d/s", "/d/t", "/d/u", "/d/v"};
+	for(int k = 0; k < NELEMS(names); k++)
+		if(fs_unlink(sb, names[k])) ERROR("FAIL unlink");
+	if(fs_rmdir(sb, "/d")) ERROR("FAIL rmdir");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+
+	free(data);
+	free(data2);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_noclone_test(uint64_t blksz)/*{{{*/
+{
+	generate_file(1 << 20);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb");
+	if(fs_write_file(sb, "/a", "data", 4) != 0) ERROR("FAIL write /a");
+	errno = 0;
+	if(fs_clone(sb, "/a", "/b") != -1 || errno != EOPNOTSUPP) ERROR("FAIL clone without refcounts");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_snapshot_test(struct superblock *sb, uint64_t blksz);
+int fs_nosnapshot_test(uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {FS_FEATURE_REFCOUNT, FS_FEATURE_COMPACT | FS_FEATURE_REFCOUNT, FS_FEATURE_ITABLE | FS_FEATURE_REFCOUNT};
+	int i;
+	if(fs_nosnapshot_test(blksz)) ERROR("FAIL fs_nosnapshot_test\n");
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_snapshot_test(sb, blksz)) ERROR("FAIL fs_snapshot_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_links && !r.bad_nodes && !r.bad_free_lists;
+}
+/*}}}*/
+
+
+int same_fileat(struct superblock *sb, struct fs_dir *at, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_fileat(sb, at, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int fs_snapshot_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t nblocks = 40, size = nblocks * blksz - 3, fsize = 10 * blksz;
+	char *data = malloc(size), *data2 = malloc(size);
+	assert(data && data2);
+	for(uint64_t k = 0; k < size; k++) data[k] = (char) (k * 7 + 1);
+	memcpy(data2, data, size);
+	data2[size / 2] ^= 1;
+
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL mkdir d");
+	if(fs_mkdir(sb, "/d/sub")) ERROR("FAIL mkdir sub");
+	if(fs_write_file(sb, "/d/a", data, size) != 0) ERROR("FAIL write a");
+	if(fs_write_file(sb, "/d/e", "tiny", 4) != 0) ERROR("FAIL write e");
+	if(fs_write_file(sb, "/d/sub/g", data, 100) != 0) ERROR("FAIL write g");
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+	if(fs_write_file(sb, "/f", data2, fsize) != 0) ERROR("FAIL write f");
+
+	/* the snapshot takes no data block, and sees buffered files */
+	uint64_t before = sb->freeblks;
+	if(fs_snapshot_create(sb, "s1")) ERROR("FAIL snapshot");
+	if(fs_set_options(sb, 0)) ERROR("FAIL options");
+	if(before - sb->freeblks >= nblocks / 2 + 10) ERROR("FAIL snapshot copied data");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after snapshot");
+
+	struct fs_dir snap, sd;
+	if(fs_snapshot_open(sb, "s1", &snap)) ERROR("FAIL snapshot open");
+	if(!same_fileat(sb, &snap, "d/a", data, size)) ERROR("FAIL snapshot a");
+	if(!same_fileat(sb, &snap, "f", data2, fsize)) ERROR("FAIL snapshot f");
+	char *list = fs_list_dirat(sb, &snap, "d");
+	if(!list || !strstr(list, "sub/") || !strstr(list, "e")) ERROR("FAIL snapshot list");
+	free(list);
+
+	/* writes go on without touching the snapshot */
+	if(fs_write_file(sb, "/d/a", data2, size) != 0) ERROR("FAIL write a again");
+	before = sb->freeblks;
+	if(fs_unlink(sb, "/f")) ERROR("FAIL unlink f");
+	if(sb->freeblks - before >= 10) ERROR("FAIL pinned blocks freed");
+	if(fs_write_file(sb, "/d/sub/g", data2, 50) != 0) ERROR("FAIL write g again");
+	if(fs_mkdir(sb, "/n")) ERROR("FAIL mkdir n");
+	if(!same_fileat(sb, &snap, "d/a", data, size)) ERROR("FAIL snapshot a changed");
+	if(!same_fileat(sb, &snap, "f", data2, fsize)) ERROR("FAIL snapshot f gone");
+	if(!same_fileat(sb, &snap, "d/sub/g", data, 100)) ERROR("FAIL snapshot g changed");
+	if(!same_fileat(sb, &snap, "d/e", "tiny", 4)) ERROR("FAIL snapshot e");
+	if(!same_fileat(sb, NULL, "/d/a", data2, size)) ERROR("FAIL tree a");
+	errno = 0;
+	if(fs_opendirat(sb, &snap, "n", &sd) != -1 || errno != ENOENT) ERROR("FAIL snapshot sees n");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after writes");
+
+	/* snapshots are read-only, down to the handles opened from them */
+	errno = 0;
+	if(fs_write_fileat(sb, &snap, "d/a", data, 10) != -1 || errno != EROFS) ERROR("FAIL write in snapshot");
+	errno = 0;
+	if(fs_unlinkat(sb, &snap, "f") != -1 || errno != EROFS) ERROR("FAIL unlink in snapshot");
+	errno = 0;
+	if(fs_mkdirat(sb, &snap, "x") != -1 || errno != EROFS) ERROR("FAIL mkdir in snapshot");
+	if(fs_opendirat(sb, &snap, "d", &sd)) ERROR("FAIL opendir in snapshot");
+	errno = 0;
+	if(fs_write_fileat(sb, &sd, "a", data, 10) != -1 || errno != EROFS) ERROR("FAIL write below snapshot");
+	if(!same_fileat(sb, &sd, "a", data, size)) ERROR("FAIL read below snapshot");
+	/* which the handle's flags do not decide */
+	sd.flags = 0;
+	errno = 0;
+	if(fs_write_fileat(sb, &sd, "a", data, 10) != -1 || errno != EROFS) ERROR("FAIL write with flags cleared");
+	snap.flags = 0;
+	errno = 0;
+	if(fs_mkdirat(sb, &snap, "x") != -1 || errno != EROFS) ERROR("FAIL mkdir with flags cleared");
+	if(!same_fileat(sb, &sd, "a", data, size)) ERROR("FAIL snapshot written with flags cleared");
+
+	/* errors */
+	errno = 0;
+	if(fs_snapshot_create(sb, "s1") != -1 || errno != EEXIST) ERROR("FAIL snapshot twice");
+	errno = 0;
+	if(fs_snapshot_create(sb, "s/2") != -1 || errno != EINVAL) ERROR("FAIL snapshot name");
+	errno = 0;
+	if(fs_snapshot_open(sb, "s2", &sd) != -1 || errno != ENOENT) ERROR("FAIL open missing snapshot");
+	errno = 0;
+	if(fs_snapshot_delete(sb, "s2") != -1 || errno != ENOENT) ERROR("FAIL delete missing snapshot");
+
+	/* deleting the snapshot releases what only it used */
+	if(fs_snapshot_create(sb, "s2")) ERROR("FAIL second snapshot");
+	before = sb->freeblks;
+	if(fs_snapshot_delete(sb, "s1")) ERROR("FAIL delete s1");
+	if(sb->freeblks - before < nblocks + 10) ERROR("FAIL s1 blocks not freed");
+	if(fs_snapshot_open(sb, "s2", &snap)) ERROR("FAIL open s2");
+	if(!same_fileat(sb, &snap, "d/a", data2, size)) ERROR("FAIL snapshot s2 a");
+	if(fs_unlink(sb, "/d/a")) ERROR("FAIL unlink a");
+	if(!same_fileat(sb, &snap, "d/a", data2, size)) ERROR("FAIL s2 lost a");
+	if(fs_snapshot_delete(sb, "s2")) ERROR("FAIL delete s2");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+
+	free(data);
+	free(data2);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_nosnapshot_test(uint64_t blksz)/*{{{*/
+{
+	struct fs_dir snap;
+	generate_file(1 << 20);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb");
+	errno = 0;
+	if(fs_snapshot_create(sb, "s") != -1 || errno != EOPNOTSUPP) ERROR("FAIL snapshot without refcounts");
+	errno = 0;
+	if(fs_snapshot_open(sb, "s", &snap) != -1 || errno != EOPNOTSUPP) ERROR("FAIL open without refcounts");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
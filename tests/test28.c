@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_compress_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1<<23};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {FS_FEATURE_COMPRESS, FS_FEATURE_COMPACT | FS_FEATURE_COMPRESS,
+		FS_FEATURE_ITABLE | FS_FEATURE_COMPRESS, FS_FEATURE_REFCOUNT | FS_FEATURE_COMPRESS};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_compress_test(sb, blksz)) ERROR("FAIL fs_compress_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int same_view(struct superblock *sb, const char *fname, const char *data, uint64_t offset, size_t len)/*{{{*/
+{
+	struct fs_view *view = fs_read_view(sb, fname, offset, len);
+	uint64_t pos = offset;
+	int ok = view != NULL && view->len == len;
+	for(int i = 0; ok && i < view->iovcnt; i++) {
+		ok = memcmp(view->iov[i].iov_base, data + pos, view->iov[i].iov_len) == 0;
+		pos += view->iov[i].iov_len;
+	}
+	if(view) fs_release_view(view);
+	return ok && pos - offset == len;
+}
+/*}}}*/
+
+
+uint64_t stored_blocks(struct superblock *sb, const char *fname)/*{{{*/
+{
+	struct fs_stat st;
+	if(fs_stat(sb, fname, &st)) return UINT64_MAX;
+	return st.blocks;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_links && !r.bad_nodes && !r.bad_free_lists;
+}
+/*}}}*/
+
+
+int fs_compress_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t size = 600 * 1024 + 11, rsize = 100 * 1024 + 5;
+	uint64_t freeblks = sb->freeblks;
+	char *text = malloc(size), *noise = malloc(size), *mixed = malloc(size);
+	assert(text && noise && mixed);
+	srand(blksz);
+	for(uint64_t k = 0; k < size; k++) {
+		text[k] = "the quick brown fox jumps over the lazy dog "[(k * 3 + k / 1000) % 44];
+		noise[k] = (char) rand();
+	}
+	/* compressible and incompressible chunks in one file */
+	for(uint64_t k = 0; k < size; k++)
+		mixed[k] = (k / FS_COMP_CHUNK) % 2 ? noise[k] : text[k];
+
+	/* everything goes below /d, so that the root does not grow */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL mkdir");
+
+	/* compressible data takes fewer blocks and reads back the same */
+	uint64_t before = sb->freeblks;
+	if(fs_write_file(sb, "/d/t", text, size) != 0) ERROR("FAIL write t");
+	if(!same_file(sb, "/d/t", text, size)) ERROR("FAIL compressed contents");
+	if(stored_blocks(sb, "/d/t") > size / blksz / 2) ERROR("FAIL not compressed");
+	if(before - sb->freeblks > size / blksz / 2) ERROR("FAIL compressed file took blocks");
+	if(!same_view(sb, "/d/t", text, 0, 10)) ERROR("FAIL view at start");
+	if(!same_view(sb, "/d/t", text, FS_COMP_CHUNK - 7, 3 * blksz)) ERROR("FAIL view across chunks");
+	if(!same_view(sb, "/d/t", text, size - 100, 100)) ERROR("FAIL view at end");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after compressed write");
+
+	/* incompressible data is stored as it is */
+	if(fs_write_file(sb, "/d/r", noise, rsize) != 0) ERROR("FAIL write r");
+	if(!same_file(sb, "/d/r", noise, rsize)) ERROR("FAIL raw contents");
+	if(stored_blocks(sb, "/d/r") != (rsize + blksz - 1) / blksz) ERROR("FAIL raw blocks");
+
+	/* each chunk is stored the best way */
+	if(fs_write_file(sb, "/d/m", mixed, size) != 0) ERROR("FAIL write m");
+	if(!same_file(sb, "/d/m", mixed, size)) ERROR("FAIL mixed contents");
+	if(!same_view(sb, "/d/m", mixed, FS_COMP_CHUNK - 5, 10)) ERROR("FAIL mixed view");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after mixed write");
+
+	/* files switch between compressed and raw, larger and smaller */
+	if(fs_write_file(sb, "/d/r", text, size) != 0) ERROR("FAIL raw to compressed");
+	if(!same_file(sb, "/d/r", text, size)) ERROR("FAIL raw to compressed contents");
+	if(fs_write_file(sb, "/d/t", noise, rsize) != 0) ERROR("FAIL compressed to raw");
+	if(!same_file(sb, "/d/t", noise, rsize)) ERROR("FAIL compressed to raw contents");
+	if(fs_write_file(sb, "/d/m", text, size / 3) != 0) ERROR("FAIL truncate m");
+	if(!same_file(sb, "/d/m", text, size / 3)) ERROR("FAIL truncated contents");
+	if(fs_write_file(sb, "/d/m", mixed, size) != 0) ERROR("FAIL grow m");
+	if(!same_file(sb, "/d/m", mixed, size)) ERROR("FAIL grown contents");
+	if(fs_write_file(sb, "/d/m", "tiny", 4) != 0) ERROR("FAIL inline m");
+	if(!same_file(sb, "/d/m", "tiny", 4)) ERROR("FAIL inline contents");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after rewrites");
+
+	/* buffered writes are compressed when flushed */
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+	if(fs_write_file(sb, "/d/b", text, size) != 0) ERROR("FAIL write b");
+	if(fs_write_file(sb, "/d/c", mixed, size) != 0) ERROR("FAIL write c");
+	if(fs_sync(sb)) ERROR("FAIL sync");
+	if(fs_set_options(sb, 0)) ERROR("FAIL options");
+	if(!same_file(sb, "/d/b", text, size)) ERROR("FAIL buffered contents");
+	if(!same_file(sb, "/d/c", mixed, size)) ERROR("FAIL buffered mixed contents");
+	if(stored_blocks(sb, "/d/b") > size / blksz / 2) ERROR("FAIL buffered not compressed");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after buffered writes");
+
+	/* clones share the compressed blocks */
+	if(sb->features & FS_FEATURE_REFCOUNT) {
+		if(fs_clone(sb, "/d/c", "/d/e")) ERROR("FAIL clone");
+		if(!same_file(sb, "/d/e", mixed, size)) ERROR("FAIL clone contents");
+		if(fs_write_file(sb, "/d/c", text, size) != 0) ERROR("FAIL write source");
+		if(!same_file(sb, "/d/e", mixed, size)) ERROR("FAIL clone changed");
+		if(fs_write_file(sb, "/d/e", noise, size / 2) != 0) ERROR("FAIL write clone");
+		if(!same_file(sb, "/d/e", noise, size / 2)) ERROR("FAIL clone write contents");
+		if(fs_unlink(sb, "/d/e")) ERROR("FAIL unlink clone");
+		if(!fsck_clean(sb)) ERROR("FAIL fsck after clones");
+	}
+
+	/* nothing is left behind */
+	const char *names[] = {"/d/t", "/d/r", "/d/m", "/d/b", "/d/c"};
+	for(int k = 0; k < NELEMS(names); k++)
+		if(fs_unlink(sb, names[k])) ERROR("FAIL unlink");
+	if(fs_rmdir(sb, "/d")) ERROR("FAIL rmdir");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+
+	free(text);
+	free(noise);
+	free(mixed);
+	return 0;
+}
+/*}}}*/
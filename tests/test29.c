@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_dedup_test(struct superblock **sbp, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {FS_FEATURE_DEDUP, FS_FEATURE_COMPACT | FS_FEATURE_DEDUP,
+		FS_FEATURE_ITABLE | FS_FEATURE_DEDUP, FS_FEATURE_COMPRESS | FS_FEATURE_DEDUP};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(!(sb->features & FS_FEATURE_REFCOUNT)) ERROR("FAIL no reference counts\n");
+		if(fs_dedup_test(&sb, blksz)) ERROR("FAIL fs_dedup_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int same_view(struct superblock *sb, const char *fname, const char *data, uint64_t offset, size_t len)/*{{{*/
+{
+	struct fs_view *view = fs_read_view(sb, fname, offset, len);
+	uint64_t pos = offset;
+	int ok = view != NULL && view->len == len;
+	for(int i = 0; ok && i < view->iovcnt; i++) {
+		ok = memcmp(view->iov[i].iov_base, data + pos, view->iov[i].iov_len) == 0;
+		pos += view->iov[i].iov_len;
+	}
+	if(view) fs_release_view(view);
+	return ok && pos - offset == len;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_hashes && !r.bad_links && !r.bad_nodes && !r.bad_free_lists;
+}
+/*}}}*/
+
+
+int fs_dedup_test(struct superblock **sbp, uint64_t blksz)/*{{{*/
+{
+	struct superblock *sb = *sbp;
+	uint64_t nblocks = 40, size = nblocks * blksz + 9;
+	uint64_t freeblks = sb->freeblks;
+	char *data = malloc(size), *data2 = malloc(size), *same = malloc(size);
+	assert(data && data2 && same);
+	srand(blksz);
+	for(uint64_t k = 0; k < size; k++) data[k] = (char) rand();
+	memcpy(data2, data, size);
+	data2[size / 2] ^= 1;
+	/* the same block over and over */
+	for(uint64_t k = 0; k < size; k++) same[k] = data[k % blksz];
+
+	/* everything goes below /d, so that the root does not grow */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL mkdir");
+	uint64_t before = sb->freeblks;
+	if(fs_write_file(sb, "/d/a", data, size) != 0) ERROR("FAIL write a");
+	if(before - sb->freeblks < nblocks) ERROR("FAIL first copy not stored");
+
+	/* a second copy links to the first one */
+	struct fs_stats st;
+	if(fs_set_options(sb, FS_OPT_STATS)) ERROR("FAIL stats");
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/d/b", data, size) != 0) ERROR("FAIL write b");
+	if(before - sb->freeblks >= nblocks / 2) ERROR("FAIL copy not deduplicated");
+	if(fs_get_stats(sb, &st) || st.dedup_blocks != nblocks) ERROR("FAIL dedup counter");
+	if(st.bytes_written >= nblocks * blksz / 2) ERROR("FAIL copy written");
+	if(fs_set_options(sb, 0)) ERROR("FAIL options");
+	if(!same_file(sb, "/d/b", data, size)) ERROR("FAIL copy contents");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after copy");
+
+	/* repeated blocks within one file are stored once */
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/d/s", same, size) != 0) ERROR("FAIL write s");
+	if(before - sb->freeblks >= nblocks / 2) ERROR("FAIL repeated blocks stored");
+	if(!same_file(sb, "/d/s", same, size)) ERROR("FAIL repeated contents");
+	if(!same_view(sb, "/d/s", same, blksz - 3, 3 * blksz)) ERROR("FAIL repeated view");
+
+	/* writing a shared block leaves the other files alone */
+	if(fs_write_file(sb, "/d/a", data2, size) != 0) ERROR("FAIL write a again");
+	if(!same_file(sb, "/d/a", data2, size)) ERROR("FAIL changed contents");
+	if(!same_file(sb, "/d/b", data, size)) ERROR("FAIL other copy changed");
+	if(fs_write_file(sb, "/d/s", data, size) != 0) ERROR("FAIL overwrite s");
+	if(!same_file(sb, "/d/s", data, size)) ERROR("FAIL overwritten contents");
+	if(fs_write_file(sb, "/d/s", same, size / 2) != 0) ERROR("FAIL truncate s");
+	if(!same_file(sb, "/d/s", same, size / 2)) ERROR("FAIL truncated contents");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after rewrites");
+
+	/* the hashes are kept in the image */
+	if(fs_close(sb)) ERROR("FAIL close");
+	if((sb = *sbp = fs_open(fname)) == NULL) ERROR("FAIL open");
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/d/c", data2, size) != 0) ERROR("FAIL write c");
+	if(before - sb->freeblks >= nblocks / 2) ERROR("FAIL not deduplicated after open");
+	if(!same_file(sb, "/d/c", data2, size)) ERROR("FAIL contents after open");
+
+	/* data survives its first writer */
+	if(fs_unlink(sb, "/d/a")) ERROR("FAIL unlink a");
+	if(!same_file(sb, "/d/c", data2, size)) ERROR("FAIL contents after unlink");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after unlink");
+
+	/* a hash left on a free block is found and cleared */
+	struct fs_fsck_report r;
+	uint32_t h = 1;
+	uint64_t tail = sb->rctable + 2 * sb->rcblocks - 1;
+	lseek(sb->fd, tail * blksz, SEEK_SET);
+	if(write(sb->fd, &h, sizeof(h)) != sizeof(h)) ERROR("FAIL corrupt table");
+	if(fs_fsck(sb, FS_FSCK_REPAIR, 0, &r) || r.bad_hashes != 1 || !r.repaired) ERROR("FAIL fsck repair");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after repair");
+
+	/* defrag moves hashes with the data, right after fs_open too */
+	char *data3 = malloc(size);
+	assert(data3);
+	for(uint64_t k = 0; k < size; k++) data3[k] = data[k] ^ 0x55;
+	if(fs_write_file(sb, "/d/f", data3, size / 2) != 0) ERROR("FAIL write f");
+	if(fs_write_file(sb, "/d/g", data3 + size / 2, 3 * blksz) != 0) ERROR("FAIL write g");
+	if(fs_write_file(sb, "/d/f", data3, size) != 0) ERROR("FAIL grow f");
+	if(fs_unlink(sb, "/d/g")) ERROR("FAIL unlink g");
+	if(fs_close(sb)) ERROR("FAIL close before defrag");
+	if((sb = *sbp = fs_open(fname)) == NULL) ERROR("FAIL open before defrag");
+	if(fs_set_options(sb, FS_OPT_STATS)) ERROR("FAIL stats");
+	if(fs_defrag(sb, 0) != 0) ERROR("FAIL defrag");
+	if(fs_get_stats(sb, &st) || st.defrag_files == 0) ERROR("FAIL nothing defragmented");
+	if(fs_set_options(sb, 0)) ERROR("FAIL options");
+	if(!same_file(sb, "/d/f", data3, size)) ERROR("FAIL contents after defrag");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after defrag");
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/d/f2", data3, size) != 0) ERROR("FAIL write f2");
+	if(before - sb->freeblks >= nblocks / 2) ERROR("FAIL hashes lost by defrag");
+	free(data3);
+
+	/* nothing is left behind */
+	const char *names[] = {"/d/b", "/d/c", "/d/s", "/d/f", "/d/f2"};
+	for(int k = 0; k < NELEMS(names); k++)
+		if(fs_unlink(sb, names[k])) ERROR("FAIL unlink");
+	if(fs_rmdir(sb, "/d")) ERROR("FAIL rmdir");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+
+	free(data);
+	free(data2);
+	free(same);
+	return 0;
+}
+/*}}}*/
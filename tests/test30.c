@@ -0,0 +1,309 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_csum_test(struct superblock **sbp, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {FS_FEATURE_CSUM, FS_FEATURE_COMPACT | FS_FEATURE_CSUM,
+		FS_FEATURE_ITABLE | FS_FEATURE_CSUM, FS_FEATURE_DCSUM,
+		FS_FEATURE_ITABLE | FS_FEATURE_DCSUM, FS_FEATURE_COMPRESS | FS_FEATURE_DCSUM,
+		FS_FEATURE_DEDUP | FS_FEATURE_DCSUM, FS_FEATURE_REFCOUNT | FS_FEATURE_CSUM};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(!(sb->features & FS_FEATURE_CSUM) || sb->cstable == 0) ERROR("FAIL no checksum table\n");
+		if(fs_csum_test(&sb, blksz)) ERROR("FAIL fs_csum_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int same_view(struct superblock *sb, const char *fname, const char *data, uint64_t offset, size_t len)/*{{{*/
+{
+	struct fs_view *view = fs_read_view(sb, fname, offset, len);
+	uint64_t pos = offset;
+	int ok = view != NULL && view->len == len;
+	for(int i = 0; ok && i < view->iovcnt; i++) {
+		ok = memcmp(view->iov[i].iov_base, data + pos, view->iov[i].iov_len) == 0;
+		pos += view->iov[i].iov_len;
+	}
+	if(view) fs_release_view(view);
+	return ok && pos - offset == len;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_hashes && !r.bad_csums && !r.bad_links && !r.bad_nodes
+		&& !r.bad_free_lists;
+}
+/*}}}*/
+
+
+uint64_t bad_csums(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return r.bad_csums;
+}
+/*}}}*/
+
+
+/* flip a byte of the closed image at offset =off */
+int flip_byte(uint64_t off)/*{{{*/
+{
+	char c;
+	int fd = open(fname, O_RDWR);
+	if(fd < 0) return -1;
+	if(lseek(fd, off, SEEK_SET) != off || read(fd, &c, 1) != 1) { close(fd); return -1; }
+	c ^= 0x20;
+	if(lseek(fd, off, SEEK_SET) != off || write(fd, &c, 1) != 1) { close(fd); return -1; }
+	close(fd);
+	return 0;
+}
+/*}}}*/
+
+
+/* flip a byte of the image at offset =off, then open it again */
+struct superblock * flip(struct superblock *sb, uint64_t off)/*{{{*/
+{
+	if(fs_close(sb) || flip_byte(off)) return NULL;
+	return fs_open(fname);
+}
+/*}}}*/
+
+
+/* offset of inode =ino in the image */
+uint64_t inode_off(struct superblock *sb, uint64_t ino)/*{{{*/
+{
+	return (sb->features & FS_FEATURE_ITABLE)
+		? sb->itable * sb->blksz + ino * FS_INODE_SIZE
+		: ino * sb->blksz;
+}
+/*}}}*/
+
+
+int fs_csum_test(struct superblock **sbp, uint64_t blksz)/*{{{*/
+{
+	struct superblock *sb = *sbp;
+	uint64_t nblocks = 40, size = nblocks * blksz + 9;
+	int dcsum = (sb->features & FS_FEATURE_DCSUM) != 0;
+	char *data = malloc(size + blksz), *buf = malloc(size + blksz);
+	assert(data && buf);
+	srand(blksz);
+	for(uint64_t k = 0; k < size + blksz; k++) data[k] = (char) rand();
+
+	/* everything goes below /d, so that the root does not grow */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL mkdir");
+	if(fs_mkdir(sb, "/d/e")) ERROR("FAIL mkdir e");
+	if(fs_write_file(sb, "/d/a", data, 5) != 0) ERROR("FAIL write a");
+	if(fs_write_file(sb, "/d/c", data, size) != 0) ERROR("FAIL write c");
+	if(fs_write_file(sb, "/d/e/b", data + 1, size - 1) != 0) ERROR("FAIL write b");
+	if(!same_file(sb, "/d/c", data, size)) ERROR("FAIL contents");
+	if(!same_view(sb, "/d/c", data, blksz + 3, 2 * blksz)) ERROR("FAIL view");
+	/* short reads still check whole blocks */
+	if(fs_read_file(sb, "/d/c", buf, size - 3) != size - 3 || memcmp(buf, data, size - 3))
+		ERROR("FAIL short read");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after writes");
+
+	/* checksums survive fs_close and fs_open */
+	if(fs_close(sb)) ERROR("FAIL close");
+	if((sb = fs_open(fname)) == NULL) ERROR("FAIL open");
+	if(!same_file(sb, "/d/e/b", data + 1, size - 1)) ERROR("FAIL contents after open");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after open");
+
+	/* a byte of an inode no structural check looks at */
+	struct fs_stat st;
+	if(fs_stat(sb, "/d/a", &st)) ERROR("FAIL stat");
+	uint64_t ioff = (sb->features & FS_FEATURE_ITABLE)
+		? sb->itable * blksz + (st.ino + 1) * FS_INODE_SIZE - 1
+		: (st.ino + 1) * blksz - 1;
+	if((sb = flip(sb, ioff)) == NULL) ERROR("FAIL flip inode");
+	if(fs_read_file(sb, "/d/a", buf, size) != -1 || errno != EIO) ERROR("FAIL read of bad inode");
+	if(fs_stat(sb, "/d/a", &st) != -1 || errno != EIO) ERROR("FAIL stat of bad inode");
+	if(bad_csums(sb) == 0) ERROR("FAIL fsck missed bad inode");
+	/* entries after it are still found */
+	if(!(sb->features & FS_FEATURE_ITABLE) && !same_file(sb, "/d/c", data, size))
+		ERROR("FAIL neighbour of bad inode");
+	/* calls that change it fail alike, and leave it alone */
+	errno = 0;
+	if(fs_write_file(sb, "/d/a", data, 7) != -1 || errno != EIO) ERROR("FAIL write of bad inode");
+	errno = 0;
+	if(fs_unlink(sb, "/d/a") != -1 || errno != EIO) ERROR("FAIL unlink of bad inode");
+	errno = 0;
+	if(fs_rename(sb, "/d/a", "/d/z") != -1 || errno != EIO) ERROR("FAIL rename of bad inode");
+	errno = 0;
+	if(fs_list_dir(sb, "/d") != NULL || errno != EIO) ERROR("FAIL list of bad inode");
+	if((sb = flip(sb, ioff)) == NULL) ERROR("FAIL flip inode back");
+	if(!same_file(sb, "/d/a", data, 5)) ERROR("FAIL read of restored inode");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after restore");
+
+	/* a bad root fails every path */
+	uint64_t roff = (sb->features & FS_FEATURE_ITABLE)
+		? sb->itable * blksz + (sb->root + 1) * FS_INODE_SIZE - 1
+		: (sb->root + 1) * blksz - 1;
+	if((sb = flip(sb, roff)) == NULL) ERROR("FAIL flip root");
+	errno = 0;
+	if(fs_list_dir(sb, "/") != NULL || errno != EIO) ERROR("FAIL list of bad root");
+	errno = 0;
+	if(fs_write_file(sb, "/x", data, 7) != -1 || errno != EIO) ERROR("FAIL write below bad root");
+	errno = 0;
+	if(fs_mkdir(sb, "/y") != -1 || errno != EIO) ERROR("FAIL mkdir below bad root");
+	errno = 0;
+	if(fs_rmdir(sb, "/d/e") != -1 || errno != EIO) ERROR("FAIL rmdir below bad root");
+	if((sb = flip(sb, roff)) == NULL) ERROR("FAIL flip root back");
+	if(!same_file(sb, "/d/a", data, 5)) ERROR("FAIL read after root restored");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after root restored");
+
+	/* a byte of file data: only seen with FS_FEATURE_DCSUM */
+	struct fs_view *view = fs_read_view(sb, "/d/c", 3 * blksz, 1);
+	if(view == NULL || view->iovcnt != 1) ERROR("FAIL view of c");
+	uint64_t doff = view->off[0];
+	fs_release_view(view);
+	if((sb = flip(sb, doff)) == NULL) ERROR("FAIL flip data");
+	if(dcsum) {
+		if(fs_read_file(sb, "/d/c", buf, size) != -1 || errno != EIO) ERROR("FAIL read of bad data");
+		if(fs_read_view(sb, "/d/c", 3 * blksz + 5, 1) != NULL || errno != EIO) ERROR("FAIL view of bad data");
+		if(bad_csums(sb) != 1) ERROR("FAIL fsck missed bad data");
+		if(!same_view(sb, "/d/c", data, 0, 3 * blksz)) ERROR("FAIL view of good data");
+	} else {
+		if(fs_read_file(sb, "/d/c", buf, size) != size || buf[3 * blksz] == data[3 * blksz])
+			ERROR("FAIL data checked");
+		if(!fsck_clean(sb)) ERROR("FAIL fsck of data");
+	}
+	if((sb = flip(sb, doff)) == NULL) ERROR("FAIL flip data back");
+	if(!same_file(sb, "/d/c", data, size)) ERROR("FAIL read of restored data");
+
+	/* a buffered file whose chain cannot be read stays buffered, and the
+	 * others are still written; checksums of a packed inode table cover
+	 * its neighbours too */
+	struct inode first;
+	if(fs_stat(sb, "/d/c", &st)) ERROR("FAIL stat c");
+	if(lseek(sb->fd, inode_off(sb, st.ino), SEEK_SET) < 0
+			|| read(sb->fd, &first, sizeof(first)) != sizeof(first))
+		ERROR("FAIL read inode of c");
+	if(first.next != 0 && inode_off(sb, first.next) / blksz != inode_off(sb, st.ino) / blksz) {
+		uint64_t coff = inode_off(sb, first.next) + 1;
+		if((sb = flip(sb, coff)) == NULL) ERROR("FAIL flip child");
+		/* and a clone of it is not left half built */
+		if(sb->features & FS_FEATURE_REFCOUNT) {
+			errno = 0;
+			if(fs_clone(sb, "/d/c", "/d/k") != -1 || errno != EIO) ERROR("FAIL clone of bad child");
+			if(fs_stat(sb, "/d/k", &st) != -1 || errno != ENOENT) ERROR("FAIL half built clone");
+		}
+		if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+		if(fs_write_file(sb, "/d/c", data, size + blksz) != 0) ERROR("FAIL buffered write c");
+		if(fs_write_file(sb, "/d/n", data, size) != 0) ERROR("FAIL buffered write n");
+		errno = 0;
+		if(fs_sync(sb) != -1 || errno != EIO) ERROR("FAIL sync of bad child");
+		if(!same_file(sb, "/d/c", data, size + blksz)) ERROR("FAIL c no longer buffered");
+		if(!same_file(sb, "/d/n", data, size)) ERROR("FAIL n after sync");
+		if(fs_close(sb) != -1) ERROR("FAIL close of bad child");
+		if(flip_byte(coff) || (sb = fs_open(fname)) == NULL) ERROR("FAIL flip child back");
+		if(!same_file(sb, "/d/n", data, size)) ERROR("FAIL n flushed beside bad child");
+		if(!fsck_clean(sb)) ERROR("FAIL fsck after bad child");
+		if(fs_unlink(sb, "/d/n")) ERROR("FAIL unlink n");
+		if(fs_write_file(sb, "/d/c", data, size) != 0) ERROR("FAIL write c again");
+	}
+
+	/* a buffered file whose inode goes bad is kept, and the others are
+	 * still written */
+	if(!(sb->features & FS_FEATURE_ITABLE)) {
+		if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+		if(fs_write_file(sb, "/d/a", data, 2 * blksz) != 0) ERROR("FAIL buffered write a");
+		if(fs_write_file(sb, "/d/n", data, size) != 0) ERROR("FAIL buffered write n");
+		uint64_t freeblks = sb->freeblks;
+		if(flip_byte(ioff)) ERROR("FAIL flip buffered inode");
+		errno = 0;
+		if(fs_sync(sb) != -1 || errno != EIO) ERROR("FAIL sync of bad inode");
+		if(sb->freeblks >= freeblks) ERROR("FAIL n not written beside bad inode");
+		if(flip_byte(ioff)) ERROR("FAIL flip buffered inode back");
+		if(fs_set_options(sb, 0)) ERROR("FAIL flush after restore");
+		if(!same_file(sb, "/d/a", data, 2 * blksz)) ERROR("FAIL a after restore");
+		if(!same_file(sb, "/d/n", data, size)) ERROR("FAIL n after restore");
+		if(fs_unlink(sb, "/d/n")) ERROR("FAIL unlink n");
+		if(fs_write_file(sb, "/d/a", data, 5) != 0) ERROR("FAIL write a again");
+		if(!fsck_clean(sb)) ERROR("FAIL fsck after bad buffered inode");
+	}
+
+	/* rewriting a file replaces its checksums */
+	data[7] ^= 1;
+	if(fs_write_file(sb, "/d/c", data, size - blksz) != 0) ERROR("FAIL rewrite c");
+	if(!same_file(sb, "/d/c", data, size - blksz)) ERROR("FAIL contents after rewrite");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after rewrite");
+
+	if(fs_unlink(sb, "/d/a") || fs_unlink(sb, "/d/c") || fs_unlink(sb, "/d/e/b")) ERROR("FAIL unlink");
+	if(fs_rmdir(sb, "/d/e") || fs_rmdir(sb, "/d")) ERROR("FAIL rmdir");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+	free(data);
+	free(buf);
+	*sbp = sb;
+	return 0;
+}
+/*}}}*/
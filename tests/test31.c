@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_sparse_test(struct superblock **sbp, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define CEIL(x, y) (((x) + (y) - 1) / (y))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1<<22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t features[] = {0, FS_FEATURE_SPARSE, FS_FEATURE_COMPACT | FS_FEATURE_SPARSE,
+		FS_FEATURE_ITABLE | FS_FEATURE_SPARSE, FS_FEATURE_REFCOUNT | FS_FEATURE_SPARSE,
+		FS_FEATURE_COMPRESS | FS_FEATURE_SPARSE, FS_FEATURE_DEDUP | FS_FEATURE_SPARSE,
+		FS_FEATURE_DCSUM | FS_FEATURE_SPARSE,
+		FS_FEATURE_ITABLE | FS_FEATURE_COMPRESS | FS_FEATURE_SPARSE};
+	int i;
+	for(i = 0; i < NELEMS(features); i++) {
+		if((features[i] & FS_FEATURE_ITABLE) && blksz % FS_INODE_SIZE)
+			continue;
+		generate_file(fsize);
+		struct superblock *sb = fs_format_features(fname, blksz, features[i]);
+		if(sb == NULL) ERROR("FAIL no sb\n");
+		if(fs_sparse_test(&sb, blksz)) ERROR("FAIL fs_sparse_test\n");
+		if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+int same_file(struct superblock *sb, const char *fname, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	assert(buf);
+	int ok = fs_read_file(sb, fname, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+int same_view(struct superblock *sb, const char *fname, const char *data, uint64_t offset, size_t len)/*{{{*/
+{
+	struct fs_view *view = fs_read_view(sb, fname, offset, len);
+	uint64_t pos = offset;
+	int ok = view != NULL && view->len == len;
+	for(int i = 0; ok && i < view->iovcnt; i++) {
+		ok = memcmp(view->iov[i].iov_base, data + pos, view->iov[i].iov_len) == 0;
+		pos += view->iov[i].iov_len;
+	}
+	if(view) fs_release_view(view);
+	return ok && pos - offset == len;
+}
+/*}}}*/
+
+
+int fsck_clean(struct superblock *sb)/*{{{*/
+{
+	struct fs_fsck_report r;
+	if(fs_fsck(sb, 0, 0, &r)) return 0;
+	return !r.leaked && !r.used_free && !r.cross_linked && !r.bad_refcounts
+		&& !r.bad_hashes && !r.bad_csums && !r.bad_links && !r.bad_nodes
+		&& !r.bad_free_lists;
+}
+/*}}}*/
+
+
+int same_host_file(const char *path, const char *data, size_t size)/*{{{*/
+{
+	char *buf = malloc(size + 1);
+	int fd = open(path, O_RDONLY);
+	assert(buf);
+	int ok = fd >= 0 && read(fd, buf, size + 1) == size && memcmp(buf, data, size) == 0;
+	if(fd >= 0) close(fd);
+	free(buf);
+	return ok;
+}
+/*}}}*/
+
+
+/* Data, a hole, data ending inside a block, then zeros up to the end.
+ * Regions are =unit bytes long, a multiple of the hole granularity. */
+int fs_sparse_test(struct superblock **sbp, uint64_t blksz)/*{{{*/
+{
+	struct superblock *sb = *sbp;
+	int sparse = (sb->features & FS_FEATURE_SPARSE) != 0;
+	int comp = (sb->features & FS_FEATURE_COMPRESS) != 0;
+	uint64_t gran = comp ? FS_COMP_CHUNK : blksz;
+	uint64_t unit = comp ? FS_COMP_CHUNK : 4 * blksz;
+	uint64_t size = 5 * unit + 9, cend = 3 * unit + unit / 2 + 3;
+	char *data = calloc(1, size), *buf = malloc(size);
+	struct fs_stat st;
+	assert(data && buf);
+	srand(blksz);
+	for(uint64_t k = 0; k < unit; k++) data[k] = (char) rand();
+	for(uint64_t k = 3 * unit; k < cend; k++) data[k] = (char) rand();
+
+	if(fs_mkdir(sb, "/s")) ERROR("FAIL mkdir");
+	uint64_t free0 = sb->freeblks;
+	if(fs_write_file(sb, "/s/f", data, size) != 0) ERROR("FAIL write f");
+	if(!same_file(sb, "/s/f", data, size)) ERROR("FAIL contents");
+	if(fs_read_file(sb, "/s/f", buf, unit + 5) != unit + 5 || memcmp(buf, data, unit + 5))
+		ERROR("FAIL short read");
+	if(!same_view(sb, "/s/f", data, unit - 7, 2 * unit)) ERROR("FAIL view across hole");
+	if(!same_view(sb, "/s/f", data, 4 * unit, unit + 9)) ERROR("FAIL view of trailing hole");
+	if(!same_view(sb, "/s/f", data, 3, unit - 3)) ERROR("FAIL view of data");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after write");
+
+	/* only the blocks holding data are stored */
+	uint64_t dblocks = unit / blksz + CEIL(cend - 3 * unit, blksz);
+	if(fs_stat(sb, "/s/f", &st)) ERROR("FAIL stat");
+	if(sparse && (comp ? st.blocks >= 2 * unit / blksz : st.blocks != dblocks)) ERROR("FAIL stored blocks");
+	if(!sparse && st.blocks != CEIL(size, blksz)) ERROR("FAIL blocks without holes");
+	if(sparse && free0 - sb->freeblks >= CEIL(size, blksz)) ERROR("FAIL space used");
+
+	/* holes are whole blocks, or whole chunks in compressed files */
+	uint64_t hend = CEIL(cend, gran) * gran;
+	if(fs_seek_data(sb, "/s/f", 0) != 0) ERROR("FAIL seek_data 0");
+	if(fs_seek_data(sb, "/s/f", 17) != 17) ERROR("FAIL seek_data in data");
+	if(fs_seek_hole(sb, "/s/f", 0) != (sparse ? unit : size)) ERROR("FAIL seek_hole 0");
+	if(fs_seek_data(sb, "/s/f", unit) != (sparse ? 3 * unit : unit)) ERROR("FAIL seek_data in hole");
+	if(fs_seek_hole(sb, "/s/f", unit + 1) != (sparse ? unit + 1 : size)) ERROR("FAIL seek_hole in hole");
+	if(fs_seek_hole(sb, "/s/f", 3 * unit) != (sparse ? hend : size)) ERROR("FAIL seek_hole after data");
+	if(sparse && (fs_seek_data(sb, "/s/f", hend) != -1 || errno != ENXIO)) ERROR("FAIL seek_data at end");
+	if(fs_seek_hole(sb, "/s/f", size - 1) != (sparse ? size - 1 : size)) ERROR("FAIL seek_hole at end");
+	if(fs_seek_data(sb, "/s/f", size) != -1 || errno != ENXIO) ERROR("FAIL seek_data past end");
+	if(fs_seek_hole(sb, "/s/f", size) != -1 || errno != ENXIO) ERROR("FAIL seek_hole past end");
+	if(fs_seek_data(sb, "/s", 0) != -1 || errno != EISDIR) ERROR("FAIL seek of directory");
+	if(fs_seek_hole(sb, "/s/none", 0) != -1 || errno != ENOENT) ERROR("FAIL seek of missing file");
+
+	/* small files: inline zeros are data, a file of zeros is one hole */
+	if(fs_write_file(sb, "/s/z", data + 4 * unit, 5) != 0) ERROR("FAIL write inline");
+	if(fs_seek_hole(sb, "/s/z", 0) != 5) ERROR("FAIL seek_hole inline");
+	if(fs_write_file(sb, "/s/z", data + 4 * unit, 2 * blksz) != 0) ERROR("FAIL write zeros");
+	if(!same_file(sb, "/s/z", data + 4 * unit, 2 * blksz)) ERROR("FAIL contents of zeros");
+	if(fs_stat(sb, "/s/z", &st) || st.blocks != (sparse ? 0 : 2)) ERROR("FAIL blocks of zeros");
+	if(sparse && (fs_seek_data(sb, "/s/z", 0) != -1 || errno != ENXIO)) ERROR("FAIL seek_data in zeros");
+	if(fs_unlink(sb, "/s/z")) ERROR("FAIL unlink z");
+
+	/* holes survive fs_close and fs_open */
+	if(fs_close(sb)) ERROR("FAIL close");
+	if((sb = fs_open(fname)) == NULL) ERROR("FAIL open");
+	if(!same_file(sb, "/s/f", data, size)) ERROR("FAIL contents after open");
+	if(fs_seek_data(sb, "/s/f", unit) != (sparse ? 3 * unit : unit)) ERROR("FAIL seek after open");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after open");
+
+	/* out to a host file and to a tar archive */
+	unlink("img.d/f");
+	rmdir("img.d");
+	if(fs_export_dir(sb, "/s", "img.d") != 1) ERROR("FAIL fs_export_dir");
+	if(!same_host_file("img.d/f", data, size)) ERROR("FAIL exported file");
+	unlink("img.d/f");
+	rmdir("img.d");
+	int fd = open("img.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || fs_export_tar(sb, "/s", fd) != 1) ERROR("FAIL fs_export_tar");
+	close(fd);
+	char *tar = malloc(512 + size);
+	assert(tar);
+	fd = open("img.tar", O_RDONLY);
+	if(fd < 0 || read(fd, tar, 512 + size) != 512 + size || memcmp(tar + 512, data, size))
+		ERROR("FAIL exported archive");
+	close(fd);
+	free(tar);
+	remove("img.tar");
+
+	/* filling the hole takes blocks, punching it again gives them back */
+	for(uint64_t k = unit; k < 2 * unit; k++) data[k] = (char) rand();
+	if(fs_write_file(sb, "/s/f", data, size) != 0) ERROR("FAIL fill hole");
+	if(!same_file(sb, "/s/f", data, size)) ERROR("FAIL contents after fill");
+	if(fs_seek_hole(sb, "/s/f", 0) != (sparse ? 2 * unit : size)) ERROR("FAIL seek_hole after fill");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after fill");
+	uint64_t free1 = sb->freeblks;
+	memset(data + unit, 0, unit);
+	if(fs_write_file(sb, "/s/f", data, size) != 0) ERROR("FAIL punch hole");
+	if(!same_file(sb, "/s/f", data, size)) ERROR("FAIL contents after punch");
+	if(sparse && sb->freeblks < free1 + unit / blksz) ERROR("FAIL blocks not freed");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after punch");
+
+	/* buffered contents are all data until they are written */
+	if(fs_set_options(sb, FS_OPT_DELALLOC)) ERROR("FAIL delalloc");
+	if(fs_write_file(sb, "/s/g", data, size) != 0) ERROR("FAIL write g");
+	if(fs_seek_hole(sb, "/s/g", 0) != size) ERROR("FAIL seek_hole buffered");
+	if(!same_view(sb, "/s/g", data, unit - 7, 2 * unit)) ERROR("FAIL view buffered");
+	if(fs_set_options(sb, 0)) ERROR("FAIL flush");
+	if(fs_seek_hole(sb, "/s/g", 0) != (sparse ? unit : size)) ERROR("FAIL seek_hole flushed");
+	if(!same_file(sb, "/s/g", data, size)) ERROR("FAIL contents flushed");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after flush");
+
+	/* clones share the data; writing into the hole leaves the source alone */
+	if(sb->features & FS_FEATURE_REFCOUNT) {
+		char *other = malloc(size);
+		assert(other);
+		memcpy(other, data, size);
+		memset(other + 2 * unit, 0x5a, unit);
+		if(fs_clone(sb, "/s/f", "/s/c")) ERROR("FAIL clone");
+		if(fs_seek_data(sb, "/s/c", unit) != 3 * unit) ERROR("FAIL seek_data clone");
+		if(fs_write_file(sb, "/s/c", other, size) != 0) ERROR("FAIL write clone");
+		if(!same_file(sb, "/s/c", other, size)) ERROR("FAIL contents of clone");
+		if(!same_file(sb, "/s/f", data, size)) ERROR("FAIL source of clone");
+		if(!fsck_clean(sb)) ERROR("FAIL fsck after clone");
+		if(fs_unlink(sb, "/s/c")) ERROR("FAIL unlink clone");
+		free(other);
+	}
+
+	/* fragmented sparse files are left where they are */
+	if(fs_defrag(sb, 0) < 0) ERROR("FAIL defrag");
+	if(!same_file(sb, "/s/f", data, size) || !same_file(sb, "/s/g", data, size))
+		ERROR("FAIL contents after defrag");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck after defrag");
+
+	if(fs_unlink(sb, "/s/f") || fs_unlink(sb, "/s/g") || fs_rmdir(sb, "/s")) ERROR("FAIL unlink");
+	if(!fsck_clean(sb)) ERROR("FAIL fsck at the end");
+	free(data);
+	free(buf);
+	*sbp = sb;
+	return 0;
+}
+/*}}}*/
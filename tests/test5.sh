@@ -3,8 +3,8 @@ set -u
 
 i=5
 
-gcc -g -std=c99 -Wall -c fs.c -o bin/fs.o &>> log/gcc.log
-gcc -g -std=c99 -Wall -I. tests/test$i.c bin/fs.o -o bin/test$i &>> log/gcc.log
+gcc -g -std=c99 -Wall -pthread -c fs.c -o bin/fs.o &>> log/gcc.log
+gcc -g -std=c99 -Wall -pthread -I. tests/test$i.c bin/fs.o -o bin/test$i &>> log/gcc.log
 if [ ! -x bin/test$i ] ; then
     echo "[$i] compilation error"
     exit 1 ;
@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Defragment a filesystem image.
+ *
+ * usage: defrag [-b budget] [-d delay_ms] image
+ *
+ * Runs one fs_defrag pass over the image, =budget I/O requests at a time
+ * (default 1024, 0 for a single call), sleeping =delay_ms milliseconds
+ * between calls to leave room for other work. */
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t budget = 1024, calls = 0;
+	long delay = 0;
+	struct fs_stats st;
+	int c, r;
+
+	while((c = getopt(argc, argv, "b:d:")) != -1) {
+		switch(c) {
+		case 'b': budget = strtoull(optarg, NULL, 0); break;
+		case 'd': delay = atol(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-b budget] [-d delay_ms] image\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-b budget] [-d delay_ms] image\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct superblock *sb = fs_open(argv[optind]);
+	if(!sb) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(EXIT_FAILURE); }
+	if(fs_set_options(sb, FS_OPT_STATS)) { perror("fs_set_options"); exit(EXIT_FAILURE); }
+
+	while((r = fs_defrag(sb, budget)) == 1) {
+		calls++;
+		if(delay > 0) {
+			struct timespec ts = {delay / 1000, (delay % 1000) * 1000000};
+			nanosleep(&ts, NULL);
+		}
+	}
+	if(r < 0) {
+		fprintf(stderr, "%s: fs_defrag: %s\n", argv[optind], strerror(errno));
+		fs_close(sb);
+		exit(EXIT_FAILURE);
+	}
+	calls++;
+
+	fs_get_stats(sb, &st);
+	printf("%s: %" PRIu64 " files moved in %" PRIu64 " calls, %" PRIu64
+			" reads, %" PRIu64 " writes\n", argv[optind], st.defrag_files,
+			calls, st.reads, st.writes);
+	if(fs_close(sb)) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(EXIT_FAILURE); }
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Extract the contents of a filesystem image.
+ *
+ * usage: export [-C dir] image [path]
+ *
+ * Writes the tree under =path (default "/") as a tar archive to standard
+ * output, or recreates it inside host directory =dir with -C. */
+
+#define USAGE "usage: %s [-C dir] image [path]\n"
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const char *dir = NULL, *path = "/";
+	int c;
+
+	while((c = getopt(argc, argv, "C:")) != -1) {
+		switch(c) {
+		case 'C': dir = optarg; break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind != argc - 1 && optind != argc - 2) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(optind == argc - 2) path = argv[optind + 1];
+	if(!dir && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "%s: refusing to write a tar archive to a terminal\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct superblock *sb = fs_open(argv[optind]);
+	if(!sb) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(EXIT_FAILURE); }
+
+	ssize_t n = dir ? fs_export_dir(sb, path, dir) : fs_export_tar(sb, path, STDOUT_FILENO);
+	if(n < 0) {
+		fprintf(stderr, "%s: export %s: %s\n", argv[optind], path, strerror(errno));
+		fs_close(sb);
+		exit(EXIT_FAILURE);
+	}
+	if(fs_close(sb)) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(EXIT_FAILURE); }
+
+	fprintf(stderr, "%s: %zd entries exported\n", argv[optind], n);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,69 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Check, and optionally repair, a filesystem image.
+ *
+ * usage: fsck [-r] [-j threads] image
+ *
+ * -r rebuilds the free lists when blocks or inodes are leaked or both in
+ * use and free, the reference count table when it is wrong and clears hash
+ * table entries of unused blocks; checksum mismatches are only reported.
+ * The exit status follows e2fsck: 0 if the image is clean, 1 if problems
+ * were found and all of them repaired, 4 if problems are left and 8 if the
+ * check could not run. */
+
+int main(int argc, char **argv)/*{{{*/
+{
+	struct fs_fsck_report r;
+	int flags = 0, nthreads = 0, c;
+
+	while((c = getopt(argc, argv, "rj:")) != -1) {
+		switch(c) {
+		case 'r': flags |= FS_FSCK_REPAIR; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+			exit(8);
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+		exit(8);
+	}
+
+	struct superblock *sb = fs_open(argv[optind]);
+	if(!sb) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(8); }
+	if(fs_fsck(sb, flags, nthreads, &r)) {
+		fprintf(stderr, "%s: fs_fsck: %s\n", argv[optind], strerror(errno));
+		fs_close(sb);
+		exit(8);
+	}
+	if(fs_close(sb)) { fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno)); exit(8); }
+
+	printf("%s: %" PRIu64 " files, %" PRIu64 " directories, %" PRIu64
+			" used, %" PRIu64 " free\n", argv[optind], r.files, r.dirs,
+			r.used, r.free);
+	if(r.leaked) printf("%" PRIu64 " leaked\n", r.leaked);
+	if(r.used_free) printf("%" PRIu64 " both in use and free\n", r.used_free);
+	if(r.cross_linked) printf("%" PRIu64 " cross-linked\n", r.cross_linked);
+	if(r.bad_refcounts) printf("%" PRIu64 " wrong reference counts\n", r.bad_refcounts);
+	if(r.bad_hashes) printf("%" PRIu64 " stale block hashes\n", r.bad_hashes);
+	if(r.bad_csums) printf("%" PRIu64 " checksum mismatches\n", r.bad_csums);
+	if(r.bad_links) printf("%" PRIu64 " links out of range\n", r.bad_links);
+	if(r.bad_nodes) printf("%" PRIu64 " inconsistent inodes\n", r.bad_nodes);
+	if(r.bad_free_lists) printf("%" PRIu64 " broken free lists\n", r.bad_free_lists);
+
+	int space = r.leaked || r.used_free || r.bad_free_lists || r.bad_refcounts || r.bad_hashes;
+	int other = r.cross_linked || r.bad_links || r.bad_nodes || r.bad_csums;
+	if(r.repaired) printf(r.bad_refcounts || r.bad_hashes ? "free lists and block tables rebuilt\n" : "free lists rebuilt\n");
+	if(other || (space && !r.repaired)) exit(4);
+	exit(space ? 1 : 0);
+}
+/*}}}*/
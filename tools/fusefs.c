@@ -0,0 +1,568 @@
+#define _POSIX_C_SOURCE 200809L
+#define FUSE_USE_VERSION 31
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "fs.h"
+
+/* Linux values; glibc only defines them with _GNU_SOURCE */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/* Mount a filesystem image with FUSE.
+ *
+ * usage: fusefs [--timeout=secs] image mountpoint [fuse options]
+ *
+ * The image is only changed through this daemon while it is mounted, so
+ * the kernel is told to cache entries, attributes and file pages for
+ * =secs seconds (60 by default) and to keep page caches across opens.
+ * Requests are dispatched by libfuse's thread pool unless -s is given;
+ * fs.c is not thread safe, so every call into it holds one lock.
+ *
+ * With -s, reads hand libfuse the image file descriptor and the offsets of
+ * the file's blocks (see fs_read_view), so it can splice them to the
+ * kernel without copying them through the daemon.  libfuse splices after
+ * the lock is dropped, which is only safe when no other request can free
+ * those blocks in between, so the thread pool copies them under the lock
+ * instead.  Holes are reported to lseek(2) with SEEK_DATA and SEEK_HOLE.
+ * fs.h only writes whole files, so files opened for writing are loaded
+ * into a buffer shared by all of their handles and written back on flush,
+ * fsync and the last release.  There are no permissions or timestamps:
+ * entries show up as 0755 directories and 0644 files owned by the mounting
+ * user. */
+
+struct wbuf {
+	char *path; /* NULL once the file is unlinked */
+	char *data;
+	size_t len, cap;
+	int refs, dirty;
+	struct wbuf *next;
+};
+
+struct fusefs {
+	char *image;
+	double timeout;
+	struct superblock *sb;
+	pthread_mutex_t lock;
+	struct wbuf *wbufs; /* files open for writing */
+	int single; /* -s: requests are handled one at a time */
+};
+
+static struct fusefs fusefs = {NULL, 60.0, NULL, PTHREAD_MUTEX_INITIALIZER, NULL};
+
+#define LOCK() pthread_mutex_lock(&fusefs.lock)
+#define UNLOCK() pthread_mutex_unlock(&fusefs.lock)
+
+static struct wbuf *wbuf_find(const char *path)/*{{{*/
+{
+	struct wbuf *w;
+	for(w = fusefs.wbufs; w; w = w->next)
+		if(w->path && strcmp(w->path, path) == 0) return w;
+	return NULL;
+}
+/*}}}*/
+
+static int wbuf_resize(struct wbuf *w, size_t len)/*{{{*/
+{
+	if(len > w->cap) {
+		size_t cap = w->cap ? w->cap : 4096;
+		while(cap < len) cap *= 2;
+		char *data = realloc(w->data, cap);
+		if(!data) return -ENOMEM;
+		w->data = data;
+		w->cap = cap;
+	}
+	if(len > w->len) memset(w->data + w->len, 0, len - w->len);
+	w->len = len;
+	w->dirty = 1;
+	return 0;
+}
+/*}}}*/
+
+static int wbuf_sync(struct wbuf *w)/*{{{*/
+{
+	if(!w->path || !w->dirty) return 0;
+	if(fs_write_file(fusefs.sb, w->path, w->data ? w->data : "", w->len) < 0)
+		return -errno;
+	w->dirty = 0;
+	return 0;
+}
+/*}}}*/
+
+/* Shared write buffer of =path, loaded from the image unless =truncate. */
+static int wbuf_get(const char *path, int truncate, struct wbuf **wp)/*{{{*/
+{
+	struct fs_stat st;
+	struct wbuf *w = wbuf_find(path);
+	int ret;
+	if(!w) {
+		if(fs_stat(fusefs.sb, path, &st)) return -errno;
+		if(st.mode != IMREG) return -EISDIR;
+		if(!(w = calloc(1, sizeof(*w))) || !(w->path = strdup(path))) {
+			free(w);
+			return -ENOMEM;
+		}
+		if((ret = wbuf_resize(w, truncate ? 0 : st.size)) == 0 && !truncate
+				&& fs_read_file(fusefs.sb, path, w->data, w->len) != (ssize_t)w->len)
+			ret = -errno;
+		if(ret) {
+			free(w->data);
+			free(w->path);
+			free(w);
+			return ret;
+		}
+		w->dirty = truncate;
+		w->next = fusefs.wbufs;
+		fusefs.wbufs = w;
+	} else if(truncate && (ret = wbuf_resize(w, 0))) {
+		return ret;
+	}
+	w->refs++;
+	*wp = w;
+	return 0;
+}
+/*}}}*/
+
+static int wbuf_put(struct wbuf *w)/*{{{*/
+{
+	struct wbuf **p;
+	int ret = wbuf_sync(w);
+	if(--w->refs > 0) return ret;
+	for(p = &fusefs.wbufs; *p != w; p = &(*p)->next);
+	*p = w->next;
+	free(w->data);
+	free(w->path);
+	free(w);
+	return ret;
+}
+/*}}}*/
+
+static void *fusefs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)/*{{{*/
+{
+	cfg->entry_timeout = fusefs.timeout;
+	cfg->attr_timeout = fusefs.timeout;
+	cfg->negative_timeout = fusefs.timeout;
+	cfg->kernel_cache = 1;
+	cfg->use_ino = 1;
+	if(conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if(conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+	return NULL;
+}
+/*}}}*/
+
+static void fusefs_destroy(void *data)/*{{{*/
+{
+	LOCK();
+	while(fusefs.wbufs) {
+		fusefs.wbufs->refs = 1;
+		wbuf_put(fusefs.wbufs);
+	}
+	if(fs_close(fusefs.sb)) perror("fs_close");
+	fusefs.sb = NULL;
+	UNLOCK();
+}
+/*}}}*/
+
+static int fusefs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)/*{{{*/
+{
+	struct fs_stat st;
+	struct wbuf *w;
+	LOCK();
+	int ret = fs_stat(fusefs.sb, path, &st) ? -errno : 0;
+	if(ret == 0 && (w = wbuf_find(path))) st.size = w->len;
+	UNLOCK();
+	if(ret) return ret;
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = st.ino;
+	stbuf->st_mode = st.mode == IMDIR ? S_IFDIR | 0755 : S_IFREG | 0644;
+	stbuf->st_nlink = st.mode == IMDIR ? 2 : 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = st.size;
+	stbuf->st_blksize = fusefs.sb->blksz;
+	stbuf->st_blocks = st.blocks * fusefs.sb->blksz / 512;
+	return 0;
+}
+/*}}}*/
+
+static int fusefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,/*{{{*/
+		off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	char *entry, *save;
+	LOCK();
+	char *list = fs_list_dir(fusefs.sb, path);
+	int ret = list ? 0 : -errno;
+	UNLOCK();
+	if(ret) return ret;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for(entry = strtok_r(list, " ", &save); entry; entry = strtok_r(NULL, " ", &save)) {
+		size_t len = strlen(entry);
+		if(len > 0 && entry[len - 1] == '/') entry[len - 1] = 0;
+		if(filler(buf, entry, NULL, 0, 0)) break;
+	}
+	free(list);
+	return 0;
+}
+/*}}}*/
+
+static int fusefs_mkdir(const char *path, mode_t mode)/*{{{*/
+{
+	LOCK();
+	int ret = fs_mkdir(fusefs.sb, path) ? -errno : 0;
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_rmdir(const char *path)/*{{{*/
+{
+	LOCK();
+	int ret = fs_rmdir(fusefs.sb, path) ? -errno : 0;
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_unlink(const char *path)/*{{{*/
+{
+	struct wbuf *w;
+	LOCK();
+	int ret = fs_unlink(fusefs.sb, path) ? -errno : 0;
+	if(ret == 0 && (w = wbuf_find(path))) {
+		/* open handles keep their buffer but never write it back */
+		free(w->path);
+		w->path = NULL;
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_rename(const char *from, const char *to, unsigned int flags)/*{{{*/
+{
+	size_t len = strlen(from);
+	struct wbuf *w;
+	if(flags) return -EINVAL;
+	LOCK();
+	int ret = fs_rename(fusefs.sb, from, to) ? -errno : 0;
+	for(w = fusefs.wbufs; ret == 0 && w; w = w->next) {
+		if(!w->path) continue;
+		if(strcmp(w->path, to) == 0) {
+			/* replaced: as if unlinked */
+			free(w->path);
+			w->path = NULL;
+		} else if(strncmp(w->path, from, len) == 0 && (w->path[len] == '\0' || w->path[len] == '/')) {
+			char *path = malloc(strlen(to) + strlen(w->path + len) + 1);
+			if(!path) { ret = -ENOMEM; break; }
+			sprintf(path, "%s%s", to, w->path + len);
+			free(w->path);
+			w->path = path;
+		}
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_open(const char *path, struct fuse_file_info *fi)/*{{{*/
+{
+	struct fs_stat st;
+	struct wbuf *w;
+	int ret;
+	LOCK();
+	if((fi->flags & O_ACCMODE) == O_RDONLY) {
+		ret = fs_stat(fusefs.sb, path, &st) ? -errno : (st.mode == IMREG ? 0 : -EISDIR);
+		fi->fh = 0;
+	} else if((ret = wbuf_get(path, fi->flags & O_TRUNC, &w)) == 0) {
+		fi->fh = (uint64_t)(uintptr_t)w;
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_create(const char *path, mode_t mode, struct fuse_file_info *fi)/*{{{*/
+{
+	struct wbuf *w;
+	int ret;
+	LOCK();
+	if(fs_write_file(fusefs.sb, path, "", 0) < 0) ret = -errno;
+	else if((ret = wbuf_get(path, 1, &w)) == 0) fi->fh = (uint64_t)(uintptr_t)w;
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_read(const char *path, char *buf, size_t size, off_t offset,/*{{{*/
+		struct fuse_file_info *fi)
+{
+	struct wbuf *w;
+	int i;
+	ssize_t ret = 0;
+	LOCK();
+	if((w = fi->fh ? (struct wbuf *)(uintptr_t)fi->fh : wbuf_find(path))) {
+		if((size_t)offset < w->len) {
+			ret = size < w->len - offset ? size : w->len - offset;
+			memcpy(buf, w->data + offset, ret);
+		}
+	} else {
+		struct fs_view *view = fs_read_view(fusefs.sb, path, offset, size);
+		if(!view) ret = -errno;
+		for(i = 0; view && i < view->iovcnt; i++) {
+			memcpy(buf + ret, view->iov[i].iov_base, view->iov[i].iov_len);
+			ret += view->iov[i].iov_len;
+		}
+		fs_release_view(view);
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+/* Point libfuse at the file's blocks in the image so it can splice them,
+ * or copy them while the lock is held if another request could free them
+ * before libfuse gets to it. */
+static int fusefs_read_buf(const char *path, struct fuse_bufvec **bufp,/*{{{*/
+		size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *bv;
+	int i;
+	LOCK();
+	struct wbuf *w = fi->fh ? (struct wbuf *)(uintptr_t)fi->fh : wbuf_find(path);
+	struct fs_view *view = w ? NULL : fs_read_view(fusefs.sb, path, offset, size);
+	if(!w && !view) {
+		UNLOCK();
+		return -errno;
+	}
+	if(view && view->off && fusefs.single) {
+		bv = calloc(1, sizeof(*bv) + view->iovcnt * sizeof(struct fuse_buf));
+		if(bv) {
+			bv->count = view->iovcnt;
+			for(i = 0; i < view->iovcnt; i++) {
+				bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				bv->buf[i].fd = fusefs.sb->fd;
+				bv->buf[i].pos = view->off[i];
+				bv->buf[i].size = view->iov[i].iov_len;
+			}
+		}
+	} else {
+		/* contents are copied; libfuse frees them */
+		size_t len = view ? view->len : ((size_t)offset < w->len ? (size < w->len - offset ? size : w->len - offset) : 0);
+		bv = calloc(1, sizeof(*bv));
+		if(bv) {
+			bv->count = 1;
+			bv->buf[0].size = len;
+			if(len && (bv->buf[0].mem = malloc(len))) {
+				char *p = bv->buf[0].mem;
+				for(i = 0; view && i < view->iovcnt; i++) {
+					memcpy(p, view->iov[i].iov_base, view->iov[i].iov_len);
+					p += view->iov[i].iov_len;
+				}
+				if(!view) memcpy(p, w->data + offset, len);
+			} else if(len) {
+				free(bv);
+				bv = NULL;
+			}
+		}
+	}
+	fs_release_view(view);
+	UNLOCK();
+	if(!bv) return -ENOMEM;
+	*bufp = bv;
+	return 0;
+}
+/*}}}*/
+
+/* Only SEEK_DATA and SEEK_HOLE get here; files open for writing are
+ * buffered whole, so they have no holes. */
+static off_t fusefs_lseek(const char *path, off_t offset, int whence,/*{{{*/
+		struct fuse_file_info *fi)
+{
+	struct wbuf *w;
+	off_t ret;
+	if(whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+	if(offset < 0) return -ENXIO;
+	LOCK();
+	if((w = fi && fi->fh ? (struct wbuf *)(uintptr_t)fi->fh : wbuf_find(path))) {
+		ret = (size_t)offset >= w->len ? -ENXIO : whence == SEEK_DATA ? offset : (off_t)w->len;
+	} else {
+		ssize_t n = whence == SEEK_DATA ? fs_seek_data(fusefs.sb, path, offset)
+				: fs_seek_hole(fusefs.sb, path, offset);
+		ret = n < 0 ? -errno : n;
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_write(const char *path, const char *buf, size_t size,/*{{{*/
+		off_t offset, struct fuse_file_info *fi)
+{
+	struct wbuf *w = (struct wbuf *)(uintptr_t)fi->fh;
+	int ret = 0;
+	if(!w) return -EBADF;
+	LOCK();
+	if(offset + size > w->len) ret = wbuf_resize(w, offset + size);
+	if(ret == 0) {
+		memcpy(w->data + offset, buf, size);
+		w->dirty = 1;
+	}
+	UNLOCK();
+	return ret ? ret : (int)size;
+}
+/*}}}*/
+
+static int fusefs_truncate(const char *path, off_t size, struct fuse_file_info *fi)/*{{{*/
+{
+	struct wbuf *w;
+	LOCK();
+	int ret = wbuf_get(path, size == 0, &w);
+	if(ret == 0) {
+		if(size > 0) ret = wbuf_resize(w, size);
+		int put = wbuf_put(w);
+		ret = ret ? ret : put;
+	}
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_flush(const char *path, struct fuse_file_info *fi)/*{{{*/
+{
+	struct wbuf *w = (struct wbuf *)(uintptr_t)fi->fh;
+	if(!w) return 0;
+	LOCK();
+	int ret = wbuf_sync(w);
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_fsync(const char *path, int datasync, struct fuse_file_info *fi)/*{{{*/
+{
+	struct wbuf *w = (struct wbuf *)(uintptr_t)fi->fh;
+	LOCK();
+	int ret = w ? wbuf_sync(w) : 0;
+	if(ret == 0 && fs_sync(fusefs.sb)) ret = -errno;
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_release(const char *path, struct fuse_file_info *fi)/*{{{*/
+{
+	struct wbuf *w = (struct wbuf *)(uintptr_t)fi->fh;
+	if(!w) return 0;
+	LOCK();
+	wbuf_put(w);
+	UNLOCK();
+	return 0;
+}
+/*}}}*/
+
+/* No timestamps are stored; accepting the call keeps touch(1) working. */
+static int fusefs_utimens(const char *path, const struct timespec tv[2],/*{{{*/
+		struct fuse_file_info *fi)
+{
+	struct fs_stat st;
+	LOCK();
+	int ret = fs_stat(fusefs.sb, path, &st) ? -errno : 0;
+	UNLOCK();
+	return ret;
+}
+/*}}}*/
+
+static int fusefs_statfs(const char *path, struct statvfs *sv)/*{{{*/
+{
+	struct superblock *sb = fusefs.sb;
+	memset(sv, 0, sizeof(*sv));
+	LOCK();
+	sv->f_bsize = sv->f_frsize = sb->blksz;
+	sv->f_blocks = sb->blks;
+	sv->f_bfree = sv->f_bavail = sb->freeblks;
+	sv->f_files = (sb->features & FS_FEATURE_ITABLE) ? sb->inodes : sb->blks;
+	sv->f_ffree = sv->f_favail = (sb->features & FS_FEATURE_ITABLE) ? sb->nifree : sb->freeblks;
+	UNLOCK();
+	return 0;
+}
+/*}}}*/
+
+static const struct fuse_operations fusefs_ops = {
+	.init = fusefs_init,
+	.destroy = fusefs_destroy,
+	.getattr = fusefs_getattr,
+	.readdir = fusefs_readdir,
+	.mkdir = fusefs_mkdir,
+	.rmdir = fusefs_rmdir,
+	.unlink = fusefs_unlink,
+	.rename = fusefs_rename,
+	.open = fusefs_open,
+	.create = fusefs_create,
+	.read = fusefs_read,
+	.read_buf = fusefs_read_buf,
+	.lseek = fusefs_lseek,
+	.write = fusefs_write,
+	.truncate = fusefs_truncate,
+	.flush = fusefs_flush,
+	.fsync = fusefs_fsync,
+	.release = fusefs_release,
+	.utimens = fusefs_utimens,
+	.statfs = fusefs_statfs,
+};
+
+enum { FUSEFS_KEY_SINGLE };
+
+static const struct fuse_opt fusefs_opts[] = {
+	{"--timeout=%lf", offsetof(struct fusefs, timeout), 0},
+	FUSE_OPT_KEY("-s", FUSEFS_KEY_SINGLE),
+	FUSE_OPT_END
+};
+
+/* The first argument that is not an option is the image; -s is noted and
+ * passed on to libfuse. */
+static int fusefs_opt(void *data, const char *arg, int key, struct fuse_args *out)/*{{{*/
+{
+	if(key == FUSE_OPT_KEY_NONOPT && fusefs.image == NULL) {
+		fusefs.image = strdup(arg);
+		return 0;
+	}
+	if(key == FUSEFS_KEY_SINGLE) fusefs.single = 1;
+	return 1;
+}
+/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	if(fuse_opt_parse(&args, &fusefs, fusefs_opts, fusefs_opt) || !fusefs.image) {
+		fprintf(stderr, "usage: %s [--timeout=secs] image mountpoint [fuse options]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fusefs.sb = fs_open(fusefs.image);
+	if(!fusefs.sb) { fprintf(stderr, "%s: %s\n", fusefs.image, strerror(errno)); exit(EXIT_FAILURE); }
+
+	int ret = fuse_main(args.argc, args.argv, &fusefs_ops, NULL);
+	if(fusefs.sb && fs_close(fusefs.sb)) perror("fs_close");
+	fuse_opt_free_args(&args);
+	free(fusefs.image);
+	return ret;
+}
+/*}}}*/
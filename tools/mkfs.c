@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Build a filesystem image from a host directory.
+ *
+ * usage: mkfs [-b blksz] [-s size] [-c] [-i] [-r] [-z] [-d] [-k] [-K] [-H] [-j threads] dir image
+ *
+ * With -s the image is created (or resized) to =size bytes (k, m and g
+ * suffixes allowed); otherwise it must already exist.  -c, -i, -r, -z, -d,
+ * -k, -K and -H format it with FS_FEATURE_COMPACT, FS_FEATURE_ITABLE,
+ * FS_FEATURE_REFCOUNT, FS_FEATURE_COMPRESS, FS_FEATURE_DEDUP,
+ * FS_FEATURE_CSUM, FS_FEATURE_DCSUM and FS_FEATURE_SPARSE; the imported
+ * files themselves are stored as they are, only files written later are
+ * compressed, deduplicated or made sparse.
+ * The tree is loaded with fs_import using =threads reader threads (one per
+ * CPU by default). */
+
+#define USAGE "usage: %s [-b blksz] [-s size] [-c] [-i] [-r] [-z] [-d] [-k] [-K] [-H] [-j threads] dir image\n"
+
+uint64_t parse_size(const char *s)/*{{{*/
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 0);
+	switch(*end) {
+	case 'g': case 'G': n <<= 10; /* fall through */
+	case 'm': case 'M': n <<= 10; /* fall through */
+	case 'k': case 'K': n <<= 10;
+	}
+	return n;
+}
+/*}}}*/
+
+double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blksz = 4096, size = 0, features = 0;
+	int nthreads = 0, c;
+	struct fs_stats st;
+
+	while((c = getopt(argc, argv, "b:s:cirzdkKHj:")) != -1) {
+		switch(c) {
+		case 'b': blksz = parse_size(optarg); break;
+		case 's': size = parse_size(optarg); break;
+		case 'c': features |= FS_FEATURE_COMPACT; break;
+		case 'i': features |= FS_FEATURE_ITABLE; break;
+		case 'r': features |= FS_FEATURE_REFCOUNT; break;
+		case 'z': features |= FS_FEATURE_COMPRESS; break;
+		case 'd': features |= FS_FEATURE_DEDUP; break;
+		case 'k': features |= FS_FEATURE_CSUM; break;
+		case 'K': features |= FS_FEATURE_DCSUM; break;
+		case 'H': features |= FS_FEATURE_SPARSE; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind != argc - 2) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	const char *dir = argv[optind], *image = argv[optind + 1];
+
+	if(size > 0) {
+		int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0 || ftruncate(fd, size)) { fprintf(stderr, "%s: %s\n", image, strerror(errno)); exit(EXIT_FAILURE); }
+		close(fd);
+	}
+
+	double t0 = now();
+	struct superblock *sb = fs_format_features(image, blksz, features);
+	if(!sb) { fprintf(stderr, "%s: %s\n", image, strerror(errno)); exit(EXIT_FAILURE); }
+	if(fs_set_options(sb, FS_OPT_STATS)) { perror("fs_set_options"); exit(EXIT_FAILURE); }
+
+	ssize_t n = fs_import(sb, "/", dir, nthreads);
+	if(n < 0) {
+		fprintf(stderr, "%s: fs_import %s: %s\n", image, dir, strerror(errno));
+		fs_close(sb);
+		exit(EXIT_FAILURE);
+	}
+	fs_get_stats(sb, &st);
+	if(fs_close(sb)) { fprintf(stderr, "%s: %s\n", image, strerror(errno)); exit(EXIT_FAILURE); }
+	double secs = now() - t0;
+
+	printf("%s: %zd entries, %" PRIu64 " bytes in %" PRIu64 " writes, %.3f s"
+			" (%.1f MB/s)\n", image, n, st.bytes_written, st.writes, secs,
+			st.bytes_written / secs / 1e6);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/